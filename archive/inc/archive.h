@@ -0,0 +1,132 @@
+/**
+ * @file archive.h
+ * @author jkilopu
+ * @brief Replay archive, many replays (see "replay.h") in one append-only file with a sorted index.
+ *
+ * @details About the archive:
+ * 1. Linux only. An archive is two files: "<archive>" is an "ArchiveHeader" followed by whole replay files,
+ *    only ever appended to, and "<archive>.idx" is an "ArchiveIndexHeader" followed by an "ArchiveEntry" for
+ *    each replay.
+ * 2. The entries are sorted by settings (map width, height, mines), then by date, so the games of a preset are
+ *    next to each other. An entry has what the queries need from the footer of its replay, so they read only
+ *    the index.
+ * 3. Adding replays appends them to the archive, sorts their entries and merges them into a new index, which
+ *    replaces the old one by "rename". The index also has the length of the archive it covers, so bytes
+ *    appended by an add that didn't finish are cut before the next one.
+ * 4. Both files are read with "mmap", the entries and replays are used where they are in the mapping.
+ *    Queries split the entries into a contiguous range for each thread. Each thread aggregates its range
+ *    alone, then the partial results are merged: a preset cut at a range boundary is combined.
+ */
+#ifndef __ARCHIVE_H
+#define __ARCHIVE_H
+
+#include "SDL_stdinc.h"
+#include "replay.h"
+
+#define ARCHIVE_MAGIC "MYMNARC"       ///< With the '\0', 8 bytes.
+#define ARCHIVE_INDEX_MAGIC "MYMNIDX"
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_INDEX_SUFFIX ".idx"
+#define ARCHIVE_PATH_MAX 1024
+#define ARCHIVE_WRITE_BUF_SIZE (1024 * 1024)
+#define ARCHIVE_THREADS_MAX 64
+#define DENSITY_BUCKETS 101           ///< Mines per 100 blocks, 0 to 100.
+
+//-------------------------------------------------------------------
+// Type Definations
+//-------------------------------------------------------------------
+
+typedef struct {
+    char magic[8];
+    Uint32 version;
+    Uint32 paddings;
+} ArchiveHeader;
+SDL_COMPILE_TIME_ASSERT(ArchiveHeader, sizeof(ArchiveHeader) == 16);
+
+typedef struct {
+    char magic[8];
+    Uint32 version;
+    Uint32 entry_size;
+    Uint64 n_entries;
+    Uint64 archive_len; ///< The bytes of the archive the entries cover.
+} ArchiveIndexHeader;
+SDL_COMPILE_TIME_ASSERT(ArchiveIndexHeader, sizeof(ArchiveIndexHeader) == 32);
+
+typedef struct {
+    Uint64 offset;       ///< Of the replay in the archive.
+    Sint64 start_time;   ///< Unix time, from "ReplayHeader".
+    Uint32 len;
+    Uint32 n_mine;
+    Uint16 map_width, map_height;
+    Uint32 duration;     ///< The rest is from "ReplayFooter".
+    Uint32 bbbv;
+    Uint32 n_clicks[3];
+    ReplayResult result;
+    Uint8 game_mode;
+    Uint8 paddings[6];
+} ArchiveEntry;
+SDL_COMPILE_TIME_ASSERT(ArchiveEntry, sizeof(ArchiveEntry) == 56);
+
+/**
+ * @brief A file mapped read only.
+ */
+typedef struct {
+    const Uint8 *data;
+    size_t len;
+} MappedFile;
+
+/**
+ * @brief The games of one preset (map size and mines).
+ */
+typedef struct {
+    Uint32 map_width, map_height, n_mine;
+    Uint64 games, wins;
+    Uint32 best_time;    ///< Of the won games, in milliseconds.
+    Sint64 best_date;
+    Uint64 clicks, bbbv; ///< Of the won games.
+} PresetStats;
+
+typedef struct {
+    Uint64 games, wins;
+} DensityStats;
+
+/**
+ * @brief The entries of a thread and what it found in them.
+ */
+typedef struct {
+    const ArchiveEntry *entries;
+    Uint64 begin, end;
+    const MappedFile *p_archive; ///< Only for "check".
+    PresetStats *presets;
+    Uint32 n_presets, presets_cap;
+    DensityStats density[DENSITY_BUCKETS];
+    Uint64 bad;                  ///< Replays that don't match their entries, only for "check".
+} QueryTask;
+
+//-------------------------------------------------------------------
+// Prototypes
+//-------------------------------------------------------------------
+
+static void index_path(const char *archive, char *path);
+static SDL_bool map_file(const char *path, MappedFile *p_file);
+static void unmap_file(MappedFile *p_file);
+static const ArchiveIndexHeader *map_index(const char *archive, MappedFile *p_index);
+static void write_all(int fd, const void *buf, size_t len, const char *path);
+
+static int compare_entries(const void *p_a, const void *p_b);
+static void fill_entry(ArchiveEntry *p_entry, const Replay *p_replay, Uint64 offset);
+static void add_replays(const char *archive, char **paths, int n_paths);
+static void write_index(const char *archive, const ArchiveEntry *old_entries, Uint64 n_old,
+        const ArchiveEntry *new_entries, Uint64 n_new, Uint64 archive_len);
+
+static PresetStats *preset_of(QueryTask *p_task, const ArchiveEntry *p_entry);
+static SDL_bool check_entry(const MappedFile *p_archive, const ArchiveEntry *p_entry);
+static int query_thread(void *data);
+static void run_tasks(QueryTask *tasks, unsigned int n_threads, const ArchiveEntry *entries, Uint64 n_entries,
+        const MappedFile *p_archive);
+static void merge_tasks(QueryTask *tasks, unsigned int n_threads, QueryTask *p_total);
+static void print_query(const QueryTask *p_total, Uint64 n_entries, double elapsed);
+static void query_archive(const char *archive, unsigned int n_threads, SDL_bool check);
+static void extract_replay(const char *archive, Uint64 n, const char *path);
+
+#endif
@@ -0,0 +1,538 @@
+/**
+ * @file archive.c
+ * @author jkilopu
+ * @brief Pack replays into an archive with a sorted index, and query the archive in parallel.
+ *
+ * @note Usage:
+ *       ./mymines-archive add <archive> <replay>...      "-" reads the paths of the replays from stdin
+ *       ./mymines-archive query <archive> [threads]      best times per preset, win rate per density, clicks per 3BV
+ *       ./mymines-archive check <archive> [threads]      read every replay and check it against its entry
+ *       ./mymines-archive extract <archive> <n> <replay> write the n-th replay in index order to a file
+ *       threads defaults to the number of CPUs.
+ */
+#include "archive.h"
+#include "SDL.h"
+#include "fatal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//-------------------------------------------------------------------
+// Files
+//-------------------------------------------------------------------
+
+static void index_path(const char *archive, char *path)
+{
+    if (SDL_snprintf(path, ARCHIVE_PATH_MAX, "%s%s", archive, ARCHIVE_INDEX_SUFFIX) >= ARCHIVE_PATH_MAX)
+        Error("The path %s is too long!\n", archive);
+}
+
+/**
+ * @brief Map a whole file read only, an empty file is mapped to NULL.
+ *
+ * @return Return SDL_FALSE if it can't be opened.
+ */
+static SDL_bool map_file(const char *path, MappedFile *p_file)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return SDL_FALSE;
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        Error("Can't stat %s: %s\n", path, strerror(errno));
+    p_file->len = st.st_size;
+    p_file->data = NULL;
+    if (p_file->len > 0)
+    {
+        void *data = mmap(NULL, p_file->len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+            Error("Can't map %s: %s\n", path, strerror(errno));
+        madvise(data, p_file->len, MADV_SEQUENTIAL);
+        p_file->data = data;
+    }
+    close(fd); ///< The mapping stays.
+    return SDL_TRUE;
+}
+
+static void unmap_file(MappedFile *p_file)
+{
+    if (p_file->data != NULL)
+        munmap((void *)p_file->data, p_file->len);
+    p_file->data = NULL;
+}
+
+/**
+ * @brief Map the index of an archive and check its header.
+ *
+ * @return Return the header, the entries follow it, or NULL if the archive has no index yet.
+ */
+static const ArchiveIndexHeader *map_index(const char *archive, MappedFile *p_index)
+{
+    char path[ARCHIVE_PATH_MAX];
+    index_path(archive, path);
+    if (!map_file(path, p_index))
+        return NULL;
+    const ArchiveIndexHeader *p_header = (const ArchiveIndexHeader *)p_index->data;
+    if (p_index->len < sizeof(ArchiveIndexHeader) || memcmp(p_header->magic, ARCHIVE_INDEX_MAGIC, sizeof(p_header->magic)) != 0
+            || p_header->version != ARCHIVE_VERSION || p_header->entry_size != sizeof(ArchiveEntry)
+            || p_header->n_entries != (p_index->len - sizeof(ArchiveIndexHeader)) / sizeof(ArchiveEntry))
+        Error("%s is not an archive index of version %d!\n", path, ARCHIVE_VERSION);
+    return p_header;
+}
+
+static void write_all(int fd, const void *buf, size_t len, const char *path)
+{
+    const Uint8 *p = buf;
+    while (len > 0)
+    {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            Error("Can't write %s: %s\n", path, strerror(errno));
+        p += n;
+        len -= n;
+    }
+}
+
+//-------------------------------------------------------------------
+// Add
+//-------------------------------------------------------------------
+
+/**
+ * @brief The order of the index: settings, then date, then where it is in the archive.
+ */
+static int compare_entries(const void *p_a, const void *p_b)
+{
+    const ArchiveEntry *a = p_a, *b = p_b;
+    if (a->map_width != b->map_width)
+        return a->map_width < b->map_width ? -1 : 1;
+    if (a->map_height != b->map_height)
+        return a->map_height < b->map_height ? -1 : 1;
+    if (a->n_mine != b->n_mine)
+        return a->n_mine < b->n_mine ? -1 : 1;
+    if (a->start_time != b->start_time)
+        return a->start_time < b->start_time ? -1 : 1;
+    return a->offset < b->offset ? -1 : a->offset > b->offset;
+}
+
+static void fill_entry(ArchiveEntry *p_entry, const Replay *p_replay, Uint64 offset)
+{
+    const ReplayHeader *p_header = &p_replay->header;
+    const ReplayFooter *p_footer = &p_replay->footer;
+    SDL_zerop(p_entry);
+    p_entry->offset = offset;
+    p_entry->start_time = p_header->start_time;
+    p_entry->len = p_replay->len;
+    p_entry->n_mine = p_header->settings.n_mine;
+    p_entry->map_width = p_header->settings.map_width;
+    p_entry->map_height = p_header->settings.map_height;
+    p_entry->duration = p_footer->duration;
+    p_entry->bbbv = p_footer->bbbv;
+    SDL_memcpy(p_entry->n_clicks, p_footer->n_clicks, sizeof(p_entry->n_clicks));
+    p_entry->result = p_footer->result;
+    p_entry->game_mode = p_header->settings.game_mode;
+}
+
+/**
+ * @brief Append the replays to the archive, then merge their entries into the index.
+ */
+static void add_replays(const char *archive, char **paths, int n_paths)
+{
+    MappedFile index = {0};
+    const ArchiveIndexHeader *p_index_header = map_index(archive, &index);
+    Uint64 n_old = p_index_header != NULL ? p_index_header->n_entries : 0;
+    Uint64 archive_len = p_index_header != NULL ? p_index_header->archive_len : 0;
+
+    int fd = open(archive, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+        Error("Can't open %s: %s\n", archive, strerror(errno));
+    if (archive_len == 0)
+    {
+        if (st.st_size > 0)
+            Error("%s has no index!\n", archive);
+        ArchiveHeader header;
+        SDL_zero(header);
+        SDL_memcpy(header.magic, ARCHIVE_MAGIC, sizeof(header.magic));
+        header.version = ARCHIVE_VERSION;
+        write_all(fd, &header, sizeof(header), archive);
+        archive_len = sizeof(header);
+    }
+    else if ((Uint64)st.st_size < archive_len)
+        Error("%s is shorter than its index!\n", archive);
+    else if (ftruncate(fd, archive_len) < 0 || lseek(fd, archive_len, SEEK_SET) < 0) ///< Cut what an add that failed left.
+        Error("Can't seek %s: %s\n", archive, strerror(errno));
+
+    Uint64 n_new = 0, cap = 1024, skipped = 0;
+    ArchiveEntry *new_entries = malloc_fatal(cap * sizeof(ArchiveEntry), "add_replays - new_entries");
+    char line[ARCHIVE_PATH_MAX];
+    SDL_bool from_stdin = n_paths == 1 && strcmp(paths[0], "-") == 0;
+    for (int i = 0; ; i++)
+    {
+        const char *path;
+        if (from_stdin)
+        {
+            if (fgets(line, sizeof(line), stdin) == NULL)
+                break;
+            line[strcspn(line, "\r\n")] = '\0';
+            path = line;
+        }
+        else if (i < n_paths)
+            path = paths[i];
+        else
+            break;
+
+        Uint32 len;
+        Uint8 *buf = load_replay_file(path, &len);
+        Replay replay;
+        if (buf == NULL || !read_replay(buf, len, &replay))
+        {
+            SDL_Log("Skip %s, not a replay of version %d.\n", path, REPLAY_VERSION);
+            free(buf);
+            skipped++;
+            continue;
+        }
+        if (n_new == cap)
+        {
+            cap *= 2;
+            ArchiveEntry *entries = realloc(new_entries, cap * sizeof(ArchiveEntry));
+            if (entries == NULL)
+                Error("add_replays: %s\n", MALLOC_FAIL_MSG);
+            new_entries = entries;
+        }
+        fill_entry(&new_entries[n_new++], &replay, archive_len);
+        write_all(fd, buf, len, archive);
+        archive_len += len;
+        free(buf);
+    }
+    if (fsync(fd) < 0) ///< The index must not cover bytes that are not on disk.
+        Error("Can't sync %s: %s\n", archive, strerror(errno));
+    close(fd);
+
+    qsort(new_entries, n_new, sizeof(ArchiveEntry), compare_entries);
+    write_index(archive, p_index_header != NULL ? (const ArchiveEntry *)(p_index_header + 1) : NULL, n_old,
+                new_entries, n_new, archive_len);
+    SDL_Log("Added %llu replays (%llu skipped), %llu in %s, %llu bytes.\n", (unsigned long long)n_new,
+            (unsigned long long)skipped, (unsigned long long)(n_old + n_new), archive, (unsigned long long)archive_len);
+    free(new_entries);
+    unmap_file(&index);
+}
+
+/**
+ * @brief Merge the sorted old and new entries into a new index, then replace the old one.
+ */
+static void write_index(const char *archive, const ArchiveEntry *old_entries, Uint64 n_old,
+        const ArchiveEntry *new_entries, Uint64 n_new, Uint64 archive_len)
+{
+    char path[ARCHIVE_PATH_MAX], tmp_path[ARCHIVE_PATH_MAX + 4];
+    index_path(archive, path);
+    SDL_snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        Error("Can't create %s: %s\n", tmp_path, strerror(errno));
+
+    ArchiveIndexHeader header;
+    SDL_zero(header);
+    SDL_memcpy(header.magic, ARCHIVE_INDEX_MAGIC, sizeof(header.magic));
+    header.version = ARCHIVE_VERSION;
+    header.entry_size = sizeof(ArchiveEntry);
+    header.n_entries = n_old + n_new;
+    header.archive_len = archive_len;
+    write_all(fd, &header, sizeof(header), tmp_path);
+
+    Uint32 buf_cap = ARCHIVE_WRITE_BUF_SIZE / sizeof(ArchiveEntry), n_buf = 0;
+    ArchiveEntry *buf = malloc_fatal(buf_cap * sizeof(ArchiveEntry), "write_index - buf");
+    for (Uint64 i = 0, j = 0; i < n_old || j < n_new; )
+    {
+        if (j == n_new || (i < n_old && compare_entries(&old_entries[i], &new_entries[j]) <= 0))
+            buf[n_buf++] = old_entries[i++];
+        else
+            buf[n_buf++] = new_entries[j++];
+        if (n_buf == buf_cap)
+        {
+            write_all(fd, buf, n_buf * sizeof(ArchiveEntry), tmp_path);
+            n_buf = 0;
+        }
+    }
+    write_all(fd, buf, n_buf * sizeof(ArchiveEntry), tmp_path);
+    free(buf);
+    if (fsync(fd) < 0 || close(fd) < 0)
+        Error("Can't sync %s: %s\n", tmp_path, strerror(errno));
+    if (rename(tmp_path, path) < 0)
+        Error("Can't replace %s: %s\n", path, strerror(errno));
+}
+
+//-------------------------------------------------------------------
+// Query
+//-------------------------------------------------------------------
+
+/**
+ * @brief The stats of the preset of the entry, the entries are sorted so it is the last one or a new one.
+ */
+static PresetStats *preset_of(QueryTask *p_task, const ArchiveEntry *p_entry)
+{
+    if (p_task->n_presets > 0)
+    {
+        PresetStats *p_last = &p_task->presets[p_task->n_presets - 1];
+        if (p_last->map_width == p_entry->map_width && p_last->map_height == p_entry->map_height
+                && p_last->n_mine == p_entry->n_mine)
+            return p_last;
+    }
+    if (p_task->n_presets == p_task->presets_cap)
+    {
+        p_task->presets_cap = p_task->presets_cap == 0 ? 16 : p_task->presets_cap * 2;
+        PresetStats *presets = realloc(p_task->presets, p_task->presets_cap * sizeof(PresetStats));
+        if (presets == NULL)
+            Error("preset_of: %s\n", MALLOC_FAIL_MSG);
+        p_task->presets = presets;
+    }
+    PresetStats *p_preset = &p_task->presets[p_task->n_presets++];
+    SDL_zerop(p_preset);
+    p_preset->map_width = p_entry->map_width;
+    p_preset->map_height = p_entry->map_height;
+    p_preset->n_mine = p_entry->n_mine;
+    p_preset->best_time = SDL_MAX_UINT32;
+    return p_preset;
+}
+
+/**
+ * @brief Read the replay of the entry where it is mapped, and count its clicks again.
+ */
+static SDL_bool check_entry(const MappedFile *p_archive, const ArchiveEntry *p_entry)
+{
+    Replay replay;
+    if (p_entry->offset < sizeof(ArchiveHeader) || p_entry->offset + p_entry->len > p_archive->len
+            || !read_replay(p_archive->data + p_entry->offset, p_entry->len, &replay))
+        return SDL_FALSE;
+    if (replay.footer.duration != p_entry->duration || replay.footer.result != p_entry->result
+            || replay.footer.bbbv != p_entry->bbbv || replay.header.start_time != p_entry->start_time)
+        return SDL_FALSE;
+
+    Uint32 n_clicks[3] = {0}, time = 0;
+    ReplayRecord record;
+    SDL_bool ended = SDL_FALSE;
+    for (const Uint8 *p = replay_records(&replay); (p = next_replay_record(&replay, p, time, &record)) != NULL; )
+    {
+        time = record.time;
+        if (record.kind == REPLAY_END)
+            ended = SDL_TRUE;
+        else if (record.kind != REPLAY_KEYFRAME)
+            n_clicks[record.kind]++;
+    }
+    return ended && memcmp(n_clicks, p_entry->n_clicks, sizeof(n_clicks)) == 0;
+}
+
+/**
+ * @brief Aggregate the range of entries of a task, in a thread.
+ */
+static int query_thread(void *data)
+{
+    QueryTask *p_task = data;
+    for (Uint64 i = p_task->begin; i < p_task->end; i++)
+    {
+        const ArchiveEntry *p_entry = &p_task->entries[i];
+        if (p_task->p_archive != NULL && !check_entry(p_task->p_archive, p_entry))
+        {
+            p_task->bad++;
+            continue;
+        }
+        PresetStats *p_preset = preset_of(p_task, p_entry);
+        SDL_bool won = p_entry->result == REPLAY_WON;
+        p_preset->games++;
+        Uint64 blocks = (Uint64)p_entry->map_width * p_entry->map_height;
+        DensityStats *p_density = &p_task->density[blocks > 0 && p_entry->n_mine <= blocks ? p_entry->n_mine * 100 / blocks : 0];
+        p_density->games++;
+        if (!won)
+            continue;
+        p_preset->wins++;
+        p_density->wins++;
+        p_preset->clicks += p_entry->n_clicks[REPLAY_LEFT] + p_entry->n_clicks[REPLAY_RIGHT] + p_entry->n_clicks[REPLAY_CHORD];
+        p_preset->bbbv += p_entry->bbbv;
+        if (p_entry->duration < p_preset->best_time)
+        {
+            p_preset->best_time = p_entry->duration;
+            p_preset->best_date = p_entry->start_time;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Split the entries into a contiguous range for each thread and wait for them.
+ */
+static void run_tasks(QueryTask *tasks, unsigned int n_threads, const ArchiveEntry *entries, Uint64 n_entries,
+        const MappedFile *p_archive)
+{
+    SDL_Thread *threads[ARCHIVE_THREADS_MAX];
+    for (unsigned int t = 0; t < n_threads; t++)
+    {
+        QueryTask *p_task = &tasks[t];
+        SDL_zerop(p_task);
+        p_task->entries = entries;
+        p_task->begin = n_entries * t / n_threads;
+        p_task->end = n_entries * (t + 1) / n_threads;
+        p_task->p_archive = p_archive;
+        if ((threads[t] = SDL_CreateThread(query_thread, "query", p_task)) == NULL)
+            Error("Can't create a query thread: %s\n", SDL_GetError());
+    }
+    for (unsigned int t = 0; t < n_threads; t++)
+        SDL_WaitThread(threads[t], NULL);
+}
+
+/**
+ * @brief Add up the results of the threads, a preset split between two of them is combined.
+ */
+static void merge_tasks(QueryTask *tasks, unsigned int n_threads, QueryTask *p_total)
+{
+    SDL_zerop(p_total);
+    for (unsigned int t = 0; t < n_threads; t++)
+    {
+        const QueryTask *p_task = &tasks[t];
+        for (Uint32 i = 0; i < p_task->n_presets; i++)
+        {
+            const PresetStats *p_part = &p_task->presets[i];
+            ArchiveEntry key;
+            key.map_width = p_part->map_width;
+            key.map_height = p_part->map_height;
+            key.n_mine = p_part->n_mine;
+            PresetStats *p_preset = preset_of(p_total, &key);
+            p_preset->games += p_part->games;
+            p_preset->wins += p_part->wins;
+            p_preset->clicks += p_part->clicks;
+            p_preset->bbbv += p_part->bbbv;
+            if (p_part->best_time < p_preset->best_time)
+            {
+                p_preset->best_time = p_part->best_time;
+                p_preset->best_date = p_part->best_date;
+            }
+        }
+        for (int d = 0; d < DENSITY_BUCKETS; d++)
+        {
+            p_total->density[d].games += p_task->density[d].games;
+            p_total->density[d].wins += p_task->density[d].wins;
+        }
+        p_total->bad += p_task->bad;
+        free(tasks[t].presets);
+    }
+}
+
+static void print_query(const QueryTask *p_total, Uint64 n_entries, double elapsed)
+{
+    Uint64 games = 0, wins = 0, clicks = 0, bbbv = 0;
+    printf("%-14s %10s %10s %7s %10s %-19s %10s\n", "preset", "games", "wins", "win%", "best (s)", "best date",
+           "clicks/3BV");
+    for (Uint32 i = 0; i < p_total->n_presets; i++)
+    {
+        const PresetStats *p_preset = &p_total->presets[i];
+        char name[32], date[32] = "-";
+        SDL_snprintf(name, sizeof(name), "%ux%u/%u", p_preset->map_width, p_preset->map_height, p_preset->n_mine);
+        if (p_preset->wins > 0)
+        {
+            time_t best_date = (time_t)p_preset->best_date;
+            strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&best_date));
+        }
+        printf("%-14s %10llu %10llu %6.2f%% %10.3f %-19s %10.2f\n", name, (unsigned long long)p_preset->games,
+               (unsigned long long)p_preset->wins, p_preset->wins * 100.0 / p_preset->games,
+               p_preset->wins > 0 ? p_preset->best_time / 1000.0 : 0.0, date,
+               p_preset->bbbv > 0 ? (double)p_preset->clicks / p_preset->bbbv : 0.0);
+        games += p_preset->games;
+        wins += p_preset->wins;
+        clicks += p_preset->clicks;
+        bbbv += p_preset->bbbv;
+    }
+
+    printf("\n%-14s %10s %10s %7s\n", "mines/100", "games", "wins", "win%");
+    for (int d = 0; d < DENSITY_BUCKETS; d++)
+        if (p_total->density[d].games > 0)
+            printf("%-14d %10llu %10llu %6.2f%%\n", d, (unsigned long long)p_total->density[d].games,
+                   (unsigned long long)p_total->density[d].wins,
+                   p_total->density[d].wins * 100.0 / p_total->density[d].games);
+
+    printf("\n%llu games, %llu won, %.2f clicks per 3BV in won games\n", (unsigned long long)games,
+           (unsigned long long)wins, bbbv > 0 ? (double)clicks / bbbv : 0.0);
+    printf("%llu entries in %.3f ms, %.1f M entries/s\n", (unsigned long long)n_entries, elapsed * 1000,
+           elapsed > 0 ? n_entries / elapsed / 1e6 : 0.0);
+}
+
+/**
+ * @brief Aggregate the entries of the index, and with "check" read every replay, in "n_threads" threads.
+ */
+static void query_archive(const char *archive, unsigned int n_threads, SDL_bool check)
+{
+    MappedFile index, data = {0};
+    const ArchiveIndexHeader *p_header = map_index(archive, &index);
+    if (p_header == NULL)
+        Error("%s has no index!\n", archive);
+    if (check)
+    {
+        if (!map_file(archive, &data) || data.len < p_header->archive_len || data.len < sizeof(ArchiveHeader)
+                || memcmp(((const ArchiveHeader *)data.data)->magic, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC)) != 0)
+            Error("%s is not an archive of version %d!\n", archive, ARCHIVE_VERSION);
+    }
+
+    QueryTask tasks[ARCHIVE_THREADS_MAX], total;
+    Uint64 perf_freq = SDL_GetPerformanceFrequency(), start = SDL_GetPerformanceCounter();
+    run_tasks(tasks, n_threads, (const ArchiveEntry *)(p_header + 1), p_header->n_entries, check ? &data : NULL);
+    merge_tasks(tasks, n_threads, &total);
+    double elapsed = (double)(SDL_GetPerformanceCounter() - start) / perf_freq;
+
+    print_query(&total, p_header->n_entries, elapsed);
+    if (check)
+        printf("%llu replays don't match their entries\n", (unsigned long long)total.bad);
+    free(total.presets);
+    unmap_file(&data);
+    unmap_file(&index);
+    if (total.bad > 0)
+        exit(1);
+}
+
+/**
+ * @brief Write the n-th replay in index order to a file, for "mymines-replay".
+ */
+static void extract_replay(const char *archive, Uint64 n, const char *path)
+{
+    MappedFile index, data;
+    const ArchiveIndexHeader *p_header = map_index(archive, &index);
+    if (p_header == NULL || n >= p_header->n_entries)
+        Error("%s has no replay %llu!\n", archive, (unsigned long long)n);
+    const ArchiveEntry *p_entry = (const ArchiveEntry *)(p_header + 1) + n;
+    if (!map_file(archive, &data) || p_entry->offset + p_entry->len > data.len)
+        Error("%s is cut short!\n", archive);
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        Error("Can't create %s: %s\n", path, strerror(errno));
+    write_all(fd, data.data + p_entry->offset, p_entry->len, path);
+    close(fd);
+    unmap_file(&data);
+    unmap_file(&index);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+        Error("Usage: %s add <archive> <replay>... | query|check <archive> [threads] | extract <archive> <n> <replay>\n",
+              argv[0]);
+    const char *command = argv[1], *archive = argv[2];
+    if (strcmp(command, "add") == 0 && argc >= 4)
+        add_replays(archive, argv + 3, argc - 3);
+    else if ((strcmp(command, "query") == 0 || strcmp(command, "check") == 0) && argc <= 4)
+    {
+        int n_threads = argc == 4 ? atoi(argv[3]) : SDL_GetCPUCount();
+        if (n_threads < 1 || n_threads > ARCHIVE_THREADS_MAX)
+            n_threads = n_threads < 1 ? 1 : ARCHIVE_THREADS_MAX;
+        query_archive(archive, n_threads, strcmp(command, "check") == 0);
+    }
+    else if (strcmp(command, "extract") == 0 && argc == 5)
+        extract_replay(archive, strtoull(argv[3], NULL, 10), argv[4]);
+    else
+        Error("Unknown command %s or wrong arguments!\n", command);
+    return 0;
+}
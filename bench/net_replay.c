@@ -0,0 +1,217 @@
+/**
+ * @file net_replay.c
+ * @author jkilopu
+ * @brief Replay a net trace (see "net_trace.h") into the game on the headless backend, with no sockets.
+ *
+ * @note Usage (run in the directory containing "res", like the game):
+ *       ./mymines-net-replay <trace> [speed]
+ *       speed is 1 for the recorded timing, N for N times faster, 0 (the default) for as fast as possible.
+ *
+ * @details The game is set up from the handshake in the trace, as the side that recorded it. Then the received
+ * packets go through "handle_recved_packet" in the batches they were read in, and the clicks the recording
+ * side sent are clicked again locally. The packets the game sends are only counted, so the replay prints the
+ * cost of each batch, the resyncs and snapshots the game asked for and the hash of the final map, which are the
+ * same in every run of the same trace.
+ */
+#include "SDL.h"
+#include "game.h"
+#include "map.h"
+#include "render.h"
+#include "block.h"
+#include "menu.h"
+#include "net.h"
+#include "net_trace.h"
+#include "prng_alleged_rc4.h"
+#include "fatal.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+extern Drawer drawer;
+extern Uint32 game_over_delay;
+
+/**
+ * @brief Accumulated cost of the received batches, in perf counter ticks.
+ */
+typedef struct {
+    Uint64 total, max;
+    unsigned int cnt;
+} Measure;
+
+static Uint64 perf_freq;
+
+/**
+ * @brief Set the game up like "connect_menu" did for the side that recorded the trace.
+ *
+ * @return Return the index of the first record after the handshake.
+ */
+static Uint32 setup_replayed_game(Game game, const NetTraceRecord *records, Uint32 n_records)
+{
+    const NetTraceRecord *p_seed = NULL, *p_local_seed = NULL, *p_settings = NULL;
+    SDL_bool is_client = SDL_FALSE;
+    Uint32 i;
+    for (i = 0; i < n_records; i++)
+        if (records[i].direction == NET_TRACE_RECVED && records[i].packet.type == TYPE_SEED_KEY)
+            is_client = SDL_TRUE;
+    NetTraceDirection setup_direction = is_client ? NET_TRACE_RECVED : NET_TRACE_SENT;
+
+    for (i = 0; i < n_records && p_settings == NULL; i++)
+    {
+        const NetTraceRecord *p_record = &records[i];
+        if (p_record->direction == NET_TRACE_SEED)
+            p_local_seed = p_record;
+        else if (p_record->direction == setup_direction && p_record->packet.type == TYPE_SEED_KEY)
+            p_seed = p_record;
+        else if (p_record->direction == setup_direction && p_record->packet.type == TYPE_SETTINGS)
+            p_settings = p_record;
+    }
+    if (p_settings == NULL || (p_seed == NULL && p_local_seed == NULL))
+        Error("The trace has no handshake!\n");
+
+    game->settings = p_settings->packet.settings_packet.settings;
+    if (is_client)
+    {
+        set_client_mode(game->settings.game_mode); ///< Like "join_game".
+        if (is_coop_mode(game->settings.game_mode) && i < n_records && records[i].packet.type == TYPE_COOP_JOIN)
+            game->awaiting_snapshot = records[i++].packet.player_packet.in_progress != 0;
+    }
+    if (has_map_authority(game->settings.game_mode))
+    {
+        const SeedKeyPacket *p_key = &(p_local_seed != NULL ? p_local_seed : p_seed)->packet.seed_key_packet;
+        Uint64 key = p_key->key;
+        prng_rc4_seed_bytes(&key, p_key->key_size);
+    }
+
+    set_logical_block_size(game->settings.block_size);
+    layout_game(game);
+    SDL_RenderClear(drawer.renderer);
+    create_map_in_game(game);
+    drawer_present();
+    printf("%s, %ux%u with %u mines, mode 0x%02hhx\n", is_client ? "client" : "server", game->settings.map_width,
+           game->settings.map_height, game->settings.n_mine, game->settings.game_mode);
+    return i;
+}
+
+/**
+ * @brief Handle the SDL events like the main loop, only the timer matters here.
+ */
+static void pump_replay_events(Game game)
+{
+    SDL_Event event;
+    while (SDL_PollEvent(&event))
+        if (event.type == SDL_USEREVENT)
+        {
+            unsigned int *p_time_passed = event.user.data1;
+            (*p_time_passed)++;
+            draw_timer(&game->timer);
+        }
+}
+
+/**
+ * @brief Wait until the record is due at "speed" times the recorded speed.
+ */
+static void wait_record(const NetTraceRecord *p_record, Uint64 first_time, Uint64 start, double speed)
+{
+    if (speed <= 0)
+        return;
+    Uint64 due = start + (Uint64)((p_record->time - first_time) / speed * perf_freq / 1000000);
+    for (Uint64 now = SDL_GetPerformanceCounter(); now < due; now = SDL_GetPerformanceCounter())
+        SDL_Delay((Uint32)((due - now) * 1000 / perf_freq));
+}
+
+/**
+ * @brief Handle the received packets pushed so far, like the main loop does.
+ */
+static void handle_replayed_batch(Game game, Measure *p_m)
+{
+    Uint64 start = SDL_GetPerformanceCounter();
+    SDL_bool need_update = handle_recved_packet(game);
+    if (update_remote_cursor(game, SDL_FALSE))
+        need_update = SDL_TRUE;
+    if (need_update)
+        drawer_present();
+    Uint64 ticks = SDL_GetPerformanceCounter() - start;
+    if (ticks > p_m->max)
+        p_m->max = ticks;
+    p_m->total += ticks;
+    p_m->cnt++;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2 && argc != 3)
+        Error("Usage: %s <trace> [speed]\n", argv[0]);
+    double speed = argc == 3 ? atof(argv[2]) : 0;
+    Uint32 n_records;
+    NetTraceRecord *records = load_net_trace(argv[1], &n_records);
+    if (records == NULL)
+        Error("Can't load %s!\n", argv[1]);
+
+    init_sdl_backend(DRAWER_HEADLESS);
+    load_media();
+    wait_media(MEDIA_ALL);
+    drawer_set_logical_size(0, 0); ///< Like the game, boards are drawn at native resolution.
+    perf_freq = SDL_GetPerformanceFrequency();
+    game_over_delay = speed > 0 ? (Uint32)(GAME_OVER_DELAY / speed) : 0;
+
+    Game game = calloc_fatal(1, sizeof(struct _game), "main - game");
+    Uint32 i = setup_replayed_game(game, records, n_records);
+    start_net_replay();
+
+    Measure batches = {0};
+    Uint32 n_recved = 0, n_clicks = 0;
+    Uint64 first_time = i < n_records ? records[i].time : 0, start = SDL_GetPerformanceCounter();
+    while (i < n_records && is_lan_mode(game->settings.game_mode)) ///< Until TYPE_QUIT.
+    {
+        const NetTraceRecord *p_record = &records[i];
+        if (p_record->direction == NET_TRACE_RECVED && p_record->packet.type == TYPE_SEED_KEY)
+            break; ///< Another session.
+        wait_record(p_record, first_time, start, speed);
+        pump_replay_events(game);
+
+        if (p_record->direction == NET_TRACE_RECVED)
+        {
+            Uint64 time = p_record->time;
+            for (; i < n_records && records[i].direction == NET_TRACE_RECVED && records[i].time == time; i++)
+            {
+                if (!push_replayed_packet(&records[i].packet))
+                {
+                    handle_replayed_batch(game, &batches); ///< More than the queue holds were read at once.
+                    push_replayed_packet(&records[i].packet);
+                }
+                n_recved++;
+            }
+            handle_replayed_batch(game, &batches);
+            continue;
+        }
+        if (p_record->direction == NET_TRACE_SENT && p_record->packet.type == TYPE_CLICK_MAP)
+        {
+            const ClickMapPacket *p_click = &p_record->packet.click_map_packet;
+            if (p_click->click_type == LEFT_CLICK)
+                local_left_click(game, p_click->pos_y, p_click->pos_x);
+            else
+                local_right_click(game, p_click->pos_y, p_click->pos_x);
+            drawer_present();
+            n_clicks++;
+        }
+        i++; ///< Other sent packets are answers, the game sends them again.
+    }
+    double elapsed = (double)(SDL_GetPerformanceCounter() - start) / perf_freq;
+
+    Uint32 sends[TYPE_TRANSPORT + 1];
+    get_replay_sends(sends);
+    printf("records: %u of %u, received packets: %u in %u batches, local clicks: %u\n", i, n_records, n_recved,
+           batches.cnt, n_clicks);
+    if (batches.cnt > 0)
+        printf("batch: mean %.2f us, max %.2f us\n", batches.total * 1e6 / perf_freq / batches.cnt,
+               batches.max * 1e6 / perf_freq);
+    printf("replayed in %.3f s, recorded in %.3f s\n", elapsed,
+           i > 0 && n_records > 0 ? (records[i - 1].time - first_time) / 1e6 : 0.0);
+    printf("sent: clicks %u, resyncs %u, snapshot packets %u, reveals %u\n", sends[TYPE_CLICK_MAP],
+           sends[TYPE_RESYNC], sends[TYPE_SNAPSHOT], sends[TYPE_REVEAL]);
+    printf("map hash: %016llx\n", (unsigned long long)game->map->hash);
+
+    free(records);
+    delete_media();
+    finish_sdl();
+    return 0;
+}
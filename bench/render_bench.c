@@ -0,0 +1,182 @@
+/**
+ * @file render_bench.c
+ * @author jkilopu
+ * @brief Measure the cost of full-board and incremental redraws on the headless backend.
+ *
+ * @note Usage (run in the directory containing "res", like the game):
+ *       ./mymines-render-bench [iterations]
+ */
+#include "SDL.h"
+#include "game.h"
+#include "map.h"
+#include "render.h"
+#include "block.h"
+#include "timer.h"
+#include "prng_alleged_rc4.h"
+#include "fatal.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define DEFAULT_ITERATIONS 200
+
+extern Drawer drawer;
+extern SDL_Texture *main_menu_texture;
+
+typedef struct {
+    Uint32 map_width, map_height, n_mine;
+} BoardSize;
+
+static const BoardSize board_sizes[] = {
+    {9, 9, 10},
+    {16, 16, 40},
+    {30, 16, 99},
+    {60, 60, 600},
+    {99, 99, 1600},
+};
+
+/**
+ * @brief Accumulated timing of one kind of redraw.
+ */
+typedef struct {
+    Uint64 total, min, max;
+    unsigned int cnt;
+} Measure;
+
+static Uint64 perf_freq;
+
+static void measure_add(Measure *p_m, Uint64 ticks)
+{
+    if (p_m->cnt == 0 || ticks < p_m->min)
+        p_m->min = ticks;
+    if (ticks > p_m->max)
+        p_m->max = ticks;
+    p_m->total += ticks;
+    p_m->cnt++;
+}
+
+static void measure_print(const char *board, const char *name, const Measure *p_m)
+{
+    if (p_m->cnt == 0)
+        return;
+    printf("%-10s %-8s %8u %12.2f %12.2f %12.2f\n", board, name, p_m->cnt,
+           p_m->total * 1e6 / perf_freq / p_m->cnt, p_m->min * 1e6 / perf_freq, p_m->max * 1e6 / perf_freq);
+}
+
+/**
+ * @brief Fill the settings the same way "settings_menu" does.
+ */
+static void fill_settings(Settings *p_s, const BoardSize *p_size)
+{
+    p_s->map_width = p_size->map_width;
+    p_s->map_height = p_size->map_height;
+    p_s->n_mine = p_size->n_mine;
+    p_s->block_size = MAIN_WIN_SIZE / (p_s->map_width > p_s->map_height ? p_s->map_width : p_s->map_height);
+    p_s->window_height = p_s->map_height * p_s->block_size;
+    p_s->window_width = p_s->map_width * p_s->block_size + TIME_REGION_WIDTH;
+    clear_mode(p_s->game_mode);
+}
+
+/**
+ * @brief Start a new round without the game over menu, which sleeps.
+ */
+static void reset_game(Game game)
+{
+    if (!game->is_first_click)
+        unset_timer(&game->timer);
+    restart(game);
+}
+
+static void bench_board(const BoardSize *p_size, unsigned int iterations)
+{
+    char board[16];
+    Measure full = {0}, click = {0}, flag = {0}, timer = {0};
+    Game game = calloc_fatal(1, sizeof(struct _game), "bench_board - game");
+
+    fill_settings(&game->settings, p_size);
+    set_logical_block_size(game->settings.block_size);
+    layout_game(game);
+    create_map_in_game(game);
+
+    for (unsigned int i = 0; i < iterations; i++)
+    {
+        Uint64 start = SDL_GetPerformanceCounter();
+        SDL_RenderClear(drawer.renderer);
+        redraw_game(game);
+        drawer_present();
+        measure_add(&full, SDL_GetPerformanceCounter() - start);
+    }
+
+    for (unsigned int i = 0; i < iterations; i++)
+    {
+        unsigned int y = prng_rc4_get_uint() % game->settings.map_height;
+        unsigned int x = prng_rc4_get_uint() % game->settings.map_width;
+
+        Uint64 start = SDL_GetPerformanceCounter();
+        set_draw_flag(game, y, x);
+        drawer_present();
+        measure_add(&flag, SDL_GetPerformanceCounter() - start);
+        set_draw_flag(game, y, x); ///< Take the flag back, so the click can open the block.
+
+        start = SDL_GetPerformanceCounter();
+        SDL_bool over = click_map(game, y, x) || success(game);
+        drawer_present();
+        measure_add(&click, SDL_GetPerformanceCounter() - start);
+
+        start = SDL_GetPerformanceCounter();
+        draw_timer(&game->timer);
+        drawer_present();
+        measure_add(&timer, SDL_GetPerformanceCounter() - start);
+
+        if (over)
+            reset_game(game);
+    }
+
+    snprintf(board, sizeof(board), "%ux%u", p_size->map_width, p_size->map_height);
+    measure_print(board, "full", &full);
+    measure_print(board, "click", &click);
+    measure_print(board, "flag", &flag);
+    measure_print(board, "timer", &timer);
+
+    reset_game(game);
+    destroy_map(game->map);
+    free(game);
+}
+
+static void bench_menu(unsigned int iterations)
+{
+    Measure menu = {0};
+    for (unsigned int i = 0; i < iterations; i++)
+    {
+        Uint64 start = SDL_GetPerformanceCounter();
+        SDL_RenderClear(drawer.renderer);
+        draw(main_menu_texture, NULL, NULL);
+        drawer_present();
+        measure_add(&menu, SDL_GetPerformanceCounter() - start);
+    }
+    measure_print("-", "menu", &menu);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int iterations = argc > 1 ? (unsigned int)atoi(argv[1]) : DEFAULT_ITERATIONS;
+    Uint64 key = 0x6d796d696e6573; ///< Fixed seed, so every run opens the same blocks.
+
+    if (iterations == 0)
+        Error("Usage: %s [iterations]\n", argv[0]);
+
+    init_sdl_backend(DRAWER_HEADLESS);
+    load_media();
+    wait_media(MEDIA_ALL);
+    drawer_set_logical_size(0, 0); ///< Like the game, boards are drawn at native resolution.
+    prng_rc4_seed_bytes(&key, sizeof(key));
+    perf_freq = SDL_GetPerformanceFrequency();
+
+    printf("%-10s %-8s %8s %12s %12s %12s\n", "board", "redraw", "count", "mean(us)", "min(us)", "max(us)");
+    bench_menu(iterations);
+    for (unsigned int i = 0; i < SDL_arraysize(board_sizes); i++)
+        bench_board(&board_sizes[i], iterations);
+
+    delete_media();
+    finish_sdl();
+    return 0;
+}
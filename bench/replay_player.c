@@ -0,0 +1,154 @@
+/**
+ * @file replay_player.c
+ * @author jkilopu
+ * @brief Play a replay (see "replay.h") back, in a window at the recorded speed or headless as fast as possible.
+ *
+ * @note Usage (run in the directory containing "res", like the game):
+ *       ./mymines-replay <replay> [speed [from]]
+ *       speed is 1 (the default) for the recorded timing, N for N times faster, 0 for as fast as possible on
+ *       the headless backend. from is the number of clicks to skip, from the nearest keyframe.
+ *
+ * @details The board is put from the state of the mine generator in the header, then the clicks are applied like
+ * the local player's. At the end the result and the map hash are checked against the footer, so a replay that
+ * doesn't play back to the recorded game is reported.
+ */
+#include "SDL.h"
+#include "game.h"
+#include "map.h"
+#include "render.h"
+#include "menu.h"
+#include "replay.h"
+#include "fatal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+extern Uint32 game_over_delay;
+
+static const char *result_names[] = {"lost", "won", "abandoned"};
+
+/**
+ * @brief Handle the SDL events like the main loop.
+ *
+ * @return Return SDL_FALSE if the window is closed.
+ */
+static SDL_bool pump_player_events(Game game)
+{
+    SDL_Event event;
+    while (SDL_PollEvent(&event))
+        if (event.type == SDL_QUIT)
+            return SDL_FALSE;
+        else if (event.type == SDL_USEREVENT)
+        {
+            unsigned int *p_time_passed = event.user.data1;
+            (*p_time_passed)++;
+            draw_timer(&game->timer);
+        }
+    return SDL_TRUE;
+}
+
+/**
+ * @brief Wait until the record is due at "speed" times the recorded speed, with the window responsive.
+ *
+ * @return Return SDL_FALSE if the window is closed.
+ */
+static SDL_bool wait_player_record(Game game, Uint32 time, Uint32 first_time, Uint32 start, double speed)
+{
+    if (speed <= 0)
+        return SDL_TRUE;
+    Uint32 due = start + (Uint32)((time - first_time) / speed);
+    for (Uint32 now = SDL_GetTicks(); !SDL_TICKS_PASSED(now, due); now = SDL_GetTicks())
+    {
+        if (!pump_player_events(game))
+            return SDL_FALSE;
+        SDL_Delay(due - now < FRAME_INTERVAL ? due - now : FRAME_INTERVAL);
+    }
+    return pump_player_events(game);
+}
+
+/**
+ * @brief Print what the header and footer say about the game.
+ */
+static void print_replay_info(const Replay *p_replay)
+{
+    const ReplayHeader *p_header = &p_replay->header;
+    const ReplayFooter *p_footer = &p_replay->footer;
+    char date[32];
+    time_t start_time = (time_t)p_header->start_time;
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&start_time));
+    Uint32 n_clicks = p_footer->n_clicks[REPLAY_LEFT] + p_footer->n_clicks[REPLAY_RIGHT] + p_footer->n_clicks[REPLAY_CHORD];
+    printf("%s, %ux%u with %u mines, mode 0x%02hhx, %s in %.3f s\n", date, p_header->settings.map_width,
+           p_header->settings.map_height, p_header->settings.n_mine, p_header->settings.game_mode,
+           p_footer->result <= REPLAY_ABANDONED ? result_names[p_footer->result] : "?", p_footer->duration / 1000.0);
+    printf("clicks: %u left, %u right, %u chords, 3BV %u", p_footer->n_clicks[REPLAY_LEFT],
+           p_footer->n_clicks[REPLAY_RIGHT], p_footer->n_clicks[REPLAY_CHORD], p_footer->bbbv);
+    if (p_footer->duration > 0)
+        printf(", %.2f 3BV/s", p_footer->bbbv * 1000.0 / p_footer->duration);
+    printf("\n%u bytes, %.2f bytes per click, %u keyframes\n", p_replay->len,
+           n_clicks > 0 ? (double)(p_footer->index_offset - sizeof(ReplayHeader)) / n_clicks : 0.0,
+           p_footer->n_keyframes);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2 || argc > 4)
+        Error("Usage: %s <replay> [speed [from]]\n", argv[0]);
+    double speed = argc >= 3 ? atof(argv[2]) : 1;
+    Uint32 from = argc == 4 ? (Uint32)strtoul(argv[3], NULL, 10) : 0;
+    Uint32 len;
+    Uint8 *buf = load_replay_file(argv[1], &len);
+    Replay replay;
+    if (buf == NULL || !read_replay(buf, len, &replay))
+        Error("%s is not a replay of version %d!\n", argv[1], REPLAY_VERSION);
+    print_replay_info(&replay);
+
+    disable_replay_recording();
+    if (speed > 0)
+        init_sdl();
+    else
+        init_sdl_backend(DRAWER_HEADLESS);
+    load_media();
+    wait_media(MEDIA_ALL);
+    game_over_delay = speed > 0 ? (Uint32)(GAME_OVER_DELAY / speed) : 0;
+
+    Game game = calloc_fatal(1, sizeof(struct _game), "main - game");
+    start_replay_game(game, &replay);
+    Uint32 last_time = 0, n_clicks = from;
+    Uint64 perf_freq = SDL_GetPerformanceFrequency(), seek_start = SDL_GetPerformanceCounter();
+    const Uint8 *p = from > 0 ? seek_replay(game, &replay, from, &last_time) : replay_records(&replay);
+    double seek_elapsed = (double)(SDL_GetPerformanceCounter() - seek_start) / perf_freq;
+    if (p == NULL)
+        Error("The replay has fewer than %u clicks!\n", from);
+    drawer_present();
+
+    ReplayRecord record;
+    SDL_bool over = SDL_FALSE, closed = SDL_FALSE;
+    Uint32 first_time = last_time, start = SDL_GetTicks();
+    Uint64 play_start = SDL_GetPerformanceCounter();
+    while ((p = next_replay_record(&replay, p, last_time, &record)) != NULL && record.kind != REPLAY_END)
+    {
+        if ((closed = !wait_player_record(game, record.time, first_time, start, speed)))
+            break;
+        last_time = record.time;
+        if (record.kind == REPLAY_KEYFRAME)
+            continue;
+        over = apply_replay_record(game, &record);
+        drawer_present();
+        n_clicks++;
+    }
+    double elapsed = (double)(SDL_GetPerformanceCounter() - play_start) / perf_freq;
+
+    ReplayResult result = success(game) ? REPLAY_WON : over ? REPLAY_LOST : REPLAY_ABANDONED;
+    SDL_bool verified = !closed && result == replay.footer.result && game->map->hash == replay.footer.hash;
+    if (from > 0)
+        printf("seeked to click %u in %.3f ms\n", from, seek_elapsed * 1000);
+    printf("played %u clicks in %.3f s, %s, map hash %016llx: %s\n", n_clicks, elapsed, result_names[result],
+           (unsigned long long)game->map->hash, closed ? "stopped" : verified ? "verified" : "MISMATCH");
+    if (over && !closed)
+        finish(game); ///< Shows the mines for "game_over_delay".
+
+    free(buf);
+    delete_media();
+    finish_sdl();
+    return verified || closed ? 0 : 1;
+}
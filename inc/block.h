@@ -33,7 +33,11 @@ typedef enum _block
 //-------------------------------------------------------------------
 
 void set_block_size(unsigned int bs);
+void set_logical_block_size(unsigned int lbs);
+unsigned int logical2pixel(unsigned int len);
 void draw_block(BLOCK b, unsigned int y, unsigned int x);
 void window2map(unsigned int *p_y, unsigned int *p_x);
+void window2logical(unsigned int *p_y, unsigned int *p_x);
+void logical2window(unsigned int *p_y, unsigned int *p_x);
 
 #endif
@@ -0,0 +1,74 @@
+/**
+ * @file codec.h
+ * @author jkilopu
+ * @brief The compact and endian-safe encoding of packets in protocol version 3.
+ *
+ * @details About protocol version 3:
+ * 1. A packet is a header byte "type | sub << 4" followed by its fields. Integers are varints (7 bits per byte,
+ *    low bits first) and signed ones are zigzag encoded first, so the bytes are the same on all machines.
+ * 2. The fields of each type:
+ *        TYPE_SEED_KEY      key_size (1 byte), varint key
+ *        TYPE_SETTINGS      varint map_width, map_height, n_mine, window_height, window_width, block_size,
+ *                           game_mode (1 byte)
+ *        TYPE_CLICK_MAP     sub is the click type, varint y, varint x, varint seq, varint acked, input_time,
+ *                           hash (8 bytes, little endian)
+ *        TYPE_MOUSE_MOVE    sub is the player, zigzag varint dy, dx, varint input_time (32 bits, wraps) from the
+ *                           previous mouse move in the same direction
+ *        TYPE_QUIT          nothing
+ *        TYPE_REVEAL        data_len (1 byte), data
+ *        TYPE_GAME_OVER     nothing
+ *        TYPE_VERSION       version (1 byte)
+ *        TYPE_RESYNC        nothing
+ *        TYPE_SNAPSHOT      data_len (1 byte), varint offset, data
+ *        TYPE_PING          varint seq, ping_time
+ *        TYPE_PONG          varint seq, ping_time, recv_time, hold_time
+ *        TYPE_VIEWPORT      varint top, left, bottom, right
+ *        TYPE_COOP_JOIN     player (1 byte), in_progress (1 byte)
+ *        TYPE_CURSOR_LEAVE  player (1 byte)
+ *        TYPE_TRANSPORT     sub is the step, varint pid, id, port
+ *    So mouse moves take 6 ~ 8 bytes and clicks about 18 instead of 32. The player of a click is not sent,
+ *    coop rooms of "mymines-server" are in version 2.
+ * 3. Negotiation, see "net.c": the server puts "VERSION_MAGIC" and its highest version in the paddings of
+ *    TYPE_SEED_KEY, which version 2 clients ignore (version 2 servers leave garbage there, hence the magic).
+ *    A client that can speak it replies TYPE_VERSION.
+ *    Each side encodes with the new version right after sending TYPE_VERSION, and decodes with it right after
+ *    receiving TYPE_VERSION. The handshake itself is always in version 2.
+ */
+#ifndef __CODEC_H
+#define __CODEC_H
+
+#include "SDL_stdinc.h"
+#include "packet.h"
+
+#define PROTOCOL_VERSION 3
+#define VERSION_MAGIC "MYM"  ///< In "SeedKeyPacket.paddings[0 ~ 2]", followed by the version.
+#define VERSION_MAGIC_LEN 3
+#define V3_PACKET_MAX 34     ///< The longest packet in version 3, TYPE_CLICK_MAP with the largest varints.
+#define VARINT_MAX 10
+
+//-------------------------------------------------------------------
+// Type Definations
+//-------------------------------------------------------------------
+
+/**
+ * @brief What the encoding of a direction depends on.
+ */
+typedef struct {
+    unsigned int cursor_y, cursor_x; ///< The previous mouse move.
+    Uint32 cursor_time;
+} CodecState;
+
+//-------------------------------------------------------------------
+// Prototypes
+//-------------------------------------------------------------------
+
+int put_varint(Uint8 *buf, Uint64 value);
+int get_varint(const Uint8 *buf, int len, Uint64 *p_value);
+int varint_size(Uint64 value);
+static Uint64 zigzag(Sint64 value);
+static Sint64 unzigzag(Uint64 value);
+
+int encode_packet_v3(const MyMinesPacket *p_mymines_packet, Uint8 *buf, CodecState *p_state);
+int decode_packet_v3(const Uint8 *buf, int len, MyMinesPacket *p_mymines_packet, CodecState *p_state);
+
+#endif
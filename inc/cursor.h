@@ -2,14 +2,64 @@
  * @file cursor.h
  * @author jkilopu
  * @brief Show remote cursor on window.
+ * 
+ * @details About the remote cursor:
+ * 1. The local cursor is sent at most "cursor rate" times per second, and only when it has moved.
+ *    The rate is 30 Hz, or set by the "CURSOR_RATE_ENV" environment variable.
+ * 2. The remote cursor is drawn one sample interval in the past, interpolated between the received samples,
+ *    so it moves smoothly at the frame rate though the samples are sparse. It waits at the newest sample
+ *    if the next one is late, it doesn't guess further.
+ * 3. In a coop room there is a remote cursor per player, each with its own samples. "mymines-server" only
+ *    sends the ones inside the local viewport, and TYPE_CURSOR_LEAVE when one leaves it.
  */
 #ifndef __CURSOR_H
 #define __CURSOR_H
 
+#include "SDL_stdinc.h"
+
 #define REMOTE_CURSOR_IMG_PATH "res/remote_cursor.gif"
 #define CURSOR_WIDTH 20
 #define CURSOR_HEIGHT 25
 
+#define CURSOR_RATE_ENV "MYMINES_CURSOR_RATE"
+#define DEFAULT_CURSOR_RATE 30             ///< In Hz.
+#define CURSOR_SAMPLE_NUM 4
+#define CURSOR_IDLE_GAP 250                ///< In milliseconds, a longer gap between samples means the motion restarts.
+#define REMOTE_CURSOR_FRAME_INTERVAL 16    ///< In milliseconds, how often the remote cursor is redrawn at most.
+
+//-------------------------------------------------------------------
+// Type Definations
+//-------------------------------------------------------------------
+
+/**
+ * @brief A received position of the remote cursor.
+ */
+typedef struct {
+    unsigned int y, x; ///< Logical pos.
+    Uint32 ticks;      ///< When it is received.
+    Uint64 input_time; ///< Perf counter of the move on the remote side, see "estimate_remote_input_time".
+} CursorSample;
+
+/**
+ * @brief The received samples of the cursor of a remote player.
+ */
+typedef struct {
+    CursorSample samples[CURSOR_SAMPLE_NUM];
+    unsigned int sample_num, newest;
+    Uint32 interval; ///< Smoothed time between samples, also the interpolation delay.
+} RemoteCursor;
+
+//-------------------------------------------------------------------
+// Prototypes
+//-------------------------------------------------------------------
+
+void init_cursor_rate(void);
+void local_cursor_moved(unsigned int y, unsigned int x);
+SDL_bool is_local_cursor_due(unsigned int *p_y, unsigned int *p_x);
+void add_remote_cursor_sample(Uint8 player, unsigned int y, unsigned int x, Uint64 input_time);
+SDL_bool get_remote_cursor(Uint8 player, unsigned int *p_y, unsigned int *p_x, Uint64 *p_input_time);
+void hide_remote_cursor(Uint8 player);
+static unsigned int lerp_pos(unsigned int from, unsigned int to, Uint32 t, Uint32 duration);
 void draw_remote_cursor(unsigned int y, unsigned int x);
 
-#endif
\ No newline at end of file
+#endif
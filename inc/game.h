@@ -37,6 +37,17 @@ typedef struct _game {
     Timer timer;
     unsigned int opened_blocks;
     SDL_bool is_first_click;
+    struct _reveal_log *reveal_log; ///< Only used by the host in authoritative mode.
+    Uint32 sent_clicks, recved_clicks; ///< Click packets sent and received, for the lockstep check.
+    SDL_bool awaiting_snapshot;        ///< The client has asked for a snapshot and doesn't check until it comes.
+    Uint32 snapshot_ticks;             ///< When the server sent the last snapshot.
+    SDL_bool awaiting_rejoin;          ///< The client has left, the server plays locally until another one joins.
+    Uint8 rejoin_mode;                 ///< The game mode before the client left.
+    struct _click_map_packet *held_clicks; ///< In coop mode, the clicks received while awaiting the snapshot.
+    Uint32 n_held_clicks, held_clicks_cap;
+    Uint8 coop_player;                 ///< The number of the local player in a coop room.
+    Uint64 click_input_time;           ///< Perf counter of the earliest local click drawn by the other side, 0 if none.
+    Uint32 click_input_seq;            ///< Its number in "sent_clicks".
 } * Game;
 
 //-------------------------------------------------------------------
@@ -45,27 +56,72 @@ typedef struct _game {
 
 #define LAN_LOCAL_BIT 0
 #define SERVER_CLIENT_BIT 1
+#define AUTHORITATIVE_BIT 2 ///< Only the server holds the mines, the client is sent the opened blocks.
+#define COOP_BIT 3 ///< Up to "COOP_MAX_PLAYERS" players on one board in a room of "mymines-server".
+#define SPECTATE_BIT 4 ///< Watch a coop room of "mymines-server" without playing, with "COOP_BIT".
 #define set_lan_mode(game_mode) (game_mode |= (1 << LAN_LOCAL_BIT))
 #define set_local_mode(game_mode) (game_mode &= ~(1 << LAN_LOCAL_BIT))
 #define set_server_mode(game_mode) (game_mode |= (1 << SERVER_CLIENT_BIT))
 #define set_client_mode(game_mode) (game_mode &= ~(1 << SERVER_CLIENT_BIT))
 #define is_lan_mode(game_mode) (game_mode & (1 << LAN_LOCAL_BIT))
 #define is_server_mode(game_mode) (game_mode & (1 << SERVER_CLIENT_BIT))
+#define set_authoritative_mode(game_mode) (game_mode |= (1 << AUTHORITATIVE_BIT))
+#define unset_authoritative_mode(game_mode) (game_mode &= ~(1 << AUTHORITATIVE_BIT))
+#define is_authoritative_mode(game_mode) (game_mode & (1 << AUTHORITATIVE_BIT))
+#define set_coop_mode(game_mode) (game_mode |= (1 << COOP_BIT))
+#define unset_coop_mode(game_mode) (game_mode &= ~(1 << COOP_BIT))
+#define is_coop_mode(game_mode) (game_mode & (1 << COOP_BIT))
+#define set_spectate_mode(game_mode) (game_mode |= (1 << SPECTATE_BIT))
+#define unset_spectate_mode(game_mode) (game_mode &= ~(1 << SPECTATE_BIT))
+#define is_spectate_mode(game_mode) (game_mode & (1 << SPECTATE_BIT))
+#define is_authoritative_host(game_mode) (is_lan_mode(game_mode) && is_server_mode(game_mode) && is_authoritative_mode(game_mode))
+#define has_map_authority(game_mode) (!is_lan_mode(game_mode) || is_server_mode(game_mode) || !is_authoritative_mode(game_mode))
 #define clear_mode(game_mode) (game_mode = 0)
 
+#define AUTHORITATIVE_ENV "MYMINES_AUTHORITATIVE" ///< Set it on the server to play in authoritative mode.
+#define COOP_ENV "MYMINES_COOP" ///< Set it on the client to join a coop room of "mymines-server".
+#define SPECTATE_ENV "MYMINES_SPECTATE" ///< Set it on the client to watch a coop room of "mymines-server".
+#define COOP_MAX_PLAYERS 16
+#define FRAME_INTERVAL 16 ///< In milliseconds, the longest time the main loop sleeps without events.
+#define RESYNC_INTERVAL 500 ///< In milliseconds, the shortest time between two snapshots the server sends by itself.
+
 //-------------------------------------------------------------------
 // Prototypes
 //-------------------------------------------------------------------
 
+union _mymines_packet; ///< "MyMinesPacket" in "packet.h", which includes this file.
+struct _click_map_packet; ///< "ClickMapPacket" in "packet.h".
+
 Game setup(void);
 static Game create_empty_game(void);
 void connect_and_complete_setup(Game game, const char *ip, Uint32 port);
+void layout_game(Game game);
 void create_map_in_game(Game game);
 
 SDL_bool handle_recved_packet(Game game);
+static SDL_bool dispatch_packet(Game game, const union _mymines_packet *p_mymines_packet);
+SDL_bool update_remote_cursor(Game game, SDL_bool force);
+static void apply_revealed_block(void *p_game, Uint32 block, Uint8 value);
+static void send_lockstep_click(Game game, Uint8 click_type, unsigned int y, unsigned int x);
+static void check_lockstep(Game game, const struct _click_map_packet *p_click_map_packet);
+static void resync_map(Game game);
+static void send_game_snapshot(Game game);
+static void restore_game_snapshot(Game game, const Uint8 *buf, Uint32 len);
+static void hold_click(Game game, const struct _click_map_packet *p_click_map_packet);
+static void apply_held_clicks(Game game);
+void send_coop_viewport(Game game, SDL_bool visible);
+void poll_rejoin(Game game);
+void local_left_click(Game game, unsigned int y, unsigned int x);
+void local_right_click(Game game, unsigned int y, unsigned int x);
+static void defer_local_click(Game game);
+static void mark_local_click_drawn(Game game);
+static void finish_left_click(Game game, SDL_bool over);
+static void log_rest_blocks(Game game);
 SDL_bool click_map(Game game, unsigned int y, unsigned int x);
+static SDL_bool click_block(Game game, unsigned int y, unsigned int x);
 static void show_block_in_map_without_mine(Map map, unsigned int y, unsigned int x);
 static void show_whole_map(Map map);
+void redraw_game(Game game);
 static void show_block_in_cursor(Map map, unsigned int cursor_y, unsigned int cursor_x);
 void set_draw_flag(Game game, unsigned int y, unsigned int x);
 static void show_blocks(Game game, unsigned int y, unsigned int x);
@@ -0,0 +1,72 @@
+/**
+ * @file latency.h
+ * @author jkilopu
+ * @brief Measure input-to-present latency and frame time, show them on a HUD.
+ * 
+ * @details About latency in mymines:
+ * 1. An input is timestamped when it is taken from the SDL event queue (local). A remote click or mouse move
+ *    carries the time of the sender, mapped to the local clock by the clock offset (see "LinkStats"), so the
+ *    network is counted too. Other remote packets, and all of them before the first pong or in a coop room, are
+ *    timestamped when they are read from the socket, minus half of the smoothed RTT.
+ * 2. The latency sample is taken when "drawer_present" shows the result of the input on screen, so an input is
+ *    only marked when its result is drawn: a remote packet when it changes the window, a mouse move when the
+ *    remote cursor reaches it, a local click in a coop room or of the client in authoritative mode when the
+ *    other side sends its result back. If more inputs are marked before the present, only the earliest one is measured.
+ * 3. Frame time is from the first draw after a present to the end of the next present.
+ * 4. Each kind keeps the last "LATENCY_WINDOW" samples, percentiles are computed over them.
+ * 5. The last row of the HUD is the link: smoothed RTT, jitter and last RTT.
+ */
+#ifndef __LATENCY_H
+#define __LATENCY_H
+
+#include "SDL.h"
+
+#define LATENCY_WINDOW 512
+#define HUD_KEY SDLK_F3
+#define HUD_REFRESH_INTERVAL 500 ///< In milliseconds.
+#define LATENCY_LOG_ENV "MYMINES_LATENCY_LOG" ///< Path of the file to dump the stats to at exit.
+
+//-------------------------------------------------------------------
+// Type Definations
+//-------------------------------------------------------------------
+
+typedef enum {
+    LATENCY_LOCAL_INPUT,
+    LATENCY_REMOTE_INPUT,
+    LATENCY_FRAME,
+    LATENCY_KIND_NUM,
+} LatencyKind;
+
+/**
+ * @brief Rolling samples of one kind, in microseconds.
+ */
+typedef struct {
+    Uint32 samples[LATENCY_WINDOW];
+    unsigned int next;  ///< Where the next sample goes.
+    unsigned int num;   ///< Number of valid samples, at most "LATENCY_WINDOW".
+    Uint64 total_num;   ///< Number of samples since start.
+} LatencyHistogram;
+
+/**
+ * @brief Summary of a histogram.
+ */
+typedef struct {
+    Uint32 p50, p99, max;
+} LatencyStats;
+
+//-------------------------------------------------------------------
+// Prototypes
+//-------------------------------------------------------------------
+
+void latency_mark_input(LatencyKind kind);
+void latency_mark_input_at(LatencyKind kind, Uint64 counter);
+void latency_mark_draw(void);
+void latency_presented(void);
+void latency_get_stats(LatencyKind kind, LatencyStats *p_stats);
+
+void draw_latency_hud(const SDL_Rect *p_region);
+void clear_latency_hud(const SDL_Rect *p_region);
+
+void latency_dump(const char *path);
+
+#endif
@@ -20,17 +20,27 @@
  * 
  * Map Blocks Flag:
  *      The flag bit is at 6th bit of the block. For details, see "Flag Manipulate Macros" below.
+ * 
+ * Map Hash:
+ *      A Zobrist hash of what the players see, the opened blocks and the flags. Each block has a key for being
+ *      opened and one for having a flag, "open_block", "set_flag" and "unset_flag" xor them into "hash", so it is
+ *      kept in O(1) per change and is the same for the same board whatever the order of the clicks.
+ *      The keys are computed from the block number, so both sides of a LAN game have the same keys without a table.
  */
 
 #ifndef __MAP_H
 #define __MAP_H
 
+#include "SDL_stdinc.h"
+
 //-------------------------------------------------------------------
 // Map Block Type Macros
 //-------------------------------------------------------------------
 
 #define MINE (9)
 #define EXPLODED_MINE (10)
+#define OPEN_KEY 0
+#define FLAG_KEY 1
 
 //-------------------------------------------------------------------
 // Map Block Manipulate Macros
@@ -38,9 +48,10 @@
 
 #define set_mine(y, x, map) map->arr[y][x] = MINE
 #define set_exploded_mine(y, x, map) map->arr[y][x] = EXPLODED_MINE
-#define open_block(y, x, map) map->arr[y][x] += '0'
+#define open_block(y, x, map) (map->arr[y][x] += '0', toggle_hash(y, x, map, OPEN_KEY))
 #define set_num(y, x, map, n) map->arr[y][x] = n
 #define get_block(y, x, map) map->arr[y][x]
+#define toggle_hash(y, x, map, kind) (map->hash ^= zobrist_key(((Uint64)(y) * map->row + (x)) * 2 + (kind)))
 
 //-------------------------------------------------------------------
 // Map Block Status Macros
@@ -67,9 +78,9 @@
 // Flag Manipulate Macros
 //-------------------------------------------------------------------
 
-#define set_flag(y, x, map) ((map->arr[y][x]) |= (1 << FLAG_BIT))
+#define set_flag(y, x, map) ((map->arr[y][x]) |= (1 << FLAG_BIT), toggle_hash(y, x, map, FLAG_KEY))
 #define has_flag(y, x, map) ((map->arr[y][x]) & (1 << FLAG_BIT))
-#define unset_flag(y, x, map) ((map->arr[y][x]) &= ~(1 << FLAG_BIT))
+#define unset_flag(y, x, map) ((map->arr[y][x]) &= ~(1 << FLAG_BIT), toggle_hash(y, x, map, FLAG_KEY))
 
 //-------------------------------------------------------------------
 // Type Definations
@@ -81,6 +92,7 @@
 typedef struct _map {
     char **arr;                 ///< The two dimension array.
     unsigned int col, row;    ///< The column and row of the map.
+    Uint64 hash;                ///< See "Map Hash" above.
 } *Map;
 
 //-------------------------------------------------------------------
@@ -93,6 +105,8 @@ void remove_mine(Map map, unsigned int y, unsigned int x);
 unsigned int cnt_mines(Map map, unsigned int y, unsigned int x);
 unsigned int cnt_flags(Map map, unsigned int y, unsigned int x);
 void unhidden_map(Map map);
+Uint64 zobrist_key(Uint64 n);
+void rehash_map(Map map);
 void clear_map(Map map);
 void destroy_map(Map map);
 
@@ -19,6 +19,8 @@
 #define RETURN_BUTTON_PATH "res/return.gif"
 #define RESTART_BUTTON_PATH "res/restart.gif"
 #define QUIT_BUTTON_PATH "res/quit.gif"
+#define WAIT_POLL_INTERVAL 33 ///< In milliseconds, the longest time the net module sleeps between "wait_menu_main".
+#define GAME_OVER_DELAY 5000 ///< In milliseconds, how long the whole map is shown.
 
 //-------------------------------------------------------------------
 // Prototypes
@@ -45,7 +47,7 @@ static void draw_settings_menu(const Character ds[], const PairButton bs[], unsi
 static SDL_bool settings_menu_main(Character ds[], PairButton bs[], unsigned int num);
 
 SDL_bool connect_menu(Game game, const char *ip, Uint32 port);
-SDL_bool host_menu_main(void);
+SDL_bool wait_menu_main(Uint32 start_ticks, Uint32 timeout);
 static void draw_host_menu(unsigned short frame_cnt);
 
 void game_over_menu(void);
@@ -4,8 +4,9 @@
  * @brief Simple net module to help establish connection, send and receive packet between client and server.
  * 
  * @note
- * 1. Only support one client and one server at present.
- * 2. I don't know if this module can be used in big endian machine.
+ * 1. Only support one client and one server at present, or many clients in a coop room of "mymines-server".
+ * 2. Version 2 packets are raw structs, I don't know if they work between machines of different endian.
+ *    Version 3 (see "codec.h") is endian-safe and much smaller, it is used when both sides support it.
  * 3. DO NOT run program that has this module on real server, I don't know if it is safe.
  * 
  * @details The design of this net module(version 2):
@@ -13,8 +14,38 @@
  *    fixed size (32 bytes) in all platforms and compilers. (Inspired by "SDL2_Event")
  * 2. The type of the packet is at the header of the packet. Each type corresponds to a structure.
  *    With the help of type, the program knows how to deal with it. (So no "PacketType" packet in this version)
- * 3. The "socket_set" in "net.c" file is used to implement asynchrony.
+ * 3. After the handshake, only a network thread touches the socket. It sleeps on "socket_set" (the socket and a
+ *    loopback UDP "wake_socket"), reads all arrived bytes into a ring buffer with one call, decodes them and passes
+ *    the packets to the main thread through a lock-free single-producer single-consumer queue, then pushes an SDL
+ *    event so the main thread, sleeping in "SDL_WaitEventTimeout", wakes up. Packets to send go the other way
+ *    through another queue, urgent ones wake the thread with a datagram to "wake_socket".
  * 4. Use magic macro in SDL2 to ensure that the size of struct and union is fixed.
+ * 5. Packet types are defined in "packet.h", which has no SDL_net dependency.
+ * 6. The main thread never waits for the network thread, which blocks in "SDLNet_TCP_Send" if the other side reads
+ *    slowly. Packets that don't fit in the send queue wait in order in a backlog of the main thread, they are never
+ *    dropped. When the queue is congested, a mouse move waits in a single slot instead and is superseded by the
+ *    next one, so only the newest position is sent. See "SendQueueStats".
+ *    The other side is taken as dead if a send of the network thread makes no progress for "SEND_TIMEOUT", or
+ *    the backlog reaches "SEND_BACKLOG_MAX" packets. The session ends then as if it sent TYPE_QUIT, like
+ *    "mymines-server" drops a connection past "CONN_OUT_BUF_MAX".
+ * 7. Sent packets are buffered by the network thread and sent together once per frame,
+ *    or at once for clicks, settings, quit, game over and the last reveal packet of a click.
+ *    Nagle's algorithm is off, as SDL_net sets TCP_NODELAY on the sockets it opens (accepted sockets inherit it
+ *    from the listening one), so the coalescing is done only by the send buffer and doesn't add delay.
+ * 8. The network thread moves bytes through a "Transport", TCP or a shared memory link ("shm_link.h") with a peer
+ *    on the same host. A client whose host is local offers a link with TYPE_TRANSPORT at the end of the handshake, and
+ *    each direction moves to it in order: the server answers SHM_ACCEPT and writes to the link from then on, the
+ *    client reads from the link after SHM_ACCEPT, answers SHM_SWITCHED and writes to it too, and the server reads
+ *    from it after SHM_SWITCHED. The byte stream just goes on in the link, so the codec and the game don't notice.
+ *    The TCP socket stays open but idle. Set "SHM_ENV" to 0 on either side to stay on TCP.
+ * 9. With "UDP_CURSOR_ENV" set, a client that doesn't use shared memory offers a UDP cursor channel at the end of
+ *    the handshake (UDP_OFFER with its port and a random token, the server answers UDP_ACCEPT with its port).
+ *    Mouse moves then go in datagrams of "CURSOR_DATAGRAM_SIZE" bytes: token, sequence number, y, x, input time (big endian),
+ *    so a lost one never holds back a click on TCP. The receiver drops datagrams with another token and ones
+ *    older than the newest it has. The server learns the address of the client from its datagrams (the first
+ *    one, sequence number 0, is sent right away), its own mouse moves stay on TCP until then.
+ * 10. The packets the game sends and takes can be recorded, see "net_trace.h". A recorded session is replayed
+ *    without sockets by "start_net_replay": the received packets are pushed to the receive queue by the caller.
  */
 
 #ifndef __NET_H
@@ -23,99 +54,92 @@
 #include "SDL_net.h"
 #include "SDL_stdinc.h"
 #include "game.h"
+#include "packet.h"
  
 #define MAX_IP_LEN 15
 #define MAX_PORT_LEN 5
+#define SEND_BUF_SIZE (sizeof(MyMinesPacket) * 64)
+#define SEND_FRAME_INTERVAL 8 ///< In milliseconds, the longest time a packet that is not urgent waits in the send buffer.
+#define RECV_RING_SIZE 4096 ///< Must be a power of two, so the ring counters can wrap.
+#define PACKET_QUEUE_SIZE 256 ///< Must be a power of two, for the same reason.
+#define SEND_QUEUE_CONGESTED (PACKET_QUEUE_SIZE / 4) ///< Mouse moves are superseded from this depth of the send queue.
+#define SEND_BACKLOG_MAX (PACKET_QUEUE_SIZE * 16) ///< A backlog of this many packets means the other side is dead.
+#define SEND_TIMEOUT 5000 ///< In milliseconds, a send of the network thread that makes no progress for this fails.
+#define CONNECT_TIMEOUT_ENV "MYMINES_CONNECT_TIMEOUT" ///< In seconds, how long the client tries, 0 for forever.
+#define DEFAULT_CONNECT_TIMEOUT 30
+#define ACCEPT_TIMEOUT_ENV "MYMINES_ACCEPT_TIMEOUT" ///< In seconds, how long the server waits, 0 for forever.
+#define DEFAULT_ACCEPT_TIMEOUT 0
+#define CONNECT_BACKOFF_MIN 100 ///< In milliseconds, the delay before the first retry, doubled after each failure.
+#define CONNECT_BACKOFF_MAX 2000
+#define PING_INTERVAL 1000 ///< In milliseconds.
+#define PING_WINDOW 8 ///< The clock offset is taken from the ping with the lowest RTT of the last ones.
+#define SHM_ENV "MYMINES_SHM" ///< Set to 0 to stay on TCP with a peer on the same host.
+#define UDP_CURSOR_ENV "MYMINES_UDP_CURSOR" ///< Set to 1 on the client to send mouse moves over UDP.
+#define CURSOR_DATAGRAM_SIZE 20
 
 //-------------------------------------------------------------------
 // Type Definations
 //-------------------------------------------------------------------
 
 /**
- * @brief All packet types sent during game process.
+ * @brief A lock-free single-producer single-consumer queue between the main thread and the network thread.
  */
-typedef enum {
-    TYPE_NONE,
-    TYPE_SEED_KEY,
-    TYPE_SETTINGS,
-    TYPE_CLICK_MAP,
-    TYPE_MOUSE_MOVE,
-    TYPE_QUIT,
-} PacketTypeEnum;
-
-typedef Uint8 PacketType;
+typedef struct {
+    MyMinesPacket packets[PACKET_QUEUE_SIZE];
+    SDL_bool urgent[PACKET_QUEUE_SIZE]; ///< Only used by the send queue.
+    Uint64 recv_times[PACKET_QUEUE_SIZE]; ///< Only used by the receive queue, when the packet was read, in perf counter ticks.
+    SDL_atomic_t head; ///< Only written by the consumer.
+    SDL_atomic_t tail; ///< Only written by the producer.
+} PacketQueue;
 
 /**
- * @brief Record the key and key_size to seed.
+ * @brief The state of the link measured by TYPE_PING and TYPE_PONG, written by the network thread.
  * 
- * @note Use:
- * Help generate totally same map on both side.
+ * @note For a pong received at "t3" (local) for a ping sent at "t0" (local), received at "t1" and answered at
+ * "t2 = t1 + hold_time" (remote): RTT is "t3 - t0 - hold_time", and the clock offset (remote minus local) is
+ * "((t1 - t0) + (t2 - t3)) / 2", exact if the link takes as long both ways.
+ * Clicks and mouse moves carry the time of the sender, which the offset maps to the local clock, see
+ * "estimate_remote_input_time".
+ * "srtt" and "jitter" are smoothed like TCP (RFC 6298), "jitter" is the mean deviation of the RTT.
  */
 typedef struct {
-    PacketType type;
-    Uint8 key_size;
-    Uint8 paddings[6];
-    Uint64 key;
-} SeedKeyPacket;
-SDL_COMPILE_TIME_ASSERT(SeedKeyPacket, sizeof(SeedKeyPacket) == 16);
+    Uint32 srtt, jitter;   ///< In microseconds.
+    Uint32 last_rtt;
+    Sint64 offset;         ///< In microseconds.
+    Uint32 pongs;          ///< The others are valid only if it is not 0.
+} LinkStats;
 
 /**
- * @brief Record pos of mouse motion.
+ * @brief The state of the sending side, only used by the main thread.
  */
 typedef struct {
-    PacketType type;
-    Uint8 padding[3];
-    Uint32 pos_y;
-    Uint32 pos_x;
-} MouseMovePacket;
-SDL_COMPILE_TIME_ASSERT(MouseMovePacket, sizeof(MouseMovePacket) == 12);
+    Uint32 depth, max_depth;       ///< Packets in the send queue.
+    Uint32 backlog, max_backlog;   ///< Packets waiting for room in the send queue.
+    Uint64 moves_superseded;       ///< Mouse moves replaced by a newer one before they are queued.
+} SendQueueStats;
 
 /**
- * @brief All click packet types.
- */
-typedef enum {
-    LEFT_CLICK,
-    RIGHT_CLICK,
-} ClickTypeEnum;
-
-typedef Uint8 ClickType;
-
-/**
- * @brief Record the type and pos of mouse click.
+ * @brief How the network thread moves bytes to and from the other side.
  */
 typedef struct {
-    PacketType type;
-    ClickType click_type;
-    Uint8 paddings[2];
-    Uint32 pos_y;
-    Uint32 pos_x;
-} ClickMapPacket;
-SDL_COMPILE_TIME_ASSERT(ClickMapPacket, sizeof(ClickMapPacket) == 12);
+    const char *name;
+    SDL_bool (*send)(const void *data, Uint32 len); ///< Blocks until all is sent, SDL_FALSE if it is broken.
+    int (*recv)(void *buf, Uint32 len);              ///< Like "SDLNet_TCP_Recv", only called when "readable".
+    SDL_bool (*readable)(void);                      ///< There are bytes, or the connection is closed.
+    void (*wait)(Uint32 timeout);                    ///< Sleep until "readable", "wake" or the timeout.
+    void (*wake)(void);                              ///< Called by the main thread.
+} Transport;
 
 /**
- * @brief Record game settings.
+ * @brief One attempt to connect, shared by the waiting client and the thread that connects.
  */
 typedef struct {
-    PacketType type;
-    Uint8 padding[3];
-    Settings settings;
-} SettingsPacket;
-SDL_COMPILE_TIME_ASSERT(SettingsPacket, sizeof(SettingsPacket) == 32);
-
-/**
- * @brief General packet union in mymines.
- * 
- * @note Always use "MyMinesPacket" to send and receive packet.
- */
-typedef union {
-    PacketType type;
-    SettingsPacket settings_packet;
-    SeedKeyPacket seed_key_packet;
-    MouseMovePacket mouse_move_packet;
-    ClickMapPacket click_map_packet;
-    Uint8 padding[32];
-} MyMinesPacket;
-SDL_COMPILE_TIME_ASSERT(MyMinesPacket, sizeof(MyMinesPacket) == 32);
+    IPaddress addr;
+    TCPsocket socket; ///< Set by the thread before "done" is posted, NULL if it fails.
+    SDL_sem *done;
+    SDL_atomic_t cancelled; ///< The client stops waiting, the socket is closed if it connects later.
+    SDL_atomic_t refcount; ///< The last of the two frees it.
+} ConnectJob;
 
 //-------------------------------------------------------------------
 // Prototypes
@@ -123,26 +147,108 @@ SDL_COMPILE_TIME_ASSERT(MyMinesPacket, sizeof(MyMinesPacket) == 32);
 
 static void server_resolve_host(IPaddress *p_addr, Uint32 port);
 static void client_resolve_host(IPaddress *p_addr, const char *host, Uint32 port);
-SDL_bool is_connected_socket_ready(void);
+static Uint32 get_timeout_env(const char *name, Uint32 default_timeout);
+static void close_connection(void);
+
+static void set_tcp_send_timeout(Uint32 timeout);
+static SDL_bool tcp_send(const void *data, Uint32 len);
+static int tcp_recv(void *buf, Uint32 len);
+static SDL_bool tcp_readable(void);
+static void tcp_wait(Uint32 timeout);
+static void tcp_wake(void);
+static SDL_bool shm_send(const void *data, Uint32 len);
+static int shm_recv(void *buf, Uint32 len);
+static SDL_bool shm_readable(void);
+static void shm_wait(Uint32 timeout);
+static void shm_wake(void);
+static const Transport *get_recv_transport(void);
+static void set_recv_transport(const Transport *p_transport);
+static void stop_recv_transport(void);
+static SDL_bool is_shm_enabled(void);
+static SDL_bool is_local_peer(void);
+static void offer_shm_link(void);
+static void handle_transport_packet(const TransportPacket *p_transport_packet);
+
+static SDL_bool open_cursor_channel(Uint16 port, Uint16 *p_port);
+static void close_cursor_channel(void);
+static void offer_cursor_channel(void);
+static SDL_bool send_cursor_datagram(const MouseMovePacket *p_mouse_move_packet);
+static SDL_bool recv_cursor_datagrams(Uint64 now);
+
+static SDL_bool push_packet_queue(PacketQueue *p_queue, const MyMinesPacket *p_mymines_packet,
+        SDL_bool urgent, Uint64 recv_time);
+static SDL_bool pop_packet_queue(PacketQueue *p_queue, MyMinesPacket *p_mymines_packet,
+        SDL_bool *p_urgent, Uint64 *p_recv_time);
+static SDL_bool is_packet_queue_full(PacketQueue *p_queue);
+static Uint32 get_packet_queue_depth(PacketQueue *p_queue);
+static void reset_packet_queue(PacketQueue *p_queue);
 
 static void fill_seed_key_packet(SeedKeyPacket *p_seed_key_packet, Uint64 key, Uint8 key_size);
 static void fill_settings_packet(SettingsPacket *p_settings_packet, Settings *p_settings);
 static void fill_click_map_packet(ClickMapPacket *p_click_map_packet,
-        ClickType click_type, unsigned int y, unsigned int x);
+        ClickType click_type, unsigned int y, unsigned int x, Uint32 seq, Uint32 acked, Uint64 hash);
 static void fill_mouse_move_packet(MouseMovePacket *p_mouse_move_packet, unsigned int y, unsigned int x);
 
-static void send_mymines_packet(MyMinesPacket *p_mymines_packet);
+static void write_packet(MyMinesPacket *p_mymines_packet, SDL_bool urgent);
+static void send_mymines_packet(MyMinesPacket *p_mymines_packet, SDL_bool urgent);
+static void push_send_backlog(const MyMinesPacket *p_mymines_packet, SDL_bool urgent);
+void pump_send_queue(void);
+void get_send_queue_stats(SendQueueStats *p_stats);
+static void send_version_packet(Uint8 version);
+static void flush_send_buf(void);
+static void flush_send_buf_per_frame(void);
 void send_seed_key_packet(Uint64 key, Uint8 key_size);
 void send_settings_packet(Settings *p_settings);
-void send_click_map_packet(ClickType click_type, unsigned int y, unsigned int x);
+void send_click_map_packet(ClickType click_type, unsigned int y, unsigned int x, Uint32 seq, Uint32 acked, Uint64 hash);
 void send_mouse_move_packet(unsigned int y, unsigned int x);
+void send_viewport_packet(Uint32 top, Uint32 left, Uint32 bottom, Uint32 right);
 void send_quit_packet(void);
-
-void recv_mymines_packet(MyMinesPacket *p_mymines_packet);
+void send_reveal_packet(const RevealPacket *p_reveal_packet, SDL_bool urgent);
+void send_game_over_packet(void);
+void send_resync_packet(void);
+void send_snapshot_packet(const SnapshotPacket *p_snapshot_packet, SDL_bool urgent);
+
+static SDL_bool fill_recv_ring(void);
+static void peek_recv_ring(void *buf, Uint32 len);
+static SDL_bool read_packet(MyMinesPacket *p_mymines_packet);
+static SDL_bool wait_recv_packet(MyMinesPacket *p_mymines_packet, Uint32 start_ticks, Uint32 timeout);
+SDL_bool pop_recved_packet(MyMinesPacket *p_mymines_packet, Uint64 *p_recv_time);
+void rearm_net_event(void);
+
+static Uint64 counter_to_us(Uint64 counter);
+static void send_ping_packet(Uint64 now);
+static void send_pong_packet(const PingPacket *p_ping_packet, Uint64 recv_time);
+static void update_link_stats(const PingPacket *p_pong_packet, Uint64 recv_time);
+void get_link_stats(LinkStats *p_stats);
+Uint32 get_input_time(void);
+Uint64 estimate_remote_input_time(Uint64 recv_time, Uint32 input_time);
+
+static void wake_net_thread(void);
+static void push_net_event(void);
+static SDL_bool deliver_recved_packets(SDL_bool closed);
+static int net_thread_main(void *data);
+static void start_net_thread(void);
+
+static ConnectJob *start_connect_job(const IPaddress *p_addr);
+static int connect_worker(void *data);
+static void release_connect_job(ConnectJob *p_job);
+static TCPsocket connect_with_backoff(const IPaddress *p_addr, Uint32 start_ticks, Uint32 timeout);
 
 SDL_bool host_game(Uint32 port, Uint64 key, Uint8 key_size, Settings *p_settings);
-SDL_bool join_game(const char *host, Uint32 port, Uint64 *p_key, Uint8 *p_key_size, Settings *p_settings);
+static void log_peer_addr(void);
+static void start_hosted_session(Settings *p_settings);
+SDL_bool join_game(const char *host, Uint32 port, Uint64 *p_key, Uint8 *p_key_size, Settings *p_settings,
+        SDL_bool *p_in_progress, Uint8 *p_player);
+
+SDL_bool listen_for_rejoin(void);
+SDL_bool accept_rejoin(Settings *p_settings);
+static void close_rejoin_listener(void);
+void stop_listening_for_rejoin(void);
 
 void finish_sdl_net(void);
 
+void start_net_replay(void);
+SDL_bool push_replayed_packet(const MyMinesPacket *p_mymines_packet);
+void get_replay_sends(Uint32 *counts);
+
 #endif
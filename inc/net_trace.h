@@ -0,0 +1,70 @@
+/**
+ * @file net_trace.h
+ * @author jkilopu
+ * @brief Record the packets sent and received by the game to a binary file, replayed by "mymines-net-replay".
+ *
+ * @details About the net trace:
+ * 1. Set "NET_TRACE_ENV" to a path to record. The file is created at the first packet and written until exit,
+ *    so a client that rejoins goes on in the same file.
+ * 2. Packets are recorded in the main thread where the game sees them: when it sends one ("send_mymines_packet")
+ *    and when it takes a received one (handshake and "pop_recved_packet"). The ones the network thread handles
+ *    itself (ping, pong, version and transport) are not recorded.
+ * 3. A received packet has the time it was read from the socket, a sent one the time it was sent, in
+ *    microseconds since the trace started. Packets read together have the same time.
+ * 4. The key the game seeds its mine generator with is recorded too ("NET_TRACE_SEED"), as the server in
+ *    authoritative mode doesn't send it.
+ * 5. The file is a "NetTraceHeader" followed by "NetTraceRecord"s, raw structs like the version 2 protocol.
+ *    Writes go through a stdio buffer, so recording costs a copy per packet.
+ */
+#ifndef __NET_TRACE_H
+#define __NET_TRACE_H
+
+#include "SDL.h"
+#include "packet.h"
+
+#define NET_TRACE_ENV "MYMINES_NET_TRACE" ///< Path of the trace file.
+#define NET_TRACE_MAGIC "MYMNTRC"         ///< With the '\0', 8 bytes.
+#define NET_TRACE_VERSION 1
+#define NET_TRACE_BUF_SIZE (64 * 1024)
+
+//-------------------------------------------------------------------
+// Type Definations
+//-------------------------------------------------------------------
+
+typedef enum {
+    NET_TRACE_SENT,
+    NET_TRACE_RECVED,
+    NET_TRACE_SEED,   ///< "packet" is a TYPE_SEED_KEY with the key of the local mine generator.
+} NetTraceDirectionEnum;
+
+typedef Uint8 NetTraceDirection;
+
+typedef struct {
+    char magic[8];
+    Uint32 version;
+    Uint32 record_size;
+} NetTraceHeader;
+SDL_COMPILE_TIME_ASSERT(NetTraceHeader, sizeof(NetTraceHeader) == 16);
+
+typedef struct {
+    Uint64 time;                 ///< In microseconds since the trace started.
+    NetTraceDirection direction;
+    Uint8 urgent;                ///< Sent packets only.
+    Uint8 paddings[6];
+    MyMinesPacket packet;
+} NetTraceRecord;
+SDL_COMPILE_TIME_ASSERT(NetTraceRecord, sizeof(NetTraceRecord) == 48);
+
+//-------------------------------------------------------------------
+// Prototypes
+//-------------------------------------------------------------------
+
+static SDL_bool open_net_trace(void);
+static void close_net_trace(void);
+void net_trace_packet(NetTraceDirection direction, const MyMinesPacket *p_mymines_packet, SDL_bool urgent,
+        Uint64 counter);
+void net_trace_seed(Uint64 key, Uint8 key_size);
+void net_trace_flush(void);
+NetTraceRecord *load_net_trace(const char *path, Uint32 *p_num);
+
+#endif
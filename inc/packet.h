@@ -0,0 +1,242 @@
+/**
+ * @file packet.h
+ * @author jkilopu
+ * @brief The packets exchanged in mymines, shared by the game and the dedicated server.
+ * 
+ * @note See "net.h" for the design of the packets.
+ */
+
+#ifndef __PACKET_H
+#define __PACKET_H
+
+#include "SDL_stdinc.h"
+#include "game.h"
+
+//-------------------------------------------------------------------
+// Type Definations
+//-------------------------------------------------------------------
+
+/**
+ * @brief All packet types sent during game process.
+ */
+typedef enum {
+    TYPE_NONE,
+    TYPE_SEED_KEY,
+    TYPE_SETTINGS,
+    TYPE_CLICK_MAP,
+    TYPE_MOUSE_MOVE,
+    TYPE_QUIT,
+    TYPE_REVEAL,
+    TYPE_GAME_OVER,
+    TYPE_VERSION,
+    TYPE_RESYNC,
+    TYPE_SNAPSHOT,
+    TYPE_PING,
+    TYPE_PONG,
+    TYPE_VIEWPORT,
+    TYPE_COOP_JOIN,
+    TYPE_CURSOR_LEAVE,
+    TYPE_TRANSPORT, ///< The last one that fits in the header nibble of version 3.
+} PacketTypeEnum;
+
+typedef Uint8 PacketType;
+
+/**
+ * @brief Record the key and key_size to seed.
+ * 
+ * @note Use:
+ * Help generate totally same map on both side.
+ */
+typedef struct {
+    PacketType type;
+    Uint8 key_size;
+    Uint8 paddings[6];
+    Uint64 key;
+} SeedKeyPacket;
+SDL_COMPILE_TIME_ASSERT(SeedKeyPacket, sizeof(SeedKeyPacket) == 16);
+
+/**
+ * @brief Record pos of mouse motion.
+ */
+typedef struct {
+    PacketType type;
+    Uint8 player;      ///< Set by "mymines-server" in a coop room, 0 otherwise.
+    Uint8 padding[2];
+    Uint32 pos_y;
+    Uint32 pos_x;
+    Uint32 input_time; ///< When it is sampled, see "ClickMapPacket".
+} MouseMovePacket;
+SDL_COMPILE_TIME_ASSERT(MouseMovePacket, sizeof(MouseMovePacket) == 16);
+
+/**
+ * @brief All click packet types.
+ */
+typedef enum {
+    LEFT_CLICK,
+    RIGHT_CLICK,
+} ClickTypeEnum;
+
+typedef Uint8 ClickType;
+
+/**
+ * @brief Record the type and pos of mouse click.
+ * 
+ * @note The lockstep fields are only sent in protocol version 3, version 2 peers leave garbage there,
+ * so "has_hash" is set by the decoder, not by the sender.
+ */
+typedef struct _click_map_packet {
+    PacketType type;
+    ClickType click_type;
+    Uint8 has_hash;
+    Uint8 player;        ///< Set by "mymines-server" in a coop room, 0 otherwise.
+    Uint32 pos_y;
+    Uint32 pos_x;
+    Uint32 seq;          ///< The number of click packets the sender has sent, including this one.
+    Uint32 acked;        ///< The number of click packets the sender has received when it sent this one.
+    Uint32 input_time;   ///< The low 32 bits of the clock of the sender in microseconds, 0 if unknown.
+    Uint64 hash;         ///< The map hash of the sender after the click.
+} ClickMapPacket;
+SDL_COMPILE_TIME_ASSERT(ClickMapPacket, sizeof(ClickMapPacket) == 32);
+
+/**
+ * @brief Record game settings.
+ */
+typedef struct {
+    PacketType type;
+    Uint8 padding[3];
+    Settings settings;
+} SettingsPacket;
+SDL_COMPILE_TIME_ASSERT(SettingsPacket, sizeof(SettingsPacket) == 32);
+
+#define REVEAL_DATA_MAX 30
+
+/**
+ * @brief Record the blocks opened by the host in authoritative mode.
+ * 
+ * @note See "reveal.h" for the encoding of "data".
+ */
+typedef struct {
+    PacketType type;
+    Uint8 data_len;
+    Uint8 data[REVEAL_DATA_MAX];
+} RevealPacket;
+SDL_COMPILE_TIME_ASSERT(RevealPacket, sizeof(RevealPacket) == 32);
+
+/**
+ * @brief Switch the protocol version of the sending direction, see "codec.h".
+ */
+typedef struct {
+    PacketType type;
+    Uint8 version;
+    Uint8 paddings[2];
+} VersionPacket;
+SDL_COMPILE_TIME_ASSERT(VersionPacket, sizeof(VersionPacket) == 4);
+
+#define SNAPSHOT_DATA_MAX 24
+
+/**
+ * @brief A chunk of the snapshot the server sends to resync the client, or to a client that rejoins.
+ * 
+ * @note See "snapshot.h". "data_len" 0 ends the snapshot.
+ */
+typedef struct {
+    PacketType type;
+    Uint8 data_len;
+    Uint8 paddings[2];
+    Uint32 offset; ///< Where "data" is in the snapshot.
+    Uint8 data[SNAPSHOT_DATA_MAX];
+} SnapshotPacket;
+SDL_COMPILE_TIME_ASSERT(SnapshotPacket, sizeof(SnapshotPacket) == 32);
+
+/**
+ * @brief Sent by each side every "PING_INTERVAL", the network thread of the other side answers at once with
+ * TYPE_PONG, which has the same fields.
+ * 
+ * @note Times are in microseconds, each on the clock of the side that takes it. See "LinkStats" in "net.h".
+ */
+typedef struct {
+    PacketType type;
+    Uint8 padding[3];
+    Uint32 seq;
+    Uint64 ping_time; ///< When the ping is sent, echoed in the pong.
+    Uint64 recv_time; ///< Pong only, when the other side received the ping.
+    Uint32 hold_time; ///< Pong only, from "recv_time" to when the pong is sent.
+    Uint8 paddings[4];
+} PingPacket;
+SDL_COMPILE_TIME_ASSERT(PingPacket, sizeof(PingPacket) == 32);
+
+/**
+ * @brief The part of the board a coop player sees, in logical pos like "MouseMovePacket".
+ * 
+ * @note "mymines-server" only sends the player the cursors inside it. "bottom" and "right" are exclusive,
+ * an empty one (e.g. the window is minimized) gets no cursor. The game sends the whole board or an empty one,
+ * see "send_coop_viewport".
+ */
+typedef struct {
+    PacketType type;
+    Uint8 padding[3];
+    Uint32 top, left;
+    Uint32 bottom, right;
+} ViewportPacket;
+SDL_COMPILE_TIME_ASSERT(ViewportPacket, sizeof(ViewportPacket) == 20);
+
+/**
+ * @brief Sent by "mymines-server" in a coop room, as TYPE_COOP_JOIN after TYPE_SETTINGS to tell a player
+ * its number, or as TYPE_CURSOR_LEAVE when the cursor of "player" leaves the viewport or the player leaves.
+ */
+typedef struct {
+    PacketType type;
+    Uint8 player;
+    Uint8 in_progress; ///< TYPE_COOP_JOIN only, the game has started, a snapshot follows.
+    Uint8 padding;
+} PlayerPacket;
+SDL_COMPILE_TIME_ASSERT(PlayerPacket, sizeof(PlayerPacket) == 4);
+
+typedef enum {
+    SHM_OFFER,    ///< Client to server, "pid" and "id" of the link it has created.
+    SHM_ACCEPT,   ///< Server to client, "pid" of the server, what follows from the server is in the link.
+    SHM_REFUSE,   ///< Server to client, stay on TCP.
+    SHM_SWITCHED, ///< Client to server, what follows from the client is in the link.
+    UDP_OFFER,    ///< Client to server, "port" of its cursor channel and the "id" in its datagrams.
+    UDP_ACCEPT,   ///< Server to client, "port" of the cursor channel of the server.
+    UDP_REFUSE,   ///< Server to client, cursors stay on TCP.
+} TransportStep;
+
+/**
+ * @brief Moves a session with a peer on the same host from TCP to shared memory (see "shm_link.h"),
+ * or opens the UDP cursor channel (see "net.h").
+ * 
+ * @note Handled by the network thread, never seen by the game.
+ */
+typedef struct {
+    PacketType type;
+    Uint8 step;
+    Uint16 port;  ///< UDP steps only.
+    Uint32 pid;   ///< SHM steps only.
+    Uint32 id;    ///< The link in SHM steps, the token of the cursor channel in UDP steps.
+} TransportPacket;
+SDL_COMPILE_TIME_ASSERT(TransportPacket, sizeof(TransportPacket) == 12);
+
+/**
+ * @brief General packet union in mymines.
+ * 
+ * @note Always use "MyMinesPacket" to send and receive packet.
+ */
+typedef union _mymines_packet {
+    PacketType type;
+    SettingsPacket settings_packet;
+    SeedKeyPacket seed_key_packet;
+    MouseMovePacket mouse_move_packet;
+    ClickMapPacket click_map_packet;
+    RevealPacket reveal_packet;
+    VersionPacket version_packet;
+    SnapshotPacket snapshot_packet;
+    PingPacket ping_packet;
+    ViewportPacket viewport_packet;
+    PlayerPacket player_packet;
+    TransportPacket transport_packet;
+    Uint8 padding[32];
+} MyMinesPacket;
+SDL_COMPILE_TIME_ASSERT(MyMinesPacket, sizeof(MyMinesPacket) == 32);
+
+#endif
@@ -11,10 +11,30 @@
 
 #define MAIN_WIN_SIZE 600 ///< Fix intial size
 #define DEFAULT_MAX_VIEWPORT_NUM 10
+#define HEADLESS_ENV "MYMINES_HEADLESS" ///< Set to non-zero to render offscreen.
+
+/**
+ * @brief Where the drawer renders to.
+ */
+typedef enum {
+    DRAWER_WINDOW,   ///< A real window with the accelerated renderer.
+    DRAWER_HEADLESS, ///< An offscreen surface with the software renderer.
+} DrawerBackend;
+
+/**
+ * @brief Media groups, in the order they are loaded.
+ */
+typedef enum {
+    MEDIA_MENU,  ///< Main menu and its buttons.
+    MEDIA_BLOCK, ///< Block textures, also used as digits in the menus.
+    MEDIA_ALL,
+} MediaGroup;
 
 typedef struct _drawer {
     SDL_Renderer *renderer;
-    SDL_Window *window;
+    SDL_Window *window;   ///< NULL in headless mode.
+    SDL_Surface *surface; ///< The offscreen target in headless mode, otherwise NULL.
+    SDL_Rect viewport; ///< Where the game is drawn, in pixels.
     SDL_Rect rs[DEFAULT_MAX_VIEWPORT_NUM];
     int viewport_num;
 } Drawer;
@@ -24,13 +44,23 @@ typedef struct _drawer {
 //-------------------------------------------------------------------
 
 void init_sdl(void);
+void init_sdl_backend(DrawerBackend backend);
 void drawer_init(int win_width, int win_height, Uint32 win_flag, Uint32 renderer_flag);
+void drawer_init_headless(int width, int height);
+void drawer_set_window_size(int window_width, int window_height);
 void drawer_set_logical_size(int logical_width, int logical_height);
+void drawer_get_output_size(int *p_width, int *p_height);
+void drawer_set_viewport(const SDL_Rect *p_r);
+SDL_bool drawer_window2pixel(int *p_y, int *p_x);
 void drawer_add_viewport(SDL_Rect rs[], int num);
 
 void load_media(void);
+static int media_loader_thread(void *data);
+void upload_loaded_media(void);
+void wait_media(MediaGroup group);
 SDL_Texture *drawer_load_texture(const char *path);
 void draw(SDL_Texture *t, const SDL_Rect *src_r, const SDL_Rect *dst_r);
+void drawer_present(void);
 void draw_mutiple(SDL_Texture *ts[], const SDL_Rect *src_rs, const SDL_Rect *dst_rs, unsigned short num);
 void delete_media(void);
 
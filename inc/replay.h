@@ -0,0 +1,143 @@
+/**
+ * @file replay.h
+ * @author jkilopu
+ * @brief Record each game to a compact replay file, played back by "mymines-replay".
+ *
+ * @details About replays:
+ * 1. Set "REPLAY_DIR_ENV" to a directory to record. Each game goes to its own file, created when the mines are
+ *    put and finished when the game is won, lost or abandoned (quit, or replaced by a snapshot). Only the side
+ *    that has the mines records, and a game abandoned before any click leaves no file.
+ * 2. The file is a "ReplayHeader", a stream of records, the keyframe index ("ReplayKeyframe"s) and a
+ *    "ReplayFooter". The header and footer are raw structs like the net trace.
+ * 3. The header has the settings, the key the mine generator was seeded with and its whole state right before
+ *    the mines were put. The generator goes on from game to game, so the key alone only gives the first one.
+ * 4. A record starts with a varint "delta << 3 | kind", delta is the milliseconds since the previous record
+ *    (since the mines were put for the first one):
+ *        REPLAY_LEFT, REPLAY_RIGHT, REPLAY_CHORD   varint block number ("y * map_width + x")
+ *        REPLAY_KEYFRAME                           varint len, a snapshot with the mines ("snapshot.h")
+ *        REPLAY_END                                nothing, the last record
+ *    A chord is a left click on an opened number. A click is 2 to 4 bytes.
+ * 5. A keyframe follows every "REPLAY_KEYFRAME_INTERVAL" clicks, so seeking restores the nearest keyframe and
+ *    clicks at most that many times instead of from the start.
+ * 6. Writes go through a stdio buffer, so a click costs a few bytes copied. The keyframes are encoded on the
+ *    game thread, a few hundred bytes every "REPLAY_KEYFRAME_INTERVAL" clicks.
+ */
+#ifndef __REPLAY_H
+#define __REPLAY_H
+
+#include "SDL.h"
+#include "game.h"
+#include <stdio.h>
+#include "prng_alleged_rc4.h"
+
+#define REPLAY_DIR_ENV "MYMINES_REPLAY_DIR" ///< Directory of the replay files.
+#define REPLAY_MAGIC "MYMNRPL"              ///< With the '\0', 8 bytes.
+#define REPLAY_END_MAGIC "MYMNEND"
+#define REPLAY_VERSION 1
+#define REPLAY_BUF_SIZE (16 * 1024)
+#define REPLAY_KEYFRAME_INTERVAL 32
+#define REPLAY_KIND_BITS 3
+#define REPLAY_PATH_MAX 1024
+
+//-------------------------------------------------------------------
+// Type Definations
+//-------------------------------------------------------------------
+
+typedef enum {
+    REPLAY_LEFT,
+    REPLAY_RIGHT,
+    REPLAY_CHORD,
+    REPLAY_KEYFRAME,
+    REPLAY_END,
+} ReplayKindEnum;
+
+typedef Uint8 ReplayKind;
+
+typedef enum {
+    REPLAY_LOST,
+    REPLAY_WON,
+    REPLAY_ABANDONED,
+} ReplayResultEnum;
+
+typedef Uint8 ReplayResult;
+
+typedef struct {
+    char magic[8];
+    Uint32 version;
+    Uint8 key_size;   ///< 0 if the generator was seeded from the time (local mode).
+    Uint8 paddings[3];
+    Sint64 start_time; ///< Unix time when the mines were put.
+    Uint64 key;
+    Settings settings;
+    Uint8 prng_state[PRNG_RC4_STATE_SIZE]; ///< Right before the mines were put.
+    Uint8 paddings2[2];
+} ReplayHeader;
+SDL_COMPILE_TIME_ASSERT(ReplayHeader, sizeof(ReplayHeader) == 320);
+
+typedef struct {
+    Uint32 offset; ///< Of the record, from the start of the file.
+    Uint32 action; ///< Clicks before it.
+    Uint32 time;   ///< Milliseconds since the mines were put.
+} ReplayKeyframe;
+
+typedef struct {
+    Uint64 hash;           ///< Of the final map, to check a playback.
+    Uint32 index_offset;   ///< Of the keyframe index, where the records end.
+    Uint32 n_keyframes;
+    Uint32 duration;       ///< Milliseconds from the first click to the end.
+    Uint32 bbbv;           ///< The 3BV of the board, the fewest clicks to open it without flags.
+    Uint32 n_clicks[3];    ///< Indexed by REPLAY_LEFT, REPLAY_RIGHT and REPLAY_CHORD.
+    ReplayResult result;
+    Uint8 paddings[3];
+    char magic[8];
+} ReplayFooter;
+SDL_COMPILE_TIME_ASSERT(ReplayFooter, sizeof(ReplayFooter) == 48);
+
+/**
+ * @brief A replay in memory, pointing into the bytes of the file.
+ */
+typedef struct {
+    ReplayHeader header;
+    ReplayFooter footer;
+    const Uint8 *buf;
+    Uint32 len;
+} Replay;
+
+/**
+ * @brief A record read from the stream.
+ */
+typedef struct {
+    ReplayKind kind;
+    Uint32 time;            ///< Milliseconds since the mines were put.
+    Uint32 block;           ///< Clicks only.
+    const Uint8 *snapshot;  ///< REPLAY_KEYFRAME only.
+    Uint32 snapshot_len;
+} ReplayRecord;
+
+//-------------------------------------------------------------------
+// Prototypes
+//-------------------------------------------------------------------
+
+void replay_seed(Uint64 key, Uint8 key_size);
+void replay_begin(Game game);
+static FILE *create_replay_file(void);
+static void put_replay_record(ReplayKind kind, Uint32 value);
+static void put_replay_keyframe(Game game);
+void replay_click(Game game, Uint8 click_type, unsigned int y, unsigned int x);
+void replay_end(Game game, ReplayResult result);
+void disable_replay_recording(void);
+Uint32 count_bbbv(Map map);
+static Uint8 block_value(Map map, unsigned int y, unsigned int x);
+static void fill_opening(Map map, Uint8 *seen, unsigned int y, unsigned int x);
+
+SDL_bool read_replay(const Uint8 *buf, Uint32 len, Replay *p_replay);
+Uint8 *load_replay_file(const char *path, Uint32 *p_len);
+const Uint8 *next_replay_record(const Replay *p_replay, const Uint8 *p, Uint32 prev_time, ReplayRecord *p_record);
+const Uint8 *replay_records(const Replay *p_replay);
+void start_replay_game(Game game, const Replay *p_replay);
+static void reset_replay_game(Game game, const Replay *p_replay);
+static void restore_replay_keyframe(Game game, const ReplayRecord *p_record);
+SDL_bool apply_replay_record(Game game, const ReplayRecord *p_record);
+const Uint8 *seek_replay(Game game, const Replay *p_replay, Uint32 action, Uint32 *p_time);
+
+#endif
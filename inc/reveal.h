@@ -0,0 +1,49 @@
+/**
+ * @file reveal.h
+ * @author jkilopu
+ * @brief Run-length encoding of revealed blocks, used by the host in authoritative mode.
+ *
+ * @details About reveal diffs:
+ * 1. A block is numbered "y * map_width + x", so a row of opened blocks is a run of consecutive numbers.
+ * 2. The host logs the blocks opened by a click, sorts them and sends them as runs in "RevealPacket"s.
+ *    Each packet can be decoded on its own. A run is:
+ *        varint skip     Blocks from the end of the previous run in the packet (from block 0 for the first run).
+ *        varint length   The number of blocks in the run.
+ *        values          "length" 4-bit block values, low nibble first: 0 ~ 8, MINE or EXPLODED_MINE.
+ * 3. So the bytes sent grow with the revealed region (about half a byte per block), not with the map.
+ */
+#ifndef __REVEAL_H
+#define __REVEAL_H
+
+#include "SDL_stdinc.h"
+#include "map.h"
+#include "packet.h"
+
+//-------------------------------------------------------------------
+// Type Definations
+//-------------------------------------------------------------------
+
+/**
+ * @brief The blocks opened since the last "send_reveal_log".
+ */
+typedef struct _reveal_log {
+    Uint32 *blocks;
+    Uint32 num, cap;
+    Uint32 map_width;
+} RevealLog;
+
+typedef void (*RevealFunc)(void *data, Uint32 block, Uint8 value);
+
+//-------------------------------------------------------------------
+// Prototypes
+//-------------------------------------------------------------------
+
+RevealLog *create_reveal_log(Uint32 map_width, Uint32 map_height);
+void reveal_log_add(RevealLog *p_log, unsigned int y, unsigned int x);
+void send_reveal_log(RevealLog *p_log, Map map);
+void destroy_reveal_log(RevealLog *p_log);
+SDL_bool decode_reveal_packet(const RevealPacket *p_reveal_packet, RevealFunc func, void *data);
+
+static Uint8 get_reveal_value(Map map, unsigned int y, unsigned int x);
+
+#endif
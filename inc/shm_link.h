@@ -0,0 +1,84 @@
+/**
+ * @file shm_link.h
+ * @author jkilopu
+ * @brief A pair of byte rings in shared memory between two processes on the same host, the local transport of
+ * "net.c".
+ *
+ * @details About the shared memory link:
+ * 1. Linux only ("MYMINES_SHM_LINK" is defined by cmake). The client creates the region with "shm_open", named
+ *    after its pid and an id, and offers it to the server over TCP. The server maps it and unlinks the name,
+ *    so nothing is left in /dev/shm once both sides have it.
+ * 2. Each ring has one writer and one reader, the bytes are the same stream as on TCP (encoded by "codec.h").
+ * 3. A reader with nothing to read sleeps on a futex in the ring, a writer wakes it only if it sleeps, so a
+ *    busy link costs no syscall. A writer with no room sleeps on another futex the same way.
+ * 4. The side that stops marks its ring closed. If the other process dies instead, the sleepers notice it
+ *    when they time out.
+ */
+#ifndef __SHM_LINK_H
+#define __SHM_LINK_H
+
+#include "SDL_stdinc.h"
+#include "SDL.h"
+
+#define SHM_RING_SIZE (64 * 1024) ///< Must be a power of two, so the ring counters can wrap.
+#define SHM_LINK_MAGIC 0x4D594D53 ///< "MYMS".
+#define SHM_LINK_NAME_MAX 32
+#define SHM_WAIT_SLICE 10         ///< In milliseconds, how often a sleeping writer checks the other process.
+
+//-------------------------------------------------------------------
+// Type Definations
+//-------------------------------------------------------------------
+
+/**
+ * @brief One direction of the link.
+ */
+typedef struct {
+    SDL_atomic_t head, tail;           ///< Bytes read and written, they wrap.
+    SDL_atomic_t data_seq;             ///< Bumped after each write, the reader sleeps on it.
+    SDL_atomic_t space_seq;            ///< Bumped after each read, a writer with no room sleeps on it.
+    SDL_atomic_t reader_sleeping, writer_sleeping;
+    SDL_atomic_t closed;               ///< The writer has stopped.
+    Uint8 data[SHM_RING_SIZE];
+} ShmRing;
+
+/**
+ * @brief The shared region, ring 0 is from the client to the server.
+ */
+typedef struct {
+    Uint32 magic;
+    Uint32 ring_size;
+    ShmRing rings[2];
+} ShmRegion;
+
+/**
+ * @brief A mapped link, private to the process.
+ */
+typedef struct {
+    ShmRegion *region;
+    ShmRing *tx, *rx;
+    Uint32 self_pid;
+    Uint32 peer_pid;                   ///< 0 until the server answers the client.
+    Uint32 id;                         ///< Tells the links of a client apart.
+    char name[SHM_LINK_NAME_MAX];      ///< Empty once unlinked.
+} ShmLink;
+
+//-------------------------------------------------------------------
+// Prototypes
+//-------------------------------------------------------------------
+
+static void futex_wait(SDL_atomic_t *p_word, int value, Uint32 timeout);
+static void futex_wake(SDL_atomic_t *p_word);
+static SDL_bool is_peer_alive(const ShmLink *p_link);
+static ShmLink *map_shm_link(int fd, SDL_bool is_client, const char *name);
+
+ShmLink *create_shm_link(Uint32 id);
+ShmLink *open_shm_link(Uint32 pid, Uint32 id);
+void unlink_shm_link(ShmLink *p_link);
+SDL_bool write_shm_link(ShmLink *p_link, const void *data, Uint32 len, Uint32 timeout);
+int read_shm_link(ShmLink *p_link, void *buf, Uint32 len);
+SDL_bool is_shm_link_readable(ShmLink *p_link);
+void wait_shm_link(ShmLink *p_link, Uint32 timeout);
+void wake_shm_link(ShmLink *p_link);
+void close_shm_link(ShmLink *p_link);
+
+#endif
@@ -0,0 +1,71 @@
+/**
+ * @file snapshot.h
+ * @author jkilopu
+ * @brief The compact snapshot of a game in progress, sent by the server to resync, or to a client that rejoins.
+ *
+ * @details About snapshots:
+ * 1. A snapshot is a byte string (varints as in "codec.h"):
+ *        format          1 byte, "SNAPSHOT_FORMAT"
+ *        flags           1 byte, SNAPSHOT_HAS_MINES | SNAPSHOT_STARTED
+ *        varint map_width, map_height, opened_blocks, time_passed
+ *        prng state      "PRNG_RC4_STATE_SIZE" bytes, only with SNAPSHOT_HAS_MINES
+ *        mine bitmap     only with SNAPSHOT_HAS_MINES
+ *        opened bitmap
+ *        flag bitmap
+ *        values          4 bits for each opened block, low nibble first, only without SNAPSHOT_HAS_MINES
+ * 2. A bitmap has a bit for each block by block number ("y * map_width + x"), run-length encoded as varint
+ *    lengths of alternating runs, starting with a run of 0s (which may be empty). A board is mostly long runs,
+ *    so a bitmap takes a few bytes per mine or opened region instead of a bit per block.
+ * 3. The numbers of the blocks are not sent, they are counted from the mine bitmap. In authoritative mode the
+ *    mines are hidden from the client, so it gets the values of the opened blocks instead, and no prng state.
+ * 4. It is sent in "SnapshotPacket"s of up to "SNAPSHOT_DATA_MAX" bytes at increasing offsets.
+ *    A packet with "data_len" 0 ends it.
+ */
+#ifndef __SNAPSHOT_H
+#define __SNAPSHOT_H
+
+#include "SDL_stdinc.h"
+#include "map.h"
+#include "packet.h"
+#include "prng_alleged_rc4.h"
+
+#define SNAPSHOT_FORMAT 1
+#define SNAPSHOT_HAS_MINES (1 << 0)
+#define SNAPSHOT_STARTED (1 << 1) ///< The first click is made and the timer is running.
+#define SNAPSHOT_MAX_LEN (1 << 20)
+
+//-------------------------------------------------------------------
+// Type Definations
+//-------------------------------------------------------------------
+
+/**
+ * @brief What is in a snapshot besides the map.
+ */
+typedef struct {
+    Uint8 flags;
+    Uint32 opened_blocks;
+    Uint32 time_passed;
+    Uint8 prng_state[PRNG_RC4_STATE_SIZE]; ///< Only with SNAPSHOT_HAS_MINES.
+} SnapshotInfo;
+
+typedef SDL_bool (*BlockTest)(Map map, unsigned int y, unsigned int x);
+
+//-------------------------------------------------------------------
+// Prototypes
+//-------------------------------------------------------------------
+
+Uint8 *encode_snapshot(Map map, const SnapshotInfo *p_info, Uint32 *p_len);
+SDL_bool decode_snapshot(const Uint8 *buf, Uint32 len, Map map, SnapshotInfo *p_info);
+void send_snapshot(Map map, const SnapshotInfo *p_info);
+int collect_snapshot_packet(const SnapshotPacket *p_snapshot_packet, const Uint8 **p_buf, Uint32 *p_len);
+void free_snapshot_collector(void);
+
+static SDL_bool is_mine_block(Map map, unsigned int y, unsigned int x);
+static SDL_bool is_opened_block(Map map, unsigned int y, unsigned int x);
+static SDL_bool is_flag_block(Map map, unsigned int y, unsigned int x);
+static Uint8 *put_bitmap(Uint8 *p, Map map, BlockTest test);
+static const Uint8 *get_snapshot_varint(const Uint8 *p, const Uint8 *end, Uint32 *p_value);
+static const Uint8 *get_bitmap(const Uint8 *p, const Uint8 *end, Uint8 *bits, Uint32 num);
+static SDL_bool is_permutation(const Uint8 *bytes);
+
+#endif
@@ -10,7 +10,7 @@
 #include "render.h"
 
 #define TIME_INTERVAL (1000)
-#define TIME_REGION_WIDTH (MAIN_WIN_SIZE / 6)
+#define TIME_REGION_WIDTH (MAIN_WIN_SIZE / 6) ///< Logical width
 
 //-------------------------------------------------------------------
 // Type Definations
@@ -23,6 +23,7 @@ typedef struct _timer {
     SDL_TimerID timer_id;
     unsigned int time_passed; ///< Time in seconds
     SDL_Rect timer_block;
+    SDL_Rect region;          ///< The whole time region.
 } Timer;
 
 //-------------------------------------------------------------------
@@ -30,7 +31,7 @@ typedef struct _timer {
 //-------------------------------------------------------------------
 
 void set_timer(Timer *p_timer);
-void set_timer_pos(Timer *p_timer, unsigned int win_width, unsigned int win_height);
+void set_timer_pos(Timer *p_timer, unsigned int win_width, unsigned int win_height, unsigned int region_width);
 void unset_timer(Timer *p_timer);
 void draw_timer(Timer *p_timer);
 Uint32 timer_callback(Uint32 interval, void *param);
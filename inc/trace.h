@@ -0,0 +1,81 @@
+/**
+ * @file trace.h
+ * @author jkilopu
+ * @brief Scoped event tracing, written as Chrome trace JSON (loadable in chrome://tracing and Perfetto).
+ * 
+ * @details About tracing in mymines:
+ * 1. Tracing is compiled in only when "MYMINES_TRACE" is defined (cmake -DMYMINES_TRACE=ON),
+ *    otherwise all macros expand to nothing.
+ * 2. Each thread writes complete events ("ph": "X") to its own ring buffer, no lock is taken.
+ *    When a ring is full, the oldest events are overwritten.
+ * 3. The trace is written at exit and when "TRACE_DUMP_KEY" is pressed,
+ *    to the file in "TRACE_FILE_ENV" or "TRACE_DEFAULT_FILE".
+ * 
+ * @note A scope is opened and closed in the same block:
+ *       TRACE_BEGIN(put_mines);
+ *       ...
+ *       TRACE_END(put_mines);
+ */
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include "SDL.h"
+
+#define TRACE_BUFFER_SIZE 65536 ///< Events per thread.
+#define TRACE_DUMP_KEY SDLK_F4
+#define TRACE_FILE_ENV "MYMINES_TRACE_FILE"
+#define TRACE_DEFAULT_FILE "mymines_trace.json"
+
+#ifdef MYMINES_TRACE
+
+//-------------------------------------------------------------------
+// Trace Macros
+//-------------------------------------------------------------------
+
+#define TRACE_INIT() trace_init()
+#define TRACE_BEGIN(name) Uint64 trace_start_##name = SDL_GetPerformanceCounter()
+#define TRACE_END(name) trace_complete(#name, trace_start_##name)
+#define TRACE_DUMP() trace_dump()
+
+//-------------------------------------------------------------------
+// Type Definations
+//-------------------------------------------------------------------
+
+/**
+ * @brief A complete event, times are in performance counter ticks.
+ */
+typedef struct {
+    const char *name; ///< Must be a string literal.
+    Uint64 start;
+    Uint64 duration;
+} TraceEvent;
+
+/**
+ * @brief The ring buffer of a thread.
+ */
+typedef struct _trace_buffer {
+    TraceEvent events[TRACE_BUFFER_SIZE];
+    SDL_atomic_t written;        ///< Number of events written, only the owner thread writes it.
+    SDL_threadID tid;
+    struct _trace_buffer *next; ///< All buffers, linked for dumping.
+} TraceBuffer;
+
+//-------------------------------------------------------------------
+// Prototypes
+//-------------------------------------------------------------------
+
+void trace_init(void);
+static TraceBuffer *get_trace_buffer(void);
+void trace_complete(const char *name, Uint64 start);
+void trace_dump(void);
+
+#else
+
+#define TRACE_INIT() ((void)0)
+#define TRACE_BEGIN(name) ((void)0)
+#define TRACE_END(name) ((void)0)
+#define TRACE_DUMP() ((void)0)
+
+#endif
+
+#endif
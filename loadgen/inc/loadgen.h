@@ -0,0 +1,111 @@
+/**
+ * @file loadgen.h
+ * @author jkilopu
+ * @brief Load generator, simulates many LAN clients against a host to find where it breaks.
+ *
+ * @details About the load generator:
+ * 1. Linux only, one thread with a non-blocking epoll event loop, like "mymines-server".
+ * 2. Each connection joins like "join_game" in protocol version 2 (it ignores the version magic): it waits for
+ *    TYPE_SEED_KEY and TYPE_SETTINGS, then sends mouse moves and clicks at the given rates.
+ * 3. The clicks are right clicks in pairs on the same block, so the board of the host ends as it was and the
+ *    game never ends. Each click has "LOADGEN_MAGIC" in "input_time" and its send time in "hash".
+ * 4. Hosts don't echo packets, so the latency is measured between the connections of this process:
+ *    "mymines-server" matches them in pairs and relays the clicks of each one to the other, the latency is
+ *    from the send time in a click to when it is read. A game host only takes one client, so against it
+ *    only the handshake and the throughput are measured.
+ * 5. Each connection keeps its last "LOADGEN_WINDOW" latency samples, percentiles are computed over them.
+ * 6. A connection doesn't queue more than "LOADGEN_OUT_BUF_MAX" bytes, the packets it can't queue are counted
+ *    as dropped. Drops mean the host doesn't read as fast as the clients send.
+ */
+#ifndef __LOADGEN_H
+#define __LOADGEN_H
+
+#include "SDL_stdinc.h"
+#include "packet.h"
+
+struct addrinfo;
+
+#define MAX_EPOLL_EVENTS 256
+#define LOADGEN_WINDOW 1024
+#define LOADGEN_OUT_BUF_MAX (16 * 1024)
+#define LOADGEN_MAGIC "MYLG"       ///< In "ClickMapPacket.input_time".
+#define LOADGEN_MAGIC_LEN 4
+#define LOADGEN_TICK 1             ///< In milliseconds, how often due packets are sent.
+#define LOADGEN_BURST_MAX 8        ///< The most packets of a kind a connection sends in a tick to catch up.
+#define HANDSHAKE_TIMEOUT 10000    ///< In milliseconds, from the start of the connect to TYPE_SETTINGS.
+#define REPORT_INTERVAL 1000       ///< In milliseconds.
+#define DEFAULT_DURATION 10        ///< In seconds.
+#define DEFAULT_MOVE_RATE 60       ///< Mouse moves per second per connection.
+#define DEFAULT_CLICK_RATE 2       ///< Clicks per second per connection.
+#define LOADGEN_SEED 1             ///< The same traffic in every run.
+
+//-------------------------------------------------------------------
+// Type Definations
+//-------------------------------------------------------------------
+
+typedef enum {
+    LOAD_CONNECTING,
+    LOAD_HANDSHAKE, ///< Connected, waiting for TYPE_SEED_KEY and TYPE_SETTINGS.
+    LOAD_RUNNING,
+    LOAD_CLOSED,
+} LoadConnState;
+
+/**
+ * @brief A simulated client.
+ */
+typedef struct {
+    int fd;
+    LoadConnState state;
+    Uint8 in_buf[sizeof(MyMinesPacket)]; ///< A partial packet.
+    Uint32 in_len;
+    Uint8 out_buf[LOADGEN_OUT_BUF_MAX];  ///< Bytes not accepted by the kernel yet.
+    Uint32 out_len;
+    SDL_bool want_out;                   ///< EPOLLOUT is registered.
+    Settings settings;
+    Uint64 start_us;                     ///< When the connect started.
+    Uint64 connect_us, handshake_us;     ///< How long the connect and the whole handshake took.
+    Uint64 next_move_us, next_click_us;
+    Uint32 cursor_y, cursor_x;
+    Uint32 click_y, click_x;             ///< The block of the first click of a pair.
+    SDL_bool click_pending;              ///< The second click of the pair is due.
+    Uint32 sent_clicks, recved_clicks;
+    Uint64 packets_sent, packets_recved, packets_dropped;
+    Uint32 samples[LOADGEN_WINDOW];      ///< Latency in microseconds.
+    unsigned int next, num;
+} LoadConn;
+
+/**
+ * @brief The command line.
+ */
+typedef struct {
+    const char *host;
+    const char *port;
+    unsigned int n_conn;
+    unsigned int duration;
+    unsigned int move_rate, click_rate;
+} LoadOptions;
+
+//-------------------------------------------------------------------
+// Prototypes
+//-------------------------------------------------------------------
+
+static Uint64 now_us(void);
+static void conn_update_events(LoadConn *conn);
+static void conn_flush(LoadConn *conn);
+static void conn_send(LoadConn *conn, const MyMinesPacket *p_packet);
+static void conn_close(LoadConn *conn);
+static void conn_read(LoadConn *conn);
+static void handle_packet(LoadConn *conn, const MyMinesPacket *p_packet);
+static void add_sample(LoadConn *conn, Uint32 latency);
+
+static void start_connect(LoadConn *conn, const struct addrinfo *p_addr);
+static void finish_connect(LoadConn *conn);
+static void start_running(LoadConn *conn);
+static void send_due_packets(LoadConn *conn, Uint64 now);
+static void send_move(LoadConn *conn);
+static void send_click(LoadConn *conn);
+
+static Uint32 percentile(Uint32 *samples, unsigned int num, unsigned int p);
+static void report(LoadConn *conns, unsigned int n_conn, Uint64 elapsed_us, SDL_bool final);
+
+#endif
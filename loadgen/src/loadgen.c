@@ -0,0 +1,469 @@
+/**
+ * @file loadgen.c
+ * @author jkilopu
+ * @brief Open many connections to a host, stream clicks and mouse moves, measure latency and throughput.
+ *
+ * @note Usage:
+ *       ./mymines-loadgen <host> <port> <connections> [seconds move_rate click_rate]
+ *       The rates are per connection per second, 0 to send none of the kind.
+ */
+#include "loadgen.h"
+#include "SDL.h"
+#include "fatal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+static int epoll_fd;
+static Uint64 perf_freq;
+static LoadOptions options;
+static Uint64 connect_failed, handshake_failed, peer_quit;
+static Uint32 *all_samples; ///< Room for the samples of all connections, for the total percentiles.
+
+static Uint64 now_us(void)
+{
+    return SDL_GetPerformanceCounter() * 1000000 / perf_freq;
+}
+
+//-------------------------------------------------------------------
+// Connection I/O
+//-------------------------------------------------------------------
+
+static void conn_update_events(LoadConn *conn)
+{
+    SDL_bool want_out = conn->out_len > 0 || conn->state == LOAD_CONNECTING;
+    if (want_out == conn->want_out)
+        return;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | (want_out ? EPOLLOUT : 0);
+    ev.data.ptr = conn;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) < 0)
+        Error("epoll_ctl mod failed: %s\n", strerror(errno));
+    conn->want_out = want_out;
+}
+
+/**
+ * @brief Write as much pending output as the kernel accepts.
+ */
+static void conn_flush(LoadConn *conn)
+{
+    Uint32 sent = 0;
+    while (sent < conn->out_len)
+    {
+        ssize_t n = send(conn->fd, conn->out_buf + sent, conn->out_len - sent, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                conn_close(conn);
+                return;
+            }
+            break;
+        }
+        sent += n;
+    }
+    memmove(conn->out_buf, conn->out_buf + sent, conn->out_len - sent);
+    conn->out_len -= sent;
+    conn_update_events(conn);
+}
+
+/**
+ * @brief Queue a packet and try to send it, or drop it if the host is too far behind.
+ */
+static void conn_send(LoadConn *conn, const MyMinesPacket *p_packet)
+{
+    if (conn->out_len + sizeof(MyMinesPacket) > LOADGEN_OUT_BUF_MAX)
+    {
+        conn->packets_dropped++;
+        return;
+    }
+    memcpy(conn->out_buf + conn->out_len, p_packet, sizeof(MyMinesPacket));
+    conn->out_len += sizeof(MyMinesPacket);
+    conn->packets_sent++;
+    if (!conn->want_out) ///< Or the kernel buffer is full, wait for EPOLLOUT.
+        conn_flush(conn);
+}
+
+static void conn_close(LoadConn *conn)
+{
+    if (conn->state == LOAD_CLOSED)
+        return;
+    if (conn->state == LOAD_CONNECTING)
+        connect_failed++;
+    else if (conn->state == LOAD_HANDSHAKE)
+        handshake_failed++;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    conn->fd = -1;
+    conn->state = LOAD_CLOSED;
+}
+
+/**
+ * @brief Read everything available, handle each complete packet.
+ */
+static void conn_read(LoadConn *conn)
+{
+    Uint8 buf[4096];
+    for (;;)
+    {
+        ssize_t n = recv(conn->fd, buf, sizeof(buf), 0);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        {
+            conn_close(conn);
+            return;
+        }
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+
+        for (ssize_t used = 0; used < n && conn->state != LOAD_CLOSED;)
+        {
+            Uint32 len = sizeof(MyMinesPacket) - conn->in_len;
+            if (len > n - used)
+                len = n - used;
+            memcpy(conn->in_buf + conn->in_len, buf + used, len);
+            conn->in_len += len;
+            used += len;
+            if (conn->in_len == sizeof(MyMinesPacket))
+            {
+                MyMinesPacket packet;
+                memcpy(&packet, conn->in_buf, sizeof(MyMinesPacket));
+                conn->in_len = 0;
+                handle_packet(conn, &packet);
+            }
+        }
+        if (conn->state == LOAD_CLOSED)
+            return;
+    }
+}
+
+static void handle_packet(LoadConn *conn, const MyMinesPacket *p_packet)
+{
+    conn->packets_recved++;
+    switch (p_packet->type)
+    {
+    case TYPE_SEED_KEY:
+        break;
+    case TYPE_SETTINGS:
+        if (conn->state != LOAD_HANDSHAKE)
+            break;
+        conn->settings = p_packet->settings_packet.settings;
+        if (conn->settings.map_width == 0 || conn->settings.map_height == 0
+                || conn->settings.window_width == 0 || conn->settings.window_height == 0)
+            conn_close(conn);
+        else
+            start_running(conn);
+        break;
+    case TYPE_CLICK_MAP:
+    {
+        const ClickMapPacket *p_click_map_packet = &p_packet->click_map_packet;
+        conn->recved_clicks++;
+        if (memcmp(&p_click_map_packet->input_time, LOADGEN_MAGIC, LOADGEN_MAGIC_LEN) == 0)
+            add_sample(conn, now_us() - p_click_map_packet->hash);
+        break;
+    }
+    case TYPE_QUIT:
+        peer_quit++;
+        conn_close(conn);
+        break;
+    default:
+        break;
+    }
+}
+
+static void add_sample(LoadConn *conn, Uint32 latency)
+{
+    conn->samples[conn->next] = latency;
+    conn->next = (conn->next + 1) % LOADGEN_WINDOW;
+    if (conn->num < LOADGEN_WINDOW)
+        conn->num++;
+}
+
+//-------------------------------------------------------------------
+// Connect and send
+//-------------------------------------------------------------------
+
+static void start_connect(LoadConn *conn, const struct addrinfo *p_addr)
+{
+    conn->start_us = now_us();
+    conn->fd = socket(p_addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (conn->fd < 0)
+        Error("Can't create socket: %s\n", strerror(errno));
+    int on = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)); ///< Like SDL_net.
+
+    conn->state = LOAD_CONNECTING;
+    conn->want_out = SDL_TRUE;
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.ptr = conn;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev) < 0)
+        Error("epoll_ctl add failed: %s\n", strerror(errno));
+    if (connect(conn->fd, p_addr->ai_addr, p_addr->ai_addrlen) < 0 && errno != EINPROGRESS)
+        conn_close(conn);
+}
+
+/**
+ * @brief Called when a connecting socket is writable, it is connected or has failed.
+ */
+static void finish_connect(LoadConn *conn)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+    {
+        conn_close(conn);
+        return;
+    }
+    conn->connect_us = now_us() - conn->start_us;
+    conn->state = LOAD_HANDSHAKE;
+    conn_update_events(conn);
+}
+
+/**
+ * @brief The handshake is done, start sending at random phases so the connections don't send together.
+ */
+static void start_running(LoadConn *conn)
+{
+    Uint64 now = now_us();
+    conn->handshake_us = now - conn->start_us;
+    conn->state = LOAD_RUNNING;
+    conn->cursor_y = rand() % conn->settings.window_height;
+    conn->cursor_x = rand() % conn->settings.window_width;
+    if (options.move_rate > 0)
+        conn->next_move_us = now + rand() % (1000000 / options.move_rate);
+    if (options.click_rate > 0)
+        conn->next_click_us = now + rand() % (1000000 / options.click_rate);
+}
+
+/**
+ * @brief Send the moves and clicks that are due, catch up at most "LOADGEN_BURST_MAX" of each.
+ */
+static void send_due_packets(LoadConn *conn, Uint64 now)
+{
+    for (int i = 0; options.move_rate > 0 && conn->next_move_us <= now && i < LOADGEN_BURST_MAX; i++)
+    {
+        send_move(conn);
+        conn->next_move_us += 1000000 / options.move_rate;
+    }
+    for (int i = 0; options.click_rate > 0 && conn->next_click_us <= now && i < LOADGEN_BURST_MAX; i++)
+    {
+        send_click(conn);
+        conn->next_click_us += 1000000 / options.click_rate;
+    }
+}
+
+/**
+ * @brief Move the cursor a few logical pixels, like a hand on a mouse.
+ */
+static void send_move(LoadConn *conn)
+{
+    conn->cursor_y = (conn->cursor_y + conn->settings.window_height + rand() % 9 - 4) % conn->settings.window_height;
+    conn->cursor_x = (conn->cursor_x + conn->settings.window_width + rand() % 9 - 4) % conn->settings.window_width;
+
+    MyMinesPacket packet;
+    SDL_zero(packet);
+    packet.mouse_move_packet.type = TYPE_MOUSE_MOVE;
+    packet.mouse_move_packet.pos_y = conn->cursor_y;
+    packet.mouse_move_packet.pos_x = conn->cursor_x;
+    conn_send(conn, &packet);
+}
+
+/**
+ * @brief Flag a random block, or unflag the block of the previous click.
+ */
+static void send_click(LoadConn *conn)
+{
+    if (!conn->click_pending)
+    {
+        conn->click_y = rand() % conn->settings.map_height;
+        conn->click_x = rand() % conn->settings.map_width;
+    }
+    conn->click_pending = !conn->click_pending;
+
+    MyMinesPacket packet;
+    ClickMapPacket *p_click_map_packet = &packet.click_map_packet;
+    SDL_zero(packet);
+    p_click_map_packet->type = TYPE_CLICK_MAP;
+    p_click_map_packet->click_type = RIGHT_CLICK;
+    p_click_map_packet->pos_y = conn->click_y;
+    p_click_map_packet->pos_x = conn->click_x;
+    p_click_map_packet->seq = ++conn->sent_clicks;
+    p_click_map_packet->acked = conn->recved_clicks;
+    memcpy(&p_click_map_packet->input_time, LOADGEN_MAGIC, LOADGEN_MAGIC_LEN);
+    p_click_map_packet->hash = now_us();
+    conn_send(conn, &packet);
+}
+
+//-------------------------------------------------------------------
+// Report
+//-------------------------------------------------------------------
+
+static int cmp_sample(const void *a, const void *b)
+{
+    Uint32 lhs = *(const Uint32 *)a, rhs = *(const Uint32 *)b;
+    return (lhs > rhs) - (lhs < rhs);
+}
+
+/**
+ * @brief The p-th percentile of the samples, which are sorted in place.
+ */
+static Uint32 percentile(Uint32 *samples, unsigned int num, unsigned int p)
+{
+    if (num == 0)
+        return 0;
+    qsort(samples, num, sizeof(Uint32), cmp_sample);
+    return samples[(num - 1) * p / 100];
+}
+
+/**
+ * @brief Print the totals, and every connection if it is the final report.
+ */
+static void report(LoadConn *conns, unsigned int n_conn, Uint64 elapsed_us, SDL_bool final)
+{
+    Uint32 samples[LOADGEN_WINDOW];
+    unsigned int running = 0, num = 0;
+    Uint64 sent = 0, recved = 0, dropped = 0;
+
+    if (final)
+        printf("%6s %8s %10s %10s %10s %10s %8s %8s %8s\n", "conn", "state", "connect", "handshake",
+               "sent/s", "recved/s", "dropped", "p50", "p99");
+    for (unsigned int i = 0; i < n_conn; i++)
+    {
+        LoadConn *conn = &conns[i];
+        running += conn->state == LOAD_RUNNING;
+        sent += conn->packets_sent;
+        recved += conn->packets_recved;
+        dropped += conn->packets_dropped;
+        SDL_memcpy(all_samples + num, conn->samples, conn->num * sizeof(Uint32));
+        num += conn->num;
+        if (!final)
+            continue;
+
+        static const char *state_names[] = {"connect", "shake", "running", "closed"};
+        SDL_memcpy(samples, conn->samples, conn->num * sizeof(Uint32));
+        printf("%6u %8s %8lluus %8lluus %10.1f %10.1f %8llu %6uus %6uus\n", i, state_names[conn->state],
+               (unsigned long long)conn->connect_us, (unsigned long long)conn->handshake_us,
+               conn->packets_sent * 1e6 / elapsed_us, conn->packets_recved * 1e6 / elapsed_us,
+               (unsigned long long)conn->packets_dropped,
+               percentile(samples, conn->num, 50), percentile(samples, conn->num, 99));
+    }
+    fflush(stdout); ///< The table before the totals, which go to stderr.
+    Uint32 p50 = percentile(all_samples, num, 50), p99 = percentile(all_samples, num, 99);
+    Uint32 max = num > 0 ? all_samples[num - 1] : 0; ///< Sorted by "percentile".
+    SDL_Log("%.1fs: %u/%u running, %llu connect failed, %llu handshake failed, %llu peer quit\n",
+            elapsed_us / 1e6, running, n_conn, (unsigned long long)connect_failed,
+            (unsigned long long)handshake_failed, (unsigned long long)peer_quit);
+    SDL_Log("sent %.1f/s, received %.1f/s, dropped %llu, latency p50 %uus p99 %uus max %uus\n",
+            sent * 1e6 / elapsed_us, recved * 1e6 / elapsed_us, (unsigned long long)dropped, p50, p99, max);
+}
+
+//-------------------------------------------------------------------
+// Main loop
+//-------------------------------------------------------------------
+
+int main(int argc, char *argv[])
+{
+    if (argc != 4 && argc != 7)
+        Error("Usage: %s <host> <port> <connections> [seconds move_rate click_rate]\n", argv[0]);
+    options.host = argv[1];
+    options.port = argv[2];
+    options.n_conn = atoi(argv[3]);
+    options.duration = argc == 7 ? (unsigned int)atoi(argv[4]) : DEFAULT_DURATION;
+    options.move_rate = argc == 7 ? (unsigned int)atoi(argv[5]) : DEFAULT_MOVE_RATE;
+    options.click_rate = argc == 7 ? (unsigned int)atoi(argv[6]) : DEFAULT_CLICK_RATE;
+    if (options.n_conn == 0 || options.duration == 0 || options.move_rate > 1000000 || options.click_rate > 1000000)
+        Error("Invalid arguments!\n");
+
+    struct addrinfo hints, *p_addr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int err = getaddrinfo(options.host, options.port, &hints, &p_addr);
+    if (err != 0)
+        Error("Can't resolve %s:%s: %s\n", options.host, options.port, gai_strerror(err));
+
+    signal(SIGPIPE, SIG_IGN);
+    srand(LOADGEN_SEED);
+    perf_freq = SDL_GetPerformanceFrequency();
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        Error("Can't create epoll: %s\n", strerror(errno));
+
+    LoadConn *conns = calloc_fatal(options.n_conn, sizeof(LoadConn), "main - conns");
+    all_samples = malloc_fatal((size_t)options.n_conn * LOADGEN_WINDOW * sizeof(Uint32), "main - all_samples");
+    for (unsigned int i = 0; i < options.n_conn; i++)
+        start_connect(&conns[i], p_addr);
+    freeaddrinfo(p_addr);
+    SDL_Log("mymines-loadgen: %u connections to %s:%s for %us, %u moves/s and %u clicks/s each\n",
+            options.n_conn, options.host, options.port, options.duration, options.move_rate, options.click_rate);
+
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    Uint64 start = now_us(), end = start + options.duration * 1000000ULL, report_us = start;
+    for (Uint64 now = start; now < end; now = now_us())
+    {
+        int n = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, LOADGEN_TICK);
+        if (n < 0 && errno != EINTR)
+            Error("epoll_wait failed: %s\n", strerror(errno));
+
+        for (int i = 0; i < n; i++)
+        {
+            LoadConn *conn = events[i].data.ptr;
+            if (conn->state == LOAD_CLOSED) ///< Closed by an earlier event of this loop.
+                continue;
+            if (conn->state == LOAD_CONNECTING)
+            {
+                if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+                    finish_connect(conn);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT)
+                conn_flush(conn);
+            if (conn->state != LOAD_CLOSED && (events[i].events & EPOLLIN))
+                conn_read(conn);
+            if (conn->state != LOAD_CLOSED && (events[i].events & (EPOLLERR | EPOLLHUP)))
+                conn_close(conn);
+        }
+
+        now = now_us();
+        for (unsigned int i = 0; i < options.n_conn; i++)
+        {
+            LoadConn *conn = &conns[i];
+            if (conn->state == LOAD_RUNNING)
+                send_due_packets(conn, now);
+            else if (conn->state != LOAD_CLOSED && now - conn->start_us > HANDSHAKE_TIMEOUT * 1000ULL)
+                conn_close(conn);
+        }
+        if (now - report_us >= REPORT_INTERVAL * 1000ULL)
+        {
+            report(conns, options.n_conn, now - start, SDL_FALSE);
+            report_us = now;
+        }
+    }
+
+    report(conns, options.n_conn, now_us() - start, SDL_TRUE);
+    MyMinesPacket quit_packet;
+    SDL_zero(quit_packet);
+    quit_packet.type = TYPE_QUIT;
+    for (unsigned int i = 0; i < options.n_conn; i++)
+        if (conns[i].state == LOAD_RUNNING)
+            send(conns[i].fd, &quit_packet, sizeof(quit_packet), MSG_NOSIGNAL | MSG_DONTWAIT);
+    for (unsigned int i = 0; i < options.n_conn; i++)
+        conn_close(&conns[i]);
+    free(all_samples);
+    free(conns);
+    return 0;
+}
@@ -3,8 +3,13 @@
 
 #include <stddef.h>
 
+/* Size of the state saved by prng_rc4_get_state(): s[256], i and j. */
+#define PRNG_RC4_STATE_SIZE 258
+
 void prng_rc4_seed_time (void);
 void prng_rc4_seed_bytes (const void *, size_t);
+void prng_rc4_get_state (unsigned char *);
+void prng_rc4_set_state (const unsigned char *);
 unsigned char prng_rc4_get_octet (void);
 unsigned char prng_rc4_get_byte (void);
 void prng_rc4_get_bytes (void *, size_t);
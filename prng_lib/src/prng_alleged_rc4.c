@@ -137,6 +137,38 @@ prng_rc4_seed_bytes (const void *key, size_t size)
   seeded = 1;
 }
 
+/* Saves the state of the pseudo-random number generator into
+   the PRNG_RC4_STATE_SIZE bytes of STATE, so that another
+   generator restored from it with prng_rc4_set_state() returns
+   the same numbers from then on. */
+void
+prng_rc4_get_state (unsigned char *state)
+{
+  int i;
+
+  if (!seeded)
+    prng_rc4_seed_time ();
+
+  for (i = 0; i < 256; i++)
+    state[i] = s[i];
+  state[256] = s_i;
+  state[257] = s_j;
+}
+
+/* Restores the state saved by prng_rc4_get_state() from the
+   PRNG_RC4_STATE_SIZE bytes of STATE. */
+void
+prng_rc4_set_state (const unsigned char *state)
+{
+  int i;
+
+  for (i = 0; i < 256; i++)
+    s[i] = state[i];
+  s_i = state[256];
+  s_j = state[257];
+  seeded = 1;
+}
+
 /* Returns a pseudo-random integer in the range [0, 255]. */
 unsigned char
 prng_rc4_get_octet (void)
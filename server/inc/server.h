@@ -0,0 +1,193 @@
+/**
+ * @file server.h
+ * @author jkilopu
+ * @brief Dedicated headless mymines server, hosts many 2-player and coop rooms in one process.
+ *
+ * @details About the dedicated server:
+ * 1. Linux only, one thread with a non-blocking epoll event loop, no SDL video.
+ * 2. It speaks the version 2 protocol in "packet.h", so the game joins it like a normal host (client mode).
+ * 3. Matchmaking: a player that sends a TYPE_SETTINGS packet right after connecting waits for a player
+ *    with the same map width, height and number of mines. A player that sends nothing within
+ *    "MATCH_DEFAULT_TIMEOUT" (like the game client) waits with the default settings.
+ * 4. When two players are matched, both receive TYPE_SEED_KEY and TYPE_SETTINGS, exactly like from
+ *    "host_game". After that every packet is relayed to the other player of the room.
+ * 5. When a player quits or disconnects, the other one receives TYPE_QUIT and the room is closed.
+ * 6. Coop rooms: a player that sends TYPE_SETTINGS with the coop bit in the game mode (map size 0 for the default)
+ *    joins an open coop room with the same settings, up to "COOP_MAX_PLAYERS" players, or opens one.
+ *    It receives TYPE_SEED_KEY, TYPE_SETTINGS and TYPE_COOP_JOIN with its player number.
+ *    - Clicks are ordered by the server: each one is sent to every player, the sender too, and the players only
+ *      apply clicks in that order, so all boards stay the same.
+ *    - A player that joins a game in progress is sent the clicks from then on, and a snapshot taken right then:
+ *      the server sends TYPE_RESYNC to the "donor" (the oldest player) and passes its TYPE_SNAPSHOT to the
+ *      joiners in the order of the requests. If the donor leaves, the players waiting for it are closed.
+ *    - Interest management: each player sends its viewport (TYPE_VIEWPORT), and is only sent the cursors inside
+ *      it, with TYPE_CURSOR_LEAVE when one leaves it. The game always shows the whole board, so its viewport is
+ *      the whole board, or empty while its window is minimized or hidden: only the mouse moves to those players
+ *      are saved.
+ *    - TYPE_PING is answered by the server, which is the host every player waits for.
+ *    A coop room is closed when the last player leaves.
+ * 7. Backpressure: a connection whose output is not read keeps at most "CONN_OUT_BUF_MAX" bytes, then it is
+ *    dropped. From "CONN_CONGESTED" bytes mouse moves are not queued any more: the newest one of each player
+ *    waits in a slot of the connection and supersedes the older one, and the slots are sent when the output
+ *    drains. So a slow player gets fewer cursor updates first, clicks, settings and quit are never dropped.
+ * 8. Spectators: a client that sends TYPE_SETTINGS with the coop and spectate bits watches a coop room with the
+ *    same settings (or opens one). It is sent the room setup with the spectate bit, TYPE_COOP_JOIN with player
+ *    "COOP_MAX_PLAYERS", then every click, mouse move and TYPE_CURSOR_LEAVE of the room. It never plays.
+ *    - Broadcast: the packets of a room for its spectators in one loop are copied once into a "SharedBuf", which
+ *      is queued by reference to every spectator and sent with "writev", so a spectator costs no copy and
+ *      "SHARED_BUF_SIZE" packets cost one system call at most.
+ *    - Spectators of a game in progress are synced in batches: one TYPE_RESYNC to the donor for all of them,
+ *      its snapshot is collected in one "SharedBuf" for the batch.
+ *    - A spectator with "SPECTATOR_QUEUE_MAX" buffers not sent is dropped. When the last player leaves, the
+ *      spectators receive the broadcasts of the loop, then TYPE_QUIT.
+ *    - The packets sent to a spectator alone go after its shared buffers not sent yet, so it gets them in order.
+ */
+#ifndef __SERVER_H
+#define __SERVER_H
+
+#include "SDL_stdinc.h"
+#include "packet.h"
+
+#define MAX_EPOLL_EVENTS 256
+#define CONN_OUT_BUF_MAX (64 * 1024) ///< A player that can't keep up with this backlog is dropped.
+#define CONN_CONGESTED (4 * 1024)    ///< From this backlog mouse moves are superseded instead of queued.
+#define MATCH_DEFAULT_TIMEOUT 500    ///< In milliseconds.
+#define SERVER_TICK 100              ///< In milliseconds, how often lobby timeouts are checked.
+#define SHARED_BUF_SIZE (64 * sizeof(MyMinesPacket)) ///< A broadcast buffer is sent when it is full.
+#define SPECTATOR_QUEUE_MAX 256      ///< A spectator with more shared buffers not sent is dropped.
+#define CONN_MAX_IOV 64              ///< Buffers passed to one "writev".
+
+//-------------------------------------------------------------------
+// Type Definations
+//-------------------------------------------------------------------
+
+typedef enum {
+    CONN_NEW,     ///< Connected, settings not known yet.
+    CONN_WAITING, ///< In the lobby, waiting for a player with the same settings.
+    CONN_PLAYING, ///< In a room.
+    CONN_CLOSING, ///< Close after the pending output is sent.
+} ConnState;
+
+typedef enum {
+    SPECTATOR_NONE,     ///< A player.
+    SPECTATOR_WAITING,  ///< The game is in progress, waiting for the next batch.
+    SPECTATOR_SYNCING,  ///< In the batch the donor takes a snapshot for.
+    SPECTATOR_WATCHING, ///< Sent the broadcasts of the room.
+} SpectatorState;
+
+/**
+ * @brief Packets serialized once and sent to many connections, freed when the last one has sent it.
+ */
+typedef struct {
+    Uint32 refcount;
+    Uint32 len, cap;
+    Uint8 data[];
+} SharedBuf;
+
+struct _room;
+
+/**
+ * @brief A connected player.
+ */
+typedef struct _conn {
+    int fd;
+    ConnState state;
+    Uint8 in_buf[sizeof(MyMinesPacket)]; ///< A partial packet.
+    Uint32 in_len;
+    Uint8 *out_buf;                      ///< Bytes not accepted by the kernel yet.
+    Uint32 out_len, out_cap;
+    SDL_bool want_out;                   ///< EPOLLOUT is registered.
+    Settings settings;                   ///< The wanted settings.
+    Uint32 accept_ticks;
+    struct _room *room;
+    struct _conn *prev, *next;           ///< In the new or waiting list.
+    Uint8 player;                        ///< The slot in a coop room.
+    SDL_bool has_cursor;                 ///< In a coop room, a mouse move is received.
+    Uint32 cursor_y, cursor_x;
+    Uint32 view_top, view_left, view_bottom, view_right; ///< See "ViewportPacket", empty until it is received.
+    Uint32 seen_by;                      ///< Bit i: the cursor is sent to player i and not left its viewport.
+    MyMinesPacket pending_cursors[COOP_MAX_PLAYERS]; ///< The newest mouse move of each player while congested.
+    Uint32 pending_mask;                 ///< Bit i: "pending_cursors[i]" is waiting.
+    SpectatorState spectating;
+    unsigned int spectator_index;        ///< In "Room.spectators".
+    SharedBuf **shared;                  ///< A ring of "SPECTATOR_QUEUE_MAX" buffers to send after "out_buf".
+    Uint32 shared_head, shared_num;
+    Uint32 shared_offset;                ///< Bytes of the head buffer sent, it goes before "out_buf" then.
+} Conn;
+
+/**
+ * @brief Two players, or up to "COOP_MAX_PLAYERS" in coop, on the same map.
+ */
+typedef struct _room {
+    Uint32 id;
+    Conn *players[COOP_MAX_PLAYERS];     ///< Only the first two in a 2-player room, NULL for a free slot in coop.
+    Settings settings;
+    SDL_bool coop;
+    SDL_bool closed;                     ///< Freed at the end of the loop, like closed connections.
+    unsigned int n_players;
+    MyMinesPacket seed_packet;           ///< For the players that join later.
+    Conn *donor;                         ///< The player asked for the snapshots, NULL before the first one joins.
+    Conn *joiners[COOP_MAX_PLAYERS];     ///< Waiting for a snapshot, in the order of the requests, NULL for the spectators.
+    unsigned int n_joiners;
+    struct _room *next;                  ///< In the list of open coop rooms, or of closed rooms.
+    Conn **spectators;
+    unsigned int n_spectators, spectators_cap;
+    SDL_bool spectator_batch;            ///< A snapshot for the syncing spectators is asked for.
+    SharedBuf *spectator_snapshot;       ///< Collected from the donor for the batch.
+    SharedBuf *broadcast;                ///< The packets for the spectators in this loop.
+    SDL_bool dirty;                      ///< In the list of rooms to broadcast.
+    struct _room *next_dirty;
+} Room;
+
+/**
+ * @brief A doubly linked list of connections.
+ */
+typedef struct {
+    Conn *head, *tail;
+} ConnList;
+
+/**
+ * @brief Server statistics.
+ */
+typedef struct {
+    Uint64 accepted, closed;
+    Uint64 rooms_opened, rooms_closed;
+    Uint64 packets_relayed;
+    Uint64 cursors_relayed, cursors_culled; ///< Mouse moves in coop rooms sent to a player, and not sent.
+    Uint64 moves_superseded;                ///< Mouse moves replaced by a newer one while congested.
+    Uint64 slow_drops;                      ///< Connections dropped at "CONN_OUT_BUF_MAX".
+    Uint32 max_out_len;                     ///< The largest backlog of a connection.
+    Uint64 spectators;                      ///< Watching now.
+    Uint64 broadcasts;                      ///< Shared buffers serialized.
+    Uint64 shared_sends, shared_bytes;      ///< Shared buffers queued to a spectator, and their bytes not copied.
+} ServerStats;
+
+//-------------------------------------------------------------------
+// Prototypes
+//-------------------------------------------------------------------
+
+/* server.c */
+void conn_send(Conn *conn, const MyMinesPacket *p_packet);
+void conn_send_cursor(Conn *conn, const MyMinesPacket *p_packet);
+void conn_close(Conn *conn);
+void conn_close_after_flush(Conn *conn);
+SharedBuf *shared_buf_append(SharedBuf *buf, const MyMinesPacket *p_packet);
+void shared_buf_unref(SharedBuf *buf);
+void conn_send_shared(Conn *conn, SharedBuf *buf);
+
+/* room.c */
+void fill_match_settings(Settings *p_s, Uint32 map_width, Uint32 map_height, Uint32 n_mine);
+SDL_bool is_valid_match_settings(const Settings *p_s);
+void lobby_add_new(Conn *conn);
+void lobby_remove(Conn *conn);
+void lobby_wait(Conn *conn, const Settings *p_settings);
+void lobby_set_default_settings(const Settings *p_settings);
+void lobby_check_timeouts(Uint32 now);
+void room_handle_packet(Conn *conn, const MyMinesPacket *p_packet);
+void room_leave(Conn *conn);
+void flush_broadcasts(void);
+void free_closed_rooms(void);
+
+extern ServerStats server_stats;
+
+#endif
@@ -0,0 +1,773 @@
+/**
+ * @file room.c
+ * @author jkilopu
+ * @brief Matchmaking by settings, packet relay between the players of a room, and coop rooms.
+ */
+#include "server.h"
+#include "SDL.h"
+#include "game.h"
+#include "render.h"
+#include "timer.h"
+#include "fatal.h"
+#include <stdlib.h>
+#include <time.h>
+
+static ConnList new_conns;     ///< Ordered by accept time.
+static ConnList waiting_conns; ///< At most one connection per settings.
+static Uint32 next_room_id;
+static Settings default_settings;
+static Room *coop_rooms;       ///< Open coop rooms.
+static Room *closed_rooms;     ///< Freed at the end of the loop.
+static Room *dirty_rooms;      ///< Rooms with packets for their spectators, linked by "next_dirty".
+
+//-------------------------------------------------------------------
+// Connection list
+//-------------------------------------------------------------------
+
+static void list_append(ConnList *p_list, Conn *conn)
+{
+    conn->prev = p_list->tail;
+    conn->next = NULL;
+    if (p_list->tail != NULL)
+        p_list->tail->next = conn;
+    else
+        p_list->head = conn;
+    p_list->tail = conn;
+}
+
+static void list_remove(ConnList *p_list, Conn *conn)
+{
+    if (conn->prev != NULL)
+        conn->prev->next = conn->next;
+    else
+        p_list->head = conn->next;
+    if (conn->next != NULL)
+        conn->next->prev = conn->prev;
+    else
+        p_list->tail = conn->prev;
+    conn->prev = conn->next = NULL;
+}
+
+//-------------------------------------------------------------------
+// Settings
+//-------------------------------------------------------------------
+
+/**
+ * @brief Fill in all settings from the map size, the same way "settings_menu" does.
+ */
+void fill_match_settings(Settings *p_s, Uint32 map_width, Uint32 map_height, Uint32 n_mine)
+{
+    SDL_zerop(p_s);
+    p_s->map_width = map_width;
+    p_s->map_height = map_height;
+    p_s->n_mine = n_mine;
+    p_s->block_size = MAIN_WIN_SIZE / (map_width > map_height ? map_width : map_height);
+    p_s->window_height = map_height * p_s->block_size;
+    p_s->window_width = map_width * p_s->block_size + TIME_REGION_WIDTH;
+    set_lan_mode(p_s->game_mode);
+}
+
+/**
+ * @brief See if the settings can be played, limits are the same as in "settings_menu".
+ */
+SDL_bool is_valid_match_settings(const Settings *p_s)
+{
+    return p_s->map_width > 0 && p_s->map_width <= 99 && p_s->map_height > 0 && p_s->map_height <= 99 &&
+           p_s->n_mine > 0 && p_s->n_mine < p_s->map_width * p_s->map_height;
+}
+
+static SDL_bool is_same_match(const Settings *p_a, const Settings *p_b)
+{
+    return p_a->map_width == p_b->map_width && p_a->map_height == p_b->map_height && p_a->n_mine == p_b->n_mine;
+}
+
+//-------------------------------------------------------------------
+// Lobby
+//-------------------------------------------------------------------
+
+/**
+ * @brief The settings of the players that don't ask for a map.
+ */
+void lobby_set_default_settings(const Settings *p_settings)
+{
+    default_settings = *p_settings;
+}
+
+/**
+ * @brief Put a just accepted connection in the lobby, waiting for its settings.
+ */
+void lobby_add_new(Conn *conn)
+{
+    conn->state = CONN_NEW;
+    conn->accept_ticks = SDL_GetTicks();
+    list_append(&new_conns, conn);
+}
+
+/**
+ * @brief Remove a connection from the lobby, if it is in.
+ */
+void lobby_remove(Conn *conn)
+{
+    if (conn->state == CONN_NEW)
+        list_remove(&new_conns, conn);
+    else if (conn->state == CONN_WAITING)
+        list_remove(&waiting_conns, conn);
+}
+
+/**
+ * @brief Create a room with a new seed key.
+ */
+static Room *create_room(const Settings *p_settings)
+{
+    Room *room = calloc_fatal(1, sizeof(Room), "create_room - room");
+    room->id = next_room_id++;
+    room->settings = *p_settings;
+    room->seed_packet.seed_key_packet.type = TYPE_SEED_KEY;
+    room->seed_packet.seed_key_packet.key = (Uint64)time(NULL) ^ ((Uint64)room->id * 0x9E3779B97F4A7C15ULL);
+    room->seed_packet.seed_key_packet.key_size = sizeof(Uint64);
+    server_stats.rooms_opened++;
+    return room;
+}
+
+/**
+ * @brief Send the seed key and settings of the room to a player, like "host_game".
+ */
+static void send_room_setup(Room *room, Conn *conn)
+{
+    MyMinesPacket settings_packet;
+    SDL_zero(settings_packet);
+    settings_packet.settings_packet.type = TYPE_SETTINGS;
+    settings_packet.settings_packet.settings = room->settings;
+    conn_send(conn, &room->seed_packet);
+    conn_send(conn, &settings_packet);
+}
+
+/**
+ * @brief Start a room for two players.
+ */
+static void open_room(Conn *a, Conn *b, const Settings *p_settings)
+{
+    Room *room = create_room(p_settings);
+    room->players[0] = a;
+    room->players[1] = b;
+    room->n_players = 2;
+
+    for (int i = 0; i < 2; i++)
+    {
+        room->players[i]->state = CONN_PLAYING;
+        room->players[i]->room = room;
+    }
+    for (int i = 0; i < 2; i++)
+        if (room->players[i]->room == room) ///< Not dropped by sending to the other one.
+            send_room_setup(room, room->players[i]);
+}
+
+/**
+ * @brief Match the connection with a waiting one with the same settings, or let it wait.
+ *
+ * @param conn A new or waiting connection.
+ * @param p_settings The settings it wants.
+ */
+void lobby_wait(Conn *conn, const Settings *p_settings)
+{
+    lobby_remove(conn);
+    for (Conn *waiting = waiting_conns.head; waiting != NULL; waiting = waiting->next)
+    {
+        if (is_same_match(&waiting->settings, p_settings))
+        {
+            list_remove(&waiting_conns, waiting);
+            open_room(waiting, conn, &waiting->settings);
+            return;
+        }
+    }
+    conn->settings = *p_settings;
+    conn->state = CONN_WAITING;
+    list_append(&waiting_conns, conn);
+}
+
+/**
+ * @brief Let the connections that sent no settings in time wait with the default settings.
+ */
+void lobby_check_timeouts(Uint32 now)
+{
+    while (new_conns.head != NULL && SDL_TICKS_PASSED(now, new_conns.head->accept_ticks + MATCH_DEFAULT_TIMEOUT))
+        lobby_wait(new_conns.head, &default_settings);
+}
+
+//-------------------------------------------------------------------
+// Coop room
+//-------------------------------------------------------------------
+
+/**
+ * @brief Microseconds of the server clock, for TYPE_PONG.
+ */
+static Uint64 now_us(void)
+{
+    Uint64 counter = SDL_GetPerformanceCounter(), freq = SDL_GetPerformanceFrequency();
+    return counter / freq * 1000000 + counter % freq * 1000000 / freq;
+}
+
+static SDL_bool in_viewport(const Conn *viewer, Uint32 y, Uint32 x)
+{
+    return y >= viewer->view_top && y < viewer->view_bottom && x >= viewer->view_left && x < viewer->view_right;
+}
+
+/**
+ * @brief Find an open coop room with the same settings, or open one.
+ *
+ * @param need_slot The room must have a free player slot, spectators take none.
+ */
+static Room *find_coop_room(const Settings *p_settings, SDL_bool need_slot)
+{
+    Room *room = coop_rooms;
+    while (room != NULL && ((need_slot && room->n_players == COOP_MAX_PLAYERS) ||
+                            !is_same_match(&room->settings, p_settings)))
+        room = room->next;
+    if (room == NULL)
+    {
+        room = create_room(p_settings);
+        room->coop = SDL_TRUE;
+        room->next = coop_rooms;
+        coop_rooms = room;
+    }
+    return room;
+}
+
+static void close_coop_room(Room *room)
+{
+    if (room->closed)
+        return;
+    Room **p_room = &coop_rooms;
+    while (*p_room != room)
+        p_room = &(*p_room)->next;
+    *p_room = room->next;
+    room->closed = SDL_TRUE;
+    room->next = closed_rooms;
+    closed_rooms = room;
+    server_stats.rooms_closed++;
+}
+
+//-------------------------------------------------------------------
+// Spectators
+//-------------------------------------------------------------------
+
+/**
+ * @brief Send the packets for the spectators of the room so far, one shared buffer to all of them.
+ */
+static void flush_room_broadcast(Room *room)
+{
+    SharedBuf *buf = room->broadcast;
+    if (buf == NULL)
+        return;
+    room->broadcast = NULL;
+    server_stats.broadcasts++;
+    for (unsigned int i = room->n_spectators; i-- > 0;) ///< A dropped spectator is swapped with the last one.
+        if (room->spectators[i]->spectating != SPECTATOR_WAITING)
+            conn_send_shared(room->spectators[i], buf);
+    shared_buf_unref(buf);
+}
+
+/**
+ * @brief Add a packet for the spectators of the room, sent at the end of the loop or when the buffer is full.
+ */
+static void room_broadcast(Room *room, const MyMinesPacket *p_packet)
+{
+    if (room->n_spectators == 0 || room->closed)
+        return;
+    room->broadcast = shared_buf_append(room->broadcast, p_packet);
+    if (!room->dirty)
+    {
+        room->dirty = SDL_TRUE;
+        room->next_dirty = dirty_rooms;
+        dirty_rooms = room;
+    }
+    if (room->broadcast->len >= SHARED_BUF_SIZE)
+        flush_room_broadcast(room);
+}
+
+/**
+ * @brief Send the packets of this loop to the spectators of each room, before the closed rooms are freed.
+ */
+void flush_broadcasts(void)
+{
+    while (dirty_rooms != NULL)
+    {
+        Room *room = dirty_rooms;
+        dirty_rooms = room->next_dirty;
+        room->dirty = SDL_FALSE;
+        if (!room->closed)
+            flush_room_broadcast(room);
+    }
+}
+
+/**
+ * @brief Ask the donor for one snapshot for all waiting spectators, unless one is asked for already.
+ */
+static void start_spectator_batch(Room *room)
+{
+    if (room->spectator_batch || room->donor == NULL)
+        return;
+    flush_room_broadcast(room); ///< The snapshot has these clicks, the waiting spectators must not get them.
+    unsigned int n_waiting = 0;
+    for (unsigned int i = 0; i < room->n_spectators; i++)
+        if (room->spectators[i]->spectating == SPECTATOR_WAITING)
+        {
+            room->spectators[i]->spectating = SPECTATOR_SYNCING;
+            n_waiting++;
+        }
+    if (n_waiting == 0)
+        return;
+
+    room->spectator_batch = SDL_TRUE;
+    room->joiners[room->n_joiners++] = NULL; ///< The donor is not a joiner, so there is room.
+    MyMinesPacket packet;
+    SDL_zero(packet);
+    packet.type = TYPE_RESYNC;
+    conn_send(room->donor, &packet);
+}
+
+/**
+ * @brief Collect a snapshot chunk of the donor for the syncing spectators, they watch from the last one.
+ */
+static void spectator_snapshot(Room *room, const MyMinesPacket *p_packet)
+{
+    room->spectator_snapshot = shared_buf_append(room->spectator_snapshot, p_packet);
+    if (p_packet->snapshot_packet.data_len != 0)
+        return;
+
+    SharedBuf *buf = room->spectator_snapshot;
+    room->spectator_snapshot = NULL;
+    room->spectator_batch = SDL_FALSE;
+    server_stats.broadcasts++;
+    for (unsigned int i = room->n_spectators; i-- > 0;)
+        if (room->spectators[i]->spectating == SPECTATOR_SYNCING)
+        {
+            room->spectators[i]->spectating = SPECTATOR_WATCHING;
+            conn_send_shared(room->spectators[i], buf);
+        }
+    shared_buf_unref(buf);
+    start_spectator_batch(room);
+}
+
+/**
+ * @brief Let a spectator watch an open coop room with the same settings, or a new one.
+ *
+ * @note It is sent the settings with the spectate bit, so the client knows it is one.
+ */
+static void spectate_join(Conn *conn, const Settings *p_settings)
+{
+    Room *room = find_coop_room(p_settings, SDL_FALSE);
+    if (room->n_spectators == room->spectators_cap)
+    {
+        room->spectators_cap = room->spectators_cap ? room->spectators_cap * 2 : 16;
+        Conn **new_spectators = realloc(room->spectators, room->spectators_cap * sizeof(Conn *));
+        if (new_spectators == NULL)
+            Error("spectate_join: %s\n", MALLOC_FAIL_MSG);
+        room->spectators = new_spectators;
+    }
+    conn->spectator_index = room->n_spectators;
+    room->spectators[room->n_spectators++] = conn;
+    conn->state = CONN_PLAYING;
+    conn->room = room;
+    conn->player = COOP_MAX_PLAYERS;
+    conn->spectating = room->donor != NULL ? SPECTATOR_WAITING : SPECTATOR_WATCHING;
+    server_stats.spectators++;
+
+    MyMinesPacket packet;
+    SDL_zero(packet);
+    packet.settings_packet.type = TYPE_SETTINGS;
+    packet.settings_packet.settings = room->settings;
+    set_spectate_mode(packet.settings_packet.settings.game_mode);
+    conn_send(conn, &room->seed_packet);
+    conn_send(conn, &packet);
+    SDL_zero(packet);
+    packet.player_packet.type = TYPE_COOP_JOIN;
+    packet.player_packet.player = COOP_MAX_PLAYERS;
+    packet.player_packet.in_progress = room->donor != NULL;
+    conn_send(conn, &packet);
+    if (conn->room == room)
+        start_spectator_batch(room);
+}
+
+/**
+ * @brief Remove a spectator from its room, a room with no player is closed with its last spectator.
+ */
+static void spectator_leave(Conn *conn)
+{
+    Room *room = conn->room;
+    Conn *last = room->spectators[--room->n_spectators];
+    room->spectators[conn->spectator_index] = last;
+    last->spectator_index = conn->spectator_index;
+    conn->room = NULL;
+    conn->spectating = SPECTATOR_NONE;
+    server_stats.spectators--;
+    if (room->n_players == 0 && room->n_spectators == 0)
+        close_coop_room(room);
+}
+
+//-------------------------------------------------------------------
+// Coop players
+//-------------------------------------------------------------------
+
+/**
+ * @brief Put a player in an open coop room with the same settings, or in a new one.
+ *
+ * @note A player that joins a game in progress waits for a snapshot from the donor, see "server.h".
+ */
+static void coop_join(Conn *conn, const Settings *p_settings)
+{
+    Room *room = find_coop_room(p_settings, SDL_TRUE);
+
+    Uint8 player = 0;
+    while (room->players[player] != NULL)
+        player++;
+    room->players[player] = conn;
+    room->n_players++;
+    conn->state = CONN_PLAYING;
+    conn->room = room;
+    conn->player = player;
+
+    Conn *donor = room->donor;
+    if (donor == NULL)
+        room->donor = conn;
+    else
+        room->joiners[room->n_joiners++] = conn;
+
+    MyMinesPacket packet;
+    send_room_setup(room, conn);
+    SDL_zero(packet);
+    packet.player_packet.type = TYPE_COOP_JOIN;
+    packet.player_packet.player = player;
+    packet.player_packet.in_progress = donor != NULL;
+    conn_send(conn, &packet);
+    if (donor != NULL && conn->room == room)
+    {
+        SDL_zero(packet);
+        packet.type = TYPE_RESYNC; ///< The snapshot is taken after the clicks sent so far, the joiner gets the rest.
+        conn_send(donor, &packet);
+    }
+    else if (donor == NULL && conn->room == room)
+        start_spectator_batch(room); ///< Spectators left waiting by a donor that left.
+}
+
+/**
+ * @brief Send the cursor of "mover" to "viewer" if it is in the viewport, or TYPE_CURSOR_LEAVE if it has left.
+ *
+ * @param moved The cursor has moved, so it is sent again even if the viewer has it.
+ */
+static void update_cursor_interest(Conn *mover, Conn *viewer, SDL_bool moved)
+{
+    Uint32 bit = 1u << viewer->player;
+    MyMinesPacket packet;
+    SDL_zero(packet);
+    if (mover->has_cursor && in_viewport(viewer, mover->cursor_y, mover->cursor_x))
+    {
+        if (!moved && (mover->seen_by & bit))
+            return;
+        packet.mouse_move_packet.type = TYPE_MOUSE_MOVE;
+        packet.mouse_move_packet.player = mover->player;
+        packet.mouse_move_packet.pos_y = mover->cursor_y;
+        packet.mouse_move_packet.pos_x = mover->cursor_x;
+        mover->seen_by |= bit;
+        server_stats.cursors_relayed++;
+        conn_send_cursor(viewer, &packet);
+        return;
+    }
+    else if (mover->seen_by & bit)
+    {
+        packet.player_packet.type = TYPE_CURSOR_LEAVE;
+        packet.player_packet.player = mover->player;
+        mover->seen_by &= ~bit;
+    }
+    else
+    {
+        if (moved)
+            server_stats.cursors_culled++;
+        return;
+    }
+    conn_send(viewer, &packet);
+}
+
+static SDL_bool is_joiner(const Room *room, const Conn *conn)
+{
+    for (unsigned int i = 0; i < room->n_joiners; i++)
+        if (room->joiners[i] == conn)
+            return SDL_TRUE;
+    return SDL_FALSE;
+}
+
+/**
+ * @brief Handle a packet from a player or spectator of a coop room.
+ */
+static void coop_handle_packet(Conn *conn, const MyMinesPacket *p_packet)
+{
+    Room *room = conn->room;
+    Conn *players[COOP_MAX_PLAYERS];
+    SDL_memcpy(players, room->players, sizeof(players)); ///< Sending may drop a slow player and change the room.
+    MyMinesPacket packet = *p_packet;
+    if (conn->spectating != SPECTATOR_NONE && packet.type != TYPE_PING) ///< Spectators only watch.
+        return;
+    if (packet.type == TYPE_CLICK_MAP) ///< The clock offsets of the players are to the server, not to each other.
+        packet.click_map_packet.input_time = 0;
+    else if (packet.type == TYPE_MOUSE_MOVE)
+        packet.mouse_move_packet.input_time = 0;
+
+    switch (packet.type)
+    {
+    case TYPE_CLICK_MAP:
+        if (is_joiner(room, conn)) ///< It doesn't have the board yet.
+            break;
+        packet.click_map_packet.player = conn->player;
+        for (int i = 0; i < COOP_MAX_PLAYERS; i++)
+            if (players[i] != NULL && players[i]->room == room)
+            {
+                conn_send(players[i], &packet);
+                server_stats.packets_relayed++;
+            }
+        room_broadcast(room, &packet);
+        break;
+    case TYPE_MOUSE_MOVE:
+        conn->has_cursor = SDL_TRUE;
+        conn->cursor_y = packet.mouse_move_packet.pos_y;
+        conn->cursor_x = packet.mouse_move_packet.pos_x;
+        for (int i = 0; i < COOP_MAX_PLAYERS && conn->room == room; i++)
+            if (players[i] != NULL && players[i] != conn && players[i]->room == room)
+                update_cursor_interest(conn, players[i], SDL_TRUE);
+        packet.mouse_move_packet.player = conn->player;
+        room_broadcast(room, &packet); ///< Spectators see every cursor.
+        break;
+    case TYPE_VIEWPORT:
+        conn->view_top = packet.viewport_packet.top;
+        conn->view_left = packet.viewport_packet.left;
+        conn->view_bottom = packet.viewport_packet.bottom;
+        conn->view_right = packet.viewport_packet.right;
+        for (int i = 0; i < COOP_MAX_PLAYERS && conn->room == room; i++)
+            if (players[i] != NULL && players[i] != conn && players[i]->room == room)
+                update_cursor_interest(players[i], conn, SDL_FALSE);
+        break;
+    case TYPE_SNAPSHOT:
+        if (conn != room->donor || room->n_joiners == 0)
+            break;
+        Conn *joiner = room->joiners[0];
+        if (packet.snapshot_packet.data_len == 0) ///< The end, the joiner has the board now.
+        {
+            room->n_joiners--;
+            SDL_memmove(room->joiners, room->joiners + 1, room->n_joiners * sizeof(Conn *));
+        }
+        if (joiner == NULL)
+            spectator_snapshot(room, &packet);
+        else
+            conn_send(joiner, &packet);
+        break;
+    case TYPE_PING:
+        packet.ping_packet.type = TYPE_PONG;
+        packet.ping_packet.recv_time = now_us();
+        packet.ping_packet.hold_time = 0;
+        conn_send(conn, &packet);
+        break;
+    default: ///< TYPE_PONG, TYPE_RESYNC and the others are not for the other players.
+        break;
+    }
+}
+
+/**
+ * @brief Remove a player from its coop room, its cursor leaves the others.
+ *
+ * @note If it was the donor, the joiners and syncing spectators waiting for it are closed and the oldest other
+ * player becomes the donor. When the last player leaves, the spectators are closed with the room.
+ */
+static void coop_leave(Conn *conn)
+{
+    Room *room = conn->room;
+    Conn *players[COOP_MAX_PLAYERS], *joiners[COOP_MAX_PLAYERS];
+    unsigned int n_joiners = 0;
+    SDL_bool spectator_batch = SDL_FALSE;
+
+    room->players[conn->player] = NULL;
+    room->n_players--;
+    conn->room = NULL;
+    for (unsigned int i = 0; i < room->n_joiners; i++)
+        if (room->joiners[i] != conn)
+            room->joiners[n_joiners++] = room->joiners[i];
+    room->n_joiners = n_joiners;
+    if (room->donor == conn)
+    {
+        room->donor = NULL;
+        for (int i = 0; i < COOP_MAX_PLAYERS && room->donor == NULL; i++)
+            if (room->players[i] != NULL && room->players[i]->state == CONN_PLAYING && !is_joiner(room, room->players[i]))
+                room->donor = room->players[i];
+        SDL_memcpy(joiners, room->joiners, n_joiners * sizeof(Conn *));
+        room->n_joiners = 0;
+        spectator_batch = room->spectator_batch;
+        room->spectator_batch = SDL_FALSE;
+        shared_buf_unref(room->spectator_snapshot);
+        room->spectator_snapshot = NULL;
+    }
+    else
+        n_joiners = 0;
+
+    SDL_memcpy(players, room->players, sizeof(players));
+    MyMinesPacket packet;
+    SDL_zero(packet);
+    packet.player_packet.type = TYPE_CURSOR_LEAVE;
+    packet.player_packet.player = conn->player;
+    for (int i = 0; i < COOP_MAX_PLAYERS; i++)
+        if (players[i] != NULL)
+        {
+            players[i]->seen_by &= ~(1u << conn->player);
+            if ((conn->seen_by & (1u << i)) && players[i]->room == room)
+                conn_send(players[i], &packet);
+        }
+    conn->seen_by = 0;
+    if (conn->has_cursor)
+        room_broadcast(room, &packet);
+    flush_room_broadcast(room); ///< Before TYPE_QUIT, and "flush_broadcasts" skips the room once it is closed.
+
+    SDL_zero(packet);
+    packet.type = TYPE_QUIT;
+    for (unsigned int i = 0; i < n_joiners; i++)
+        if (joiners[i] != NULL && joiners[i]->room == room)
+        {
+            conn_send(joiners[i], &packet); ///< Its snapshot is gone with the donor.
+            conn_close_after_flush(joiners[i]);
+        }
+    for (unsigned int i = room->n_spectators; spectator_batch && i-- > 0;)
+        if (i < room->n_spectators && room->spectators[i]->spectating == SPECTATOR_SYNCING)
+        {
+            Conn *spectator = room->spectators[i];
+            spectator->spectating = SPECTATOR_WATCHING; ///< Not syncing again with the next donor.
+            conn_send(spectator, &packet);
+            conn_close_after_flush(spectator);
+        }
+
+    if (room->n_players == 0)
+    {
+        for (unsigned int i = 0; i < room->n_spectators; i++) ///< They leave the room now, it is freed at the end of the loop.
+        {
+            Conn *spectator = room->spectators[i];
+            spectator->room = NULL;
+            spectator->spectating = SPECTATOR_NONE;
+            server_stats.spectators--;
+        }
+        unsigned int n_spectators = room->n_spectators;
+        room->n_spectators = 0;
+        for (unsigned int i = 0; i < n_spectators; i++)
+        {
+            conn_send(room->spectators[i], &packet);
+            conn_close_after_flush(room->spectators[i]);
+        }
+        close_coop_room(room);
+    }
+    else if (spectator_batch)
+        start_spectator_batch(room); ///< For the spectators that joined during the one cancelled.
+}
+
+/**
+ * @brief Free the coop rooms closed in this loop, the connections of the loop may still point to them.
+ */
+void free_closed_rooms(void)
+{
+    while (closed_rooms != NULL)
+    {
+        Room *room = closed_rooms;
+        closed_rooms = room->next;
+        shared_buf_unref(room->broadcast);
+        shared_buf_unref(room->spectator_snapshot);
+        free(room->spectators);
+        free(room);
+    }
+}
+
+//-------------------------------------------------------------------
+// Room
+//-------------------------------------------------------------------
+
+/**
+ * @brief Handle a complete packet from a connection.
+ */
+void room_handle_packet(Conn *conn, const MyMinesPacket *p_packet)
+{
+    if (conn->state == CONN_PLAYING)
+    {
+        if (p_packet->type == TYPE_QUIT)
+            conn_close(conn); ///< The other player receives TYPE_QUIT in "room_leave".
+        else if (conn->room->coop)
+            coop_handle_packet(conn, p_packet);
+        else
+        {
+            Room *room = conn->room;
+            if (p_packet->type == TYPE_MOUSE_MOVE)
+                conn_send_cursor(room->players[room->players[0] == conn], p_packet);
+            else
+                conn_send(room->players[room->players[0] == conn], p_packet);
+            server_stats.packets_relayed++;
+        }
+        return;
+    }
+
+    switch (p_packet->type)
+    {
+    case TYPE_SETTINGS:
+    {
+        Settings settings;
+        const Settings *p_wanted = &p_packet->settings_packet.settings;
+        SDL_bool coop = is_coop_mode(p_wanted->game_mode) != 0;
+        if (coop && p_wanted->map_width == 0)
+            settings = default_settings;
+        else
+            fill_match_settings(&settings, p_wanted->map_width, p_wanted->map_height, p_wanted->n_mine);
+        if (conn->state != CONN_NEW || !is_valid_match_settings(&settings))
+            conn_close(conn);
+        else if (coop)
+        {
+            lobby_remove(conn);
+            set_coop_mode(settings.game_mode);
+            if (is_spectate_mode(p_wanted->game_mode))
+                spectate_join(conn, &settings);
+            else
+                coop_join(conn, &settings);
+        }
+        else
+            lobby_wait(conn, &settings);
+        break;
+    }
+    case TYPE_QUIT:
+        conn_close(conn);
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * @brief Remove the connection from its room, the other player is told to quit and closed.
+ * In a coop room only the connection leaves, see "coop_leave".
+ *
+ * @note Called when the connection is closed for any reason.
+ */
+void room_leave(Conn *conn)
+{
+    Room *room = conn->room;
+    if (room == NULL)
+        return;
+    if (room->coop)
+    {
+        if (conn->spectating != SPECTATOR_NONE)
+            spectator_leave(conn);
+        else
+            coop_leave(conn);
+        return;
+    }
+
+    Conn *peer = room->players[room->players[0] == conn];
+    MyMinesPacket quit_packet;
+    SDL_zero(quit_packet);
+    quit_packet.type = TYPE_QUIT;
+
+    conn->room = NULL;
+    peer->room = NULL;
+    conn_send(peer, &quit_packet);
+    conn_close_after_flush(peer);
+    free(room);
+    server_stats.rooms_closed++;
+}
@@ -0,0 +1,525 @@
+/**
+ * @file server.c
+ * @author jkilopu
+ * @brief The epoll event loop and non-blocking connection I/O of the dedicated server.
+ *
+ * @note Usage:
+ *       ./mymines-server <port> [map_width map_height n_mine]
+ *       The map size is the default settings for players that don't ask for one.
+ */
+#define _GNU_SOURCE ///< For accept4
+#include "server.h"
+#include "SDL.h"
+#include "fatal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define LISTEN_BACKLOG 1024
+#define RECV_BUF_SIZE 4096
+#define STATS_INTERVAL 10000 ///< In milliseconds.
+
+ServerStats server_stats;
+
+static int epoll_fd;
+static Conn *closed_conns; ///< Linked by "next", freed after the events of a loop are handled.
+static Conn listen_conn; ///< Only its fd is used, to tell the listen socket in events.
+
+//-------------------------------------------------------------------
+// Connection I/O
+//-------------------------------------------------------------------
+
+static void conn_update_events(Conn *conn)
+{
+    SDL_bool want_out = conn->out_len > 0 || conn->shared_num > 0;
+    if (want_out == conn->want_out)
+        return;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | (want_out ? EPOLLOUT : 0);
+    ev.data.ptr = conn;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) < 0)
+        Error("epoll_ctl mod failed: %s\n", strerror(errno));
+    conn->want_out = want_out;
+}
+
+/**
+ * @brief Append a packet to the pending output.
+ *
+ * @return Return SDL_FALSE if the connection is dropped for being too slow.
+ */
+static SDL_bool conn_append(Conn *conn, const MyMinesPacket *p_packet)
+{
+    if (conn->out_len + sizeof(MyMinesPacket) > CONN_OUT_BUF_MAX)
+    {
+        SDL_Log("Drop slow connection %d\n", conn->fd);
+        server_stats.slow_drops++;
+        conn_close(conn);
+        return SDL_FALSE;
+    }
+    if (conn->out_len + sizeof(MyMinesPacket) > conn->out_cap)
+    {
+        Uint32 new_cap = conn->out_cap ? conn->out_cap * 2 : sizeof(MyMinesPacket) * 8;
+        Uint8 *new_buf = realloc(conn->out_buf, new_cap);
+        if (new_buf == NULL)
+            Error("conn_append: %s\n", MALLOC_FAIL_MSG);
+        conn->out_buf = new_buf;
+        conn->out_cap = new_cap;
+    }
+    memcpy(conn->out_buf + conn->out_len, p_packet, sizeof(MyMinesPacket));
+    conn->out_len += sizeof(MyMinesPacket);
+    if (conn->out_len > server_stats.max_out_len)
+        server_stats.max_out_len = conn->out_len;
+    return SDL_TRUE;
+}
+
+/**
+ * @brief Take "*p_len" sent bytes off the shared buffers, from the head.
+ */
+static void conn_consume_shared(Conn *conn, Uint32 *p_len)
+{
+    while (*p_len > 0 && conn->shared_num > 0)
+    {
+        SharedBuf *buf = conn->shared[conn->shared_head];
+        Uint32 n = SDL_min(*p_len, buf->len - conn->shared_offset);
+        conn->shared_offset += n;
+        *p_len -= n;
+        if (conn->shared_offset < buf->len)
+            break;
+        shared_buf_unref(buf);
+        conn->shared_head = (conn->shared_head + 1) % SPECTATOR_QUEUE_MAX;
+        conn->shared_num--;
+        conn->shared_offset = 0;
+    }
+}
+
+/**
+ * @brief Write as much pending output as the kernel accepts, in one "writev" per round: the rest of a shared
+ * buffer begun, "out_buf", then the shared buffers queued.
+ *
+ * @return Return SDL_FALSE if the connection is closed.
+ */
+static SDL_bool conn_write(Conn *conn)
+{
+    while (conn->out_len > 0 || conn->shared_num > 0)
+    {
+        struct iovec iov[CONN_MAX_IOV];
+        int n_iov = 0;
+        Uint32 total = 0, first = 0;
+        if (conn->shared_offset > 0) ///< Its packets go before the packets in "out_buf".
+        {
+            SharedBuf *buf = conn->shared[conn->shared_head];
+            iov[n_iov].iov_base = buf->data + conn->shared_offset;
+            iov[n_iov++].iov_len = buf->len - conn->shared_offset;
+            first = 1;
+        }
+        if (conn->out_len > 0)
+        {
+            iov[n_iov].iov_base = conn->out_buf;
+            iov[n_iov++].iov_len = conn->out_len;
+        }
+        for (Uint32 i = first; i < conn->shared_num && n_iov < CONN_MAX_IOV; i++)
+        {
+            SharedBuf *buf = conn->shared[(conn->shared_head + i) % SPECTATOR_QUEUE_MAX];
+            iov[n_iov].iov_base = buf->data;
+            iov[n_iov++].iov_len = buf->len;
+        }
+        for (int i = 0; i < n_iov; i++)
+            total += iov[i].iov_len;
+
+        struct msghdr msg;
+        SDL_zero(msg);
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n_iov;
+        ssize_t n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL); ///< "writev" without SIGPIPE.
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                conn_close(conn);
+                return SDL_FALSE;
+            }
+            return SDL_TRUE;
+        }
+
+        Uint32 left = n;
+        if (first)
+        {
+            Uint32 head_len = SDL_min(left, (Uint32)iov[0].iov_len); ///< Only the head, "out_buf" is next.
+            left -= head_len;
+            conn_consume_shared(conn, &head_len);
+        }
+        if (conn->shared_offset == 0)
+        {
+            Uint32 sent = SDL_min(left, conn->out_len);
+            memmove(conn->out_buf, conn->out_buf + sent, conn->out_len - sent);
+            conn->out_len -= sent;
+            left -= sent;
+        }
+        if (conn->out_len == 0)
+            conn_consume_shared(conn, &left);
+        if ((Uint32)n < total)
+            return SDL_TRUE; ///< The kernel buffer is full.
+    }
+    return SDL_TRUE;
+}
+
+/**
+ * @brief Write as much pending output as the kernel accepts, then the waiting mouse moves if it has drained.
+ */
+static void conn_flush(Conn *conn)
+{
+    SDL_bool appended;
+    do
+    {
+        if (!conn_write(conn))
+            return;
+
+        appended = SDL_FALSE;
+        if (conn->pending_mask && conn->out_len < CONN_CONGESTED && conn->state != CONN_CLOSING)
+        {
+            for (int i = 0; i < COOP_MAX_PLAYERS; i++)
+                if (conn->pending_mask & (1u << i))
+                    conn_append(conn, &conn->pending_cursors[i]); ///< Can't overflow below "CONN_CONGESTED".
+            conn->pending_mask = 0;
+            appended = SDL_TRUE;
+        }
+    } while (appended);
+
+    if (conn->state == CONN_CLOSING && conn->out_len == 0 && conn->shared_num == 0)
+        conn_close(conn);
+    else
+        conn_update_events(conn);
+}
+
+/**
+ * @brief Queue a packet to the connection and try to send it.
+ *
+ * @note "out_buf" is sent before the shared buffers, so while a spectator has some queued, the packet goes
+ * through a shared buffer of its own to stay after them.
+ */
+void conn_send(Conn *conn, const MyMinesPacket *p_packet)
+{
+    if (conn->fd < 0 || conn->state == CONN_CLOSING)
+        return;
+    if (p_packet->type == TYPE_CURSOR_LEAVE && p_packet->player_packet.player < COOP_MAX_PLAYERS)
+        conn->pending_mask &= ~(1u << p_packet->player_packet.player); ///< Don't show it again after it leaves.
+    if (conn->shared_num > 0)
+    {
+        SharedBuf *buf = shared_buf_append(NULL, p_packet);
+        conn_send_shared(conn, buf);
+        shared_buf_unref(buf);
+        return;
+    }
+    if (conn_append(conn, p_packet))
+        conn_flush(conn);
+}
+
+/**
+ * @brief Queue a mouse move, or keep it in the slot of its player while the connection is congested.
+ * A newer move of the same player supersedes the one in the slot.
+ */
+void conn_send_cursor(Conn *conn, const MyMinesPacket *p_packet)
+{
+    if (conn->fd < 0 || conn->state == CONN_CLOSING)
+        return;
+    Uint8 player = p_packet->mouse_move_packet.player < COOP_MAX_PLAYERS ? p_packet->mouse_move_packet.player : 0;
+    Uint32 bit = 1u << player;
+    if (conn->out_len < CONN_CONGESTED && !(conn->pending_mask & bit))
+    {
+        conn_send(conn, p_packet);
+        return;
+    }
+    if (conn->pending_mask & bit)
+        server_stats.moves_superseded++;
+    conn->pending_cursors[player] = *p_packet;
+    conn->pending_mask |= bit;
+}
+
+/**
+ * @brief Append a packet to a shared buffer that is not shared yet, it grows as needed.
+ *
+ * @param buf NULL for a new buffer.
+ * @return Return the buffer, it may have moved.
+ */
+SharedBuf *shared_buf_append(SharedBuf *buf, const MyMinesPacket *p_packet)
+{
+    if (buf == NULL || buf->len + sizeof(MyMinesPacket) > buf->cap)
+    {
+        Uint32 new_cap = buf != NULL ? buf->cap * 2 : SHARED_BUF_SIZE;
+        SharedBuf *new_buf = realloc(buf, sizeof(SharedBuf) + new_cap);
+        if (new_buf == NULL)
+            Error("shared_buf_append: %s\n", MALLOC_FAIL_MSG);
+        if (buf == NULL)
+        {
+            new_buf->refcount = 1;
+            new_buf->len = 0;
+        }
+        new_buf->cap = new_cap;
+        buf = new_buf;
+    }
+    memcpy(buf->data + buf->len, p_packet, sizeof(MyMinesPacket));
+    buf->len += sizeof(MyMinesPacket);
+    return buf;
+}
+
+void shared_buf_unref(SharedBuf *buf)
+{
+    if (buf != NULL && --buf->refcount == 0)
+        free(buf);
+}
+
+/**
+ * @brief Queue a reference to a shared buffer to a spectator and try to send it, the bytes are not copied.
+ */
+void conn_send_shared(Conn *conn, SharedBuf *buf)
+{
+    if (conn->fd < 0 || conn->state == CONN_CLOSING)
+        return;
+    if (conn->shared_num == SPECTATOR_QUEUE_MAX)
+    {
+        SDL_Log("Drop slow spectator %d\n", conn->fd);
+        server_stats.slow_drops++;
+        conn_close(conn);
+        return;
+    }
+    if (conn->shared == NULL)
+        conn->shared = malloc_fatal(SPECTATOR_QUEUE_MAX * sizeof(SharedBuf *), "conn_send_shared - conn->shared");
+    buf->refcount++;
+    conn->shared[(conn->shared_head + conn->shared_num) % SPECTATOR_QUEUE_MAX] = buf;
+    conn->shared_num++;
+    server_stats.shared_sends++;
+    server_stats.shared_bytes += buf->len;
+    conn_flush(conn);
+}
+
+/**
+ * @brief Close the connection now, it is freed at the end of the loop.
+ */
+void conn_close(Conn *conn)
+{
+    if (conn->fd < 0)
+        return;
+    lobby_remove(conn);
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    conn->fd = -1;
+    room_leave(conn);
+    conn->next = closed_conns;
+    closed_conns = conn;
+    server_stats.closed++;
+}
+
+/**
+ * @brief Close the connection when all pending output is sent, input is ignored meanwhile.
+ */
+void conn_close_after_flush(Conn *conn)
+{
+    if (conn->fd < 0)
+        return;
+    lobby_remove(conn);
+    conn->state = CONN_CLOSING;
+    if (conn->out_len == 0 && conn->shared_num == 0)
+        conn_close(conn);
+}
+
+/**
+ * @brief Read everything available, handle each complete packet.
+ */
+static void conn_read(Conn *conn)
+{
+    Uint8 buf[RECV_BUF_SIZE];
+    for (;;)
+    {
+        ssize_t n = recv(conn->fd, buf, sizeof(buf), 0);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        {
+            conn_close(conn);
+            return;
+        }
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+
+        for (ssize_t used = 0; used < n && conn->fd >= 0 && conn->state != CONN_CLOSING;)
+        {
+            Uint32 len = sizeof(MyMinesPacket) - conn->in_len;
+            if (len > n - used)
+                len = n - used;
+            memcpy(conn->in_buf + conn->in_len, buf + used, len);
+            conn->in_len += len;
+            used += len;
+            if (conn->in_len == sizeof(MyMinesPacket))
+            {
+                MyMinesPacket packet;
+                memcpy(&packet, conn->in_buf, sizeof(MyMinesPacket));
+                conn->in_len = 0;
+                room_handle_packet(conn, &packet);
+            }
+        }
+        if (conn->fd < 0 || conn->state == CONN_CLOSING)
+            return;
+    }
+}
+
+//-------------------------------------------------------------------
+// Listen and accept
+//-------------------------------------------------------------------
+
+static int open_listen_socket(Uint16 port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        Error("Can't create listen socket: %s\n", strerror(errno));
+
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        Error("Can't bind port %hu: %s\n", port, strerror(errno));
+    if (listen(fd, LISTEN_BACKLOG) < 0)
+        Error("Can't listen: %s\n", strerror(errno));
+    return fd;
+}
+
+static void accept_conns(int listen_fd)
+{
+    for (;;)
+    {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                SDL_Log("Accept failed: %s\n", strerror(errno));
+            return;
+        }
+
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)); ///< Packets are small and latency sensitive.
+
+        Conn *conn = calloc_fatal(1, sizeof(Conn), "accept_conns - conn");
+        conn->fd = fd;
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+            Error("epoll_ctl add failed: %s\n", strerror(errno));
+        lobby_add_new(conn);
+        server_stats.accepted++;
+    }
+}
+
+static void free_closed_conns(void)
+{
+    while (closed_conns != NULL)
+    {
+        Conn *conn = closed_conns;
+        closed_conns = conn->next;
+        for (; conn->shared_num > 0; conn->shared_num--, conn->shared_head = (conn->shared_head + 1) % SPECTATOR_QUEUE_MAX)
+            shared_buf_unref(conn->shared[conn->shared_head]);
+        free(conn->shared);
+        free(conn->out_buf);
+        free(conn);
+    }
+}
+
+//-------------------------------------------------------------------
+// Main loop
+//-------------------------------------------------------------------
+
+int main(int argc, char *argv[])
+{
+    Settings default_settings;
+    if (argc != 2 && argc != 5)
+        Error("Usage: %s <port> [map_width map_height n_mine]\n", argv[0]);
+    if (argc == 5)
+        fill_match_settings(&default_settings, atoi(argv[2]), atoi(argv[3]), atoi(argv[4]));
+    else
+        fill_match_settings(&default_settings, 9, 9, 10);
+    if (!is_valid_match_settings(&default_settings))
+        Error("Invalid default settings!\n");
+    lobby_set_default_settings(&default_settings);
+
+    signal(SIGPIPE, SIG_IGN);
+    int listen_fd = open_listen_socket(atoi(argv[1]));
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        Error("Can't create epoll: %s\n", strerror(errno));
+    listen_conn.fd = listen_fd;
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &listen_conn;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0)
+        Error("epoll_ctl add failed: %s\n", strerror(errno));
+    SDL_Log("mymines-server listening on port %s\n", argv[1]);
+
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    Uint32 stats_ticks = SDL_GetTicks();
+    for (;;)
+    {
+        int n = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, SERVER_TICK);
+        if (n < 0 && errno != EINTR)
+            Error("epoll_wait failed: %s\n", strerror(errno));
+
+        for (int i = 0; i < n; i++)
+        {
+            Conn *conn = events[i].data.ptr;
+            if (conn == &listen_conn)
+            {
+                accept_conns(listen_fd);
+                continue;
+            }
+            if (conn->fd < 0) ///< Closed by an earlier event of this loop.
+                continue;
+            if (events[i].events & EPOLLOUT)
+                conn_flush(conn);
+            if (conn->fd >= 0 && (events[i].events & EPOLLIN))
+                conn_read(conn);
+            if (conn->fd >= 0 && (events[i].events & (EPOLLERR | EPOLLHUP)))
+                conn_close(conn);
+        }
+
+        Uint32 now = SDL_GetTicks();
+        lobby_check_timeouts(now);
+        flush_broadcasts();
+        free_closed_conns();
+        free_closed_rooms();
+
+        if (SDL_TICKS_PASSED(now, stats_ticks + STATS_INTERVAL))
+        {
+            SDL_Log("connections: %llu open, rooms: %llu open, packets relayed: %llu, cursors relayed: %llu, culled: %llu\n",
+                    (unsigned long long)(server_stats.accepted - server_stats.closed),
+                    (unsigned long long)(server_stats.rooms_opened - server_stats.rooms_closed),
+                    (unsigned long long)server_stats.packets_relayed,
+                    (unsigned long long)server_stats.cursors_relayed, (unsigned long long)server_stats.cursors_culled);
+            SDL_Log("max output backlog: %u bytes, mouse moves superseded: %llu, slow connections dropped: %llu\n",
+                    server_stats.max_out_len, (unsigned long long)server_stats.moves_superseded,
+                    (unsigned long long)server_stats.slow_drops);
+            if (server_stats.broadcasts > 0)
+                SDL_Log("spectators: %llu, broadcast buffers: %llu, queued %llu times (%llu bytes not copied)\n",
+                        (unsigned long long)server_stats.spectators, (unsigned long long)server_stats.broadcasts,
+                        (unsigned long long)server_stats.shared_sends, (unsigned long long)server_stats.shared_bytes);
+            stats_ticks = now;
+        }
+    }
+    return 0;
+}
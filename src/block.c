@@ -25,13 +25,14 @@ const char *block_image_paths[BLOCK_TEXTURE_NUM] = {
     "res/hidden.gif",
 };
 SDL_Texture *block_textures[BLOCK_TEXTURE_NUM];
-static unsigned int block_size;
+static unsigned int block_size;         ///< In pixels.
+static unsigned int logical_block_size; ///< In "Settings", shared with the remote side.
 extern Drawer drawer;
 
 /**
  * @brief Set the block size.
  * 
- * @param bs The block size.
+ * @param bs The block size in pixels.
  * 
  * @note The functions must be called before any other functions in the block module.
 */
@@ -40,6 +41,27 @@ void set_block_size(unsigned int bs)
     block_size = bs;
 }
 
+/**
+ * @brief Set the block size that logical positions are measured with.
+ * 
+ * @param lbs The block size in settings.
+ * 
+ * @note Logical positions don't change when the window is resized,
+ * so they are used to exchange positions with the remote side.
+*/
+void set_logical_block_size(unsigned int lbs)
+{
+    logical_block_size = lbs;
+}
+
+/**
+ * @brief Convert a logical length to pixels.
+ */
+unsigned int logical2pixel(unsigned int len)
+{
+    return len * block_size / logical_block_size;
+}
+
 /**
  * @brief Draw block according to the position.
  * 
@@ -69,3 +91,27 @@ void window2map(unsigned int *p_y, unsigned int *p_x)
     *p_y = *p_y / block_size;
     *p_x = *p_x / block_size;
 }
+
+/**
+ * @brief Convert window pos to logical pos.
+ * 
+ * @param p_y The pointer to window pos on y axis.
+ * @param p_x The pointer to window pos on x axis.
+ */
+void window2logical(unsigned int *p_y, unsigned int *p_x)
+{
+    *p_y = *p_y * logical_block_size / block_size;
+    *p_x = *p_x * logical_block_size / block_size;
+}
+
+/**
+ * @brief Convert logical pos to window pos.
+ * 
+ * @param p_y The pointer to logical pos on y axis.
+ * @param p_x The pointer to logical pos on x axis.
+ */
+void logical2window(unsigned int *p_y, unsigned int *p_x)
+{
+    *p_y = logical2pixel(*p_y);
+    *p_x = logical2pixel(*p_x);
+}
@@ -0,0 +1,375 @@
+/**
+ * @file codec.c
+ * @author jkilopu
+ * @brief Provides the varint helpers and the encoder and decoder of protocol version 3.
+ */
+#include "codec.h"
+#include "SDL_stdinc.h"
+
+//-------------------------------------------------------------------
+// Varint
+//-------------------------------------------------------------------
+
+/**
+ * @brief Write a varint, return the bytes written (at most "VARINT_MAX").
+ */
+int put_varint(Uint8 *buf, Uint64 value)
+{
+    int n = 0;
+    while (value >= 0x80)
+    {
+        buf[n++] = (Uint8)(value | 0x80);
+        value >>= 7;
+    }
+    buf[n++] = (Uint8)value;
+    return n;
+}
+
+/**
+ * @brief Read a varint from at most "len" bytes.
+ *
+ * @return Return the bytes read, or 0 if it is truncated or longer than "VARINT_MAX".
+ */
+int get_varint(const Uint8 *buf, int len, Uint64 *p_value)
+{
+    Uint64 value = 0;
+    for (int n = 0; n < len && n < VARINT_MAX; n++)
+    {
+        value |= (Uint64)(buf[n] & 0x7F) << (7 * n);
+        if (!(buf[n] & 0x80))
+        {
+            *p_value = value;
+            return n + 1;
+        }
+    }
+    return 0;
+}
+
+int varint_size(Uint64 value)
+{
+    int n = 1;
+    while (value >= 0x80)
+    {
+        value >>= 7;
+        n++;
+    }
+    return n;
+}
+
+static Uint64 zigzag(Sint64 value)
+{
+    return ((Uint64)value << 1) ^ (Uint64)(value >> 63);
+}
+
+static Sint64 unzigzag(Uint64 value)
+{
+    return (Sint64)(value >> 1) ^ -(Sint64)(value & 1);
+}
+
+//-------------------------------------------------------------------
+// Encode
+//-------------------------------------------------------------------
+
+/**
+ * @brief Encode a packet in version 3.
+ *
+ * @param p_mymines_packet Points to the packet.
+ * @param buf Has at least "V3_PACKET_MAX" bytes.
+ * @param p_state The state of the sending direction.
+ *
+ * @return Return the length of the encoded packet.
+ */
+int encode_packet_v3(const MyMinesPacket *p_mymines_packet, Uint8 *buf, CodecState *p_state)
+{
+    int n = 1;
+    buf[0] = p_mymines_packet->type;
+    switch (p_mymines_packet->type)
+    {
+    case TYPE_SEED_KEY:
+        buf[n++] = p_mymines_packet->seed_key_packet.key_size;
+        n += put_varint(buf + n, p_mymines_packet->seed_key_packet.key);
+        break;
+    case TYPE_SETTINGS:
+    {
+        const Settings *p_s = &p_mymines_packet->settings_packet.settings;
+        n += put_varint(buf + n, p_s->map_width);
+        n += put_varint(buf + n, p_s->map_height);
+        n += put_varint(buf + n, p_s->n_mine);
+        n += put_varint(buf + n, p_s->window_height);
+        n += put_varint(buf + n, p_s->window_width);
+        n += put_varint(buf + n, p_s->block_size);
+        buf[n++] = p_s->game_mode;
+        break;
+    }
+    case TYPE_CLICK_MAP:
+        buf[0] |= p_mymines_packet->click_map_packet.click_type << 4;
+        n += put_varint(buf + n, p_mymines_packet->click_map_packet.pos_y);
+        n += put_varint(buf + n, p_mymines_packet->click_map_packet.pos_x);
+        n += put_varint(buf + n, p_mymines_packet->click_map_packet.seq);
+        n += put_varint(buf + n, p_mymines_packet->click_map_packet.acked);
+        n += put_varint(buf + n, p_mymines_packet->click_map_packet.input_time);
+        for (int i = 0; i < 8; i++)
+            buf[n++] = (Uint8)(p_mymines_packet->click_map_packet.hash >> (8 * i));
+        break;
+    case TYPE_MOUSE_MOVE:
+    {
+        const MouseMovePacket *p_move = &p_mymines_packet->mouse_move_packet;
+        buf[0] |= (p_move->player & 0x0F) << 4;
+        n += put_varint(buf + n, zigzag((Sint64)p_move->pos_y - p_state->cursor_y));
+        n += put_varint(buf + n, zigzag((Sint64)p_move->pos_x - p_state->cursor_x));
+        n += put_varint(buf + n, (Uint32)(p_move->input_time - p_state->cursor_time));
+        p_state->cursor_y = p_move->pos_y;
+        p_state->cursor_x = p_move->pos_x;
+        p_state->cursor_time = p_move->input_time;
+        break;
+    }
+    case TYPE_REVEAL:
+        buf[n++] = p_mymines_packet->reveal_packet.data_len;
+        SDL_memcpy(buf + n, p_mymines_packet->reveal_packet.data, p_mymines_packet->reveal_packet.data_len);
+        n += p_mymines_packet->reveal_packet.data_len;
+        break;
+    case TYPE_VERSION:
+        buf[n++] = p_mymines_packet->version_packet.version;
+        break;
+    case TYPE_SNAPSHOT:
+        buf[n++] = p_mymines_packet->snapshot_packet.data_len;
+        n += put_varint(buf + n, p_mymines_packet->snapshot_packet.offset);
+        SDL_memcpy(buf + n, p_mymines_packet->snapshot_packet.data, p_mymines_packet->snapshot_packet.data_len);
+        n += p_mymines_packet->snapshot_packet.data_len;
+        break;
+    case TYPE_PING:
+    case TYPE_PONG:
+        n += put_varint(buf + n, p_mymines_packet->ping_packet.seq);
+        n += put_varint(buf + n, p_mymines_packet->ping_packet.ping_time);
+        if (p_mymines_packet->type == TYPE_PING)
+            break;
+        n += put_varint(buf + n, p_mymines_packet->ping_packet.recv_time);
+        n += put_varint(buf + n, p_mymines_packet->ping_packet.hold_time);
+        break;
+    case TYPE_VIEWPORT:
+        n += put_varint(buf + n, p_mymines_packet->viewport_packet.top);
+        n += put_varint(buf + n, p_mymines_packet->viewport_packet.left);
+        n += put_varint(buf + n, p_mymines_packet->viewport_packet.bottom);
+        n += put_varint(buf + n, p_mymines_packet->viewport_packet.right);
+        break;
+    case TYPE_COOP_JOIN:
+        buf[n++] = p_mymines_packet->player_packet.player;
+        buf[n++] = p_mymines_packet->player_packet.in_progress;
+        break;
+    case TYPE_CURSOR_LEAVE:
+        buf[n++] = p_mymines_packet->player_packet.player;
+        break;
+    case TYPE_TRANSPORT:
+        buf[0] |= (p_mymines_packet->transport_packet.step & 0x0F) << 4;
+        n += put_varint(buf + n, p_mymines_packet->transport_packet.pid);
+        n += put_varint(buf + n, p_mymines_packet->transport_packet.id);
+        n += put_varint(buf + n, p_mymines_packet->transport_packet.port);
+        break;
+    default: ///< TYPE_QUIT, TYPE_GAME_OVER and TYPE_RESYNC have no field.
+        break;
+    }
+    return n;
+}
+
+//-------------------------------------------------------------------
+// Decode
+//-------------------------------------------------------------------
+
+/**
+ * @brief Read varints into "values", used by "decode_packet_v3".
+ *
+ * @return Return the bytes read, or 0 if they are not complete.
+ */
+static int get_varints(const Uint8 *buf, int len, Uint64 *values, int num)
+{
+    int n = 0;
+    for (int i = 0; i < num; i++)
+    {
+        int size = get_varint(buf + n, len - n, &values[i]);
+        if (size == 0)
+            return 0;
+        n += size;
+    }
+    return n;
+}
+
+/**
+ * @brief Decode a packet in version 3.
+ *
+ * @param buf The received bytes.
+ * @param len The number of received bytes.
+ * @param p_mymines_packet Points to the packet will be filled in.
+ * @param p_state The state of the receiving direction.
+ *
+ * @return Return the length of the packet, 0 if it is not complete, or -1 if it is malformed.
+ *
+ * @note A packet is never longer than "V3_PACKET_MAX", so 0 with that many bytes also means malformed.
+ */
+int decode_packet_v3(const Uint8 *buf, int len, MyMinesPacket *p_mymines_packet, CodecState *p_state)
+{
+    Uint64 values[6];
+    int n = 1, size;
+
+    if (len < 1)
+        return 0;
+    SDL_zerop(p_mymines_packet);
+    p_mymines_packet->type = buf[0] & 0x0F;
+    switch (p_mymines_packet->type)
+    {
+    case TYPE_SEED_KEY:
+        if (len < 2 || (size = get_varint(buf + 2, len - 2, &values[0])) == 0)
+            return 0;
+        p_mymines_packet->seed_key_packet.key_size = buf[1];
+        p_mymines_packet->seed_key_packet.key = values[0];
+        n = 2 + size;
+        break;
+    case TYPE_SETTINGS:
+    {
+        Settings *p_s = &p_mymines_packet->settings_packet.settings;
+        if ((size = get_varints(buf + 1, len - 1, values, 6)) == 0 || len < 1 + size + 1)
+            return 0;
+        for (int i = 0; i < 6; i++)
+            if (values[i] > SDL_MAX_UINT32)
+                return -1;
+        p_s->map_width = values[0];
+        p_s->map_height = values[1];
+        p_s->n_mine = values[2];
+        p_s->window_height = values[3];
+        p_s->window_width = values[4];
+        p_s->block_size = values[5];
+        p_s->game_mode = buf[1 + size];
+        n = 1 + size + 1;
+        break;
+    }
+    case TYPE_CLICK_MAP:
+    {
+        ClickMapPacket *p_click = &p_mymines_packet->click_map_packet;
+        if ((size = get_varints(buf + 1, len - 1, values, 5)) == 0 || len < 1 + size + 8)
+            return 0;
+        for (int i = 0; i < 5; i++)
+            if (values[i] > SDL_MAX_UINT32)
+                return -1;
+        p_click->click_type = buf[0] >> 4;
+        p_click->pos_y = values[0];
+        p_click->pos_x = values[1];
+        p_click->seq = values[2];
+        p_click->acked = values[3];
+        p_click->input_time = values[4];
+        for (int i = 0; i < 8; i++)
+            p_click->hash |= (Uint64)buf[1 + size + i] << (8 * i);
+        p_click->has_hash = 1;
+        n = 1 + size + 8;
+        break;
+    }
+    case TYPE_MOUSE_MOVE:
+        if ((size = get_varints(buf + 1, len - 1, values, 3)) == 0)
+            return 0;
+        if (values[2] > SDL_MAX_UINT32)
+            return -1;
+        p_state->cursor_y += (unsigned int)unzigzag(values[0]);
+        p_state->cursor_x += (unsigned int)unzigzag(values[1]);
+        p_state->cursor_time += (Uint32)values[2];
+        p_mymines_packet->mouse_move_packet.player = buf[0] >> 4;
+        p_mymines_packet->mouse_move_packet.pos_y = p_state->cursor_y;
+        p_mymines_packet->mouse_move_packet.pos_x = p_state->cursor_x;
+        p_mymines_packet->mouse_move_packet.input_time = p_state->cursor_time;
+        n = 1 + size;
+        break;
+    case TYPE_REVEAL:
+        if (len < 2)
+            return 0;
+        if (buf[1] > REVEAL_DATA_MAX)
+            return -1;
+        if (len < 2 + buf[1])
+            return 0;
+        p_mymines_packet->reveal_packet.data_len = buf[1];
+        SDL_memcpy(p_mymines_packet->reveal_packet.data, buf + 2, buf[1]);
+        n = 2 + buf[1];
+        break;
+    case TYPE_VERSION:
+        if (len < 2)
+            return 0;
+        p_mymines_packet->version_packet.version = buf[1];
+        n = 2;
+        break;
+    case TYPE_SNAPSHOT:
+        if (len < 2)
+            return 0;
+        if (buf[1] > SNAPSHOT_DATA_MAX)
+            return -1;
+        if ((size = get_varints(buf + 2, len - 2, values, 1)) == 0 || len < 2 + size + buf[1])
+            return 0;
+        if (values[0] > SDL_MAX_UINT32)
+            return -1;
+        p_mymines_packet->snapshot_packet.data_len = buf[1];
+        p_mymines_packet->snapshot_packet.offset = values[0];
+        SDL_memcpy(p_mymines_packet->snapshot_packet.data, buf + 2 + size, buf[1]);
+        n = 2 + size + buf[1];
+        break;
+    case TYPE_PING:
+    case TYPE_PONG:
+    {
+        PingPacket *p_ping = &p_mymines_packet->ping_packet;
+        int num = p_ping->type == TYPE_PING ? 2 : 4;
+        if ((size = get_varints(buf + 1, len - 1, values, num)) == 0)
+            return 0;
+        if (values[0] > SDL_MAX_UINT32 || (num == 4 && values[3] > SDL_MAX_UINT32))
+            return -1;
+        p_ping->seq = values[0];
+        p_ping->ping_time = values[1];
+        if (num == 4)
+        {
+            p_ping->recv_time = values[2];
+            p_ping->hold_time = values[3];
+        }
+        n = 1 + size;
+        break;
+    }
+    case TYPE_VIEWPORT:
+    {
+        ViewportPacket *p_view = &p_mymines_packet->viewport_packet;
+        if ((size = get_varints(buf + 1, len - 1, values, 4)) == 0)
+            return 0;
+        for (int i = 0; i < 4; i++)
+            if (values[i] > SDL_MAX_UINT32)
+                return -1;
+        p_view->top = values[0];
+        p_view->left = values[1];
+        p_view->bottom = values[2];
+        p_view->right = values[3];
+        n = 1 + size;
+        break;
+    }
+    case TYPE_COOP_JOIN:
+        if (len < 3)
+            return 0;
+        p_mymines_packet->player_packet.player = buf[1];
+        p_mymines_packet->player_packet.in_progress = buf[2];
+        n = 3;
+        break;
+    case TYPE_CURSOR_LEAVE:
+        if (len < 2)
+            return 0;
+        p_mymines_packet->player_packet.player = buf[1];
+        n = 2;
+        break;
+    case TYPE_TRANSPORT:
+        if ((size = get_varints(buf + 1, len - 1, values, 3)) == 0)
+            return 0;
+        if (values[0] > SDL_MAX_UINT32 || values[1] > SDL_MAX_UINT32 || values[2] > SDL_MAX_UINT16)
+            return -1;
+        p_mymines_packet->transport_packet.step = buf[0] >> 4;
+        p_mymines_packet->transport_packet.pid = values[0];
+        p_mymines_packet->transport_packet.id = values[1];
+        p_mymines_packet->transport_packet.port = values[2];
+        n = 1 + size;
+        break;
+    case TYPE_QUIT:
+    case TYPE_GAME_OVER:
+    case TYPE_RESYNC:
+        break;
+    default:
+        return -1;
+    }
+    return n;
+}
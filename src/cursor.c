@@ -1,19 +1,180 @@
 /**
  * @file cursor.c
  * @author jkilopu
- * @brief Provide fuctions to draw cursor.
+ * @brief Provide fuctions to throttle the local cursor, interpolate and draw the remote cursor.
  */
 #include "cursor.h"
 #include "SDL.h"
 #include "render.h"
+#include "block.h"
+#include "game.h"
 
 extern Drawer drawer;
 SDL_Texture *remote_cursor_texture;
 
+static Uint32 send_interval = 1000 / DEFAULT_CURSOR_RATE;
+static unsigned int local_y, local_x;
+static unsigned int sent_y, sent_x;
+static Uint32 sent_ticks;
+
+static RemoteCursor remote_cursors[COOP_MAX_PLAYERS]; ///< Only the first one outside a coop room.
+
+//-------------------------------------------------------------------
+// Local cursor
+//-------------------------------------------------------------------
+
+/**
+ * @brief Read the cursor rate from "CURSOR_RATE_ENV".
+ */
+void init_cursor_rate(void)
+{
+    const char *rate = SDL_getenv(CURSOR_RATE_ENV);
+    if (rate == NULL)
+        return;
+    int hz = SDL_atoi(rate);
+    if (hz > 0 && hz <= 1000)
+        send_interval = 1000 / hz;
+    else
+        SDL_Log("Invalid %s: %s, use %d Hz.\n", CURSOR_RATE_ENV, rate, DEFAULT_CURSOR_RATE);
+}
+
+/**
+ * @brief Record the local cursor, it is sent later by "is_local_cursor_due".
+ * 
+ * @param y The logical pos on y axis.
+ * @param x The logical pos on x axis.
+ */
+void local_cursor_moved(unsigned int y, unsigned int x)
+{
+    local_y = y;
+    local_x = x;
+}
+
+/**
+ * @brief See if the local cursor should be sent now.
+ * 
+ * @param p_y Points to the logical pos on y axis will be filled in.
+ * @param p_x Points to the logical pos on x axis will be filled in.
+ * 
+ * @return Return SDL_TRUE if it has moved since the last sent, and the last is a send interval ago.
+ */
+SDL_bool is_local_cursor_due(unsigned int *p_y, unsigned int *p_x)
+{
+    Uint32 now = SDL_GetTicks();
+    if ((local_y == sent_y && local_x == sent_x) || !SDL_TICKS_PASSED(now, sent_ticks + send_interval))
+        return SDL_FALSE;
+    *p_y = sent_y = local_y;
+    *p_x = sent_x = local_x;
+    sent_ticks = now;
+    return SDL_TRUE;
+}
+
+//-------------------------------------------------------------------
+// Remote cursor
+//-------------------------------------------------------------------
+
+/**
+ * @brief Add a received position of a remote cursor.
+ * 
+ * @param player The player, less than "COOP_MAX_PLAYERS".
+ * @param y The logical pos on y axis.
+ * @param x The logical pos on x axis.
+ * @param input_time Perf counter of the move on the remote side.
+ */
+void add_remote_cursor_sample(Uint8 player, unsigned int y, unsigned int x, Uint64 input_time)
+{
+    RemoteCursor *p_cursor = &remote_cursors[player];
+    Uint32 now = SDL_GetTicks();
+    if (p_cursor->sample_num == 0)
+        p_cursor->interval = 1000 / DEFAULT_CURSOR_RATE;
+    else
+    {
+        CursorSample *p_newest = &p_cursor->samples[p_cursor->newest];
+        Uint32 gap = now - p_newest->ticks;
+        if (gap == 0) ///< Received in the same batch, only the newest is useful.
+        {
+            p_newest->y = y;
+            p_newest->x = x;
+            p_newest->input_time = input_time;
+            return;
+        }
+        if (gap > CURSOR_IDLE_GAP)
+            p_newest->ticks = now - p_cursor->interval; ///< Start moving from it now, instead of crawling since it is received.
+        else
+            p_cursor->interval = (p_cursor->interval * 7 + gap) / 8;
+    }
+    p_cursor->newest = (p_cursor->newest + 1) % CURSOR_SAMPLE_NUM;
+    p_cursor->samples[p_cursor->newest].y = y;
+    p_cursor->samples[p_cursor->newest].x = x;
+    p_cursor->samples[p_cursor->newest].ticks = now;
+    p_cursor->samples[p_cursor->newest].input_time = input_time;
+    if (p_cursor->sample_num < CURSOR_SAMPLE_NUM)
+        p_cursor->sample_num++;
+}
+
+/**
+ * @brief Forget the samples of a remote cursor, it is not drawn until a new one comes.
+ */
+void hide_remote_cursor(Uint8 player)
+{
+    remote_cursors[player].sample_num = 0;
+}
+
+static unsigned int lerp_pos(unsigned int from, unsigned int to, Uint32 t, Uint32 duration)
+{
+    return (unsigned int)((Sint64)from + ((Sint64)to - (Sint64)from) * t / duration);
+}
+
+/**
+ * @brief Get where a remote cursor should be drawn now.
+ * 
+ * @param player The player, less than "COOP_MAX_PLAYERS".
+ * @param p_y Points to the logical pos on y axis will be filled in.
+ * @param p_x Points to the logical pos on x axis will be filled in.
+ * @param p_input_time Points to the input time of the newest sample the cursor has reached will be filled in,
+ *                     0 if it hasn't reached any.
+ * 
+ * @return Return SDL_FALSE if no sample is received yet, or it is hidden.
+ */
+SDL_bool get_remote_cursor(Uint8 player, unsigned int *p_y, unsigned int *p_x, Uint64 *p_input_time)
+{
+    const RemoteCursor *p_cursor = &remote_cursors[player];
+    if (p_cursor->sample_num == 0)
+        return SDL_FALSE;
+
+    Uint32 render_ticks = SDL_GetTicks() - p_cursor->interval;
+    const CursorSample *p_newer = &p_cursor->samples[p_cursor->newest];
+    for (unsigned int i = 1; i < p_cursor->sample_num && (Sint32)(render_ticks - p_newer->ticks) < 0; i++)
+    {
+        const CursorSample *p_older = &p_cursor->samples[(p_cursor->newest + CURSOR_SAMPLE_NUM - i) % CURSOR_SAMPLE_NUM];
+        if ((Sint32)(render_ticks - p_older->ticks) >= 0)
+        {
+            Uint32 t = render_ticks - p_older->ticks, duration = p_newer->ticks - p_older->ticks;
+            *p_y = lerp_pos(p_older->y, p_newer->y, t, duration);
+            *p_x = lerp_pos(p_older->x, p_newer->x, t, duration);
+            *p_input_time = p_older->input_time;
+            return SDL_TRUE;
+        }
+        p_newer = p_older;
+    }
+    /* After the newest sample, or before the oldest one. */
+    *p_y = p_newer->y;
+    *p_x = p_newer->x;
+    *p_input_time = (Sint32)(render_ticks - p_newer->ticks) >= 0 ? p_newer->input_time : 0;
+    return SDL_TRUE;
+}
+
+/**
+ * @brief Draw the remote cursor.
+ * 
+ * @param y The logical pos on y axis.
+ * @param x The logical pos on x axis.
+ */
 void draw_remote_cursor(unsigned int y, unsigned int x)
 {
-    if (y + CURSOR_HEIGHT > MAIN_WIN_SIZE || x + CURSOR_WIDTH > MAIN_WIN_SIZE)
+    logical2window(&y, &x);
+    SDL_Rect r = { x, y, logical2pixel(CURSOR_WIDTH), logical2pixel(CURSOR_HEIGHT) };
+    if (y + r.h > (unsigned int)drawer.viewport.h || x + r.w > (unsigned int)drawer.viewport.w)
         return;
-    SDL_Rect r = { x, y, CURSOR_WIDTH, CURSOR_HEIGHT };
     draw(remote_cursor_texture, NULL, &r);
 }
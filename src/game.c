@@ -14,7 +14,13 @@
 #include "render.h"
 #include "timer.h"
 #include "net.h"
+#include "reveal.h"
+#include "snapshot.h"
+#include "replay.h"
+#include "latency.h"
+#include "trace.h"
 #include "SDL_stdinc.h"
+#include "prng_alleged_rc4.h"
 #include "fatal.h"
 
 extern const int directions[8][2];
@@ -51,18 +57,55 @@ static Game create_empty_game(void)
  */
 Game setup(void)
 {
+    TRACE_INIT();
     init_sdl();
+    init_cursor_rate();
     load_media();
 
     Game game = create_empty_game();
 
     menu_main(game);
+    wait_media(MEDIA_ALL);
 
-    set_block_size(game->settings.block_size);
-    set_timer_pos(&game->timer, game->settings.window_width, game->settings.window_height);
+    drawer_set_window_size(game->settings.window_width, game->settings.window_height);
+    drawer_set_logical_size(0, 0);
+    set_logical_block_size(game->settings.block_size);
+    layout_game(game);
     return game;
 }
 
+/**
+ * @brief Fit the game into the output at its native pixel resolution.
+ * 
+ * @param game The game which is already set up.
+ * 
+ * @note Only sizes and positions change, the renderer and textures are kept.
+ * Call it again when the window is resized or moved to a display with another DPI.
+ */
+void layout_game(Game game)
+{
+    int output_w, output_h;
+    drawer_get_output_size(&output_w, &output_h);
+
+    Uint32 lbs = game->settings.block_size;
+    Uint32 bs_w = (Uint32)output_w * lbs / game->settings.window_width;
+    Uint32 bs_h = (Uint32)output_h * lbs / game->settings.window_height;
+    Uint32 bs = bs_w < bs_h ? bs_w : bs_h;
+    if (bs == 0)
+        bs = 1;
+    set_block_size(bs);
+
+    SDL_Rect viewport;
+    unsigned int time_region_width = logical2pixel(TIME_REGION_WIDTH);
+    viewport.w = game->settings.map_width * bs + time_region_width;
+    viewport.h = game->settings.map_height * bs;
+    viewport.x = (output_w - viewport.w) / 2;
+    viewport.y = (output_h - viewport.h) / 2;
+    drawer_set_viewport(&viewport);
+
+    set_timer_pos(&game->timer, viewport.w, viewport.h, time_region_width);
+}
+
 /**
  * @brief Create the map in game.
  * 
@@ -74,69 +117,453 @@ void create_map_in_game(Game game)
     game->opened_blocks = 0;
     game->is_first_click = SDL_TRUE;
     show_whole_map(game->map);
-    put_mines(game->map, game->settings.n_mine);    
+    if (is_authoritative_host(game->settings.game_mode))
+        game->reveal_log = create_reveal_log(game->settings.map_width, game->settings.map_height);
+    if (has_map_authority(game->settings.game_mode))
+    {
+        replay_begin(game);
+        put_mines(game->map, game->settings.n_mine);
+    }
 }
 
 /**
- * @brief Receive packet from remote and handle it normally according to its type.
+ * @brief Receive all packets that have arrived and handle them in order.
  * 
  * @param game The running game.
  * 
  * @return Return SDL_TRUE if the window need to update.
+ * 
+ * @note Mouse moves are only sampled here, the remote cursor is drawn by "update_remote_cursor".
+ * A packet is only measured by the latency HUD if it changes the window.
  */
 SDL_bool handle_recved_packet(Game game)
 {
-    static unsigned int last_move_y, last_move_x;
-    if (!is_connected_socket_ready())
-        return SDL_FALSE;
+    SDL_bool need_update = SDL_FALSE;
+
+    if (is_lan_mode(game->settings.game_mode))
+        rearm_net_event();
 
     MyMinesPacket mymines_packet;
-    recv_mymines_packet(&mymines_packet);
+    Uint64 recv_time;
+    while (is_lan_mode(game->settings.game_mode) && pop_recved_packet(&mymines_packet, &recv_time)) ///< Stop after TYPE_QUIT.
+    {
+        if (mymines_packet.type == TYPE_MOUSE_MOVE)
+        {
+            const MouseMovePacket *p_move = &mymines_packet.mouse_move_packet;
+            Uint8 player = is_coop_mode(game->settings.game_mode) ? p_move->player : 0; ///< Garbage from version 2 peers.
+            if (player < COOP_MAX_PLAYERS)
+                add_remote_cursor_sample(player, p_move->pos_y, p_move->pos_x,
+                        estimate_remote_input_time(recv_time, p_move->input_time));
+        }
+        else if (dispatch_packet(game, &mymines_packet))
+        {
+            Uint32 input_time = mymines_packet.type == TYPE_CLICK_MAP ? mymines_packet.click_map_packet.input_time : 0;
+            latency_mark_input_at(LATENCY_REMOTE_INPUT, estimate_remote_input_time(recv_time, input_time));
+            need_update = SDL_TRUE;
+        }
+    }
+    if (need_update)
+        update_remote_cursor(game, SDL_TRUE); ///< The blocks under it may be redrawn.
+    return need_update;
+}
+
+/**
+ * @brief Move the remote cursors to their interpolated positions, at most once per frame.
+ * 
+ * @param game The running game.
+ * @param force Redraw them now even if they don't move.
+ * 
+ * @return Return SDL_TRUE if the window need to update.
+ * 
+ * @note All cursors are erased before any is drawn, so an erased one doesn't cut another that overlaps it.
+ * A mouse move is measured by the latency HUD when the cursor first reaches its sample.
+ */
+SDL_bool update_remote_cursor(Game game, SDL_bool force)
+{
+    static unsigned int drawn_y[COOP_MAX_PLAYERS], drawn_x[COOP_MAX_PLAYERS];
+    static SDL_bool drawn[COOP_MAX_PLAYERS];
+    static Uint64 drawn_input_time[COOP_MAX_PLAYERS];
+    static Uint32 frame_ticks;
+    unsigned int y[COOP_MAX_PLAYERS], x[COOP_MAX_PLAYERS];
+    Uint64 input_time[COOP_MAX_PLAYERS];
+    SDL_bool visible[COOP_MAX_PLAYERS], changed = SDL_FALSE, any = SDL_FALSE;
+
+    Uint32 now = SDL_GetTicks();
+    if (!force && !SDL_TICKS_PASSED(now, frame_ticks + REMOTE_CURSOR_FRAME_INTERVAL))
+        return SDL_FALSE;
+    for (Uint8 i = 0; i < COOP_MAX_PLAYERS; i++)
+    {
+        visible[i] = get_remote_cursor(i, &y[i], &x[i], &input_time[i]);
+        if (visible[i] != drawn[i] || (visible[i] && (y[i] != drawn_y[i] || x[i] != drawn_x[i])))
+            changed = SDL_TRUE;
+        if (visible[i] || drawn[i])
+            any = SDL_TRUE;
+    }
+    if (!any || (!force && !changed))
+        return SDL_FALSE;
+
+    frame_ticks = now;
+    for (int i = 0; i < COOP_MAX_PLAYERS; i++)
+        if (drawn[i])
+            show_block_in_cursor(game->map, drawn_y[i], drawn_x[i]);
+    for (int i = 0; i < COOP_MAX_PLAYERS; i++)
+    {
+        if (visible[i])
+        {
+            draw_remote_cursor(y[i], x[i]);
+            if (input_time[i] != 0 && input_time[i] != drawn_input_time[i])
+                latency_mark_input_at(LATENCY_REMOTE_INPUT, input_time[i]);
+            drawn_input_time[i] = input_time[i];
+        }
+        drawn_y[i] = y[i];
+        drawn_x[i] = x[i];
+        drawn[i] = visible[i];
+    }
+    return SDL_TRUE;
+}
+
+/**
+ * @brief Handle a received packet according to its type.
+ * 
+ * @param game The running game.
+ * @param p_mymines_packet Points to the packet, TYPE_MOUSE_MOVE is handled by "handle_recved_packet".
+ * 
+ * @return Return SDL_TRUE if the window need to update.
+ */
+static SDL_bool dispatch_packet(Game game, const MyMinesPacket *p_mymines_packet)
+{
+    MyMinesPacket mymines_packet = *p_mymines_packet;
     switch (mymines_packet.type)
     {
     case TYPE_NONE:
         Error("TYPE_NONE should not be here!\n");
     case TYPE_CLICK_MAP:
     {
-        unsigned int y = mymines_packet.click_map_packet.pos_y;
-        unsigned int x = mymines_packet.click_map_packet.pos_x;
-        switch (mymines_packet.click_map_packet.click_type)
+        if (is_coop_mode(game->settings.game_mode) && game->awaiting_snapshot)
+        {
+            hold_click(game, &mymines_packet.click_map_packet);
+            return SDL_FALSE;
+        }
+        const ClickMapPacket *p_click_map_packet = &mymines_packet.click_map_packet;
+        unsigned int y = p_click_map_packet->pos_y;
+        unsigned int x = p_click_map_packet->pos_x;
+        SDL_bool over = SDL_FALSE;
+        switch (p_click_map_packet->click_type)
         {
             case LEFT_CLICK:
-                if (click_map(game, y, x) || success(game))
+                if (has_map_authority(game->settings.game_mode)) ///< Or wait for TYPE_REVEAL from the server.
                 {
-                    finish(game);
-                    restart(game);
+                    replay_click(game, LEFT_CLICK, y, x);
+                    over = click_map(game, y, x) || success(game);
                 }
                 break;
             case RIGHT_CLICK:
+                replay_click(game, RIGHT_CLICK, y, x);
                 set_draw_flag(game, y, x);
                 break;
             default:
                 break;
         }
-        return SDL_TRUE;
-    }
-    case TYPE_MOUSE_MOVE:
-    {
-        show_block_in_cursor(game->map, last_move_y, last_move_x);
-        last_move_y = mymines_packet.mouse_move_packet.pos_y;
-        last_move_x = mymines_packet.mouse_move_packet.pos_x;
-        draw_remote_cursor(last_move_y, last_move_x);
+        check_lockstep(game, p_click_map_packet); ///< Before the map is cleared by "restart".
+        if (is_coop_mode(game->settings.game_mode) && p_click_map_packet->player == game->coop_player
+                && game->click_input_time != 0 && (Sint32)(p_click_map_packet->seq - game->click_input_seq) >= 0)
+            mark_local_click_drawn(game); ///< Its own click sent back by "mymines-server".
+        if (p_click_map_packet->click_type == LEFT_CLICK && has_map_authority(game->settings.game_mode))
+            finish_left_click(game, over);
         return SDL_TRUE;
     }
     case TYPE_QUIT:
+    {
         /** TODO: Show that other side quits on the screen */
+        Uint8 game_mode = game->settings.game_mode;
         finish_sdl_net();
         set_local_mode(game->settings.game_mode);
+        unset_coop_mode(game->settings.game_mode);
+        unset_spectate_mode(game->settings.game_mode);
+        game->n_held_clicks = 0;
+        game->awaiting_snapshot = SDL_FALSE;
+        game->click_input_time = 0; ///< Its result won't come.
+        if (is_authoritative_mode(game->settings.game_mode) && !is_server_mode(game->settings.game_mode))
+        {
+            /* The mines have gone with the server, start a local game. */
+            unset_authoritative_mode(game->settings.game_mode);
+            if (!game->is_first_click)
+                unset_timer(&game->timer);
+            restart(game);
+        }
+        unset_authoritative_mode(game->settings.game_mode);
         SDL_Log("The other side has quit.\n");
+        if (is_server_mode(game_mode) && listen_for_rejoin())
+        {
+            game->rejoin_mode = game_mode;
+            game->awaiting_rejoin = SDL_TRUE;
+        }
+        return SDL_TRUE;
+    }
+    case TYPE_REVEAL:
+        if (has_map_authority(game->settings.game_mode))
+            Error("TYPE_REVEAL should only be sent to the client in authoritative mode!\n");
+        if (!decode_reveal_packet(&mymines_packet.reveal_packet, apply_revealed_block, game))
+            Error("Malformed TYPE_REVEAL packet!\n");
+        mark_local_click_drawn(game); ///< The blocks opened by the left click of the client.
         return SDL_TRUE;
+    case TYPE_GAME_OVER:
+        finish(game);
+        restart(game);
+        return SDL_TRUE;
+    case TYPE_RESYNC:
+        if (!is_server_mode(game->settings.game_mode) && !is_coop_mode(game->settings.game_mode))
+            Error("TYPE_RESYNC should only be sent to the server!\n");
+        send_game_snapshot(game); ///< In a coop room, "mymines-server" passes it to a player that joins.
+        return SDL_FALSE;
+    case TYPE_SNAPSHOT:
+    {
+        if (is_server_mode(game->settings.game_mode))
+            Error("TYPE_SNAPSHOT should only be sent to the client!\n");
+        const Uint8 *buf;
+        Uint32 len;
+        int complete = collect_snapshot_packet(&mymines_packet.snapshot_packet, &buf, &len);
+        if (complete < 0)
+            Error("Malformed TYPE_SNAPSHOT packet!\n");
+        if (complete == 0)
+            return SDL_FALSE;
+        restore_game_snapshot(game, buf, len);
+        if (is_coop_mode(game->settings.game_mode))
+            apply_held_clicks(game);
+        return SDL_TRUE;
+    }
+    case TYPE_CURSOR_LEAVE:
+        if (mymines_packet.player_packet.player < COOP_MAX_PLAYERS)
+            hide_remote_cursor(mymines_packet.player_packet.player);
+        return SDL_FALSE;
     default:
         break;
     }
     return SDL_FALSE;
 }
 
+/**
+ * @brief Put a block opened by the server into the map of the client, see "decode_reveal_packet".
+ * 
+ * @param p_game The running game.
+ * @param block The block number, y * map_width + x.
+ * @param value 0 ~ 8, MINE or EXPLODED_MINE.
+ */
+static void apply_revealed_block(void *p_game, Uint32 block, Uint8 value)
+{
+    Game game = p_game;
+    unsigned int y = block / game->settings.map_width, x = block % game->settings.map_width;
+    if (!in_map_range(y, x, game->map) || value > EXPLODED_MINE)
+        Error("Bad revealed block %u: %hhu!\n", block, value);
+
+    if (game->is_first_click)
+    {
+        game->is_first_click = SDL_FALSE;
+        set_timer(&game->timer);
+        draw_timer(&game->timer);
+    }
+    if (has_flag(y, x, game->map)) ///< Reached by the flood fill of the server, which unsets it.
+        unset_flag(y, x, game->map);
+    if (value <= 8)
+    {
+        if (!is_shown_num(y, x, game->map))
+        {
+            game->opened_blocks++;
+            set_num(y, x, game->map, value);
+            open_block(y, x, game->map);
+        }
+    }
+    else
+        set_num(y, x, game->map, value);
+    show_block_in_map_without_mine(game->map, y, x);
+}
+
+//-------------------------------------------------------------------
+// Lockstep
+//-------------------------------------------------------------------
+
+/**
+ * @brief Send a local click with the number of clicks sent and received and the map hash after the click.
+ */
+static void send_lockstep_click(Game game, Uint8 click_type, unsigned int y, unsigned int x)
+{
+    game->sent_clicks++;
+    send_click_map_packet(click_type, y, x, game->sent_clicks, game->recved_clicks, game->map->hash);
+}
+
+/**
+ * @brief Compare the map hash in a received click with the local one after the same click, O(1) per click.
+ * 
+ * @param game The running game.
+ * @param p_click_map_packet The click which is just applied.
+ * 
+ * @note The hashes are only comparable if the other side had received all local clicks when it sent this one.
+ * The host in authoritative mode doesn't check, the client hasn't applied its own clicks yet when it sends them.
+ */
+static void check_lockstep(Game game, const ClickMapPacket *p_click_map_packet)
+{
+    game->recved_clicks++;
+    if (!p_click_map_packet->has_hash || p_click_map_packet->acked != game->sent_clicks
+            || is_authoritative_host(game->settings.game_mode) || game->awaiting_snapshot)
+        return;
+    if (p_click_map_packet->hash == game->map->hash)
+        return;
+    SDL_Log("Desync at click %u of the other side: hash %016llx, local %016llx!\n", p_click_map_packet->seq,
+            (unsigned long long)p_click_map_packet->hash, (unsigned long long)game->map->hash);
+    resync_map(game);
+}
+
+/**
+ * @brief Make the client's map the same as the server's, the server holds the true one.
+ */
+static void resync_map(Game game)
+{
+    if (is_server_mode(game->settings.game_mode))
+    {
+        if (!SDL_TICKS_PASSED(SDL_GetTicks(), game->snapshot_ticks + RESYNC_INTERVAL)) ///< The last one is on its way.
+            return;
+        send_game_snapshot(game);
+    }
+    else
+    {
+        send_resync_packet();
+        game->awaiting_snapshot = SDL_TRUE;
+    }
+}
+
+//-------------------------------------------------------------------
+// Coop
+//-------------------------------------------------------------------
+
+/**
+ * @brief Keep a click "mymines-server" has ordered after the snapshot being waited for.
+ */
+static void hold_click(Game game, const ClickMapPacket *p_click_map_packet)
+{
+    if (game->n_held_clicks == game->held_clicks_cap)
+    {
+        game->held_clicks_cap = game->held_clicks_cap ? game->held_clicks_cap * 2 : 16;
+        ClickMapPacket *new_clicks = malloc_fatal(game->held_clicks_cap * sizeof(ClickMapPacket), "hold_click - new_clicks");
+        if (game->n_held_clicks > 0)
+            SDL_memcpy(new_clicks, game->held_clicks, game->n_held_clicks * sizeof(ClickMapPacket));
+        free(game->held_clicks);
+        game->held_clicks = new_clicks;
+    }
+    game->held_clicks[game->n_held_clicks++] = *p_click_map_packet;
+}
+
+/**
+ * @brief Apply the clicks held while waiting for the snapshot, in the order of "mymines-server".
+ */
+static void apply_held_clicks(Game game)
+{
+    MyMinesPacket mymines_packet;
+    for (Uint32 i = 0; i < game->n_held_clicks; i++)
+    {
+        mymines_packet.click_map_packet = game->held_clicks[i];
+        dispatch_packet(game, &mymines_packet);
+    }
+    game->n_held_clicks = 0;
+}
+
+/**
+ * @brief Tell "mymines-server" which part of the board is seen, so it only sends the cursors inside it.
+ * 
+ * @param game The running game in coop mode.
+ * @param visible SDL_FALSE if the window is minimized or hidden.
+ * 
+ * @note "layout_game" scales the board to fit the window and nothing scrolls, so the viewport is the whole board
+ * or nothing, and it doesn't change on resize.
+ */
+void send_coop_viewport(Game game, SDL_bool visible)
+{
+    if (!is_lan_mode(game->settings.game_mode) || !is_coop_mode(game->settings.game_mode)
+            || is_spectate_mode(game->settings.game_mode)) ///< Spectators are sent all cursors.
+        return;
+    Uint32 bs = game->settings.block_size;
+    if (visible)
+        send_viewport_packet(0, 0, game->settings.map_height * bs, game->settings.map_width * bs);
+    else
+        send_viewport_packet(0, 0, 0, 0);
+}
+
+//-------------------------------------------------------------------
+// Snapshot and rejoin
+//-------------------------------------------------------------------
+
+/**
+ * @brief Send the whole game to the client, see "snapshot.h".
+ * 
+ * @note In authoritative mode the mines stay on the server, otherwise the prng state is sent with them
+ * so that both sides put the same mines in the next rounds.
+ */
+static void send_game_snapshot(Game game)
+{
+    SnapshotInfo info;
+    SDL_zero(info);
+    if (!is_authoritative_mode(game->settings.game_mode))
+    {
+        info.flags |= SNAPSHOT_HAS_MINES;
+        prng_rc4_get_state(info.prng_state);
+    }
+    if (!game->is_first_click)
+        info.flags |= SNAPSHOT_STARTED;
+    info.opened_blocks = game->opened_blocks;
+    info.time_passed = game->timer.time_passed;
+    send_snapshot(game->map, &info);
+    game->snapshot_ticks = SDL_GetTicks();
+}
+
+/**
+ * @brief Replace the game of the client with a snapshot from the server, and redraw it.
+ * 
+ * @param game The running game.
+ * @param buf The snapshot.
+ * @param len The length of the snapshot.
+ */
+static void restore_game_snapshot(Game game, const Uint8 *buf, Uint32 len)
+{
+    SnapshotInfo info;
+    replay_end(game, REPLAY_ABANDONED); ///< The board is replaced, record again from the next game.
+    if (!decode_snapshot(buf, len, game->map, &info))
+        Error("Malformed snapshot!\n");
+    SDL_bool has_mines = (info.flags & SNAPSHOT_HAS_MINES) != 0, started = (info.flags & SNAPSHOT_STARTED) != 0;
+    if (has_mines == (is_authoritative_mode(game->settings.game_mode) != 0))
+        Error("The snapshot should have the mines only if not in authoritative mode!\n");
+
+    game->opened_blocks = info.opened_blocks;
+    if (started && game->is_first_click)
+        set_timer(&game->timer);
+    else if (!started && !game->is_first_click)
+        unset_timer(&game->timer);
+    game->is_first_click = !started;
+    game->timer.time_passed = info.time_passed;
+    if (has_mines)
+        prng_rc4_set_state(info.prng_state);
+    game->awaiting_snapshot = SDL_FALSE;
+    redraw_game(game);
+    SDL_Log("Restored from a snapshot of %u bytes, hash %016llx.\n", len, (unsigned long long)game->map->hash);
+}
+
+/**
+ * @brief Let a client join the game in progress if the server is waiting for one, called once per frame.
+ * 
+ * @param game The running game, in local mode while waiting.
+ */
+void poll_rejoin(Game game)
+{
+    if (!game->awaiting_rejoin)
+        return;
+    Settings settings = game->settings;
+    settings.game_mode = game->rejoin_mode;
+    if (!accept_rejoin(&settings))
+        return;
+    game->awaiting_rejoin = SDL_FALSE;
+    game->settings.game_mode = game->rejoin_mode;
+    game->sent_clicks = game->recved_clicks = 0;
+    send_game_snapshot(game);
+}
+
 static void show_block_in_map_without_mine(Map map, unsigned int y, unsigned int x)
 {
     BLOCK b = get_block_type_without_mine(y, x, map);
@@ -151,21 +578,42 @@ static void show_block_in_map_all(Map map, unsigned int y, unsigned int x)
 
 static void show_whole_map(Map map)
 {
+    TRACE_BEGIN(show_whole_map);
     for (unsigned int y = 0; y < map->col; y++)
         for (unsigned int x = 0; x < map->row; x++)
             show_block_in_map_all(map, y, x);
+    TRACE_END(show_whole_map);
+}
+
+/**
+ * @brief Redraw the whole board as the player sees it, with the timer if it is running.
+ * 
+ * @param game The running game.
+ */
+void redraw_game(Game game)
+{
+    TRACE_BEGIN(redraw_game);
+    for (unsigned int y = 0; y < game->map->col; y++)
+        for (unsigned int x = 0; x < game->map->row; x++)
+            show_block_in_map_without_mine(game->map, y, x);
+    if (!game->is_first_click)
+        draw_timer(&game->timer);
+    TRACE_END(redraw_game);
 }
 
 /**
  * @brief Show the block which is previously occupied by cursor.
  * 
  * @param map The map.
- * @param cursor_y The y coordinate in window.
- * @param cursor_x The x coordinate in window.
+ * @param cursor_y The logical y coordinate.
+ * @param cursor_x The logical x coordinate.
  */
 static void show_block_in_cursor(Map map, unsigned int cursor_y, unsigned int cursor_x)
 {
+    TRACE_BEGIN(show_block_in_cursor);
     unsigned int down_y = cursor_y + CURSOR_HEIGHT, right_x = cursor_x + CURSOR_WIDTH;
+    logical2window(&cursor_y, &cursor_x);
+    logical2window(&down_y, &right_x);
     window2map(&cursor_y, &cursor_x);
     window2map(&down_y, &right_x);
 
@@ -173,6 +621,137 @@ static void show_block_in_cursor(Map map, unsigned int cursor_y, unsigned int cu
         for (unsigned int j = cursor_x; j <= right_x; j++)
             if (in_map_range(i, j, map))
                 show_block_in_map_without_mine(map, i, j);
+    TRACE_END(show_block_in_cursor);
+}
+
+/**
+ * @brief Handle a left click of the local player.
+ * 
+ * @param game The running game.
+ * @param y   The column number of clicked block.
+ * @param x   The row number of clicked mine.
+ * 
+ * @note The client in authoritative mode only sends the click, the server sends back the opened blocks.
+ * In coop mode every click is only sent, and applied when "mymines-server" sends it back in order.
+ * The latency of those is measured when the result comes, see "defer_local_click".
+ */
+void local_left_click(Game game, unsigned int y, unsigned int x)
+{
+    Uint8 game_mode = game->settings.game_mode;
+    if (is_spectate_mode(game_mode))
+        return;
+    if (is_coop_mode(game_mode))
+    {
+        if (!game->awaiting_snapshot)
+        {
+            send_lockstep_click(game, LEFT_CLICK, y, x); ///< Applied when "mymines-server" sends it back in order.
+            defer_local_click(game);
+        }
+        return;
+    }
+    SDL_bool over = SDL_FALSE;
+    if (has_map_authority(game_mode))
+    {
+        latency_mark_input(LATENCY_LOCAL_INPUT);
+        replay_click(game, LEFT_CLICK, y, x);
+        over = click_map(game, y, x) || success(game);
+    }
+    if (is_lan_mode(game_mode) && !is_authoritative_host(game_mode))
+        send_lockstep_click(game, LEFT_CLICK, y, x); ///< With the hash after the click, before "restart" clears it.
+    if (has_map_authority(game_mode))
+        finish_left_click(game, over);
+    else if (in_map_range(y, x, game->map) && !has_flag(y, x, game->map) && !is_shown_num(y, x, game->map))
+        defer_local_click(game); ///< A hidden block is always opened, so TYPE_REVEAL comes.
+}
+
+/**
+ * @brief Handle a right click of the local player.
+ * 
+ * @param game The running game.
+ * @param y   The column number of clicked block.
+ * @param x   The row number of clicked mine.
+ */
+void local_right_click(Game game, unsigned int y, unsigned int x)
+{
+    if (is_spectate_mode(game->settings.game_mode))
+        return;
+    if (is_coop_mode(game->settings.game_mode))
+    {
+        if (!game->awaiting_snapshot)
+        {
+            send_lockstep_click(game, RIGHT_CLICK, y, x);
+            defer_local_click(game);
+        }
+        return;
+    }
+    latency_mark_input(LATENCY_LOCAL_INPUT);
+    replay_click(game, RIGHT_CLICK, y, x);
+    set_draw_flag(game, y, x);
+    if (is_lan_mode(game->settings.game_mode))
+        send_lockstep_click(game, RIGHT_CLICK, y, x);
+}
+
+/**
+ * @brief Remember a local click whose result is drawn when the other side sends it, the latency HUD measures it then.
+ * 
+ * @param game The running game, the click is just sent.
+ * 
+ * @note Only the earliest one is remembered, like "latency_mark_input".
+ */
+static void defer_local_click(Game game)
+{
+    if (game->click_input_time != 0)
+        return;
+    game->click_input_time = SDL_GetPerformanceCounter();
+    game->click_input_seq = game->sent_clicks;
+}
+
+/**
+ * @brief Called when the result of the click remembered by "defer_local_click" is drawn,
+ * the next present takes its latency sample.
+ */
+static void mark_local_click_drawn(Game game)
+{
+    if (game->click_input_time == 0)
+        return;
+    latency_mark_input_at(LATENCY_LOCAL_INPUT, game->click_input_time);
+    game->click_input_time = 0;
+}
+
+/**
+ * @brief After a click on the map that has the mines, finish and restart if the game is over.
+ * In authoritative mode, the opened blocks are sent to the client first.
+ * 
+ * @param game The running game.
+ * @param over The click steps on a mine or wins.
+ */
+static void finish_left_click(Game game, SDL_bool over)
+{
+    if (is_authoritative_host(game->settings.game_mode))
+    {
+        if (over)
+            log_rest_blocks(game);
+        send_reveal_log(game->reveal_log, game->map);
+        if (over)
+            send_game_over_packet();
+    }
+    if (over)
+    {
+        replay_end(game, success(game) ? REPLAY_WON : REPLAY_LOST);
+        finish(game);
+        restart(game);
+    }
+}
+
+/**
+ * @brief Log the blocks that the client doesn't know, to show the whole map when the game is over.
+ */
+static void log_rest_blocks(Game game)
+{
+    for (unsigned int y = 0; y < game->map->col; y++)
+        for (unsigned int x = 0; x < game->map->row; x++)
+            if (!is_shown_num(y, x, game->map) && !is_exploded_mine(y, x, game->map)) ///< The exploded mine is logged by "click_block".
+                reveal_log_add(game->reveal_log, y, x);
 }
 
 /**
@@ -185,6 +764,17 @@ static void show_block_in_cursor(Map map, unsigned int cursor_y, unsigned int cu
  * @return Return SDL_TRUE if click on a mine.
  */
 SDL_bool click_map(Game game, unsigned int y, unsigned int x)
+{
+    TRACE_BEGIN(click_map);
+    SDL_bool step_on_mine = click_block(game, y, x);
+    TRACE_END(click_map);
+    return step_on_mine;
+}
+
+/**
+ * @brief The untraced body of "click_map".
+ */
+static SDL_bool click_block(Game game, unsigned int y, unsigned int x)
 {
     if (!in_map_range(y, x, game->map) || has_flag(y, x, game->map))
         return SDL_FALSE;
@@ -209,10 +799,16 @@ SDL_bool click_map(Game game, unsigned int y, unsigned int x)
     {
         set_exploded_mine(y, x, game->map);
         draw_block(T_EXPLODED_MINE, y, x);
+        if (is_authoritative_host(game->settings.game_mode))
+            reveal_log_add(game->reveal_log, y, x);
         return SDL_TRUE;
     }
     else
+    {
+        TRACE_BEGIN(show_blocks);
         show_blocks(game, y, x);
+        TRACE_END(show_blocks);
+    }
     return SDL_FALSE;
 }
 
@@ -234,6 +830,8 @@ static void show_blocks(Game game, unsigned int y, unsigned int x)
     game->opened_blocks++;
     draw_block(get_block(y, x, game->map), y, x);
     open_block(y, x, game->map); ///< If it is a digit(e.g '2'), it is opened
+    if (is_authoritative_host(game->settings.game_mode))
+        reveal_log_add(game->reveal_log, y, x);
     if (!is_empty(y, x, game->map))
         return;
     for (int i = 0; i < 8; i++)
@@ -316,6 +914,9 @@ static void destroy_game(Game game)
 {
     destroy_map(game->map);
     game->map = NULL;
+    free(game->held_clicks);
+    if (game->reveal_log != NULL)
+        destroy_reveal_log(game->reveal_log);
     free(game);
 }
 
@@ -343,7 +944,11 @@ void restart(Game game)
     game->is_first_click = SDL_TRUE;
     clear_map(game->map);
     show_whole_map(game->map);
-    put_mines(game->map, game->settings.n_mine);
+    if (has_map_authority(game->settings.game_mode))
+    {
+        replay_begin(game);
+        put_mines(game->map, game->settings.n_mine);
+    }
     SDL_PumpEvents(); ///< Must call this function before flushing events.
     SDL_FlushEvents(SDL_FIRSTEVENT, SDL_LASTEVENT);
 }
@@ -355,10 +960,18 @@ void restart(Game game)
  */
 void wrapup(Game game)
 {
+    TRACE_DUMP();
+    const char *latency_log = SDL_getenv(LATENCY_LOG_ENV);
+    if (latency_log != NULL)
+        latency_dump(latency_log);
+
     delete_media();
     finish_sdl();
     if (is_lan_mode(game->settings.game_mode))
         finish_sdl_net();
+    else if (game->awaiting_rejoin)
+        stop_listening_for_rejoin();
 
+    replay_end(game, REPLAY_ABANDONED);
     destroy_game(game);
 }
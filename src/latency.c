@@ -0,0 +1,237 @@
+/**
+ * @file latency.c
+ * @author jkilopu
+ * @brief Provides functions to record latency samples, summarize, draw and dump them.
+ */
+#include "latency.h"
+#include "SDL.h"
+#include "render.h"
+#include "block.h"
+#include "fatal.h"
+#include "net.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HUD_DIGIT_NUM 3
+#define HUD_MAX_VALUE 999
+#define HUD_UNIT_US 100 ///< The HUD shows tenths of a millisecond.
+#define HUD_ROW_NUM (LATENCY_KIND_NUM + 1) ///< And the link.
+
+extern Drawer drawer;
+extern SDL_Texture *block_textures[];
+extern SDL_Texture *remote_cursor_texture;
+
+static LatencyHistogram histograms[LATENCY_KIND_NUM];
+static Uint64 pending_inputs[LATENCY_KIND_NUM]; ///< Perf counter of the earliest input not presented yet, 0 if none.
+static Uint64 frame_start;
+
+static const char *latency_kind_names[LATENCY_KIND_NUM] = {
+    "local input",
+    "remote input",
+    "frame",
+};
+
+//-------------------------------------------------------------------
+// Functions
+//-------------------------------------------------------------------
+
+static void latency_add_sample(LatencyKind kind, Uint64 ticks)
+{
+    LatencyHistogram *p_h = &histograms[kind];
+    Uint64 us = ticks * 1000000 / SDL_GetPerformanceFrequency();
+
+    p_h->samples[p_h->next] = us > 0xFFFFFFFF ? 0xFFFFFFFF : (Uint32)us;
+    p_h->next = (p_h->next + 1) % LATENCY_WINDOW;
+    if (p_h->num < LATENCY_WINDOW)
+        p_h->num++;
+    p_h->total_num++;
+}
+
+/**
+ * @brief Timestamp an input whose result is not on screen yet.
+ *
+ * @param kind LATENCY_LOCAL_INPUT or LATENCY_REMOTE_INPUT.
+ */
+void latency_mark_input(LatencyKind kind)
+{
+    latency_mark_input_at(kind, SDL_GetPerformanceCounter());
+}
+
+/**
+ * @brief Like "latency_mark_input", but the input happened at "counter" (perf counter ticks).
+ */
+void latency_mark_input_at(LatencyKind kind, Uint64 counter)
+{
+    if (pending_inputs[kind] == 0 || counter < pending_inputs[kind])
+        pending_inputs[kind] = counter;
+}
+
+/**
+ * @brief Called by "draw", start the frame time at the first draw after a present.
+ */
+void latency_mark_draw(void)
+{
+    if (frame_start == 0)
+        frame_start = SDL_GetPerformanceCounter();
+}
+
+/**
+ * @brief Called by "drawer_present" after "SDL_RenderPresent", take the samples of the inputs being presented.
+ */
+void latency_presented(void)
+{
+    Uint64 now = SDL_GetPerformanceCounter();
+
+    for (int kind = 0; kind < LATENCY_FRAME; kind++)
+    {
+        if (pending_inputs[kind] != 0)
+        {
+            latency_add_sample(kind, now - pending_inputs[kind]);
+            pending_inputs[kind] = 0;
+        }
+    }
+    if (frame_start != 0)
+    {
+        latency_add_sample(LATENCY_FRAME, now - frame_start);
+        frame_start = 0;
+    }
+}
+
+static int cmp_uint32(const void *a, const void *b)
+{
+    Uint32 lhs = *(const Uint32 *)a, rhs = *(const Uint32 *)b;
+    return (lhs > rhs) - (lhs < rhs);
+}
+
+/**
+ * @brief Summarize the rolling samples of a kind.
+ *
+ * @param kind The kind of latency.
+ * @param p_stats Points to the stats will be filled in, all zero if there is no sample.
+ */
+void latency_get_stats(LatencyKind kind, LatencyStats *p_stats)
+{
+    const LatencyHistogram *p_h = &histograms[kind];
+    Uint32 sorted[LATENCY_WINDOW];
+
+    memset(p_stats, 0, sizeof(LatencyStats));
+    if (p_h->num == 0)
+        return;
+    memcpy(sorted, p_h->samples, p_h->num * sizeof(Uint32));
+    qsort(sorted, p_h->num, sizeof(Uint32), cmp_uint32);
+    p_stats->p50 = sorted[(p_h->num - 1) * 50 / 100];
+    p_stats->p99 = sorted[(p_h->num - 1) * 99 / 100];
+    p_stats->max = sorted[p_h->num - 1];
+}
+
+static void draw_hud_value(SDL_Rect *p_r, Uint32 us)
+{
+    Uint32 value = us / HUD_UNIT_US;
+    if (value > HUD_MAX_VALUE)
+        value = HUD_MAX_VALUE;
+
+    p_r->x += p_r->w * (HUD_DIGIT_NUM - 1);
+    for (int i = 0; i < HUD_DIGIT_NUM; i++)
+    {
+        draw(block_textures[value % 10], NULL, p_r);
+        value /= 10;
+        p_r->x -= p_r->w;
+    }
+    p_r->x += p_r->w * (HUD_DIGIT_NUM + 1) + p_r->w / 2;
+}
+
+/**
+ * @brief Draw p50, p99 and max of each kind at the bottom of the region, one kind per row.
+ *
+ * @param p_region The region to draw in, usually the time region.
+ *
+ * @note Each row starts with an icon: flag for local input, remote cursor for remote input, hidden block for frame.
+ * The last row (mine icon) is the smoothed RTT, jitter and last RTT of the link. Values are in tenths of a millisecond.
+ */
+void draw_latency_hud(const SDL_Rect *p_region)
+{
+    SDL_Texture *icons[LATENCY_KIND_NUM] = {block_textures[T_FLAG], remote_cursor_texture, block_textures[T_HIDDEN]};
+    int size = p_region->w / 12;
+    SDL_Rect r = {0, p_region->y + p_region->h - (size + size / 2) * HUD_ROW_NUM, size, size};
+
+    clear_latency_hud(p_region);
+    for (int kind = 0; kind < LATENCY_KIND_NUM; kind++)
+    {
+        LatencyStats stats;
+        latency_get_stats(kind, &stats);
+
+        r.x = p_region->x + size / 2;
+        draw(icons[kind], NULL, &r);
+        r.x += size + size / 2;
+        draw_hud_value(&r, stats.p50);
+        draw_hud_value(&r, stats.p99);
+        draw_hud_value(&r, stats.max);
+        r.y += size + size / 2;
+    }
+
+    LinkStats link;
+    get_link_stats(&link);
+    r.x = p_region->x + size / 2;
+    draw(block_textures[T_MINE], NULL, &r);
+    r.x += size + size / 2;
+    draw_hud_value(&r, link.srtt);
+    draw_hud_value(&r, link.jitter);
+    draw_hud_value(&r, link.last_rtt);
+}
+
+/**
+ * @brief Erase the HUD drawn by "draw_latency_hud".
+ */
+void clear_latency_hud(const SDL_Rect *p_region)
+{
+    int size = p_region->w / 12;
+    SDL_Rect r = *p_region;
+    r.h = (size + size / 2) * HUD_ROW_NUM;
+    r.y = p_region->y + p_region->h - r.h;
+    if (SDL_RenderFillRect(drawer.renderer, &r) != 0) ///< Draw color is the background color.
+        SDL_render_fatal_error("Fill rect error!\n%s\n", SDL_GetError());
+}
+
+/**
+ * @brief Write the summary and the rolling samples of every kind to a file.
+ *
+ * @param path The file path.
+ */
+void latency_dump(const char *path)
+{
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL)
+    {
+        SDL_Log("Can't open latency log %s!\n", path);
+        return;
+    }
+
+    fprintf(fp, "# kind, samples, p50(us), p99(us), max(us)\n");
+    for (int kind = 0; kind < LATENCY_KIND_NUM; kind++)
+    {
+        LatencyStats stats;
+        latency_get_stats(kind, &stats);
+        fprintf(fp, "%s, %llu, %u, %u, %u\n", latency_kind_names[kind],
+                (unsigned long long)histograms[kind].total_num, stats.p50, stats.p99, stats.max);
+    }
+    LinkStats link;
+    get_link_stats(&link);
+    fprintf(fp, "# pongs, srtt(us), jitter(us), last rtt(us), clock offset(us)\n");
+    fprintf(fp, "%u, %u, %u, %u, %lld\n", link.pongs, link.srtt, link.jitter, link.last_rtt, (long long)link.offset);
+    SendQueueStats send;
+    get_send_queue_stats(&send);
+    fprintf(fp, "# send queue depth, max depth, backlog, max backlog, mouse moves superseded\n");
+    fprintf(fp, "%u, %u, %u, %u, %llu\n", send.depth, send.max_depth, send.backlog, send.max_backlog,
+            (unsigned long long)send.moves_superseded);
+    for (int kind = 0; kind < LATENCY_KIND_NUM; kind++)
+    {
+        const LatencyHistogram *p_h = &histograms[kind];
+        unsigned int oldest = (p_h->next + LATENCY_WINDOW - p_h->num) % LATENCY_WINDOW;
+
+        fprintf(fp, "# %s samples(us), oldest first\n", latency_kind_names[kind]);
+        for (unsigned int i = 0; i < p_h->num; i++)
+            fprintf(fp, "%u\n", p_h->samples[(oldest + i) % LATENCY_WINDOW]);
+    }
+    fclose(fp);
+}
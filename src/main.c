@@ -10,6 +10,9 @@
 #include "render.h"
 #include "block.h"
 #include "net.h"
+#include "cursor.h"
+#include "latency.h"
+#include "trace.h"
 #include "fatal.h"
 
 extern Drawer drawer;
@@ -20,19 +23,40 @@ int main(int argc, char *argv[])
 
     SDL_RenderClear(drawer.renderer);
     create_map_in_game(game);
-    SDL_RenderPresent(drawer.renderer);
+    drawer_present();
+    send_coop_viewport(game, SDL_TRUE);
 
     SDL_Event event;
     SDL_bool quit = SDL_FALSE;
+    SDL_bool hud_visible = SDL_FALSE;
+    Uint32 hud_ticks = 0;
 
     while(!quit)
     {
-        if (SDL_PollEvent(&event))
+        /* Sleep until an event comes, the network thread pushes one when packets arrive. */
+        int has_event = SDL_WaitEventTimeout(&event, FRAME_INTERVAL);
+        for (; !quit && has_event; has_event = SDL_PollEvent(&event)) ///< Handle all pending events, so their packets are sent together.
         {
             unsigned int y, x;
             switch(event.type)
             {
+                case SDL_KEYDOWN:
+                    if (event.key.keysym.sym == HUD_KEY && event.key.repeat == SDL_FALSE)
+                    {
+                        hud_visible = !hud_visible;
+                        if (hud_visible)
+                            draw_latency_hud(&game->timer.region);
+                        else
+                            clear_latency_hud(&game->timer.region);
+                        hud_ticks = SDL_GetTicks();
+                        drawer_present();
+                    }
+                    else if (event.key.keysym.sym == TRACE_DUMP_KEY && event.key.repeat == SDL_FALSE)
+                        TRACE_DUMP();
+                    break;
                 case SDL_MOUSEBUTTONUP: ///< PairButton up will return state 0.
+                    if (!drawer_window2pixel(&event.button.y, &event.button.x))
+                        break; ///< In the letterbox, would wrap around as unsigned.
                     y = event.button.y;
                     x = event.button.x;
                     if (event.button.clicks == 1 && event.button.state == SDL_RELEASED)
@@ -41,37 +65,47 @@ int main(int argc, char *argv[])
                         switch(event.button.button)
                         {
                             case SDL_BUTTON_LEFT:
-                                if (is_lan_mode(game->settings.game_mode))
-                                    send_click_map_packet(LEFT_CLICK, y, x);
-                                if (click_map(game, y, x) || success(game))
-                                {
-                                    finish(game);
-                                    restart(game);
-                                }
+                                local_left_click(game, y, x);
                                 break;
                             case SDL_BUTTON_RIGHT:
-                                if (is_lan_mode(game->settings.game_mode))
-                                    send_click_map_packet(RIGHT_CLICK, y, x);
-                                set_draw_flag(game, y, x);
+                                local_right_click(game, y, x);
                                 break;
                             default:
                                 break;
                         }
-                        SDL_RenderPresent(drawer.renderer);
+                        drawer_present();
                     }
                     break;
                 case SDL_MOUSEMOTION:
+                    if (!drawer_window2pixel(&event.motion.y, &event.motion.x))
+                        break;
                     y = event.motion.y;
                     x = event.motion.x;
-                    if (is_lan_mode(game->settings.game_mode))
-                        send_mouse_move_packet(y, x);
+                    window2logical(&y, &x);
+                    if (!is_spectate_mode(game->settings.game_mode))
+                        local_cursor_moved(y, x);
+                    break;
+                case SDL_WINDOWEVENT:
+                    if (event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED) ///< Also sent when the DPI changes.
+                    {
+                        layout_game(game);
+                        SDL_RenderClear(drawer.renderer);
+                        redraw_game(game);
+                        if (hud_visible)
+                            draw_latency_hud(&game->timer.region);
+                        drawer_present();
+                    }
+                    else if (event.window.event == SDL_WINDOWEVENT_MINIMIZED || event.window.event == SDL_WINDOWEVENT_HIDDEN)
+                        send_coop_viewport(game, SDL_FALSE); ///< No cursor is sent while nobody sees them.
+                    else if (event.window.event == SDL_WINDOWEVENT_RESTORED || event.window.event == SDL_WINDOWEVENT_SHOWN)
+                        send_coop_viewport(game, SDL_TRUE);
                     break;
                 case SDL_USEREVENT:
                 {
                     unsigned int *p_time_passed = event.user.data1;
                     (*p_time_passed)++;
                     draw_timer(&game->timer);
-                    SDL_RenderPresent(drawer.renderer);
+                    drawer_present();
                     break;
                 }
                 case SDL_QUIT:
@@ -83,9 +117,25 @@ int main(int argc, char *argv[])
                     break;
             }
         }
+        poll_rejoin(game);
         if (is_lan_mode(game->settings.game_mode))
-            if (handle_recved_packet(game))
-                SDL_RenderPresent(drawer.renderer);
+        {
+            unsigned int cursor_y, cursor_x;
+            pump_send_queue(); ///< The backlog of a slow link.
+            if (is_local_cursor_due(&cursor_y, &cursor_x))
+                send_mouse_move_packet(cursor_y, cursor_x);
+            SDL_bool need_update = handle_recved_packet(game);
+            if (update_remote_cursor(game, SDL_FALSE))
+                need_update = SDL_TRUE;
+            if (need_update)
+                drawer_present();
+        }
+        if (hud_visible && SDL_TICKS_PASSED(SDL_GetTicks(), hud_ticks + HUD_REFRESH_INTERVAL))
+        {
+            draw_latency_hud(&game->timer.region);
+            drawer_present();
+            hud_ticks = SDL_GetTicks();
+        }
     }
 
     wrapup(game);
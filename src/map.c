@@ -8,6 +8,7 @@
 #include <string.h>
 #include "map.h"
 #include "prng_alleged_rc4.h"
+#include "trace.h"
 #include "fatal.h"
 
 #define FAILED_PLACEMENT_MAX_TIMES (10000)
@@ -39,6 +40,7 @@ Map create_map(unsigned int col, unsigned int row)
     
     new_map->col = col;
     new_map->row = row;
+    new_map->hash = 0;
     return new_map;
 }
 
@@ -52,6 +54,7 @@ Map create_map(unsigned int col, unsigned int row)
  */
 void put_mines(Map map, unsigned int num)
 {
+    TRACE_BEGIN(put_mines);
     unsigned int y, x;
     int times = 0;
     
@@ -75,6 +78,7 @@ void put_mines(Map map, unsigned int num)
                 map->arr[next_y][next_x]++;
         }
     }
+    TRACE_END(put_mines);
 }
 
 /**
@@ -154,6 +158,37 @@ void unhidden_map(Map map)
         }
 }
 
+/**
+ * @brief The key of a block in the map hash, the splitmix64 finalizer of its number.
+ * 
+ * @param n (y * row + x) * 2 + OPEN_KEY or FLAG_KEY.
+ */
+Uint64 zobrist_key(Uint64 n)
+{
+    n += 0x9E3779B97F4A7C15ULL;
+    n = (n ^ (n >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    n = (n ^ (n >> 27)) * 0x94D049BB133111EBULL;
+    return n ^ (n >> 31);
+}
+
+/**
+ * @brief Compute the hash of the map from scratch, after its blocks are written directly.
+ * 
+ * @param map The map.
+ */
+void rehash_map(Map map)
+{
+    map->hash = 0;
+    for (unsigned int y = 0; y < map->col; y++)
+        for (unsigned int x = 0; x < map->row; x++)
+        {
+            if (is_shown_num(y, x, map))
+                toggle_hash(y, x, map, OPEN_KEY);
+            if (has_flag(y, x, map))
+                toggle_hash(y, x, map, FLAG_KEY);
+        }
+}
+
 /**
  * @brief Clear the map.
  * 
@@ -163,6 +198,7 @@ void clear_map(Map map)
 {
     for (unsigned int i = 0; i < map->col; i++)
         memset(map->arr[i], 0, map->row);
+    map->hash = 0;
 }
 
 /**
@@ -13,6 +13,8 @@
 #include "button.h"
 #include "timer.h"
 #include "prng_alleged_rc4.h"
+#include "net_trace.h"
+#include "replay.h"
 #include "fatal.h"
 #include <stdlib.h>
 #include <string.h>
@@ -51,6 +53,7 @@
 #define HOST_BLOCK_INTERVAL (HOST_BLOCK_SIZE / 2)
 #define HOST_BLOCK_X (MAIN_WIN_SIZE / 2 - (HOST_BLOCK_SIZE * 3 + HOST_BLOCK_INTERVAL * 2) / 2)
 #define HOST_BLOCK_Y (MAIN_WIN_SIZE / 2 - HOST_BLOCK_SIZE / 2)
+#define WAIT_FRAME_INTERVAL 250 ///< In milliseconds, how long each frame of the waiting animation lasts.
 
 extern SDL_Texture *block_textures[]; ///< Used as options and characters.
 extern Drawer drawer;
@@ -63,6 +66,7 @@ SDL_Texture *client_button_texture;
 SDL_Texture *return_button_texture;
 SDL_Texture *restart_button_texture;
 SDL_Texture *quit_button_texture;
+Uint32 game_over_delay = GAME_OVER_DELAY; ///< Shortened by "mymines-net-replay" and "mymines-replay" when they play faster.
 
 //-------------------------------------------------------------------
 // Functions
@@ -73,6 +77,8 @@ void menu_main(Game game)
     char ip[MAX_IP_LEN + 1];
     Uint32 port = 0;
 
+    wait_media(MEDIA_MENU); ///< Block textures keep loading while the user is in menus.
+
     /** TODO: Assert settings are set at proper position */
     PLAY_MODE:
     if (!play_mode_option(&game->settings.game_mode))
@@ -90,7 +96,11 @@ void menu_main(Game game)
             if (!settings_menu(&game->settings))
                 goto IP_PORT_MENU;
         if (!connect_menu(game, ip, port))
-            goto SETTINGS_MENU;
+        {
+            if (is_server_mode(game->settings.game_mode))
+                goto SETTINGS_MENU;
+            goto IP_PORT_MENU; ///< The client has no settings menu.
+        }
     }
     else
     {
@@ -108,7 +118,7 @@ static SDL_bool option(OptionButton *p_opt_btn)
 {
     draw_main_menu();
     draw_mutiple(p_opt_btn->textures, NULL, p_opt_btn->buttons, p_opt_btn->num);
-    SDL_RenderPresent(drawer.renderer);
+    drawer_present();
 
     return option_main(p_opt_btn->buttons, p_opt_btn->p_option, p_opt_btn->num, p_opt_btn->selector);
 }
@@ -121,6 +131,7 @@ static SDL_bool option_main(SDL_Rect *buttons, void *p_option, unsigned short nu
     {
         if (!SDL_WaitEvent(&e))
             SDL_other_fatal_error("SDL event error!\n%s\n", SDL_GetError());
+        upload_loaded_media();
         switch (e.type)
         {
         case SDL_MOUSEBUTTONUP:
@@ -241,14 +252,16 @@ static SDL_bool ip_port_menu_main(char ip_port_buf[])
     SDL_bool finished = SDL_FALSE;
     SDL_Event e;
 
+    wait_media(MEDIA_BLOCK);
     SDL_RenderClear(drawer.renderer);
-    SDL_RenderPresent(drawer.renderer);
+    drawer_present();
     SDL_StartTextInput();
     /** TODO: Add code for quit */
     while (!finished)
     {
         if (!SDL_WaitEvent(&e))
             SDL_other_fatal_error("SDL event error!\n%s\n", SDL_GetError());
+        upload_loaded_media();
         if (e.type == SDL_KEYDOWN)
         {
             if (e.key.keysym.sym == SDLK_BACKSPACE && e.key.repeat == SDL_FALSE && buf_len > 0)
@@ -256,7 +269,7 @@ static SDL_bool ip_port_menu_main(char ip_port_buf[])
                 ip_port_buf[--buf_len] = '\0';
                 SDL_RenderClear(drawer.renderer);
                 draw_ip_port(ip_port_buf);
-                SDL_RenderPresent(drawer.renderer);
+                drawer_present();
             }
             else if (e.key.keysym.sym == SDLK_RETURN)
                 finished = SDL_TRUE;
@@ -273,7 +286,7 @@ static SDL_bool ip_port_menu_main(char ip_port_buf[])
                 ip_port_buf[buf_len] = '\0';
                 SDL_RenderClear(drawer.renderer);
                 draw_ip_port(ip_port_buf);
-                SDL_RenderPresent(drawer.renderer);
+                drawer_present();
             }
         }
         else if (e.type == SDL_QUIT)
@@ -353,9 +366,10 @@ SDL_bool settings_menu(Settings *p_s)
         {{ONES_BUTTON_X, N_MINE_BUTTON_Y, BUTTON_SIZE, BUTTON_SIZE}, BUTTON_INTERVAL, &characters[5].ch},
     };
     
+    wait_media(MEDIA_BLOCK);
     SDL_RenderClear(drawer.renderer);
     draw_settings_menu(characters, buttons, 6);
-    SDL_RenderPresent(drawer.renderer);
+    drawer_present();
 
     SDL_bool finished = settings_menu_main(characters, buttons, 6);
 
@@ -414,6 +428,7 @@ static SDL_bool settings_menu_main(Character ds[], PairButton bs[], unsigned int
     {
         if (!SDL_WaitEvent(&e))
             SDL_other_fatal_error("SDL event error!\n%s\n", SDL_GetError());
+        upload_loaded_media();
         if (e.type == SDL_MOUSEBUTTONUP)
         {
             int selected = -1;
@@ -441,7 +456,7 @@ static SDL_bool settings_menu_main(Character ds[], PairButton bs[], unsigned int
             if (selected != -1)
             {
                 draw(block_textures[ds[selected].ch], NULL, &ds[selected].r);
-                SDL_RenderPresent(drawer.renderer);
+                drawer_present();
             }
             else
                 finished = SDL_TRUE;
@@ -467,6 +482,7 @@ SDL_bool connect_menu(Game game, const char *ip, Uint32 port)
 {
     if (SDLNet_Init() < -1)
         SDL_net_error("SDL_Net could not initialize!\n%s\n", SDL_GetError());
+    wait_media(MEDIA_BLOCK); ///< The waiting animation is drawn with blocks.
 
     SDL_bool finished;
     Uint64 key;
@@ -476,30 +492,80 @@ SDL_bool connect_menu(Game game, const char *ip, Uint32 port)
         key = time(NULL);
         key_size = sizeof(time_t);
         prng_rc4_seed_bytes(&key, key_size);
-        finished = host_game(port, key, key_size, &game->settings);
+        net_trace_seed(key, key_size);
+        replay_seed(key, key_size);
+        if (SDL_getenv(AUTHORITATIVE_ENV) != NULL)
+        {
+            set_authoritative_mode(game->settings.game_mode);
+            finished = host_game(port, 0, 0, &game->settings); ///< The client can't generate the mines.
+        }
+        else
+            finished = host_game(port, key, key_size, &game->settings);
     }
     else
     {
-        finished = join_game(ip, port, &key, &key_size, &game->settings);
-        if (finished)
+        SDL_bool in_progress;
+        if (SDL_getenv(COOP_ENV) != NULL)
+            set_coop_mode(game->settings.game_mode);
+        if (SDL_getenv(SPECTATE_ENV) != NULL)
+        {
+            set_coop_mode(game->settings.game_mode);
+            set_spectate_mode(game->settings.game_mode); ///< Sent back by the server if it has spectators.
+        }
+        finished = join_game(ip, port, &key, &key_size, &game->settings, &in_progress,
+                &game->coop_player);
+        if (finished && has_map_authority(game->settings.game_mode))
+        {
             prng_rc4_seed_bytes(&key, key_size);
+            net_trace_seed(key, key_size);
+            replay_seed(key, key_size);
+        }
+        game->awaiting_snapshot = finished && in_progress;
     }
+    if (!finished)
+        SDLNet_Quit(); ///< Inited again by the next try.
     return finished;
 }
 
-/** TODO: Comment: thread not safe. */
-SDL_bool host_menu_main(void)
+/**
+ * @brief Show the waiting animation and handle the events, called repeatedly while waiting for the other side.
+ * 
+ * @param start_ticks When the waiting started.
+ * @param timeout In milliseconds, 0 to wait forever.
+ * 
+ * @return Return SDL_FALSE if the user cancels with ESC or it times out.
+ * 
+ * @note Only draws when the animation moves to the next frame, the caller sleeps between calls.
+ * Not thread safe.
+ */
+SDL_bool wait_menu_main(Uint32 start_ticks, Uint32 timeout)
 {
-    static unsigned short frame_cnt = 0;
-    SDL_RenderClear(drawer.renderer);
-    /** TODO: Fix frame rate */
-    draw_host_menu(((frame_cnt++) / 1000) % 4);
-    SDL_RenderPresent(drawer.renderer);
+    static Uint32 drawn_start_ticks, drawn_frame;
+    Uint32 now = SDL_GetTicks();
+    Uint32 frame = (now - start_ticks) / WAIT_FRAME_INTERVAL;
+    if (start_ticks != drawn_start_ticks || frame != drawn_frame)
+    {
+        SDL_RenderClear(drawer.renderer);
+        draw_host_menu(frame % 4);
+        drawer_present();
+        drawn_start_ticks = start_ticks;
+        drawn_frame = frame;
+    }
 
+    upload_loaded_media();
     SDL_Event e;
     while (SDL_PollEvent(&e))
+    {
         if (e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_ESCAPE && e.key.repeat == SDL_FALSE)
             return SDL_FALSE;
+        else if (e.type == SDL_QUIT)
+            exit(0);
+    }
+    if (timeout != 0 && SDL_TICKS_PASSED(now, start_ticks + timeout))
+    {
+        SDL_Log("Timed out after %u ms!\n", timeout);
+        return SDL_FALSE;
+    }
     return SDL_TRUE;
 }
 
@@ -518,7 +584,7 @@ static void draw_host_menu(unsigned short frame_cnt)
  */
 void game_over_menu(void)
 {
-    SDL_RenderPresent(drawer.renderer); ///< show mines
-    SDL_Delay(5000);
+    drawer_present(); ///< show mines
+    SDL_Delay(game_over_delay);
     SDL_RenderClear(drawer.renderer);
 }
@@ -4,162 +4,1581 @@
  * @brief Provides functions for connection and packet manipulation.
  */
 #include "net.h"
+#include "codec.h"
 #include "SDL_net.h"
 #include "game.h"
 #include "menu.h"
 #include "SDL_stdinc.h"
+#include "trace.h"
+#include "net_trace.h"
+#include "snapshot.h"
 #include "fatal.h"
 #include "SDL_log.h"
+#include "SDL.h"
+#ifdef MYMINES_SHM_LINK
+#include "shm_link.h"
+#endif
 #include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <sys/socket.h>
+#include <sys/time.h>
+#endif
 
 static TCPsocket connected_socket;
 static SDLNet_SocketSet socket_set;
+static Uint8 send_buf[SEND_BUF_SIZE];
+static Uint32 send_len;
+static Uint32 send_ticks; ///< When the oldest packet in "send_buf" was queued.
+static Uint8 recv_ring[RECV_RING_SIZE];
+static Uint32 recv_head, recv_tail; ///< Read and write counters, only their difference matters when they wrap.
+static Uint8 send_version = 2, recv_version = 2;
+static CodecState send_codec, recv_codec;
+static SDL_Thread *net_thread; ///< NULL until the handshake is done.
+static SDL_atomic_t net_thread_quit;
+static SDL_threadID net_thread_id; ///< Set by the network thread when it starts.
+static SDL_atomic_t send_closed; ///< A send of the network thread failed, nothing is sent after it.
+static PacketQueue send_queue; ///< From the main thread to the network thread.
+static MyMinesPacket *send_backlog; ///< Only used by the main thread, what doesn't fit in "send_queue", in order.
+static SDL_bool *send_backlog_urgent;
+static Uint32 backlog_head, backlog_tail, backlog_cap;
+static MyMinesPacket pending_move; ///< Only used by the main thread, the newest mouse move while congested.
+static SDL_bool has_pending_move;
+static SendQueueStats send_stats;
+static SDL_bool backlog_dead; ///< Only used by the main thread, the backlog is full, TYPE_QUIT is delivered next.
+static PacketQueue recv_queue; ///< From the network thread to the main thread.
+static Uint32 net_event = (Uint32)-1;
+static SDL_atomic_t net_event_pending; ///< At most one "net_event" is in the SDL event queue.
+static UDPsocket wake_socket; ///< Sends to itself to wake the network thread up.
+static UDPpacket *wake_send_packet, *wake_recv_packet;
+static Uint32 host_port; ///< What "host_game" is given, used again when the client rejoins.
+static Uint64 host_key;
+static Uint8 host_key_size;
+static LinkStats link_stats; ///< Written by the network thread, read by the main thread with "link_lock".
+static SDL_SpinLock link_lock;
+static Uint32 ping_seq, ping_ticks; ///< Only used by the network thread.
+static Uint32 ping_rtts[PING_WINDOW];
+static Sint64 ping_offsets[PING_WINDOW];
+static TCPsocket rejoin_listen_socket;
+static SDLNet_SocketSet rejoin_listen_set;
+
+static const Transport tcp_transport = {"TCP", tcp_send, tcp_recv, tcp_readable, tcp_wait, tcp_wake};
+static const Transport shm_transport = {"shared memory", shm_send, shm_recv, shm_readable, shm_wait, shm_wake};
+static const Transport *send_transport = &tcp_transport; ///< Only used by the owner of the socket.
+static void *recv_transport = (void *)&tcp_transport;     ///< Also read by the main thread to wake the network thread.
+#ifdef MYMINES_SHM_LINK
+static ShmLink *shm_link;  ///< NULL on TCP.
+static Uint32 shm_link_id; ///< The next link the client offers.
+#endif
+static UDPsocket cursor_socket; ///< The cursor channel, NULL if mouse moves go over TCP.
+static UDPpacket *cursor_send_packet, *cursor_recv_packet;
+static SDL_bool cursor_peer_known; ///< The address in "cursor_send_packet" is known.
+static Uint32 cursor_token;
+static Uint32 cursor_send_seq, cursor_recv_seq;
+static Uint32 cursor_recved, cursor_stale, cursor_lost;
+static SDL_bool replaying; ///< No socket, see "start_net_replay".
+static Uint32 replay_sends[TYPE_TRANSPORT + 1];
+
+//-------------------------------------------------------------------
+// Functions
+//-------------------------------------------------------------------
+
+/**
+ * @brief Wrapper for "SDLNet_ResolveHost" used in server.
+ * 
+ * @param p_addr Points to the IPaddress that will be filled in.
+ * @param port The port to listen on.
+ */
+static void server_resolve_host(IPaddress *p_addr, Uint32 port)
+{
+    if (SDLNet_ResolveHost(p_addr, NULL, port) < 0)
+        SDL_net_error("Can't resolve server host: port: %hu!\n%s\n", port, SDLNet_GetError());
+}
+
+/**
+ * @brief Wrapper for "SDLNet_ResolveHost" used in client.
+ * 
+ * @param p_addr Points to the IPaddress that will be filled in.
+ * @param host A hostname or IP to connect with the server.
+ * @param port The server's listening port number.
+ */
+static void client_resolve_host(IPaddress *p_addr, const char *host, Uint32 port)
+{
+    if (SDLNet_ResolveHost(p_addr, host, port) < 0)
+        SDL_net_error("Can't resolve client host: %s:%hu!\n%s\n", host, port, SDLNet_GetError());
+}
+
+/**
+ * @brief Read a timeout from the environment variable "name".
+ * 
+ * @param default_timeout In seconds, used if it is not set or invalid.
+ * 
+ * @return Return the timeout in milliseconds, 0 means forever.
+ */
+static Uint32 get_timeout_env(const char *name, Uint32 default_timeout)
+{
+    const char *value = SDL_getenv(name);
+    if (value == NULL)
+        return default_timeout * 1000;
+    if (SDL_isdigit(value[0]))
+        return (Uint32)SDL_atoi(value) * 1000;
+    SDL_Log("Invalid %s: %s, use %u s.\n", name, value, default_timeout);
+    return default_timeout * 1000;
+}
+
+/**
+ * @brief Close the connection and forget everything about it, so the next one starts clean.
+ */
+static void close_connection(void)
+{
+    close_cursor_channel();
+    SDLNet_TCP_Close(connected_socket);
+    connected_socket = NULL;
+    SDLNet_FreeSocketSet(socket_set);
+    socket_set = NULL;
+    send_len = 0;
+    recv_head = recv_tail = 0;
+    send_version = recv_version = 2;
+    SDL_zero(send_codec);
+    SDL_zero(recv_codec);
+    SDL_zero(link_stats);
+    ping_seq = 0;
+#ifdef MYMINES_SHM_LINK
+    close_shm_link(shm_link);
+    shm_link = NULL;
+#endif
+    send_transport = &tcp_transport;
+    set_recv_transport(&tcp_transport);
+}
+
+//-------------------------------------------------------------------
+// Transport
+//-------------------------------------------------------------------
+
+/**
+ * @brief Make a send on the socket fail if it makes no progress for "timeout" milliseconds.
+ *
+ * @note SDL_net doesn't give the descriptor out, it is the second member of its "struct _TCPsocket" (SDL_net 2).
+ */
+static void set_tcp_send_timeout(Uint32 timeout)
+{
+    struct {
+        int ready;
+#ifdef _WIN32
+        SOCKET channel;
+#else
+        int channel;
+#endif
+    } *p_head = (void *)connected_socket;
+#ifdef _WIN32
+    DWORD value = timeout;
+#else
+    struct timeval value = {timeout / 1000, timeout % 1000 * 1000};
+#endif
+    if (setsockopt(p_head->channel, SOL_SOCKET, SO_SNDTIMEO, (const char *)&value, sizeof(value)) != 0)
+        SDL_Log("Can't set the send timeout, a dead peer may block the network thread!\n");
+}
+
+static SDL_bool tcp_send(const void *data, Uint32 len)
+{
+    return SDLNet_TCP_Send(connected_socket, data, len) == (int)len;
+}
+
+static int tcp_recv(void *buf, Uint32 len)
+{
+    return SDLNet_TCP_Recv(connected_socket, buf, len);
+}
+
+static SDL_bool tcp_readable(void)
+{
+    return SDLNet_SocketReady(connected_socket) ? SDL_TRUE : SDL_FALSE;
+}
+
+/**
+ * @brief Sleep on "socket_set", which has the socket (until it is closed) and "wake_socket".
+ */
+static void tcp_wait(Uint32 timeout)
+{
+    if (SDLNet_CheckSockets(socket_set, timeout) < 0)
+        SDL_net_error("Check socket sets failed!\n%s\n", SDLNet_GetError());
+    if (SDLNet_SocketReady(wake_socket))
+        while (SDLNet_UDP_Recv(wake_socket, wake_recv_packet) > 0)
+            ;
+}
+
+static void tcp_wake(void)
+{
+    SDLNet_UDP_Send(wake_socket, -1, wake_send_packet); ///< If it fails, the thread still wakes up in a frame.
+}
+
+#ifdef MYMINES_SHM_LINK
+static SDL_bool shm_send(const void *data, Uint32 len)
+{
+    return write_shm_link(shm_link, data, len, SEND_TIMEOUT);
+}
+
+static int shm_recv(void *buf, Uint32 len)
+{
+    return read_shm_link(shm_link, buf, len);
+}
+
+static SDL_bool shm_readable(void)
+{
+    return is_shm_link_readable(shm_link);
+}
+
+static void shm_wait(Uint32 timeout)
+{
+    wait_shm_link(shm_link, timeout);
+}
+
+static void shm_wake(void)
+{
+    wake_shm_link(shm_link);
+}
+#else
+/* Never selected, see "offer_shm_link" and "handle_transport_packet". */
+static SDL_bool shm_send(const void *data, Uint32 len)
+{
+    (void)data, (void)len;
+    return SDL_FALSE;
+}
+
+static int shm_recv(void *buf, Uint32 len)
+{
+    (void)buf, (void)len;
+    return 0;
+}
+
+static SDL_bool shm_readable(void)
+{
+    return SDL_TRUE;
+}
+
+static void shm_wait(Uint32 timeout)
+{
+    (void)timeout;
+}
+
+static void shm_wake(void)
+{
+}
+#endif
+
+static const Transport *get_recv_transport(void)
+{
+    return SDL_AtomicGetPtr(&recv_transport);
+}
+
+/**
+ * @brief Switch the transport the network thread reads from.
+ *
+ * @note A wake of the main thread that races the switch may go to the old one, the thread then sleeps for at most
+ * "SEND_FRAME_INTERVAL".
+ */
+static void set_recv_transport(const Transport *p_transport)
+{
+    if (p_transport == &shm_transport && socket_set != NULL)
+        SDLNet_TCP_DelSocket(socket_set, connected_socket); ///< Idle from now on, don't wake up for it.
+    SDL_AtomicSetPtr(&recv_transport, (void *)p_transport);
+}
+
+/**
+ * @brief Stop reading when the other side has closed the connection, it stays readable forever.
+ */
+static void stop_recv_transport(void)
+{
+    if (get_recv_transport() == &tcp_transport)
+        SDLNet_TCP_DelSocket(socket_set, connected_socket);
+    else
+        set_recv_transport(&tcp_transport); ///< Only "wake_socket" is left in "socket_set".
+}
+
+static SDL_bool is_shm_enabled(void)
+{
+#ifdef MYMINES_SHM_LINK
+    const char *value = SDL_getenv(SHM_ENV);
+    return value == NULL || SDL_strcmp(value, "0") != 0;
+#else
+    return SDL_FALSE;
+#endif
+}
+
+/**
+ * @brief Return SDL_TRUE if the other side is on the same host: a loopback address or one of this host.
+ */
+static SDL_bool is_local_peer(void)
+{
+    IPaddress *p_peer_addr = SDLNet_TCP_GetPeerAddress(connected_socket);
+    if (p_peer_addr == NULL)
+        return SDL_FALSE;
+    Uint32 host = SDLNet_Read32(&p_peer_addr->host);
+    if ((host >> 24) == 127)
+        return SDL_TRUE;
+
+    IPaddress local_addrs[16];
+    int num = SDLNet_GetLocalAddresses(local_addrs, SDL_arraysize(local_addrs));
+    for (int i = 0; i < num; i++)
+        if (local_addrs[i].host == p_peer_addr->host)
+            return SDL_TRUE;
+    return SDL_FALSE;
+}
+
+/**
+ * @brief Called by the client at the end of the handshake, offer a shared memory link if the host is local.
+ *
+ * @note Only version 3 hosts (the game) know TYPE_TRANSPORT, "mymines-server" speaks version 2.
+ */
+static void offer_shm_link(void)
+{
+#ifdef MYMINES_SHM_LINK
+    if (send_version < 3 || !is_shm_enabled() || !is_local_peer())
+        return;
+    if ((shm_link = create_shm_link(shm_link_id++)) == NULL)
+        return;
+
+    MyMinesPacket mymines_packet;
+    SDL_zero(mymines_packet);
+    mymines_packet.transport_packet.type = TYPE_TRANSPORT;
+    mymines_packet.transport_packet.step = SHM_OFFER;
+    mymines_packet.transport_packet.pid = shm_link->self_pid;
+    mymines_packet.transport_packet.id = shm_link->id;
+    write_packet(&mymines_packet, SDL_TRUE);
+#endif
+}
+
+/**
+ * @brief Take the next step of moving to a shared memory link or of opening the cursor channel, see "net.h".
+ *
+ * @note Called by the owner of the socket in "read_packet", right where the packet is in the byte stream.
+ */
+static void handle_transport_packet(const TransportPacket *p_transport_packet)
+{
+    MyMinesPacket mymines_packet;
+    SDL_zero(mymines_packet);
+    mymines_packet.transport_packet.type = TYPE_TRANSPORT;
+    switch (p_transport_packet->step)
+    {
+    case UDP_OFFER:
+        mymines_packet.transport_packet.step = UDP_REFUSE;
+        if (cursor_socket == NULL && (open_cursor_channel(host_port, &mymines_packet.transport_packet.port)
+                || open_cursor_channel(0, &mymines_packet.transport_packet.port))) ///< Any port if it is taken.
+        {
+            cursor_token = p_transport_packet->id;
+            cursor_peer_known = SDL_FALSE;
+            mymines_packet.transport_packet.step = UDP_ACCEPT;
+            SDL_Log("Cursor channel: UDP port %hu\n", mymines_packet.transport_packet.port);
+        }
+        write_packet(&mymines_packet, SDL_TRUE);
+        return;
+    case UDP_ACCEPT:
+        if (cursor_socket == NULL)
+            break;
+        cursor_send_packet->address.host = SDLNet_TCP_GetPeerAddress(connected_socket)->host;
+        SDLNet_Write16(p_transport_packet->port, &cursor_send_packet->address.port);
+        cursor_peer_known = SDL_TRUE;
+        send_cursor_datagram(NULL); ///< So the server learns the address.
+        SDL_Log("Cursor channel: UDP port %hu\n", p_transport_packet->port);
+        return;
+    case UDP_REFUSE:
+        close_cursor_channel();
+        return;
+    default:
+        break;
+    }
+
+#ifdef MYMINES_SHM_LINK
+    switch (p_transport_packet->step)
+    {
+    case SHM_OFFER:
+        if (shm_link == NULL && is_shm_enabled() && is_local_peer()) ///< Refuse a link named by a remote peer.
+            shm_link = open_shm_link(p_transport_packet->pid, p_transport_packet->id);
+        if (shm_link == NULL)
+        {
+            mymines_packet.transport_packet.step = SHM_REFUSE;
+            write_packet(&mymines_packet, SDL_TRUE);
+            return;
+        }
+        mymines_packet.transport_packet.step = SHM_ACCEPT;
+        mymines_packet.transport_packet.pid = shm_link->self_pid;
+        write_packet(&mymines_packet, SDL_TRUE); ///< The last bytes on TCP.
+        send_transport = &shm_transport;
+        return;
+    case SHM_ACCEPT:
+        if (shm_link == NULL)
+            break;
+        shm_link->peer_pid = p_transport_packet->pid;
+        set_recv_transport(&shm_transport);
+        mymines_packet.transport_packet.step = SHM_SWITCHED;
+        write_packet(&mymines_packet, SDL_TRUE);
+        send_transport = &shm_transport;
+        SDL_Log("Transport: %s\n", shm_transport.name);
+        return;
+    case SHM_REFUSE:
+        close_shm_link(shm_link);
+        shm_link = NULL;
+        return;
+    case SHM_SWITCHED:
+        if (shm_link == NULL)
+            break;
+        set_recv_transport(&shm_transport);
+        SDL_Log("Transport: %s\n", shm_transport.name);
+        return;
+    default:
+        break;
+    }
+#else
+    if (p_transport_packet->step == SHM_OFFER)
+    {
+        mymines_packet.transport_packet.step = SHM_REFUSE;
+        write_packet(&mymines_packet, SDL_TRUE);
+        return;
+    }
+#endif
+    Error("Unexpected TYPE_TRANSPORT step %hhu!\n", p_transport_packet->step);
+}
+
+//-------------------------------------------------------------------
+// UDP cursor channel
+//-------------------------------------------------------------------
+
+/**
+ * @brief Open the UDP socket of the cursor channel and add it to "socket_set".
+ *
+ * @param port The port to bind, 0 for any.
+ * @param p_port Points to where the bound port is stored.
+ *
+ * @return Return SDL_FALSE if it can't be opened, mouse moves stay on TCP then.
+ */
+static SDL_bool open_cursor_channel(Uint16 port, Uint16 *p_port)
+{
+    if ((cursor_socket = SDLNet_UDP_Open(port)) == NULL)
+        return SDL_FALSE;
+    cursor_send_packet = SDLNet_AllocPacket(CURSOR_DATAGRAM_SIZE);
+    cursor_recv_packet = SDLNet_AllocPacket(CURSOR_DATAGRAM_SIZE);
+    IPaddress *p_addr = SDLNet_UDP_GetPeerAddress(cursor_socket, -1); ///< Channel -1 is the bound address.
+    if (cursor_send_packet == NULL || cursor_recv_packet == NULL || p_addr == NULL
+            || SDLNet_UDP_AddSocket(socket_set, cursor_socket) < 0)
+    {
+        SDL_Log("Can't open the cursor channel!\n%s\n", SDLNet_GetError());
+        close_cursor_channel();
+        return SDL_FALSE;
+    }
+    *p_port = SDLNet_Read16(&p_addr->port);
+    cursor_send_packet->len = CURSOR_DATAGRAM_SIZE;
+    cursor_send_seq = cursor_recv_seq = 0;
+    return SDL_TRUE;
+}
+
+static void close_cursor_channel(void)
+{
+    if (cursor_socket == NULL)
+        return;
+    if (cursor_send_seq > 0 || cursor_recv_seq > 0)
+        SDL_Log("Cursor channel: %u sent, %u received, %u stale, %u lost.\n", cursor_send_seq, cursor_recved,
+                cursor_stale, cursor_lost);
+    if (socket_set != NULL)
+        SDLNet_UDP_DelSocket(socket_set, cursor_socket);
+    SDLNet_UDP_Close(cursor_socket);
+    cursor_socket = NULL;
+    SDLNet_FreePacket(cursor_send_packet);
+    SDLNet_FreePacket(cursor_recv_packet);
+    cursor_send_packet = cursor_recv_packet = NULL;
+    cursor_peer_known = SDL_FALSE;
+    cursor_recved = cursor_stale = cursor_lost = 0;
+}
+
+/**
+ * @brief Called by the client at the end of the handshake, offer the cursor channel if "UDP_CURSOR_ENV" is set.
+ */
+static void offer_cursor_channel(void)
+{
+    const char *value = SDL_getenv(UDP_CURSOR_ENV);
+    if (send_version < 3 || value == NULL || SDL_strcmp(value, "1") != 0)
+        return;
+#ifdef MYMINES_SHM_LINK
+    if (shm_link != NULL)
+        return; ///< Nothing is lost in shared memory.
+#endif
+
+    MyMinesPacket mymines_packet;
+    SDL_zero(mymines_packet);
+    if (!open_cursor_channel(0, &mymines_packet.transport_packet.port))
+        return;
+    cursor_token = (Uint32)(SDL_GetPerformanceCounter() ^ (Uint64)SDL_GetTicks() << 16); ///< Only tells the datagrams apart.
+    mymines_packet.transport_packet.type = TYPE_TRANSPORT;
+    mymines_packet.transport_packet.step = UDP_OFFER;
+    mymines_packet.transport_packet.id = cursor_token;
+    write_packet(&mymines_packet, SDL_TRUE);
+}
+
+/**
+ * @brief Send a mouse move over the cursor channel, only called by the network thread.
+ *
+ * @param p_mouse_move_packet The mouse move, or NULL for the first datagram (sequence number 0).
+ *
+ * @return Return SDL_FALSE if the channel is not open yet, send it over TCP then.
+ */
+static SDL_bool send_cursor_datagram(const MouseMovePacket *p_mouse_move_packet)
+{
+    if (cursor_socket == NULL || !cursor_peer_known)
+        return SDL_FALSE;
+    Uint8 *data = cursor_send_packet->data;
+    SDLNet_Write32(cursor_token, data);
+    if (p_mouse_move_packet == NULL)
+    {
+        SDLNet_Write32(0, data + 4);
+        SDLNet_Write32(0, data + 8);
+        SDLNet_Write32(0, data + 12);
+        SDLNet_Write32(0, data + 16);
+    }
+    else
+    {
+        SDLNet_Write32(++cursor_send_seq, data + 4);
+        SDLNet_Write32(p_mouse_move_packet->pos_y, data + 8);
+        SDLNet_Write32(p_mouse_move_packet->pos_x, data + 12);
+        SDLNet_Write32(p_mouse_move_packet->input_time, data + 16);
+    }
+    SDLNet_UDP_Send(cursor_socket, -1, cursor_send_packet); ///< Lost like any datagram if it fails.
+    return SDL_TRUE;
+}
+
+/**
+ * @brief Read the datagrams of the cursor channel and pass the newest mouse moves to the main thread.
+ *
+ * @param now When they are read, in perf counter ticks.
+ *
+ * @return Return SDL_TRUE if a mouse move is passed.
+ */
+static SDL_bool recv_cursor_datagrams(Uint64 now)
+{
+    SDL_bool delivered = SDL_FALSE;
+    while (SDLNet_UDP_Recv(cursor_socket, cursor_recv_packet) > 0)
+    {
+        const Uint8 *data = cursor_recv_packet->data;
+        if (cursor_recv_packet->len != CURSOR_DATAGRAM_SIZE || SDLNet_Read32(data) != cursor_token)
+            continue;
+        if (!cursor_peer_known || cursor_send_packet->address.host != cursor_recv_packet->address.host
+                || cursor_send_packet->address.port != cursor_recv_packet->address.port)
+        {
+            cursor_send_packet->address = cursor_recv_packet->address; ///< The client, maybe behind a NAT.
+            cursor_peer_known = SDL_TRUE;
+        }
+
+        Uint32 seq = SDLNet_Read32(data + 4);
+        if (seq == 0)
+            continue;
+        if ((Sint32)(seq - cursor_recv_seq) <= 0)
+        {
+            cursor_stale++;
+            continue;
+        }
+        cursor_lost += seq - cursor_recv_seq - 1;
+        cursor_recv_seq = seq;
+        cursor_recved++;
+
+        MyMinesPacket mymines_packet;
+        SDL_zero(mymines_packet);
+        mymines_packet.mouse_move_packet.type = TYPE_MOUSE_MOVE;
+        mymines_packet.mouse_move_packet.pos_y = SDLNet_Read32(data + 8);
+        mymines_packet.mouse_move_packet.pos_x = SDLNet_Read32(data + 12);
+        mymines_packet.mouse_move_packet.input_time = SDLNet_Read32(data + 16);
+        if (push_packet_queue(&recv_queue, &mymines_packet, SDL_FALSE, now)) ///< Dropped like a lost one if full.
+            delivered = SDL_TRUE;
+    }
+    return delivered;
+}
+
+//-------------------------------------------------------------------
+// Packet queue
+//-------------------------------------------------------------------
+
+/**
+ * @brief Append a packet to a single-producer single-consumer queue, only called by the producer.
+ * 
+ * @return Return SDL_FALSE if the queue is full.
+ */
+static SDL_bool push_packet_queue(PacketQueue *p_queue, const MyMinesPacket *p_mymines_packet,
+        SDL_bool urgent, Uint64 recv_time)
+{
+    unsigned int tail = (unsigned int)SDL_AtomicGet(&p_queue->tail);
+    unsigned int head = (unsigned int)SDL_AtomicGet(&p_queue->head);
+    SDL_MemoryBarrierAcquire(); ///< The consumer is done with the slot before "head" moves past it.
+    if (tail - head == PACKET_QUEUE_SIZE)
+        return SDL_FALSE;
+    p_queue->packets[tail % PACKET_QUEUE_SIZE] = *p_mymines_packet;
+    p_queue->urgent[tail % PACKET_QUEUE_SIZE] = urgent;
+    p_queue->recv_times[tail % PACKET_QUEUE_SIZE] = recv_time;
+    SDL_MemoryBarrierRelease(); ///< The packet is written before the consumer sees the new "tail".
+    SDL_AtomicSet(&p_queue->tail, (int)(tail + 1));
+    return SDL_TRUE;
+}
+
+/**
+ * @brief Take the oldest packet from a single-producer single-consumer queue, only called by the consumer.
+ * 
+ * @param p_urgent Points to where the urgency of the packet is stored, can be NULL.
+ * @param p_recv_time Points to where the receive time of the packet is stored, can be NULL.
+ * 
+ * @return Return SDL_FALSE if the queue is empty.
+ */
+static SDL_bool pop_packet_queue(PacketQueue *p_queue, MyMinesPacket *p_mymines_packet,
+        SDL_bool *p_urgent, Uint64 *p_recv_time)
+{
+    unsigned int head = (unsigned int)SDL_AtomicGet(&p_queue->head);
+    unsigned int tail = (unsigned int)SDL_AtomicGet(&p_queue->tail);
+    SDL_MemoryBarrierAcquire();
+    if (head == tail)
+        return SDL_FALSE;
+    *p_mymines_packet = p_queue->packets[head % PACKET_QUEUE_SIZE];
+    if (p_urgent != NULL)
+        *p_urgent = p_queue->urgent[head % PACKET_QUEUE_SIZE];
+    if (p_recv_time != NULL)
+        *p_recv_time = p_queue->recv_times[head % PACKET_QUEUE_SIZE];
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicSet(&p_queue->head, (int)(head + 1));
+    return SDL_TRUE;
+}
+
+static SDL_bool is_packet_queue_full(PacketQueue *p_queue)
+{
+    return (unsigned int)SDL_AtomicGet(&p_queue->tail) - (unsigned int)SDL_AtomicGet(&p_queue->head) == PACKET_QUEUE_SIZE;
+}
+
+static Uint32 get_packet_queue_depth(PacketQueue *p_queue)
+{
+    return (unsigned int)SDL_AtomicGet(&p_queue->tail) - (unsigned int)SDL_AtomicGet(&p_queue->head);
+}
+
+static void reset_packet_queue(PacketQueue *p_queue)
+{
+    SDL_AtomicSet(&p_queue->head, 0);
+    SDL_AtomicSet(&p_queue->tail, 0);
+}
+
+//-------------------------------------------------------------------
+// Fill packet
+//-------------------------------------------------------------------
+
+static void fill_seed_key_packet(SeedKeyPacket *p_seed_key_packet, Uint64 key, Uint8 key_size)
+{
+    SDL_zerop(p_seed_key_packet);
+    p_seed_key_packet->type = TYPE_SEED_KEY;
+    p_seed_key_packet->key = key;
+    p_seed_key_packet->key_size = key_size;
+    SDL_memcpy(p_seed_key_packet->paddings, VERSION_MAGIC, VERSION_MAGIC_LEN); ///< Offer the newest protocol.
+    p_seed_key_packet->paddings[VERSION_MAGIC_LEN] = PROTOCOL_VERSION;
+}
+
+static void fill_settings_packet(SettingsPacket *p_settings_packet, Settings *p_settings)
+{
+    p_settings_packet->type = TYPE_SETTINGS;
+    p_settings_packet->settings.block_size = p_settings->block_size;
+    p_settings_packet->settings.game_mode = p_settings->game_mode;
+    p_settings_packet->settings.map_height = p_settings->map_height;
+    p_settings_packet->settings.map_width = p_settings->map_width;
+    p_settings_packet->settings.window_height = p_settings->window_height;
+    p_settings_packet->settings.window_width = p_settings->window_width;
+    p_settings_packet->settings.n_mine = p_settings->n_mine;
+}
+
+static void fill_click_map_packet(ClickMapPacket *p_click_map_packet,
+        ClickType click_type, unsigned int y, unsigned int x, Uint32 seq, Uint32 acked, Uint64 hash)
+{
+    SDL_zerop(p_click_map_packet);
+    p_click_map_packet->type = TYPE_CLICK_MAP;
+    p_click_map_packet->click_type = click_type;
+    p_click_map_packet->pos_y = y;
+    p_click_map_packet->pos_x = x;
+    p_click_map_packet->seq = seq;
+    p_click_map_packet->acked = acked;
+    p_click_map_packet->hash = hash;
+    p_click_map_packet->input_time = get_input_time();
+}
+
+static void fill_mouse_move_packet(MouseMovePacket *p_mouse_move_packet, unsigned int y, unsigned int x)
+{
+    SDL_zerop(p_mouse_move_packet);
+    p_mouse_move_packet->type = TYPE_MOUSE_MOVE;
+    p_mouse_move_packet->pos_y = y;
+    p_mouse_move_packet->pos_x = x;
+    p_mouse_move_packet->input_time = get_input_time();
+}
+
+//-------------------------------------------------------------------
+// Send packet
+//-------------------------------------------------------------------
+
+/**
+ * @brief Encode a packet in the send buffer, only called by the owner of the socket.
+ * 
+ * @param p_mymines_packet Points to the packet.
+ * @param urgent If SDL_TRUE, the buffer is sent now, otherwise with the next frame.
+ */
+static void write_packet(MyMinesPacket *p_mymines_packet, SDL_bool urgent)
+{
+    Uint8 buf[V3_PACKET_MAX];
+    const void *data = p_mymines_packet;
+    Uint32 len = sizeof(MyMinesPacket); ///< Version 2 sends the raw union.
+    if (send_version >= 3)
+    {
+        len = encode_packet_v3(p_mymines_packet, buf, &send_codec);
+        data = buf;
+    }
+
+    if (send_len + len > SEND_BUF_SIZE)
+        flush_send_buf();
+    if (send_len == 0)
+        send_ticks = SDL_GetTicks();
+    memcpy(send_buf + send_len, data, len);
+    send_len += len;
+    if (urgent)
+        flush_send_buf();
+}
+
+/**
+ * @brief Send a packet from the main thread.
+ * 
+ * @param p_mymines_packet Points to the packet.
+ * @param urgent If SDL_TRUE, the packet is sent now, otherwise with the next frame.
+ * 
+ * @note During the handshake the main thread owns the socket, after it the packet goes to the network thread.
+ * It never waits, see "pump_send_queue".
+ */
+static void send_mymines_packet(MyMinesPacket *p_mymines_packet, SDL_bool urgent)
+{
+    net_trace_packet(NET_TRACE_SENT, p_mymines_packet, urgent, SDL_GetPerformanceCounter());
+    if (replaying)
+    {
+        if (p_mymines_packet->type <= TYPE_TRANSPORT)
+            replay_sends[p_mymines_packet->type]++;
+        return;
+    }
+    if (net_thread == NULL)
+    {
+        write_packet(p_mymines_packet, urgent);
+        return;
+    }
+    if (backlog_dead)
+        return; ///< The session ends with the TYPE_QUIT delivered next.
+    pump_send_queue();
+    if (p_mymines_packet->type == TYPE_MOUSE_MOVE
+            && (backlog_head != backlog_tail || get_packet_queue_depth(&send_queue) >= SEND_QUEUE_CONGESTED))
+    {
+        if (has_pending_move)
+            send_stats.moves_superseded++;
+        pending_move = *p_mymines_packet;
+        has_pending_move = SDL_TRUE;
+        return;
+    }
+    if (backlog_head != backlog_tail || !push_packet_queue(&send_queue, p_mymines_packet, urgent, 0))
+        push_send_backlog(p_mymines_packet, urgent); ///< After the ones already waiting.
+    if (urgent)
+        wake_net_thread();
+}
+
+/**
+ * @brief Keep a packet that doesn't fit in the send queue, the backlog grows as needed.
+ * 
+ * @note When it reaches "SEND_BACKLOG_MAX" packets the other side is taken as dead, see "net.h".
+ */
+static void push_send_backlog(const MyMinesPacket *p_mymines_packet, SDL_bool urgent)
+{
+    if (backlog_tail - backlog_head >= SEND_BACKLOG_MAX)
+    {
+        SDL_Log("The other side hasn't read %u packets, close the connection!\n", SEND_BACKLOG_MAX);
+        backlog_dead = SDL_TRUE;
+        return;
+    }
+    if (backlog_tail == backlog_cap)
+    {
+        Uint32 len = backlog_tail - backlog_head;
+        Uint32 new_cap = len * 2 > backlog_cap ? (backlog_cap ? backlog_cap * 2 : PACKET_QUEUE_SIZE) : backlog_cap;
+        MyMinesPacket *new_backlog = malloc_fatal(new_cap * sizeof(MyMinesPacket), "push_send_backlog - new_backlog");
+        SDL_bool *new_urgent = malloc_fatal(new_cap * sizeof(SDL_bool), "push_send_backlog - new_urgent");
+        if (len > 0)
+        {
+            SDL_memcpy(new_backlog, send_backlog + backlog_head, len * sizeof(MyMinesPacket));
+            SDL_memcpy(new_urgent, send_backlog_urgent + backlog_head, len * sizeof(SDL_bool));
+        }
+        free(send_backlog);
+        free(send_backlog_urgent);
+        send_backlog = new_backlog;
+        send_backlog_urgent = new_urgent;
+        backlog_head = 0;
+        backlog_tail = len;
+        backlog_cap = new_cap;
+    }
+    send_backlog[backlog_tail] = *p_mymines_packet;
+    send_backlog_urgent[backlog_tail] = urgent;
+    backlog_tail++;
+    if (backlog_tail - backlog_head > send_stats.max_backlog)
+        send_stats.max_backlog = backlog_tail - backlog_head;
+}
+
+/**
+ * @brief Move what the send queue has room for from the backlog, then the pending mouse move if the queue is
+ * not congested. Called before each send and once per frame by the main thread.
+ */
+void pump_send_queue(void)
+{
+    if (net_thread == NULL)
+        return;
+    SDL_bool woken = SDL_FALSE;
+    while (backlog_head != backlog_tail
+            && push_packet_queue(&send_queue, &send_backlog[backlog_head], send_backlog_urgent[backlog_head], 0))
+    {
+        if (send_backlog_urgent[backlog_head])
+            woken = SDL_TRUE;
+        backlog_head++;
+    }
+    if (backlog_head == backlog_tail)
+        backlog_head = backlog_tail = 0;
+    if (has_pending_move && backlog_head == backlog_tail && get_packet_queue_depth(&send_queue) < SEND_QUEUE_CONGESTED)
+    {
+        push_packet_queue(&send_queue, &pending_move, SDL_FALSE, 0);
+        has_pending_move = SDL_FALSE;
+    }
+    if (woken)
+        wake_net_thread();
+
+    Uint32 depth = get_packet_queue_depth(&send_queue);
+    if (depth > send_stats.max_depth)
+        send_stats.max_depth = depth;
+}
+
+/**
+ * @brief Get the state of the sending side, see "SendQueueStats".
+ */
+void get_send_queue_stats(SendQueueStats *p_stats)
+{
+    *p_stats = send_stats;
+    p_stats->depth = get_packet_queue_depth(&send_queue);
+    p_stats->backlog = backlog_tail - backlog_head;
+}
+
+/**
+ * @brief Send all buffered packets with one call.
+ * 
+ * @note If it fails on the network thread, the link is closed like when the other side closes it: the packets
+ * after it are dropped and TYPE_QUIT is delivered to the main thread, see "net_thread_main".
+ */
+static void flush_send_buf(void)
+{
+    if (send_len == 0)
+        return;
+    TRACE_BEGIN(flush_send_buf);
+    if (SDL_AtomicGet(&send_closed))
+        ; ///< Dropped, the link is closed.
+    else if (!send_transport->send(send_buf, send_len))
+    {
+        if (SDL_ThreadID() != net_thread_id) ///< The main thread in the handshake.
+            SDL_net_error("Send mymines packet over %s failed!\n%s\n", send_transport->name, SDLNet_GetError());
+        SDL_Log("Send mymines packet over %s failed, close the connection!\n%s\n", send_transport->name,
+                SDLNet_GetError());
+        SDL_AtomicSet(&send_closed, 1);
+    }
+    send_len = 0;
+    TRACE_END(flush_send_buf);
+}
+
+/**
+ * @brief Called once per loop of the network thread, send the buffered packets if the oldest one has waited for a frame.
+ */
+static void flush_send_buf_per_frame(void)
+{
+    if (send_len > 0 && SDL_TICKS_PASSED(SDL_GetTicks(), send_ticks + SEND_FRAME_INTERVAL))
+        flush_send_buf();
+}
+
+void send_seed_key_packet(Uint64 key, Uint8 key_size)
+{
+    MyMinesPacket mymines_packet;
+    fill_seed_key_packet(&mymines_packet.seed_key_packet, key, key_size);
+    send_mymines_packet(&mymines_packet, SDL_FALSE);
+}
+
+void send_settings_packet(Settings *p_settings)
+{
+    MyMinesPacket mymines_packet;
+    fill_settings_packet(&mymines_packet.settings_packet, p_settings);
+    send_mymines_packet(&mymines_packet, SDL_TRUE);
+}
+
+/**
+ * @brief Send a click with the lockstep state of the sender, see "ClickMapPacket".
+ */
+void send_click_map_packet(ClickType click_type, unsigned int y, unsigned int x, Uint32 seq, Uint32 acked, Uint64 hash)
+{
+    MyMinesPacket mymines_packet;
+    fill_click_map_packet(&mymines_packet.click_map_packet, click_type, y, x, seq, acked, hash);
+    send_mymines_packet(&mymines_packet, SDL_TRUE);
+}
+
+void send_mouse_move_packet(unsigned int y, unsigned int x)
+{
+    MyMinesPacket mymines_packet;
+    fill_mouse_move_packet(&mymines_packet.mouse_move_packet, y, x);
+    send_mymines_packet(&mymines_packet, SDL_FALSE);
+}
+
+/**
+ * @brief Tell "mymines-server" which part of the board the coop player sees, see "ViewportPacket".
+ */
+void send_viewport_packet(Uint32 top, Uint32 left, Uint32 bottom, Uint32 right)
+{
+    MyMinesPacket mymines_packet;
+    SDL_zero(mymines_packet);
+    mymines_packet.viewport_packet.type = TYPE_VIEWPORT;
+    mymines_packet.viewport_packet.top = top;
+    mymines_packet.viewport_packet.left = left;
+    mymines_packet.viewport_packet.bottom = bottom;
+    mymines_packet.viewport_packet.right = right;
+    send_mymines_packet(&mymines_packet, SDL_FALSE);
+}
+
+void send_quit_packet(void)
+{
+    MyMinesPacket mymines_packet;
+    mymines_packet.type = TYPE_QUIT;
+    send_mymines_packet(&mymines_packet, SDL_TRUE);
+}
+
+void send_reveal_packet(const RevealPacket *p_reveal_packet, SDL_bool urgent)
+{
+    MyMinesPacket mymines_packet;
+    mymines_packet.reveal_packet = *p_reveal_packet;
+    send_mymines_packet(&mymines_packet, urgent);
+}
+
+void send_game_over_packet(void)
+{
+    MyMinesPacket mymines_packet;
+    mymines_packet.type = TYPE_GAME_OVER;
+    send_mymines_packet(&mymines_packet, SDL_TRUE);
+}
+
+void send_resync_packet(void)
+{
+    MyMinesPacket mymines_packet;
+    mymines_packet.type = TYPE_RESYNC;
+    send_mymines_packet(&mymines_packet, SDL_TRUE);
+}
+
+void send_snapshot_packet(const SnapshotPacket *p_snapshot_packet, SDL_bool urgent)
+{
+    MyMinesPacket mymines_packet;
+    mymines_packet.snapshot_packet = *p_snapshot_packet;
+    send_mymines_packet(&mymines_packet, urgent);
+}
+
+/**
+ * @brief Tell the other side that the packets after this one are in "version", and switch to it.
+ * 
+ * @note Only called by the owner of the socket, the main thread in the handshake or the network thread after it.
+ */
+static void send_version_packet(Uint8 version)
+{
+    MyMinesPacket mymines_packet;
+    SDL_zero(mymines_packet);
+    mymines_packet.version_packet.type = TYPE_VERSION;
+    mymines_packet.version_packet.version = version;
+    write_packet(&mymines_packet, SDL_TRUE); ///< In the old version.
+    send_version = version;
+    SDL_zero(send_codec);
+}
+
+//-------------------------------------------------------------------
+// Receive MyMinesPacket packet
+//-------------------------------------------------------------------
+
+/**
+ * @brief Read everything the socket has (up to the free space) into the receive ring with one call.
+ * 
+ * @return Return SDL_FALSE if the connection is closed or broken.
+ * 
+ * @note Blocks if the socket has no data, check the socket set first to avoid it.
+ * A packet may be split between calls, it stays in the ring until it is complete.
+ */
+static SDL_bool fill_recv_ring(void)
+{
+    TRACE_BEGIN(fill_recv_ring);
+    Uint32 offset = recv_tail % RECV_RING_SIZE;
+    Uint32 free_len = RECV_RING_SIZE - (recv_tail - recv_head);
+    if (free_len > RECV_RING_SIZE - offset)
+        free_len = RECV_RING_SIZE - offset; ///< Only the part before the end of the array, the rest is filled next time.
+    if (free_len > 0)
+    {
+        int len = get_recv_transport()->recv(recv_ring + offset, free_len);
+        if (len <= 0)
+        {
+            TRACE_END(fill_recv_ring);
+            return SDL_FALSE;
+        }
+        recv_tail += len;
+    }
+    TRACE_END(fill_recv_ring);
+    return SDL_TRUE;
+}
+
+/**
+ * @brief Copy bytes from the head of the receive ring without taking them.
+ */
+static void peek_recv_ring(void *buf, Uint32 len)
+{
+    Uint32 offset = recv_head % RECV_RING_SIZE;
+    Uint32 first_len = RECV_RING_SIZE - offset;
+    if (first_len >= len)
+        memcpy(buf, recv_ring + offset, len);
+    else
+    {
+        memcpy(buf, recv_ring + offset, first_len);
+        memcpy((Uint8 *)buf + first_len, recv_ring, len - first_len);
+    }
+}
+
+/**
+ * @brief Take the next complete packet from the receive ring, decoded in the current version.
+ * 
+ * @param p_mymines_packet Points to the packet will be filled in.
+ * 
+ * @return Return SDL_FALSE if there is no complete packet.
+ * 
+ * @note TYPE_VERSION is handled here and never returned. Only called by the owner of the socket.
+ */
+static SDL_bool read_packet(MyMinesPacket *p_mymines_packet)
+{
+    for (;;)
+    {
+        Uint32 len = recv_tail - recv_head;
+        if (recv_version >= 3)
+        {
+            Uint8 buf[V3_PACKET_MAX];
+            if (len > V3_PACKET_MAX)
+                len = V3_PACKET_MAX;
+            peek_recv_ring(buf, len);
+            int packet_len = decode_packet_v3(buf, len, p_mymines_packet, &recv_codec);
+            if (packet_len < 0 || (packet_len == 0 && len == V3_PACKET_MAX))
+                Error("Malformed packet of type %hhu!\n", buf[0]);
+            if (packet_len == 0)
+                return SDL_FALSE;
+            recv_head += packet_len;
+        }
+        else
+        {
+            if (len < sizeof(MyMinesPacket))
+                return SDL_FALSE;
+            peek_recv_ring(p_mymines_packet, sizeof(MyMinesPacket));
+            recv_head += sizeof(MyMinesPacket);
+            if (p_mymines_packet->type == TYPE_CLICK_MAP)
+                p_mymines_packet->click_map_packet.has_hash = 0; ///< No lockstep in version 2.
+        }
+
+        if (p_mymines_packet->type == TYPE_TRANSPORT)
+        {
+            handle_transport_packet(&p_mymines_packet->transport_packet);
+            continue;
+        }
+        if (p_mymines_packet->type != TYPE_VERSION)
+            return SDL_TRUE;
+        Uint8 version = p_mymines_packet->version_packet.version;
+        if (version < 2 || version > PROTOCOL_VERSION)
+            Error("Unsupported protocol version %hhu!\n", version);
+        recv_version = version;
+        SDL_zero(recv_codec);
+        if (send_version < version) ///< The server answers the version of the client.
+            send_version_packet(version);
+    }
+}
+
+/**
+ * @brief Wait until a complete packet is received, only used in the handshake.
+ * 
+ * @param p_mymines_packet Points to the packet will be filled in.
+ * @param start_ticks When the waiting started.
+ * @param timeout In milliseconds, 0 to wait forever.
+ * 
+ * @return Return SDL_FALSE if the user cancels, it times out or the connection is closed.
+ */
+static SDL_bool wait_recv_packet(MyMinesPacket *p_mymines_packet, Uint32 start_ticks, Uint32 timeout)
+{
+    TRACE_BEGIN(wait_recv_packet);
+    SDL_bool received = SDL_TRUE;
+    while (!read_packet(p_mymines_packet))
+    {
+        if (!wait_menu_main(start_ticks, timeout))
+        {
+            received = SDL_FALSE;
+            break;
+        }
+        int ready_socket_num = SDLNet_CheckSockets(socket_set, WAIT_POLL_INTERVAL);
+        if (ready_socket_num < 0)
+            SDL_net_error("Check socket sets failed!\n%s\n", SDLNet_GetError());
+        if (ready_socket_num > 0 && !fill_recv_ring())
+        {
+            SDL_Log("The connection is closed in handshake!\n");
+            received = SDL_FALSE;
+            break;
+        }
+    }
+    if (received)
+        net_trace_packet(NET_TRACE_RECVED, p_mymines_packet, SDL_FALSE, SDL_GetPerformanceCounter());
+    TRACE_END(wait_recv_packet);
+    return received;
+}
+
+/**
+ * @brief Take the next packet the network thread has received.
+ * 
+ * @param p_mymines_packet Points to the packet will be filled in.
+ * @param p_recv_time Points to when it was read from the socket in perf counter ticks, can be NULL.
+ * 
+ * @return Return SDL_FALSE if there is no packet.
+ * 
+ * @note Call "rearm_net_event" before taking the packets, so the ones arrive after it wake the main thread again.
+ * When the send backlog is full, TYPE_QUIT is taken at once, as if the other side has quit.
+ */
+SDL_bool pop_recved_packet(MyMinesPacket *p_mymines_packet, Uint64 *p_recv_time)
+{
+    Uint64 recv_time;
+    if (backlog_dead)
+    {
+        SDL_zerop(p_mymines_packet);
+        p_mymines_packet->type = TYPE_QUIT;
+        recv_time = SDL_GetPerformanceCounter();
+    }
+    else if (!pop_packet_queue(&recv_queue, p_mymines_packet, NULL, &recv_time))
+        return SDL_FALSE;
+    net_trace_packet(NET_TRACE_RECVED, p_mymines_packet, SDL_FALSE, recv_time);
+    if (p_recv_time != NULL)
+        *p_recv_time = recv_time;
+    return SDL_TRUE;
+}
+
+void rearm_net_event(void)
+{
+    SDL_AtomicSet(&net_event_pending, 0);
+}
 
 //-------------------------------------------------------------------
-// Functions
+// Ping
 //-------------------------------------------------------------------
 
 /**
- * @brief Wrapper for "SDLNet_ResolveHost" used in server.
- * 
- * @param p_addr Points to the IPaddress that will be filled in.
- * @param port The port to listen on.
+ * @brief Perf counter ticks to microseconds, without overflow for any uptime.
  */
-static void server_resolve_host(IPaddress *p_addr, Uint32 port)
+static Uint64 counter_to_us(Uint64 counter)
 {
-    if (SDLNet_ResolveHost(p_addr, NULL, port) < 0)
-        SDL_net_error("Can't resolve server host: port: %hu!\n%s\n", port, SDLNet_GetError());
+    Uint64 freq = SDL_GetPerformanceFrequency();
+    return counter / freq * 1000000 + counter % freq * 1000000 / freq;
 }
 
 /**
- * @brief Wrapper for "SDLNet_ResolveHost" used in client.
+ * @brief Send TYPE_PING, only called by the network thread.
+ */
+static void send_ping_packet(Uint64 now)
+{
+    MyMinesPacket mymines_packet;
+    SDL_zero(mymines_packet);
+    mymines_packet.ping_packet.type = TYPE_PING;
+    mymines_packet.ping_packet.seq = ++ping_seq;
+    mymines_packet.ping_packet.ping_time = counter_to_us(now);
+    write_packet(&mymines_packet, SDL_TRUE);
+}
+
+/**
+ * @brief Answer TYPE_PING at once, only called by the network thread.
  * 
- * @param p_addr Points to the IPaddress that will be filled in.
- * @param host A hostname or IP to connect with the server.
- * @param port The server's listening port number.
+ * @param p_ping_packet The ping.
+ * @param recv_time When it was read from the socket, in perf counter ticks.
  */
-static void client_resolve_host(IPaddress *p_addr, const char *host, Uint32 port)
+static void send_pong_packet(const PingPacket *p_ping_packet, Uint64 recv_time)
 {
-    if (SDLNet_ResolveHost(p_addr, host, port) < 0)
-        SDL_net_error("Can't resolve client host: %s:%hu!\n%s\n", host, port, SDLNet_GetError());
+    MyMinesPacket mymines_packet;
+    SDL_zero(mymines_packet);
+    mymines_packet.ping_packet = *p_ping_packet;
+    mymines_packet.ping_packet.type = TYPE_PONG;
+    mymines_packet.ping_packet.recv_time = counter_to_us(recv_time);
+    mymines_packet.ping_packet.hold_time = counter_to_us(SDL_GetPerformanceCounter() - recv_time);
+    write_packet(&mymines_packet, SDL_TRUE);
 }
 
 /**
- * @brief See if "connected_socket" in the "socket_set" in this module has the data ready.
+ * @brief Add the RTT and clock offset of a pong to "link_stats", see "LinkStats".
  * 
- * @return Return SDL_TRUE if the "connected_socket" has the data ready.
+ * @param p_pong_packet The pong.
+ * @param recv_time When it was read from the socket, in perf counter ticks.
  */
-SDL_bool is_connected_socket_ready(void)
+static void update_link_stats(const PingPacket *p_pong_packet, Uint64 recv_time)
 {
-    int ready_socket_num = SDLNet_CheckSockets(socket_set, 0);
-    ///< Since "connected_socket" is the only socket in "socket_set", no need to call "SDLNet_SocketReady".
+    Uint64 t3 = counter_to_us(recv_time), t0 = p_pong_packet->ping_time;
+    if (p_pong_packet->seq == 0 || p_pong_packet->seq > ping_seq || t0 > t3 || p_pong_packet->hold_time > t3 - t0)
+        return; ///< Not a pong of a ping of this connection.
+    Uint64 rtt64 = t3 - t0 - p_pong_packet->hold_time;
+    Uint32 rtt = rtt64 > SDL_MAX_UINT32 ? SDL_MAX_UINT32 : (Uint32)rtt64;
+    Uint64 t1 = p_pong_packet->recv_time, t2 = t1 + p_pong_packet->hold_time;
+    Sint64 offset = ((Sint64)(t1 - t0) + (Sint64)(t2 - t3)) / 2;
 
-    if (ready_socket_num < 0)
-        SDL_net_error("Check socket sets failed!\n%s\n", SDLNet_GetError());
-    if (ready_socket_num == 0)
-        return SDL_FALSE;
-    return SDL_TRUE;
-}
+    LinkStats stats;
+    SDL_AtomicLock(&link_lock);
+    stats = link_stats;
+    SDL_AtomicUnlock(&link_lock);
 
-//-------------------------------------------------------------------
-// Fill packet
-//-------------------------------------------------------------------
+    unsigned int window_len = stats.pongs < PING_WINDOW ? stats.pongs + 1 : PING_WINDOW;
+    ping_rtts[stats.pongs % PING_WINDOW] = rtt;
+    ping_offsets[stats.pongs % PING_WINDOW] = offset;
+    unsigned int best = 0;
+    for (unsigned int i = 1; i < window_len; i++)
+        if (ping_rtts[i] < ping_rtts[best])
+            best = i;
 
-static void fill_seed_key_packet(SeedKeyPacket *p_seed_key_packet, Uint64 key, Uint8 key_size)
-{
-    p_seed_key_packet->type = TYPE_SEED_KEY;
-    p_seed_key_packet->key = key;
-    p_seed_key_packet->key_size = key_size;
+    if (stats.pongs == 0)
+    {
+        stats.srtt = rtt;
+        stats.jitter = rtt / 2;
+    }
+    else
+    {
+        Uint32 deviation = stats.srtt > rtt ? stats.srtt - rtt : rtt - stats.srtt;
+        stats.jitter = (3 * (Uint64)stats.jitter + deviation) / 4;
+        stats.srtt = (7 * (Uint64)stats.srtt + rtt) / 8;
+    }
+    stats.last_rtt = rtt;
+    stats.offset = ping_offsets[best];
+    stats.pongs++;
+
+    SDL_AtomicLock(&link_lock);
+    link_stats = stats;
+    SDL_AtomicUnlock(&link_lock);
 }
 
-static void fill_settings_packet(SettingsPacket *p_settings_packet, Settings *p_settings)
+/**
+ * @brief Get the latest state of the link, all zero before the first pong.
+ */
+void get_link_stats(LinkStats *p_stats)
 {
-    p_settings_packet->type = TYPE_SETTINGS;
-    p_settings_packet->settings.block_size = p_settings->block_size;
-    p_settings_packet->settings.game_mode = p_settings->game_mode;
-    p_settings_packet->settings.map_height = p_settings->map_height;
-    p_settings_packet->settings.map_width = p_settings->map_width;
-    p_settings_packet->settings.window_height = p_settings->window_height;
-    p_settings_packet->settings.window_width = p_settings->window_width;
-    p_settings_packet->settings.n_mine = p_settings->n_mine;
+    SDL_AtomicLock(&link_lock);
+    *p_stats = link_stats;
+    SDL_AtomicUnlock(&link_lock);
 }
 
-static void fill_click_map_packet(ClickMapPacket *p_click_map_packet,
-        ClickType click_type, unsigned int y, unsigned int x)
+/**
+ * @brief The time of an input to send in its packet, the low 32 bits of the local clock in microseconds.
+ * 
+ * @return Never 0, which means unknown.
+ */
+Uint32 get_input_time(void)
 {
-    p_click_map_packet->type = TYPE_CLICK_MAP;
-    p_click_map_packet->click_type = click_type;
-    p_click_map_packet->pos_y = y;
-    p_click_map_packet->pos_x = x;
+    return (Uint32)counter_to_us(SDL_GetPerformanceCounter()) | 1;
 }
 
-static void fill_mouse_move_packet(MouseMovePacket *p_mouse_move_packet, unsigned int y, unsigned int x)
+/**
+ * @brief Estimate when a remote input happened on the local clock, for the latency of remote inputs.
+ * 
+ * @param recv_time When its packet was read from the socket, in perf counter ticks.
+ * @param input_time The time of the sender in the packet (see "get_input_time"), 0 if it has none.
+ * 
+ * @return Return "input_time" mapped through the clock offset, see "LinkStats". Without it, or before the first
+ * pong, return "recv_time" minus half of the smoothed RTT ("recv_time" itself before the first pong).
+ * 
+ * @note "input_time" has only 32 bits, it is taken as the latest time that is not after "recv_time" on the
+ * clock of the sender. "mymines-server" clears it in coop rooms, the offset is to the server there.
+ */
+Uint64 estimate_remote_input_time(Uint64 recv_time, Uint32 input_time)
 {
-    p_mouse_move_packet->type = TYPE_MOUSE_MOVE;
-    p_mouse_move_packet->pos_y = y;
-    p_mouse_move_packet->pos_x = x;
+    LinkStats stats;
+    get_link_stats(&stats);
+    Uint64 freq = SDL_GetPerformanceFrequency();
+    if (input_time == 0 || stats.pongs == 0)
+    {
+        Uint64 one_way = (Uint64)stats.srtt / 2 * freq / 1000000;
+        return one_way < recv_time ? recv_time - one_way : recv_time;
+    }
+
+    Uint32 remote_recv = (Uint32)(counter_to_us(recv_time) + stats.offset);
+    Sint32 age = (Sint32)(remote_recv - input_time); ///< Microseconds from the input to the arrival.
+    if (age < 0)
+        age = 0; ///< The offset is off by more than the delay.
+    Uint64 age_ticks = (Uint64)age * freq / 1000000;
+    return age_ticks < recv_time ? recv_time - age_ticks : recv_time;
 }
 
 //-------------------------------------------------------------------
-// Send packet
+// Network thread
 //-------------------------------------------------------------------
 
-static void send_mymines_packet(MyMinesPacket *p_mymines_packet)
+/**
+ * @brief Wake the network thread up from the wait of its transport.
+ */
+static void wake_net_thread(void)
 {
-    if (SDLNet_TCP_Send(connected_socket, p_mymines_packet, sizeof(MyMinesPacket)) != sizeof(MyMinesPacket))
-        SDL_net_error("Send mymines packet len not match!\n%s\n", SDLNet_GetError());
+    get_recv_transport()->wake();
 }
 
-void send_seed_key_packet(Uint64 key, Uint8 key_size)
+/**
+ * @brief Move the complete packets in the receive ring to "recv_queue" and tell the main thread.
+ * 
+ * @param closed If SDL_TRUE, TYPE_QUIT is delivered after the last packet, as if the other side quit.
+ * 
+ * @return Return SDL_FALSE after TYPE_QUIT is delivered, nothing is read after it.
+ */
+static SDL_bool deliver_recved_packets(SDL_bool closed)
 {
     MyMinesPacket mymines_packet;
-    fill_seed_key_packet(&mymines_packet.seed_key_packet, key, key_size);
-    send_mymines_packet(&mymines_packet);
-}
+    SDL_bool delivered = SDL_FALSE, reading = SDL_TRUE;
+    Uint64 now = SDL_GetPerformanceCounter(); ///< Right after the bytes are read.
 
-void send_settings_packet(Settings *p_settings)
-{
-    MyMinesPacket mymines_packet;
-    fill_settings_packet(&mymines_packet.settings_packet, p_settings);
-    send_mymines_packet(&mymines_packet);
+    while (reading && !is_packet_queue_full(&recv_queue))
+    {
+        if (!read_packet(&mymines_packet))
+        {
+            if (!closed)
+                break;
+            SDL_zero(mymines_packet);
+            mymines_packet.type = TYPE_QUIT;
+        }
+        if (mymines_packet.type == TYPE_PING)
+        {
+            if (!closed)
+                send_pong_packet(&mymines_packet.ping_packet, now);
+            continue;
+        }
+        if (mymines_packet.type == TYPE_PONG)
+        {
+            update_link_stats(&mymines_packet.ping_packet, now);
+            continue;
+        }
+        push_packet_queue(&recv_queue, &mymines_packet, SDL_FALSE, now);
+        delivered = SDL_TRUE;
+        reading = mymines_packet.type != TYPE_QUIT;
+    }
+
+    if (delivered)
+        push_net_event();
+    return reading;
 }
 
-void send_click_map_packet(ClickType click_type, unsigned int y, unsigned int x)
+/**
+ * @brief Tell the main thread there are packets in "recv_queue", at most one event is pending.
+ */
+static void push_net_event(void)
 {
-    MyMinesPacket mymines_packet;
-    fill_click_map_packet(&mymines_packet.click_map_packet, click_type, y, x);
-    send_mymines_packet(&mymines_packet);
+    if (!SDL_AtomicCAS(&net_event_pending, 0, 1))
+        return;
+    SDL_Event event;
+    SDL_zero(event);
+    event.type = net_event;
+    if (SDL_PushEvent(&event) < 0)
+        SDL_AtomicSet(&net_event_pending, 0); ///< The main thread still polls the queue every frame.
 }
 
-void send_mouse_move_packet(unsigned int y, unsigned int x)
+/**
+ * @brief The only user of the socket after the handshake. Sleeps until the socket or "wake_socket" is ready,
+ * or the oldest buffered packet has waited for a frame.
+ * 
+ * @param data Unused.
+ */
+static int net_thread_main(void *data)
 {
+    (void)data;
+    SDL_bool reading = SDL_TRUE, closed = SDL_FALSE;
     MyMinesPacket mymines_packet;
-    fill_mouse_move_packet(&mymines_packet.mouse_move_packet, y, x);
-    send_mymines_packet(&mymines_packet);
+    SDL_bool urgent;
+
+    net_thread_id = SDL_ThreadID();
+
+    while (!SDL_AtomicGet(&net_thread_quit))
+    {
+        get_recv_transport()->wait(SEND_FRAME_INTERVAL);
+        if (reading && cursor_socket != NULL && SDLNet_SocketReady(cursor_socket)
+                && recv_cursor_datagrams(SDL_GetPerformanceCounter()))
+            push_net_event();
+
+        if (!closed && (SDL_AtomicGet(&send_closed) || (get_recv_transport()->readable() && !fill_recv_ring())))
+        {
+            closed = SDL_TRUE;
+            stop_recv_transport();
+        }
+        if (reading)
+        {
+            reading = deliver_recved_packets(closed);
+            if (reading && is_packet_queue_full(&recv_queue))
+                SDL_Delay(1); ///< The socket stays ready until the main thread catches up.
+        }
+
+        while (pop_packet_queue(&send_queue, &mymines_packet, &urgent, NULL))
+            if (mymines_packet.type != TYPE_MOUSE_MOVE || !send_cursor_datagram(&mymines_packet.mouse_move_packet))
+                write_packet(&mymines_packet, urgent);
+        if (!closed && SDL_TICKS_PASSED(SDL_GetTicks(), ping_ticks + PING_INTERVAL))
+        {
+            send_ping_packet(SDL_GetPerformanceCounter());
+            ping_ticks = SDL_GetTicks();
+        }
+        flush_send_buf_per_frame();
+    }
+
+    while (pop_packet_queue(&send_queue, &mymines_packet, &urgent, NULL)) ///< TYPE_QUIT is usually the last one.
+        write_packet(&mymines_packet, urgent);
+    flush_send_buf();
+    return 0;
 }
 
-void send_quit_packet(void)
+/**
+ * @brief Hand the socket over to a new network thread, called at the end of the handshake.
+ */
+static void start_net_thread(void)
 {
-    MyMinesPacket mymines_packet;
-    mymines_packet.type = TYPE_QUIT;
-    send_mymines_packet(&mymines_packet);
+    if (net_event == (Uint32)-1 && (net_event = SDL_RegisterEvents(1)) == (Uint32)-1)
+        SDL_net_error("Can't register net event!\n%s\n", SDL_GetError());
+
+    if ((wake_socket = SDLNet_UDP_Open(0)) == NULL)
+        SDL_net_error("Can't open wake socket!\n%s\n", SDLNet_GetError());
+    wake_send_packet = SDLNet_AllocPacket(1);
+    wake_recv_packet = SDLNet_AllocPacket(1);
+    if (wake_send_packet == NULL || wake_recv_packet == NULL)
+        SDL_net_error("Can't alloc wake packet!\n%s\n", SDLNet_GetError());
+    IPaddress *p_wake_addr = SDLNet_UDP_GetPeerAddress(wake_socket, -1); ///< Channel -1 is the bound address.
+    if (p_wake_addr == NULL)
+        SDL_net_error("Can't get wake socket addr!\n%s\n", SDLNet_GetError());
+    SDLNet_Write32(INADDR_LOOPBACK, &wake_send_packet->address.host);
+    wake_send_packet->address.port = p_wake_addr->port;
+    wake_send_packet->len = 1;
+    SDLNet_UDP_AddSocket(socket_set, wake_socket);
+
+    ping_ticks = SDL_GetTicks() - PING_INTERVAL; ///< The first ping goes right away.
+    set_tcp_send_timeout(SEND_TIMEOUT); ///< Also for the last bytes on TCP before a shared memory link.
+    if ((net_thread = SDL_CreateThread(net_thread_main, "net", NULL)) == NULL)
+        SDL_net_error("Can't create net thread!\n%s\n", SDL_GetError());
 }
 
 //-------------------------------------------------------------------
-// Receive MyMinesPacket packet
+// Connect
 //-------------------------------------------------------------------
 
-void recv_mymines_packet(MyMinesPacket *p_mymines_packet)
+/**
+ * @brief Try "SDLNet_TCP_Open" once in a detached thread, since it blocks until connected or refused.
+ */
+static ConnectJob *start_connect_job(const IPaddress *p_addr)
+{
+    ConnectJob *p_job = malloc_fatal(sizeof(ConnectJob), "start_connect_job - p_job");
+    p_job->addr = *p_addr;
+    p_job->socket = NULL;
+    if ((p_job->done = SDL_CreateSemaphore(0)) == NULL)
+        SDL_net_error("Can't create connect semaphore!\n%s\n", SDL_GetError());
+    SDL_AtomicSet(&p_job->cancelled, 0);
+    SDL_AtomicSet(&p_job->refcount, 2);
+
+    SDL_Thread *thread = SDL_CreateThread(connect_worker, "connect", p_job);
+    if (thread == NULL)
+        SDL_net_error("Can't create connect thread!\n%s\n", SDL_GetError());
+    SDL_DetachThread(thread);
+    return p_job;
+}
+
+static int connect_worker(void *data)
+{
+    ConnectJob *p_job = data;
+    p_job->socket = SDLNet_TCP_Open(&p_job->addr);
+    SDL_SemPost(p_job->done);
+    release_connect_job(p_job);
+    return 0;
+}
+
+/**
+ * @brief Drop a reference of the job, the last one frees it and closes the socket nobody wants.
+ */
+static void release_connect_job(ConnectJob *p_job)
+{
+    if (!SDL_AtomicDecRef(&p_job->refcount))
+        return;
+    if (SDL_AtomicGet(&p_job->cancelled) && p_job->socket != NULL)
+        SDLNet_TCP_Close(p_job->socket);
+    SDL_DestroySemaphore(p_job->done);
+    free(p_job);
+}
+
+/**
+ * @brief Connect to the server, retry with exponential backoff until it accepts, the user cancels or it times out.
+ * 
+ * @param p_addr The server's address.
+ * @param start_ticks When the waiting started.
+ * @param timeout In milliseconds, 0 to wait forever.
+ * 
+ * @return Return the connected socket, or NULL if the user cancels or it times out.
+ * 
+ * @note An attempt in progress is left to its thread, the socket is closed if it connects later.
+ */
+static TCPsocket connect_with_backoff(const IPaddress *p_addr, Uint32 start_ticks, Uint32 timeout)
 {
-    if (SDLNet_TCP_Recv(connected_socket, p_mymines_packet, sizeof(MyMinesPacket)) != sizeof(MyMinesPacket))
-        SDL_net_error("Recv mymines packet len not match!\n%s\n", SDLNet_GetError());
+    TCPsocket socket = NULL;
+    ConnectJob *p_job = NULL;
+    Uint32 backoff = CONNECT_BACKOFF_MIN, next_try_ticks = start_ticks;
+
+    while (socket == NULL && wait_menu_main(start_ticks, timeout))
+    {
+        if (p_job == NULL)
+        {
+            Uint32 now = SDL_GetTicks();
+            if (SDL_TICKS_PASSED(now, next_try_ticks))
+                p_job = start_connect_job(p_addr);
+            else
+                SDL_Delay(SDL_min(next_try_ticks - now, WAIT_POLL_INTERVAL));
+        }
+        else if (SDL_SemWaitTimeout(p_job->done, WAIT_POLL_INTERVAL) == 0)
+        {
+            socket = p_job->socket;
+            release_connect_job(p_job);
+            p_job = NULL;
+            if (socket == NULL)
+            {
+                SDL_Log("Can't connect, retry in %u ms.\n%s\n", backoff, SDLNet_GetError());
+                next_try_ticks = SDL_GetTicks() + backoff;
+                backoff = SDL_min(backoff * 2, CONNECT_BACKOFF_MAX);
+            }
+        }
+    }
+
+    if (p_job != NULL)
+    {
+        SDL_AtomicSet(&p_job->cancelled, 1);
+        release_connect_job(p_job);
+    }
+    return socket;
 }
 
 //-------------------------------------------------------------------
 // Launch as server or client
 //-------------------------------------------------------------------
 
+static void log_peer_addr(void)
+{
+    IPaddress *peer_addr = SDLNet_TCP_GetPeerAddress(connected_socket);
+    if (peer_addr == NULL)
+        SDL_net_error("Can't get peer addr!\n");
+    const char *peer_name = SDLNet_ResolveIP(peer_addr);
+    if (peer_name == NULL)
+        SDL_net_error("Can't resovle peer addr!\n");
+    SDL_Log("Remode addr: %s\n", peer_name);
+}
+
+/**
+ * @brief Send the seed key and settings to the accepted client and hand the socket to the network thread.
+ */
+static void start_hosted_session(Settings *p_settings)
+{
+    log_peer_addr(); /** TODO: Show the client ip on window */
+
+    send_seed_key_packet(host_key, host_key_size);
+    send_settings_packet(p_settings);
+
+    socket_set = SDLNet_AllocSocketSet(3); ///< With "wake_socket" and "cursor_socket".
+    SDLNet_TCP_AddSocket(socket_set, connected_socket);
+    start_net_thread();
+}
+
 /**
  * @brief Listen on port and wait for connection, send the seed key and settings, add socket to socket set.
  * 
@@ -168,6 +1587,8 @@ void recv_mymines_packet(MyMinesPacket *p_mymines_packet)
  * @param key_size The size of key will be sent.
  * @param p_settings Point to the settings will be sent.
  * 
+ * @return Return SDL_FALSE if the user cancels or it times out.
+ * 
  * @warning If the game is the server,
  * the function must be called before ANY send and recv function.
  */
@@ -179,34 +1600,31 @@ SDL_bool host_game(Uint32 port, Uint64 key, Uint8 key_size, Settings *p_settings
     TCPsocket server_listen_socket = SDLNet_TCP_Open(&listen_addr);
     if (server_listen_socket == NULL)
         SDL_net_error("Can't open server listen socket!\n%s\n", SDLNet_GetError());
+    SDLNet_SocketSet listen_set = SDLNet_AllocSocketSet(1);
+    if (listen_set == NULL)
+        SDL_net_error("Can't alloc listen socket set!\n%s\n", SDLNet_GetError());
+    SDLNet_TCP_AddSocket(listen_set, server_listen_socket);
 
-    SDL_bool finished;
-    while (!connected_socket)
+    Uint32 start_ticks = SDL_GetTicks(), timeout = get_timeout_env(ACCEPT_TIMEOUT_ENV, DEFAULT_ACCEPT_TIMEOUT);
+    while (connected_socket == NULL && wait_menu_main(start_ticks, timeout))
     {
-        connected_socket = SDLNet_TCP_Accept(server_listen_socket);
-        finished = host_menu_main();
-        if (!finished)
-            break;
+        int ready_socket_num = SDLNet_CheckSockets(listen_set, WAIT_POLL_INTERVAL); ///< Sleep until a client comes.
+        if (ready_socket_num < 0)
+            SDL_net_error("Check listen socket set failed!\n%s\n", SDLNet_GetError());
+        if (ready_socket_num > 0)
+            connected_socket = SDLNet_TCP_Accept(server_listen_socket);
     }
 
+    SDLNet_FreeSocketSet(listen_set);
     SDLNet_TCP_Close(server_listen_socket);
 
+    SDL_bool finished = connected_socket != NULL;
     if (finished)
     {
-        /** TODO: Show the client ip on window */
-        IPaddress *peer_addr = SDLNet_TCP_GetPeerAddress(connected_socket);
-        if (peer_addr == NULL)
-            SDL_net_error("Can't get peer addr!\n");
-        const char *peer_name = SDLNet_ResolveIP(peer_addr);
-        if (peer_name == NULL)
-            SDL_net_error("Can't resovle peer addr!\n");
-        SDL_Log("Remode addr: %s\n", peer_name);
-
-        send_seed_key_packet(key, key_size);
-        send_settings_packet(p_settings);
-
-        socket_set = SDLNet_AllocSocketSet(1);
-        SDLNet_TCP_AddSocket(socket_set, connected_socket);
+        host_port = port;
+        host_key = key;
+        host_key_size = key_size;
+        start_hosted_session(p_settings);
     }
 
     return finished;
@@ -219,65 +1637,239 @@ SDL_bool host_game(Uint32 port, Uint64 key, Uint8 key_size, Settings *p_settings
  * @param port The server's listening port number.
  * @param p_key Points to key will be filled in.
  * @param p_key_size Points to key size will be filled in.
- * @param p_settings Points to settings will be filled in.
+ * @param p_settings Points to settings will be filled in. If its game mode is coop, it is sent first to ask
+ *                   "mymines-server" for a coop room, with the map size or 0 for the default one.
+ * @param p_in_progress Points to where it is stored whether the coop game has started, a snapshot follows then.
+ * @param p_player Points to where the number of the local player in the coop room is stored.
+ * 
+ * @return Return SDL_FALSE if the user cancels, it times out or the server closes the connection in handshake.
  * 
  * @warning If the game is the client,
  * the function must be called before ANY send and recv function.
  */
-SDL_bool join_game(const char *host, Uint32 port, Uint64 *p_key, Uint8 *p_key_size, Settings *p_settings)
+SDL_bool join_game(const char *host, Uint32 port, Uint64 *p_key, Uint8 *p_key_size, Settings *p_settings,
+        SDL_bool *p_in_progress, Uint8 *p_player)
 {
     IPaddress server_addr;
     client_resolve_host(&server_addr, host, port);
 
-    /** TODO: 1. Draw Connect status 
-     *        2. Allow user to quit.
-     */
-    while(!connected_socket)
-        connected_socket = SDLNet_TCP_Open(&server_addr);
+    Uint32 start_ticks = SDL_GetTicks(), timeout = get_timeout_env(CONNECT_TIMEOUT_ENV, DEFAULT_CONNECT_TIMEOUT);
+    if ((connected_socket = connect_with_backoff(&server_addr, start_ticks, timeout)) == NULL)
+        return SDL_FALSE;
 
-    /** TODO: Show the server ip on window */
-    IPaddress *peer_addr = SDLNet_TCP_GetPeerAddress(connected_socket);
-    if (peer_addr == NULL)
-        SDL_net_error("Can't get peer addr!\n");
-    const char *peer_name = SDLNet_ResolveIP(peer_addr);
-    if (peer_name == NULL)
-        SDL_net_error("Can't resovle peer addr!\n");
-    SDL_Log("Remode addr: %s\n", peer_name);
+    log_peer_addr(); /** TODO: Show the server ip on window */
 
-    socket_set = SDLNet_AllocSocketSet(1);
+    socket_set = SDLNet_AllocSocketSet(3); ///< With "wake_socket" and "cursor_socket" of the network thread.
     SDLNet_TCP_AddSocket(socket_set, connected_socket);
 
+    SDL_bool coop = is_coop_mode(p_settings->game_mode) != 0;
+    if (coop)
+        send_settings_packet(p_settings);
+    *p_in_progress = SDL_FALSE;
+    *p_player = 0;
+
     MyMinesPacket mymines_packet;
-    while (!is_connected_socket_ready())
-        ;
-    recv_mymines_packet(&mymines_packet);
+    if (!wait_recv_packet(&mymines_packet, start_ticks, timeout)) ///< The timeout covers the handshake too.
+    {
+        close_connection();
+        return SDL_FALSE;
+    }
     if (mymines_packet.type != TYPE_SEED_KEY)
         Error("Packet should be a TYPE_SEED_KEY packet, not %hhu!\n", mymines_packet.type);
     *p_key = mymines_packet.seed_key_packet.key;
     *p_key_size = mymines_packet.seed_key_packet.key_size;
+    const Uint8 *paddings = mymines_packet.seed_key_packet.paddings;
+    if (SDL_memcmp(paddings, VERSION_MAGIC, VERSION_MAGIC_LEN) == 0 && paddings[VERSION_MAGIC_LEN] >= 3)
+    {
+        Uint8 version = SDL_min(paddings[VERSION_MAGIC_LEN], PROTOCOL_VERSION);
+        send_version_packet(version);
+        SDL_Log("Protocol version: %hhu\n", version);
+    }
     SDL_Log("key: %llu, key_size: %hhu", *p_key, *p_key_size);
 
-    while (!is_connected_socket_ready())
-        ;
-    recv_mymines_packet(&mymines_packet);
+    if (!wait_recv_packet(&mymines_packet, start_ticks, timeout)) ///< May be already in the receive ring with the seed key.
+    {
+        close_connection();
+        return SDL_FALSE;
+    }
     if (mymines_packet.type != TYPE_SETTINGS)
         Error("Packet should be a TYPE_SETTINGS packet, not %hhu!\n", mymines_packet.type);
 
     *p_settings = mymines_packet.settings_packet.settings;
+    set_client_mode(p_settings->game_mode); ///< The game mode is sent from the server's view.
 
+    if (coop && !is_coop_mode(p_settings->game_mode))
+        SDL_Log("The server has no coop room, play with it.\n");
+    else if (coop)
+    {
+        if (!wait_recv_packet(&mymines_packet, start_ticks, timeout))
+        {
+            close_connection();
+            return SDL_FALSE;
+        }
+        if (mymines_packet.type != TYPE_COOP_JOIN)
+            Error("Packet should be a TYPE_COOP_JOIN packet, not %hhu!\n", mymines_packet.type);
+        *p_in_progress = mymines_packet.player_packet.in_progress != 0;
+        *p_player = mymines_packet.player_packet.player;
+        if (is_spectate_mode(p_settings->game_mode))
+            SDL_Log("Watching a coop room%s.\n", *p_in_progress ? ", the game is in progress" : "");
+        else
+            SDL_Log("Joined a coop room as player %hhu%s.\n", mymines_packet.player_packet.player,
+                    *p_in_progress ? ", the game is in progress" : "");
+    }
+    offer_shm_link(); ///< The answers are handled by the network thread.
+    offer_cursor_channel();
+
+    start_net_thread();
+    return SDL_TRUE;
+}
+
+//-------------------------------------------------------------------
+// Rejoin
+//-------------------------------------------------------------------
+
+/**
+ * @brief Listen on the port of "host_game" again after the client leaves, so that a client can join the game
+ * in progress. The game goes on locally meanwhile, see "accept_rejoin".
+ * 
+ * @return Return SDL_FALSE if the port can't be opened, then nobody can rejoin.
+ */
+SDL_bool listen_for_rejoin(void)
+{
+    if (replaying)
+        return SDL_FALSE;
+    if (SDLNet_Init() < 0)
+    {
+        SDL_Log("Can't init SDL_Net to wait for a rejoin!\n%s\n", SDLNet_GetError());
+        return SDL_FALSE;
+    }
+    IPaddress listen_addr;
+    server_resolve_host(&listen_addr, host_port);
+    if ((rejoin_listen_socket = SDLNet_TCP_Open(&listen_addr)) == NULL)
+    {
+        SDL_Log("Can't listen on port %u for a rejoin!\n%s\n", host_port, SDLNet_GetError());
+        SDLNet_Quit();
+        return SDL_FALSE;
+    }
+    if ((rejoin_listen_set = SDLNet_AllocSocketSet(1)) == NULL)
+        SDL_net_error("Can't alloc listen socket set!\n%s\n", SDLNet_GetError());
+    SDLNet_TCP_AddSocket(rejoin_listen_set, rejoin_listen_socket);
+    SDL_Log("Waiting for a client to rejoin on port %u.\n", host_port);
+    return SDL_TRUE;
+}
+
+/**
+ * @brief Accept a client if one is waiting, without blocking, and start a session like "host_game".
+ * 
+ * @param p_settings Points to the settings will be sent.
+ * 
+ * @return Return SDL_TRUE if a client has joined, the caller sends it a snapshot then.
+ */
+SDL_bool accept_rejoin(Settings *p_settings)
+{
+    int ready_socket_num = SDLNet_CheckSockets(rejoin_listen_set, 0);
+    if (ready_socket_num < 0)
+        SDL_net_error("Check listen socket set failed!\n%s\n", SDLNet_GetError());
+    if (ready_socket_num == 0 || (connected_socket = SDLNet_TCP_Accept(rejoin_listen_socket)) == NULL)
+        return SDL_FALSE;
+
+    close_rejoin_listener();
+    start_hosted_session(p_settings);
     return SDL_TRUE;
 }
 
+static void close_rejoin_listener(void)
+{
+    SDLNet_FreeSocketSet(rejoin_listen_set);
+    rejoin_listen_set = NULL;
+    SDLNet_TCP_Close(rejoin_listen_socket);
+    rejoin_listen_socket = NULL;
+}
+
+/**
+ * @brief Stop waiting for a client to rejoin, undo "listen_for_rejoin".
+ */
+void stop_listening_for_rejoin(void)
+{
+    close_rejoin_listener();
+    SDLNet_Quit();
+}
+
 //-------------------------------------------------------------------
 // Finish stuff
 //-------------------------------------------------------------------
 
 /**
  * @brief Finish connection and SDL_Net.
+ * 
+ * @note The network thread sends the queued packets (TYPE_QUIT) before it exits.
  */
 void finish_sdl_net(void)
 {
-    SDLNet_TCP_Close(connected_socket);
-    SDLNet_FreeSocketSet(socket_set);
+    if (net_thread != NULL)
+    {
+        SDL_AtomicSet(&net_thread_quit, 1);
+        wake_net_thread();
+        SDL_WaitThread(net_thread, NULL);
+        net_thread = NULL;
+        net_thread_id = 0;
+        SDL_AtomicSet(&net_thread_quit, 0);
+        SDL_AtomicSet(&send_closed, 0);
+        if (send_stats.max_depth > 0)
+            SDL_Log("Send queue: max depth %u, max backlog %u, %llu mouse moves superseded.\n", send_stats.max_depth,
+                    send_stats.max_backlog, (unsigned long long)send_stats.moves_superseded);
+        reset_packet_queue(&send_queue);
+        reset_packet_queue(&recv_queue);
+        free(send_backlog);
+        free(send_backlog_urgent);
+        send_backlog = NULL;
+        send_backlog_urgent = NULL;
+        backlog_head = backlog_tail = backlog_cap = 0;
+        has_pending_move = SDL_FALSE;
+        backlog_dead = SDL_FALSE;
+        SDL_zero(send_stats);
+        free_snapshot_collector();
+        SDL_AtomicSet(&net_event_pending, 0);
+        SDLNet_UDP_Close(wake_socket);
+        wake_socket = NULL;
+        SDLNet_FreePacket(wake_send_packet);
+        SDLNet_FreePacket(wake_recv_packet);
+    }
+    close_connection();
     SDLNet_Quit();
+    net_trace_flush();
+}
+
+//-------------------------------------------------------------------
+// Replay
+//-------------------------------------------------------------------
+
+/**
+ * @brief Stand in for the network thread to replay a trace without sockets, see "mymines-net-replay".
+ * The caller pushes the received packets with "push_replayed_packet", the packets the game sends are counted.
+ */
+void start_net_replay(void)
+{
+    replaying = SDL_TRUE;
+    SDL_zero(replay_sends);
+}
+
+/**
+ * @brief Pass a packet of the trace to the game, as if it was read from the socket now.
+ *
+ * @return Return SDL_FALSE if the receive queue is full, take the packets with "handle_recved_packet" first.
+ */
+SDL_bool push_replayed_packet(const MyMinesPacket *p_mymines_packet)
+{
+    return push_packet_queue(&recv_queue, p_mymines_packet, SDL_FALSE, SDL_GetPerformanceCounter());
+}
+
+/**
+ * @brief Get the number of packets the game has sent in the replay.
+ *
+ * @param counts Filled in by type, "TYPE_TRANSPORT" + 1 of them.
+ */
+void get_replay_sends(Uint32 *counts)
+{
+    SDL_memcpy(counts, replay_sends, sizeof(replay_sends));
 }
@@ -0,0 +1,152 @@
+/**
+ * @file net_trace.c
+ * @author jkilopu
+ * @brief Provides the packet recording of "net_trace.h" and loading for the replay.
+ */
+#include "net_trace.h"
+#include "fatal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static FILE *trace_fp;
+static int trace_state; ///< 0 before "NET_TRACE_ENV" is read, 1 recording, -1 off.
+static Uint64 trace_start;
+
+//-------------------------------------------------------------------
+// Record
+//-------------------------------------------------------------------
+
+/**
+ * @brief Create the file in "NET_TRACE_ENV", the first time a packet is recorded.
+ *
+ * @return Return SDL_TRUE if recording.
+ */
+static SDL_bool open_net_trace(void)
+{
+    if (trace_state != 0)
+        return trace_state > 0;
+    trace_state = -1;
+    const char *path = SDL_getenv(NET_TRACE_ENV);
+    if (path == NULL)
+        return SDL_FALSE;
+    if ((trace_fp = fopen(path, "wb")) == NULL)
+    {
+        SDL_Log("Can't open net trace %s!\n", path);
+        return SDL_FALSE;
+    }
+    setvbuf(trace_fp, NULL, _IOFBF, NET_TRACE_BUF_SIZE);
+
+    NetTraceHeader header;
+    SDL_zero(header);
+    SDL_memcpy(header.magic, NET_TRACE_MAGIC, sizeof(header.magic));
+    header.version = NET_TRACE_VERSION;
+    header.record_size = sizeof(NetTraceRecord);
+    fwrite(&header, sizeof(header), 1, trace_fp);
+    trace_start = SDL_GetPerformanceCounter();
+    trace_state = 1;
+    atexit(close_net_trace);
+    SDL_Log("Recording packets to %s\n", path);
+    return SDL_TRUE;
+}
+
+static void close_net_trace(void)
+{
+    if (trace_fp != NULL)
+        fclose(trace_fp);
+    trace_fp = NULL;
+}
+
+/**
+ * @brief Record a packet if "NET_TRACE_ENV" is set, only called by the main thread.
+ *
+ * @param counter When it was sent or read from the socket, in perf counter ticks.
+ */
+void net_trace_packet(NetTraceDirection direction, const MyMinesPacket *p_mymines_packet, SDL_bool urgent,
+        Uint64 counter)
+{
+    if (!open_net_trace())
+        return;
+    Uint64 freq = SDL_GetPerformanceFrequency();
+    Uint64 ticks = counter > trace_start ? counter - trace_start : 0; ///< Read before the trace started.
+
+    NetTraceRecord record;
+    SDL_zero(record);
+    record.time = ticks / freq * 1000000 + ticks % freq * 1000000 / freq;
+    record.direction = direction;
+    record.urgent = urgent;
+    record.packet = *p_mymines_packet;
+    fwrite(&record, sizeof(record), 1, trace_fp);
+}
+
+/**
+ * @brief Record the key the local mine generator is seeded with.
+ */
+void net_trace_seed(Uint64 key, Uint8 key_size)
+{
+    MyMinesPacket mymines_packet;
+    SDL_zero(mymines_packet);
+    mymines_packet.seed_key_packet.type = TYPE_SEED_KEY;
+    mymines_packet.seed_key_packet.key = key;
+    mymines_packet.seed_key_packet.key_size = key_size;
+    net_trace_packet(NET_TRACE_SEED, &mymines_packet, SDL_FALSE, SDL_GetPerformanceCounter());
+}
+
+/**
+ * @brief Write the buffered records, so the file is complete when the connection ends.
+ */
+void net_trace_flush(void)
+{
+    if (trace_fp != NULL)
+        fflush(trace_fp);
+}
+
+//-------------------------------------------------------------------
+// Load
+//-------------------------------------------------------------------
+
+/**
+ * @brief Read all records of a trace file.
+ *
+ * @param p_num Points to where the number of records is stored.
+ *
+ * @return Return the records, free them with "free", or NULL if the file is not a trace of this version.
+ */
+NetTraceRecord *load_net_trace(const char *path, Uint32 *p_num)
+{
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+    {
+        SDL_Log("Can't open net trace %s!\n", path);
+        return NULL;
+    }
+    NetTraceHeader header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, NET_TRACE_MAGIC, sizeof(header.magic)) != 0
+            || header.version != NET_TRACE_VERSION || header.record_size != sizeof(NetTraceRecord))
+    {
+        SDL_Log("%s is not a net trace of version %d!\n", path, NET_TRACE_VERSION);
+        fclose(fp);
+        return NULL;
+    }
+
+    Uint32 num = 0, cap = 1024;
+    NetTraceRecord *records = malloc_fatal(cap * sizeof(NetTraceRecord), "load_net_trace - records");
+    for (;;)
+    {
+        if (num == cap)
+        {
+            cap *= 2;
+            NetTraceRecord *new_records = realloc(records, cap * sizeof(NetTraceRecord));
+            if (new_records == NULL)
+                Error("load_net_trace: %s\n", MALLOC_FAIL_MSG);
+            records = new_records;
+        }
+        size_t n = fread(records + num, sizeof(NetTraceRecord), cap - num, fp);
+        num += n;
+        if (num < cap)
+            break;
+    }
+    fclose(fp);
+    *p_num = num; ///< A record cut by a crash is left out.
+    return records;
+}
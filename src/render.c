@@ -16,6 +16,8 @@
 #include "block.h"
 #include "cursor.h"
 #include "menu.h"
+#include "latency.h"
+#include "trace.h"
 #include "fatal.h"
 
 Drawer drawer;
@@ -32,6 +34,26 @@ extern SDL_Texture *return_button_texture;
 extern SDL_Texture *restart_button_texture;
 extern SDL_Texture *quit_button_texture;
 
+#define MEDIA_JOB_NUM (8 + BLOCK_TEXTURE_NUM + 1) ///< Menu, block and cursor media.
+
+/**
+ * @brief An image to decode in the loader thread and the texture to upload it to.
+ */
+typedef struct {
+    const char *path;
+    SDL_Texture **p_texture;
+    MediaGroup group;
+} MediaJob;
+
+static MediaJob media_jobs[MEDIA_JOB_NUM];
+static SDL_Surface *loaded_surfaces[MEDIA_JOB_NUM];
+static int loaded_media_num;   ///< Written by the loader thread, protected by "media_mutex".
+static int uploaded_media_num; ///< Only used in the main thread.
+static SDL_mutex *media_mutex;
+static SDL_cond *media_cond;
+static SDL_Thread *media_thread;
+static Uint32 media_loaded_event;
+
 void drawer_init(int win_width, int win_height, Uint32 win_flag, Uint32 renderer_flag)
 {
     drawer.window = SDL_CreateWindow("mymines", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, win_width, win_height, win_flag);
@@ -43,17 +65,86 @@ void drawer_init(int win_width, int win_height, Uint32 win_flag, Uint32 renderer
     SDL_SetRenderDrawColor( drawer.renderer, 0xFF, 0xFF, 0xFF, 0xFF );
 }
 
-void drawer_set_window_size(int window_height, int window_width)
+/**
+ * @brief Init the drawer with an offscreen surface and the software renderer, no window is created.
+ * 
+ * @param width The surface width.
+ * @param height The surface height.
+ */
+void drawer_init_headless(int width, int height)
 {
-    SDL_SetWindowSize(drawer.window, window_height, window_width);
+    drawer.surface = SDL_CreateRGBSurfaceWithFormat(0, width, height, 32, SDL_PIXELFORMAT_ARGB8888);
+    if (drawer.surface == NULL)
+        SDL_render_fatal_error("Offscreen surface could not be created!\n%s\n", SDL_GetError());
+    drawer.renderer = SDL_CreateSoftwareRenderer(drawer.surface);
+    if (drawer.renderer == NULL)
+        SDL_render_fatal_error("Software renderer could not be created!\n%s\n", SDL_GetError());
+    SDL_SetRenderDrawColor( drawer.renderer, 0xFF, 0xFF, 0xFF, 0xFF );
 }
 
+/**
+ * @brief Set the window size in screen coordinates, which may differ from pixels on high-DPI displays.
+ */
+void drawer_set_window_size(int window_width, int window_height)
+{
+    if (drawer.window != NULL)
+        SDL_SetWindowSize(drawer.window, window_width, window_height);
+}
+
+/**
+ * @brief Scale everything drawn from a fixed logical size to the output.
+ * 
+ * @note Pass 0 as both width and height to draw at the native pixel resolution again.
+ */
 void drawer_set_logical_size(int logical_width, int logical_height)
 {
     if (SDL_RenderSetLogicalSize(drawer.renderer, logical_width, logical_height) < 0)
         SDL_render_fatal_error("Can't set logical size: %s", SDL_GetError());
 }
 
+/**
+ * @brief Get the size of the output in pixels.
+ */
+void drawer_get_output_size(int *p_width, int *p_height)
+{
+    if (SDL_GetRendererOutputSize(drawer.renderer, p_width, p_height) < 0)
+        SDL_render_fatal_error("Can't get output size: %s", SDL_GetError());
+}
+
+/**
+ * @brief Restrict drawing to a rect of the output, the origin of everything drawn moves to the rect's corner.
+ * 
+ * @param p_r The rect in pixels.
+ */
+void drawer_set_viewport(const SDL_Rect *p_r)
+{
+    if (SDL_RenderSetViewport(drawer.renderer, p_r) < 0)
+        SDL_render_fatal_error("Can't set viewport: %s", SDL_GetError());
+    drawer.viewport = *p_r;
+}
+
+/**
+ * @brief Convert a window position (e.g. from mouse events) to pixels relative to the viewport.
+ * 
+ * @param p_y The pointer to window pos on y axis.
+ * @param p_x The pointer to window pos on x axis.
+ * 
+ * @return Return SDL_FALSE if the position is outside the viewport (e.g. in the letterbox), the result is
+ *         negative or past the viewport then.
+ */
+SDL_bool drawer_window2pixel(int *p_y, int *p_x)
+{
+    int output_w, output_h, window_w, window_h;
+    drawer_get_output_size(&output_w, &output_h);
+    window_w = output_w, window_h = output_h;
+    if (drawer.window != NULL)
+        SDL_GetWindowSize(drawer.window, &window_w, &window_h);
+
+    *p_y = *p_y * output_h / window_h - drawer.viewport.y;
+    *p_x = *p_x * output_w / window_w - drawer.viewport.x;
+    return *p_y >= 0 && *p_x >= 0 && *p_y < drawer.viewport.h && *p_x < drawer.viewport.w;
+}
+
 void drawer_add_viewport(SDL_Rect rs[], int num)
 {
     if (num > DEFAULT_MAX_VIEWPORT_NUM)
@@ -85,6 +176,7 @@ SDL_Texture *drawer_load_texture(const char *path)
  */
 void draw(SDL_Texture *t, const SDL_Rect *src_r, const SDL_Rect *dst_r)
 {
+    latency_mark_draw();
     if (SDL_RenderCopy(drawer.renderer, t, src_r, dst_r) != 0)
         SDL_render_fatal_error("Copy error!\n%s\n", SDL_GetError());
 }
@@ -104,27 +196,65 @@ void draw_mutiple(SDL_Texture *ts[], const SDL_Rect *src_rs, const SDL_Rect *dst
             draw(ts[i], &src_rs[i], &dst_rs[i]);
 }
 
+/**
+ * @brief Wrapper function for "SDL_RenderPresent", all frames must be presented with it to be measured.
+ */
+void drawer_present(void)
+{
+    TRACE_BEGIN(SDL_RenderPresent);
+    SDL_RenderPresent(drawer.renderer);
+    TRACE_END(SDL_RenderPresent);
+    latency_presented();
+}
+
 void drawer_finit(void)
 {
     SDL_DestroyRenderer(drawer.renderer);
-    SDL_DestroyWindow(drawer.window);
+    if (drawer.window != NULL)
+        SDL_DestroyWindow(drawer.window);
+    if (drawer.surface != NULL)
+        SDL_FreeSurface(drawer.surface);
     drawer.window = NULL;
     drawer.renderer = NULL;
+    drawer.surface = NULL;
 }
 
 /**
- * @brief Init SDL2 with necessary settings.
+ * @brief Init SDL2 with necessary settings, the backend is selected by the "HEADLESS_ENV" environment variable.
  */
 void init_sdl(void)
 {
+    const char *headless = SDL_getenv(HEADLESS_ENV);
+    if (headless != NULL && headless[0] != '\0' && headless[0] != '0')
+        init_sdl_backend(DRAWER_HEADLESS);
+    else
+        init_sdl_backend(DRAWER_WINDOW);
+}
+
+/**
+ * @brief Init SDL2 and the drawer with the specified backend.
+ * 
+ * @param backend DRAWER_WINDOW for an accelerated window,
+ * DRAWER_HEADLESS for an offscreen surface, which needs no display server.
+ */
+void init_sdl_backend(DrawerBackend backend)
+{
+    if (backend == DRAWER_HEADLESS)
+        SDL_SetHint(SDL_HINT_VIDEODRIVER, "dummy"); ///< Only the event queue is needed from the video subsystem.
     if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER) < 0)
         SDL_render_fatal_error("SDL could not initialize!\n%s\n", SDL_GetError());
+    /* The timer pushes "SDL_USEREVENT", reserve it before other events are registered. */
+    if (SDL_RegisterEvents(1) != SDL_USEREVENT)
+        SDL_render_fatal_error("Can't reserve SDL_USEREVENT for the timer!\n%s\n", SDL_GetError());
     /* Scale is needed, so try to make it better. */
     if (!SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "1"))
         SDL_render_fatal_error("SDL set scale hint error!\n%s\n", SDL_GetError());
     
-    drawer_init(MAIN_WIN_SIZE, MAIN_WIN_SIZE, SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE, SDL_RENDERER_ACCELERATED);
-    drawer_set_logical_size(MAIN_WIN_SIZE, MAIN_WIN_SIZE);
+    if (backend == DRAWER_HEADLESS)
+        drawer_init_headless(MAIN_WIN_SIZE, MAIN_WIN_SIZE);
+    else
+        drawer_init(MAIN_WIN_SIZE, MAIN_WIN_SIZE, SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE | SDL_WINDOW_ALLOW_HIGHDPI, SDL_RENDERER_ACCELERATED);
+    drawer_set_logical_size(MAIN_WIN_SIZE, MAIN_WIN_SIZE); ///< Only menus are scaled, the game draws at native resolution.
     
     int img_flags = 0; ///< MAYBE: mutiple picture format
     if(!(IMG_Init(img_flags) == img_flags))
@@ -132,47 +262,125 @@ void init_sdl(void)
 }
 
 /**
- * @brief Load media required throwgh out the game.
+ * @brief Decode the images of "media_jobs" one by one and queue the surfaces for "upload_loaded_media".
+ * 
+ * @param data Unused.
+ * 
+ * @note Only decoding happens here, textures must be created in the thread that owns the renderer.
+ */
+static int media_loader_thread(void *data)
+{
+    (void)data;
+    for (int i = 0; i < MEDIA_JOB_NUM; i++)
+    {
+        SDL_Surface *surface = IMG_Load(media_jobs[i].path);
+        if (surface == NULL)
+            SDL_render_fatal_error("Unable to load image %s!\n%s\n", media_jobs[i].path, IMG_GetError());
+
+        SDL_LockMutex(media_mutex);
+        loaded_surfaces[i] = surface;
+        loaded_media_num = i + 1;
+        SDL_CondSignal(media_cond);
+        SDL_UnlockMutex(media_mutex);
+
+        SDL_Event event;
+        SDL_zero(event);
+        event.type = media_loaded_event;
+        SDL_PushEvent(&event); ///< Wake up the menu waiting for events.
+    }
+    return 0;
+}
+
+/**
+ * @brief Start loading media required throwgh out the game in the loader thread.
+ * 
+ * @note The media are loaded in the order of "MediaGroup",
+ * use "wait_media" before drawing anything of a group.
  */
 void load_media(void)
 {
-    for (int i = 0; i < BLOCK_TEXTURE_NUM; i++)
-        block_textures[i] = drawer_load_texture(block_image_paths[i]);
-    remote_cursor_texture = drawer_load_texture(REMOTE_CURSOR_IMG_PATH);
-    local_button_texture = drawer_load_texture(LOCAL_BUTTON_PATH);
-    main_menu_texture = drawer_load_texture(MAIN_MENU_PATH);
-    lan_button_texture = drawer_load_texture(LAN_BUTTON_PATH);
-    server_button_texture = drawer_load_texture(SERVER_BUTTON_PATH);
-    client_button_texture = drawer_load_texture(CLIENT_BUTTON_PATH);
-    return_button_texture = drawer_load_texture(RETURN_BUTTON_PATH);
-    restart_button_texture = drawer_load_texture(RESTART_BUTTON_PATH);
-    quit_button_texture = drawer_load_texture(QUIT_BUTTON_PATH);
+    const MediaJob menu_jobs[] = {
+        {MAIN_MENU_PATH, &main_menu_texture, MEDIA_MENU},
+        {LOCAL_BUTTON_PATH, &local_button_texture, MEDIA_MENU},
+        {LAN_BUTTON_PATH, &lan_button_texture, MEDIA_MENU},
+        {SERVER_BUTTON_PATH, &server_button_texture, MEDIA_MENU},
+        {CLIENT_BUTTON_PATH, &client_button_texture, MEDIA_MENU},
+        {RETURN_BUTTON_PATH, &return_button_texture, MEDIA_MENU},
+        {RESTART_BUTTON_PATH, &restart_button_texture, MEDIA_MENU},
+        {QUIT_BUTTON_PATH, &quit_button_texture, MEDIA_MENU},
+    };
+    int job_num = 0;
+
+    for (unsigned int i = 0; i < SDL_arraysize(menu_jobs); i++)
+        media_jobs[job_num++] = menu_jobs[i];
+    for (int i = 0; i < BLOCK_TEXTURE_NUM; i++, job_num++)
+    {
+        media_jobs[job_num].path = block_image_paths[i];
+        media_jobs[job_num].p_texture = &block_textures[i];
+        media_jobs[job_num].group = MEDIA_BLOCK;
+    }
+    media_jobs[job_num].path = REMOTE_CURSOR_IMG_PATH;
+    media_jobs[job_num].p_texture = &remote_cursor_texture;
+    media_jobs[job_num].group = MEDIA_ALL;
+
+    if ((media_loaded_event = SDL_RegisterEvents(1)) == (Uint32)-1)
+        SDL_other_fatal_error("Can't register media event!\n%s\n", SDL_GetError());
+    if ((media_mutex = SDL_CreateMutex()) == NULL || (media_cond = SDL_CreateCond()) == NULL)
+        SDL_other_fatal_error("Can't create media lock!\n%s\n", SDL_GetError());
+    if ((media_thread = SDL_CreateThread(media_loader_thread, "media_loader", NULL)) == NULL)
+        SDL_other_fatal_error("Can't create media loader thread!\n%s\n", SDL_GetError());
 }
 
 /**
- * @brief Set the window size
+ * @brief Create textures from the surfaces decoded so far. Never blocks.
  * 
- * @param w The window width.
- * @param h The window height.
- *
- * @note Why destroy and reload resoures:
- * The renderer is related to window,
- * and the texture is related to renderer.
- * So I have to delete and reload... That's painful.
- */
-//void set_main_window_size(unsigned int w, unsigned int h)
-//{
-//    SDL_SetWindowSize(drawer.window, (int) w, (int) h);
-//
-//    SDL_DestroyRenderer(drawer.renderer);
-//    delete_media();
-//
-//    drawer.renderer = SDL_CreateRenderer(drawer.window, -1, SDL_RENDERER_ACCELERATED);
-//    if (drawer.renderer == NULL)
-//        SDL_render_fatal_error("Renderer could not be created!\n%s\n", SDL_GetError());
-//    SDL_SetRenderDrawColor( drawer.renderer, 0xFF, 0xFF, 0xFF, 0xFF );
-//    load_media();
-//}
+ * @note Must be called in the main thread, menus call it whenever they are woken up.
+ */
+void upload_loaded_media(void)
+{
+    if (media_mutex == NULL) ///< All media are uploaded.
+        return;
+    SDL_LockMutex(media_mutex);
+    int loaded_num = loaded_media_num;
+    SDL_UnlockMutex(media_mutex);
+
+    for (; uploaded_media_num < loaded_num; uploaded_media_num++)
+    {
+        MediaJob *p_job = &media_jobs[uploaded_media_num];
+        *p_job->p_texture = SDL_CreateTextureFromSurface(drawer.renderer, loaded_surfaces[uploaded_media_num]);
+        if (*p_job->p_texture == NULL)
+            SDL_render_fatal_error("Unable to create texture from %s!\n%s\n", p_job->path, SDL_GetError());
+        SDL_FreeSurface(loaded_surfaces[uploaded_media_num]);
+        loaded_surfaces[uploaded_media_num] = NULL;
+    }
+}
+
+/**
+ * @brief Block until all media of the group (and the groups before it) are usable.
+ * 
+ * @param group The media group to wait for.
+ */
+void wait_media(MediaGroup group)
+{
+    while (uploaded_media_num < MEDIA_JOB_NUM && media_jobs[uploaded_media_num].group <= group)
+    {
+        SDL_LockMutex(media_mutex);
+        while (loaded_media_num == uploaded_media_num)
+            SDL_CondWait(media_cond, media_mutex);
+        SDL_UnlockMutex(media_mutex);
+        upload_loaded_media();
+    }
+
+    if (uploaded_media_num == MEDIA_JOB_NUM && media_thread != NULL)
+    {
+        SDL_WaitThread(media_thread, NULL);
+        media_thread = NULL;
+        SDL_DestroyCond(media_cond);
+        media_cond = NULL;
+        SDL_DestroyMutex(media_mutex);
+        media_mutex = NULL;
+    }
+}
 
 /**
  * @brief Delete media that is loaded by "load_media".
@@ -200,6 +408,8 @@ void delete_media(void)
     restart_button_texture = NULL;
     SDL_DestroyTexture(quit_button_texture);
     quit_button_texture = NULL;
+    SDL_DestroyTexture(remote_cursor_texture);
+    remote_cursor_texture = NULL;
 }
 
 /**
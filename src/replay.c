@@ -0,0 +1,501 @@
+/**
+ * @file replay.c
+ * @author jkilopu
+ * @brief Provides the recording of "replay.h", and reading and playing the replays back.
+ */
+#include "replay.h"
+#include "map.h"
+#include "block.h"
+#include "render.h"
+#include "codec.h"
+#include "snapshot.h"
+#include "packet.h"
+#include "fatal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+extern const int directions[8][2];
+extern Drawer drawer;
+
+static FILE *replay_fp;
+static int replay_state; ///< 0 before "REPLAY_DIR_ENV" is read, 1 recording, -1 off.
+static const char *replay_dir;
+static char replay_path[REPLAY_PATH_MAX];
+static Uint32 replay_count; ///< Files created, in their names.
+static Uint64 replay_key;
+static Uint8 replay_key_size;
+
+static Uint32 replay_offset;            ///< Bytes written to the file.
+static Uint32 begin_ticks, last_ticks, first_click_ticks;
+static Uint32 n_actions;
+static ReplayFooter replay_footer;
+static ReplayKeyframe *keyframes;
+static Uint32 n_keyframes, keyframes_cap;
+
+//-------------------------------------------------------------------
+// Record
+//-------------------------------------------------------------------
+
+/**
+ * @brief Remember the key the mine generator is seeded with, for the header.
+ */
+void replay_seed(Uint64 key, Uint8 key_size)
+{
+    replay_key = key;
+    replay_key_size = key_size;
+}
+
+/**
+ * @brief Start recording a game if "REPLAY_DIR_ENV" is set, called right before the mines are put.
+ */
+void replay_begin(Game game)
+{
+    if (replay_fp != NULL)
+        replay_end(game, REPLAY_ABANDONED);
+    if ((replay_fp = create_replay_file()) == NULL)
+        return;
+
+    ReplayHeader header;
+    SDL_zero(header);
+    SDL_memcpy(header.magic, REPLAY_MAGIC, sizeof(header.magic));
+    header.version = REPLAY_VERSION;
+    header.key_size = replay_key_size;
+    header.start_time = time(NULL);
+    header.key = replay_key;
+    header.settings = game->settings;
+    prng_rc4_get_state(header.prng_state);
+    fwrite(&header, sizeof(header), 1, replay_fp);
+
+    replay_offset = sizeof(header);
+    begin_ticks = last_ticks = SDL_GetTicks();
+    n_actions = 0;
+    n_keyframes = 0;
+    SDL_zero(replay_footer);
+}
+
+/**
+ * @brief Create the file of the next game in "REPLAY_DIR_ENV".
+ *
+ * @return Return the file, or NULL if not recording.
+ */
+static FILE *create_replay_file(void)
+{
+    if (replay_state == 0)
+    {
+        replay_dir = SDL_getenv(REPLAY_DIR_ENV);
+        replay_state = replay_dir != NULL ? 1 : -1;
+    }
+    if (replay_state < 0)
+        return NULL;
+
+    char date[32];
+    time_t now = time(NULL);
+    strftime(date, sizeof(date), "%Y%m%d-%H%M%S", localtime(&now));
+    SDL_snprintf(replay_path, sizeof(replay_path), "%s/mymines-%s-%u.mmr", replay_dir, date, replay_count++);
+    FILE *fp = fopen(replay_path, "wb");
+    if (fp == NULL)
+    {
+        SDL_Log("Can't create replay %s, stop recording!\n", replay_path);
+        replay_state = -1;
+        return NULL;
+    }
+    setvbuf(fp, NULL, _IOFBF, REPLAY_BUF_SIZE);
+    return fp;
+}
+
+/**
+ * @brief Write the varint "delta << REPLAY_KIND_BITS | kind" and, but for REPLAY_END, the varint "value".
+ */
+static void put_replay_record(ReplayKind kind, Uint32 value)
+{
+    Uint8 buf[2 * VARINT_MAX];
+    Uint32 now = SDL_GetTicks();
+    int n = put_varint(buf, (Uint64)(now - last_ticks) << REPLAY_KIND_BITS | kind);
+    if (kind != REPLAY_END)
+        n += put_varint(buf + n, value);
+    last_ticks = now;
+    fwrite(buf, n, 1, replay_fp);
+    replay_offset += n;
+}
+
+/**
+ * @brief Write a snapshot of the map with the mines, and add it to the keyframe index.
+ */
+static void put_replay_keyframe(Game game)
+{
+    SnapshotInfo info;
+    SDL_zero(info);
+    info.flags = SNAPSHOT_HAS_MINES;
+    if (!game->is_first_click)
+        info.flags |= SNAPSHOT_STARTED;
+    info.opened_blocks = game->opened_blocks;
+    info.time_passed = game->timer.time_passed;
+    prng_rc4_get_state(info.prng_state);
+    Uint32 len;
+    Uint8 *snapshot = encode_snapshot(game->map, &info, &len);
+
+    if (n_keyframes == keyframes_cap)
+    {
+        keyframes_cap = keyframes_cap == 0 ? 16 : keyframes_cap * 2;
+        ReplayKeyframe *new_keyframes = realloc(keyframes, keyframes_cap * sizeof(ReplayKeyframe));
+        if (new_keyframes == NULL)
+            Error("put_replay_keyframe: %s\n", MALLOC_FAIL_MSG);
+        keyframes = new_keyframes;
+    }
+    ReplayKeyframe *p_keyframe = &keyframes[n_keyframes++];
+    p_keyframe->offset = replay_offset;
+    p_keyframe->action = n_actions;
+    put_replay_record(REPLAY_KEYFRAME, len);
+    p_keyframe->time = last_ticks - begin_ticks;
+    fwrite(snapshot, len, 1, replay_fp);
+    replay_offset += len;
+    free(snapshot);
+}
+
+/**
+ * @brief Record a click on the map that has the mines, called before it is applied.
+ *
+ * @param click_type LEFT_CLICK or RIGHT_CLICK, a left click on an opened number is recorded as a chord.
+ */
+void replay_click(Game game, Uint8 click_type, unsigned int y, unsigned int x)
+{
+    if (replay_fp == NULL || !in_map_range(y, x, game->map))
+        return;
+    if (n_actions > 0 && n_actions % REPLAY_KEYFRAME_INTERVAL == 0)
+        put_replay_keyframe(game); ///< After the previous clicks are applied.
+    ReplayKind kind = click_type == RIGHT_CLICK ? REPLAY_RIGHT :
+                      is_shown_num(y, x, game->map) ? REPLAY_CHORD : REPLAY_LEFT;
+    put_replay_record(kind, y * game->map->row + x);
+    if (n_actions++ == 0)
+        first_click_ticks = last_ticks;
+    replay_footer.n_clicks[kind]++;
+}
+
+/**
+ * @brief Finish the file of the game, called before the map is cleared or replaced.
+ */
+void replay_end(Game game, ReplayResult result)
+{
+    if (replay_fp == NULL)
+        return;
+    if (n_actions == 0)
+    {
+        fclose(replay_fp);
+        remove(replay_path);
+        replay_fp = NULL;
+        return;
+    }
+    put_replay_record(REPLAY_END, 0);
+
+    replay_footer.hash = game->map->hash;
+    replay_footer.index_offset = replay_offset;
+    replay_footer.n_keyframes = n_keyframes;
+    replay_footer.duration = last_ticks - first_click_ticks;
+    replay_footer.bbbv = count_bbbv(game->map);
+    replay_footer.result = result;
+    SDL_memcpy(replay_footer.magic, REPLAY_END_MAGIC, sizeof(replay_footer.magic));
+    fwrite(keyframes, sizeof(ReplayKeyframe), n_keyframes, replay_fp);
+    fwrite(&replay_footer, sizeof(replay_footer), 1, replay_fp);
+    if (fclose(replay_fp) != 0)
+        SDL_Log("Can't write replay %s!\n", replay_path);
+    else
+        SDL_Log("Replay saved to %s, %u clicks in %u bytes.\n", replay_path, n_actions,
+                replay_offset + (Uint32)(n_keyframes * sizeof(ReplayKeyframe) + sizeof(ReplayFooter)));
+    replay_fp = NULL;
+}
+
+/**
+ * @brief Don't record the games of this process, for the tools that play them back.
+ */
+void disable_replay_recording(void)
+{
+    replay_state = -1;
+}
+
+/**
+ * @brief Count the 3BV of the board: one click for each opening (connected blank blocks), one for each number
+ * not next to an opening.
+ */
+Uint32 count_bbbv(Map map)
+{
+    Uint8 *seen = calloc_fatal((size_t)map->col * map->row, sizeof(Uint8), "count_bbbv - seen");
+    Uint32 bbbv = 0;
+    for (unsigned int y = 0; y < map->col; y++)
+        for (unsigned int x = 0; x < map->row; x++)
+            if (block_value(map, y, x) == 0 && !seen[y * map->row + x])
+            {
+                fill_opening(map, seen, y, x);
+                bbbv++;
+            }
+    for (unsigned int y = 0; y < map->col; y++)
+        for (unsigned int x = 0; x < map->row; x++)
+            if (block_value(map, y, x) != MINE && !seen[y * map->row + x])
+                bbbv++;
+    free(seen);
+    return bbbv;
+}
+
+/**
+ * @brief The number of mines around the block, or MINE, whether it is opened, flagged or exploded.
+ */
+static Uint8 block_value(Map map, unsigned int y, unsigned int x)
+{
+    Uint8 value = map->arr[y][x] & ~(1 << FLAG_BIT);
+    if (value >= '0')
+        value -= '0';
+    return value == EXPLODED_MINE ? MINE : value;
+}
+
+/**
+ * @brief Mark an opening and the numbers around it, like "show_blocks" opens them.
+ */
+static void fill_opening(Map map, Uint8 *seen, unsigned int y, unsigned int x)
+{
+    if (!in_map_range(y, x, map) || seen[y * map->row + x])
+        return;
+    seen[y * map->row + x] = 1;
+    if (block_value(map, y, x) != 0)
+        return;
+    for (int i = 0; i < 8; i++)
+        fill_opening(map, seen, y + directions[i][0], x + directions[i][1]);
+}
+
+//-------------------------------------------------------------------
+// Read
+//-------------------------------------------------------------------
+
+/**
+ * @brief Check the header, footer and index of a replay in memory.
+ *
+ * @param buf The bytes of the file, kept while the replay is used.
+ *
+ * @return Return SDL_FALSE if it is not a replay of this version.
+ */
+SDL_bool read_replay(const Uint8 *buf, Uint32 len, Replay *p_replay)
+{
+    if (len < sizeof(ReplayHeader) + sizeof(ReplayFooter))
+        return SDL_FALSE;
+    SDL_memcpy(&p_replay->header, buf, sizeof(ReplayHeader));
+    SDL_memcpy(&p_replay->footer, buf + len - sizeof(ReplayFooter), sizeof(ReplayFooter));
+    const ReplayHeader *p_header = &p_replay->header;
+    const ReplayFooter *p_footer = &p_replay->footer;
+    if (memcmp(p_header->magic, REPLAY_MAGIC, sizeof(p_header->magic)) != 0 || p_header->version != REPLAY_VERSION
+            || memcmp(p_footer->magic, REPLAY_END_MAGIC, sizeof(p_footer->magic)) != 0)
+        return SDL_FALSE;
+    if (p_footer->index_offset < sizeof(ReplayHeader) || p_footer->n_keyframes > len
+            || (Uint64)p_footer->index_offset + p_footer->n_keyframes * sizeof(ReplayKeyframe) + sizeof(ReplayFooter) != len)
+        return SDL_FALSE;
+    p_replay->buf = buf;
+    p_replay->len = len;
+    return SDL_TRUE;
+}
+
+/**
+ * @brief Read a whole replay file.
+ *
+ * @return Return the bytes, free them with "free", or NULL if the file can't be read.
+ */
+Uint8 *load_replay_file(const char *path, Uint32 *p_len)
+{
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+    {
+        SDL_Log("Can't open replay %s!\n", path);
+        return NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    long len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    Uint8 *buf = len > 0 ? malloc_fatal(len, "load_replay_file - buf") : NULL;
+    if (buf == NULL || fread(buf, len, 1, fp) != 1)
+    {
+        SDL_Log("Can't read replay %s!\n", path);
+        free(buf);
+        fclose(fp);
+        return NULL;
+    }
+    fclose(fp);
+    *p_len = (Uint32)len;
+    return buf;
+}
+
+/**
+ * @brief Where the records start.
+ */
+const Uint8 *replay_records(const Replay *p_replay)
+{
+    return p_replay->buf + sizeof(ReplayHeader);
+}
+
+/**
+ * @brief Read the record at "p".
+ *
+ * @param prev_time The time of the previous record, the record has the time since it.
+ *
+ * @return Return where the next record starts, or NULL at the end of the records or if the record is malformed.
+ */
+const Uint8 *next_replay_record(const Replay *p_replay, const Uint8 *p, Uint32 prev_time, ReplayRecord *p_record)
+{
+    const Uint8 *end = p_replay->buf + p_replay->footer.index_offset;
+    Uint64 head, value;
+    int n;
+    if (p >= end || (n = get_varint(p, (int)(end - p), &head)) == 0)
+        return NULL;
+    p += n;
+    p_record->kind = head & ((1 << REPLAY_KIND_BITS) - 1);
+    p_record->time = prev_time + (Uint32)(head >> REPLAY_KIND_BITS);
+    if (p_record->kind == REPLAY_END)
+        return p;
+    if (p_record->kind > REPLAY_END || (n = get_varint(p, (int)(end - p), &value)) == 0)
+        return NULL;
+    p += n;
+    if (p_record->kind == REPLAY_KEYFRAME)
+    {
+        if (value > (Uint64)(end - p))
+            return NULL;
+        p_record->snapshot = p;
+        p_record->snapshot_len = (Uint32)value;
+        return p + value;
+    }
+    const Settings *p_settings = &p_replay->header.settings;
+    if (value >= (Uint64)p_settings->map_width * p_settings->map_height)
+        return NULL;
+    p_record->block = (Uint32)value;
+    return p;
+}
+
+//-------------------------------------------------------------------
+// Playback
+//-------------------------------------------------------------------
+
+/**
+ * @brief Set the game up in local mode with the board of the replay, and draw it.
+ */
+void start_replay_game(Game game, const Replay *p_replay)
+{
+    game->settings = p_replay->header.settings;
+    game->settings.game_mode = 0;
+    drawer_set_window_size(game->settings.window_width, game->settings.window_height);
+    drawer_set_logical_size(0, 0);
+    set_logical_block_size(game->settings.block_size);
+    layout_game(game);
+    SDL_RenderClear(drawer.renderer);
+    prng_rc4_set_state(p_replay->header.prng_state);
+    create_map_in_game(game);
+    drawer_present();
+}
+
+/**
+ * @brief Apply a click like the local player, keyframes and REPLAY_END are skipped.
+ *
+ * @return Return SDL_TRUE if the game is over.
+ */
+SDL_bool apply_replay_record(Game game, const ReplayRecord *p_record)
+{
+    unsigned int y = p_record->block / game->map->row, x = p_record->block % game->map->row;
+    switch (p_record->kind)
+    {
+    case REPLAY_LEFT:
+    case REPLAY_CHORD:
+        return click_map(game, y, x) || success(game);
+    case REPLAY_RIGHT:
+        set_draw_flag(game, y, x);
+        return SDL_FALSE;
+    default:
+        return SDL_FALSE;
+    }
+}
+
+/**
+ * @brief Put the board back to before the first click.
+ */
+static void reset_replay_game(Game game, const Replay *p_replay)
+{
+    if (!game->is_first_click)
+        unset_timer(&game->timer);
+    game->timer.time_passed = 0;
+    game->opened_blocks = 0;
+    game->is_first_click = SDL_TRUE;
+    clear_map(game->map);
+    prng_rc4_set_state(p_replay->header.prng_state);
+    put_mines(game->map, game->settings.n_mine);
+}
+
+/**
+ * @brief Replace the board with a keyframe, like "restore_game_snapshot".
+ */
+static void restore_replay_keyframe(Game game, const ReplayRecord *p_record)
+{
+    SnapshotInfo info;
+    if (!decode_snapshot(p_record->snapshot, p_record->snapshot_len, game->map, &info)
+            || !(info.flags & SNAPSHOT_HAS_MINES))
+        Error("Malformed keyframe!\n");
+    SDL_bool started = (info.flags & SNAPSHOT_STARTED) != 0;
+    if (started && game->is_first_click)
+        set_timer(&game->timer);
+    else if (!started && !game->is_first_click)
+        unset_timer(&game->timer);
+    game->is_first_click = !started;
+    game->opened_blocks = info.opened_blocks;
+    game->timer.time_passed = info.time_passed;
+    prng_rc4_set_state(info.prng_state);
+}
+
+/**
+ * @brief Bring the game to right after "action" clicks, from the nearest keyframe before it.
+ *
+ * @param p_time Points to where the time of the last record read is stored.
+ *
+ * @return Return where the records go on, or NULL if the replay ends before.
+ */
+const Uint8 *seek_replay(Game game, const Replay *p_replay, Uint32 action, Uint32 *p_time)
+{
+    const Uint8 *index = p_replay->buf + p_replay->footer.index_offset;
+    Uint32 lo = 0, hi = p_replay->footer.n_keyframes;
+    ReplayKeyframe keyframe;
+    while (lo < hi) ///< The last keyframe at or before "action".
+    {
+        Uint32 mid = lo + (hi - lo) / 2;
+        SDL_memcpy(&keyframe, index + mid * sizeof(ReplayKeyframe), sizeof(keyframe));
+        if (keyframe.action <= action)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    const Uint8 *p;
+    Uint32 n = 0, time = 0;
+    ReplayRecord record;
+    if (lo == 0)
+    {
+        reset_replay_game(game, p_replay);
+        p = replay_records(p_replay);
+    }
+    else
+    {
+        SDL_memcpy(&keyframe, index + (lo - 1) * sizeof(ReplayKeyframe), sizeof(keyframe));
+        if (keyframe.offset >= p_replay->footer.index_offset
+                || (p = next_replay_record(p_replay, p_replay->buf + keyframe.offset, 0, &record)) == NULL
+                || record.kind != REPLAY_KEYFRAME)
+            Error("Malformed keyframe index!\n");
+        restore_replay_keyframe(game, &record);
+        n = keyframe.action;
+        time = keyframe.time;
+    }
+    while (n < action)
+    {
+        if ((p = next_replay_record(p_replay, p, time, &record)) == NULL || record.kind == REPLAY_END)
+            return NULL;
+        time = record.time;
+        if (record.kind != REPLAY_KEYFRAME)
+        {
+            apply_replay_record(game, &record);
+            n++;
+        }
+    }
+    redraw_game(game);
+    *p_time = time;
+    return p;
+}
@@ -0,0 +1,163 @@
+/**
+ * @file reveal.c
+ * @author jkilopu
+ * @brief Provides the run-length encoder and decoder of revealed blocks.
+ */
+#include "reveal.h"
+#include "net.h"
+#include "codec.h"
+#include "SDL_stdinc.h"
+#include "fatal.h"
+#include <stdlib.h>
+
+//-------------------------------------------------------------------
+// Reveal log
+//-------------------------------------------------------------------
+
+/**
+ * @brief Create an empty log which can hold every block of the map.
+ */
+RevealLog *create_reveal_log(Uint32 map_width, Uint32 map_height)
+{
+    RevealLog *p_log = malloc_fatal(sizeof(RevealLog), "create_reveal_log - p_log");
+    p_log->cap = map_width * map_height;
+    p_log->blocks = malloc_fatal(p_log->cap * sizeof(Uint32), "create_reveal_log - p_log->blocks");
+    p_log->num = 0;
+    p_log->map_width = map_width;
+    return p_log;
+}
+
+/**
+ * @brief Log an opened block, it will be sent by the next "send_reveal_log".
+ */
+void reveal_log_add(RevealLog *p_log, unsigned int y, unsigned int x)
+{
+    if (p_log->num < p_log->cap)
+        p_log->blocks[p_log->num++] = y * p_log->map_width + x;
+}
+
+/**
+ * @brief The value of a block without its flag, opened or not.
+ */
+static Uint8 get_reveal_value(Map map, unsigned int y, unsigned int x)
+{
+    Uint8 value = get_block(y, x, map) & ~(1 << FLAG_BIT);
+    return value >= '0' ? value - '0' : value;
+}
+
+static int cmp_block(const void *a, const void *b)
+{
+    Uint32 lhs = *(const Uint32 *)a, rhs = *(const Uint32 *)b;
+    return (lhs > rhs) - (lhs < rhs);
+}
+
+/**
+ * @brief Send the logged blocks with their current values in the map as runs, then clear the log.
+ *
+ * @param p_log The log.
+ * @param map The map the blocks are in.
+ *
+ * @note A run that doesn't fit in a packet is continued in the next one.
+ */
+void send_reveal_log(RevealLog *p_log, Map map)
+{
+    if (p_log->num == 0)
+        return;
+    qsort(p_log->blocks, p_log->num, sizeof(Uint32), cmp_block);
+
+    MyMinesPacket mymines_packet;
+    RevealPacket *p_reveal_packet = &mymines_packet.reveal_packet;
+    SDL_zero(mymines_packet);
+    p_reveal_packet->type = TYPE_REVEAL;
+    Uint32 run_end = 0; ///< The end of the previous run in the packet.
+
+    for (Uint32 i = 0; i < p_log->num;)
+    {
+        Uint32 j = i + 1;
+        while (j < p_log->num && p_log->blocks[j] <= p_log->blocks[j - 1] + 1)
+            j++;
+        /* Blocks [i, j) are consecutive, maybe with duplicates. */
+        Uint32 start = p_log->blocks[i], len = p_log->blocks[j - 1] - start + 1;
+        while (len > 0)
+        {
+            int avail = REVEAL_DATA_MAX - p_reveal_packet->data_len - varint_size(start - run_end) - varint_size(len);
+            if (avail <= 0)
+            {
+                send_reveal_packet(p_reveal_packet, SDL_FALSE);
+                SDL_zero(mymines_packet);
+                p_reveal_packet->type = TYPE_REVEAL;
+                run_end = 0;
+                continue;
+            }
+            Uint32 n = len < (Uint32)avail * 2 ? len : (Uint32)avail * 2;
+            Uint8 *p = p_reveal_packet->data + p_reveal_packet->data_len;
+            p += put_varint(p, start - run_end);
+            p += put_varint(p, n);
+            for (Uint32 k = 0; k < n; k++)
+            {
+                Uint32 block = start + k;
+                Uint8 value = get_reveal_value(map, block / p_log->map_width, block % p_log->map_width);
+                p[k / 2] |= k % 2 ? value << 4 : value;
+            }
+            p += (n + 1) / 2;
+            p_reveal_packet->data_len = p - p_reveal_packet->data;
+            start += n;
+            len -= n;
+            run_end = start;
+        }
+        i = j;
+    }
+    if (p_reveal_packet->data_len > 0)
+        send_reveal_packet(p_reveal_packet, SDL_TRUE); ///< The result of a click shouldn't wait for the next frame.
+    p_log->num = 0;
+}
+
+void destroy_reveal_log(RevealLog *p_log)
+{
+    free(p_log->blocks);
+    p_log->blocks = NULL;
+    free(p_log);
+}
+
+//-------------------------------------------------------------------
+// Decode
+//-------------------------------------------------------------------
+
+/**
+ * @brief Call "func" for each block in the packet.
+ *
+ * @param p_reveal_packet The packet.
+ * @param func Called with "data", the block number and its value.
+ * @param data Passed to "func".
+ *
+ * @return Return SDL_FALSE if the packet is malformed. The blocks before the error are already passed to "func".
+ */
+SDL_bool decode_reveal_packet(const RevealPacket *p_reveal_packet, RevealFunc func, void *data)
+{
+    const Uint8 *p = p_reveal_packet->data;
+    int left = p_reveal_packet->data_len;
+    Uint32 run_end = 0;
+
+    if (left > REVEAL_DATA_MAX)
+        return SDL_FALSE;
+    while (left > 0)
+    {
+        Uint64 skip, len;
+        int n = get_varint(p, left, &skip);
+        if (n == 0)
+            return SDL_FALSE;
+        p += n, left -= n;
+        if ((n = get_varint(p, left, &len)) == 0)
+            return SDL_FALSE;
+        p += n, left -= n;
+        if (len == 0 || (len + 1) / 2 > (Uint64)left || skip > SDL_MAX_UINT32)
+            return SDL_FALSE;
+
+        Uint32 start = run_end + skip;
+        for (Uint32 k = 0; k < len; k++)
+            func(data, start + k, k % 2 ? p[k / 2] >> 4 : p[k / 2] & 0x0F);
+        p += (len + 1) / 2, left -= (len + 1) / 2;
+        run_end = start + len;
+    }
+    return SDL_TRUE;
+}
@@ -0,0 +1,285 @@
+/**
+ * @file shm_link.c
+ * @author jkilopu
+ * @brief Provides the shared memory link between two processes on the same host, see "shm_link.h".
+ */
+#include "shm_link.h"
+#include "SDL_log.h"
+#include "fatal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+//-------------------------------------------------------------------
+// Futex
+//-------------------------------------------------------------------
+
+/**
+ * @brief Sleep while "p_word" is "value", for at most "timeout" milliseconds.
+ *
+ * @note Not FUTEX_PRIVATE_FLAG, the word is shared with the other process.
+ */
+static void futex_wait(SDL_atomic_t *p_word, int value, Uint32 timeout)
+{
+    struct timespec ts;
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (long)(timeout % 1000) * 1000000;
+    syscall(SYS_futex, &p_word->value, FUTEX_WAIT, value, &ts, NULL, 0); ///< EAGAIN if it has changed.
+}
+
+static void futex_wake(SDL_atomic_t *p_word)
+{
+    syscall(SYS_futex, &p_word->value, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/**
+ * @brief The other process may die without closing its ring, nothing wakes us up then.
+ */
+static SDL_bool is_peer_alive(const ShmLink *p_link)
+{
+    return p_link->peer_pid == 0 || kill((pid_t)p_link->peer_pid, 0) == 0 || errno != ESRCH;
+}
+
+//-------------------------------------------------------------------
+// Create and open
+//-------------------------------------------------------------------
+
+static ShmLink *map_shm_link(int fd, SDL_bool is_client, const char *name)
+{
+    ShmRegion *region = mmap(NULL, sizeof(ShmRegion), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (region == MAP_FAILED)
+    {
+        SDL_Log("Can't map shared memory %s: %s\n", name, strerror(errno));
+        return NULL;
+    }
+
+    ShmLink *p_link = calloc_fatal(1, sizeof(ShmLink), "map_shm_link - p_link");
+    p_link->region = region;
+    p_link->tx = &region->rings[!is_client];
+    p_link->rx = &region->rings[is_client];
+    p_link->self_pid = getpid();
+    SDL_strlcpy(p_link->name, name, SHM_LINK_NAME_MAX);
+    return p_link;
+}
+
+/**
+ * @brief Create a link for the client, offer "getpid()" and "id" to the server so it can open it.
+ *
+ * @return Return NULL if shared memory can't be used, stay on TCP then.
+ */
+ShmLink *create_shm_link(Uint32 id)
+{
+    char name[SHM_LINK_NAME_MAX];
+    SDL_snprintf(name, sizeof(name), "/mymines-%u-%u", (unsigned int)getpid(), id);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+    {
+        SDL_Log("Can't create shared memory %s: %s\n", name, strerror(errno));
+        return NULL;
+    }
+    if (ftruncate(fd, sizeof(ShmRegion)) < 0) ///< Zero filled.
+    {
+        SDL_Log("Can't size shared memory %s: %s\n", name, strerror(errno));
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+
+    ShmLink *p_link = map_shm_link(fd, SDL_TRUE, name);
+    if (p_link == NULL)
+    {
+        shm_unlink(name);
+        return NULL;
+    }
+    p_link->id = id;
+    p_link->region->magic = SHM_LINK_MAGIC;
+    p_link->region->ring_size = SHM_RING_SIZE;
+    return p_link;
+}
+
+/**
+ * @brief Open the link offered by the client "pid" for the server, and unlink its name.
+ *
+ * @return Return NULL if it can't be opened or is not a link of this version.
+ */
+ShmLink *open_shm_link(Uint32 pid, Uint32 id)
+{
+    char name[SHM_LINK_NAME_MAX];
+    SDL_snprintf(name, sizeof(name), "/mymines-%u-%u", pid, id);
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+    {
+        SDL_Log("Can't open shared memory %s: %s\n", name, strerror(errno));
+        return NULL;
+    }
+    ShmLink *p_link = map_shm_link(fd, SDL_FALSE, name);
+    if (p_link == NULL)
+        return NULL;
+    p_link->peer_pid = pid;
+    p_link->id = id;
+    unlink_shm_link(p_link);
+    if (p_link->region->magic != SHM_LINK_MAGIC || p_link->region->ring_size != SHM_RING_SIZE)
+    {
+        SDL_Log("Shared memory %s is not a mymines link.\n", name);
+        close_shm_link(p_link);
+        return NULL;
+    }
+    return p_link;
+}
+
+/**
+ * @brief Remove the name of the link, the mappings stay.
+ */
+void unlink_shm_link(ShmLink *p_link)
+{
+    if (p_link->name[0] == '\0')
+        return;
+    shm_unlink(p_link->name); ///< ENOENT if the other side has done it.
+    p_link->name[0] = '\0';
+}
+
+//-------------------------------------------------------------------
+// Write and read
+//-------------------------------------------------------------------
+
+/**
+ * @brief Write all of "data", sleep while the ring is full like a blocking "send".
+ *
+ * @param timeout In milliseconds, give up if the other process reads nothing for this long.
+ *
+ * @return Return SDL_FALSE if the other process is gone or times out.
+ */
+SDL_bool write_shm_link(ShmLink *p_link, const void *data, Uint32 len, Uint32 timeout)
+{
+    ShmRing *ring = p_link->tx;
+    const Uint8 *p = data;
+    Uint32 full_ticks = 0; ///< When the ring was found full, 0 if it has room.
+    while (len > 0)
+    {
+        Uint32 tail = SDL_AtomicGet(&ring->tail);
+        Uint32 free_len = SHM_RING_SIZE - (tail - (Uint32)SDL_AtomicGet(&ring->head));
+        if (free_len == 0)
+        {
+            if (full_ticks == 0)
+                full_ticks = SDL_GetTicks() | 1;
+            else if (SDL_TICKS_PASSED(SDL_GetTicks(), full_ticks + timeout))
+                return SDL_FALSE;
+            int seq = SDL_AtomicGet(&ring->space_seq);
+            SDL_AtomicSet(&ring->writer_sleeping, 1);
+            if (tail - (Uint32)SDL_AtomicGet(&ring->head) == SHM_RING_SIZE) ///< Check again, the reader may not see the flag.
+                futex_wait(&ring->space_seq, seq, SHM_WAIT_SLICE);
+            SDL_AtomicSet(&ring->writer_sleeping, 0);
+            if (!is_peer_alive(p_link))
+                return SDL_FALSE;
+            continue;
+        }
+        full_ticks = 0;
+
+        Uint32 offset = tail % SHM_RING_SIZE;
+        Uint32 n = SDL_min(len, SDL_min(free_len, SHM_RING_SIZE - offset));
+        memcpy(ring->data + offset, p, n);
+        SDL_AtomicSet(&ring->tail, tail + n); ///< A full barrier, the bytes are visible before the tail.
+        p += n;
+        len -= n;
+    }
+    SDL_AtomicIncRef(&ring->data_seq);
+    if (SDL_AtomicGet(&ring->reader_sleeping))
+        futex_wake(&ring->data_seq);
+    return SDL_TRUE;
+}
+
+/**
+ * @brief Read what the ring has, up to "len" bytes.
+ *
+ * @return Return the number of bytes read, or 0 if the ring is empty and the other side has stopped, like "recv".
+ *
+ * @note Only called when "is_shm_link_readable".
+ */
+int read_shm_link(ShmLink *p_link, void *buf, Uint32 len)
+{
+    ShmRing *ring = p_link->rx;
+    Uint8 *p = buf;
+    Uint32 head = SDL_AtomicGet(&ring->head);
+    Uint32 avail = (Uint32)SDL_AtomicGet(&ring->tail) - head;
+    Uint32 total = SDL_min(len, avail);
+    for (Uint32 done = 0; done < total;)
+    {
+        Uint32 offset = (head + done) % SHM_RING_SIZE;
+        Uint32 n = SDL_min(total - done, SHM_RING_SIZE - offset);
+        memcpy(p + done, ring->data + offset, n);
+        done += n;
+    }
+    if (total == 0)
+        return 0;
+
+    SDL_AtomicSet(&ring->head, head + total);
+    SDL_AtomicIncRef(&ring->space_seq);
+    if (SDL_AtomicGet(&ring->writer_sleeping))
+        futex_wake(&ring->space_seq);
+    return total;
+}
+
+/**
+ * @brief Return SDL_TRUE if there are bytes to read, or the other side has stopped.
+ */
+SDL_bool is_shm_link_readable(ShmLink *p_link)
+{
+    ShmRing *ring = p_link->rx;
+    return SDL_AtomicGet(&ring->tail) != SDL_AtomicGet(&ring->head) || SDL_AtomicGet(&ring->closed);
+}
+
+/**
+ * @brief Sleep until there is something to read, "wake_shm_link" is called or "timeout" milliseconds pass.
+ *
+ * @note If it times out and the other process is gone, the ring is marked closed for it.
+ */
+void wait_shm_link(ShmLink *p_link, Uint32 timeout)
+{
+    ShmRing *ring = p_link->rx;
+    int seq = SDL_AtomicGet(&ring->data_seq);
+    if (is_shm_link_readable(p_link))
+        return;
+    SDL_AtomicSet(&ring->reader_sleeping, 1);
+    if (!is_shm_link_readable(p_link)) ///< Check again, the writer may not see the flag.
+        futex_wait(&ring->data_seq, seq, timeout);
+    SDL_AtomicSet(&ring->reader_sleeping, 0);
+    if (seq == SDL_AtomicGet(&ring->data_seq) && !is_peer_alive(p_link))
+        SDL_AtomicSet(&ring->closed, 1);
+}
+
+/**
+ * @brief Wake up the reader of this process from "wait_shm_link", from another thread.
+ */
+void wake_shm_link(ShmLink *p_link)
+{
+    SDL_AtomicIncRef(&p_link->rx->data_seq);
+    futex_wake(&p_link->rx->data_seq);
+}
+
+//-------------------------------------------------------------------
+// Close
+//-------------------------------------------------------------------
+
+/**
+ * @brief Tell the other side this one has stopped, unmap and free the link.
+ */
+void close_shm_link(ShmLink *p_link)
+{
+    if (p_link == NULL)
+        return;
+    SDL_AtomicSet(&p_link->tx->closed, 1);
+    SDL_AtomicIncRef(&p_link->tx->data_seq);
+    futex_wake(&p_link->tx->data_seq);
+    unlink_shm_link(p_link);
+    munmap(p_link->region, sizeof(ShmRegion));
+    free(p_link);
+}
@@ -0,0 +1,346 @@
+/**
+ * @file snapshot.c
+ * @author jkilopu
+ * @brief Provides the encoder, decoder, sender and receiver of compact map snapshots.
+ */
+#include "snapshot.h"
+#include "net.h"
+#include "codec.h"
+#include "SDL_stdinc.h"
+#include "fatal.h"
+#include <stdlib.h>
+
+extern const int directions[8][2];
+
+//-------------------------------------------------------------------
+// Encode
+//-------------------------------------------------------------------
+
+static SDL_bool is_mine_block(Map map, unsigned int y, unsigned int x)
+{
+    Uint8 value = get_block(y, x, map) & ~(1 << FLAG_BIT);
+    return value == MINE || value == EXPLODED_MINE;
+}
+
+static SDL_bool is_opened_block(Map map, unsigned int y, unsigned int x)
+{
+    return is_shown_num(y, x, map) ? SDL_TRUE : SDL_FALSE;
+}
+
+static SDL_bool is_flag_block(Map map, unsigned int y, unsigned int x)
+{
+    return has_flag(y, x, map) ? SDL_TRUE : SDL_FALSE;
+}
+
+/**
+ * @brief Write the blocks that pass "test" as a run-length encoded bitmap, see "snapshot.h".
+ *
+ * @return Return the end of the bitmap.
+ */
+static Uint8 *put_bitmap(Uint8 *p, Map map, BlockTest test)
+{
+    SDL_bool bit = SDL_FALSE;
+    Uint32 run = 0;
+    for (unsigned int y = 0; y < map->col; y++)
+        for (unsigned int x = 0; x < map->row; x++)
+        {
+            if (test(map, y, x) != bit)
+            {
+                p += put_varint(p, run);
+                bit = !bit;
+                run = 0;
+            }
+            run++;
+        }
+    p += put_varint(p, run);
+    return p;
+}
+
+/**
+ * @brief Encode the map and "p_info" into a new snapshot.
+ *
+ * @param map The map of the server.
+ * @param p_info The rest of the game, SNAPSHOT_HAS_MINES in its flags decides what is in the snapshot.
+ * @param p_len Points to the length which will be filled in.
+ *
+ * @return The snapshot, free it after use.
+ */
+Uint8 *encode_snapshot(Map map, const SnapshotInfo *p_info, Uint32 *p_len)
+{
+    Uint32 num = map->col * map->row;
+    size_t bitmap_max = (size_t)(num + 1) * varint_size(num); ///< At most "num + 1" runs.
+    Uint8 *buf = malloc_fatal(2 + 4 * VARINT_MAX + PRNG_RC4_STATE_SIZE + 3 * bitmap_max + (num + 1) / 2,
+            "encode_snapshot - buf");
+
+    Uint8 *p = buf;
+    *p++ = SNAPSHOT_FORMAT;
+    *p++ = p_info->flags;
+    p += put_varint(p, map->row);
+    p += put_varint(p, map->col);
+    p += put_varint(p, p_info->opened_blocks);
+    p += put_varint(p, p_info->time_passed);
+    if (p_info->flags & SNAPSHOT_HAS_MINES)
+    {
+        SDL_memcpy(p, p_info->prng_state, PRNG_RC4_STATE_SIZE);
+        p += PRNG_RC4_STATE_SIZE;
+        p = put_bitmap(p, map, is_mine_block);
+    }
+    p = put_bitmap(p, map, is_opened_block);
+    p = put_bitmap(p, map, is_flag_block);
+    if (!(p_info->flags & SNAPSHOT_HAS_MINES))
+    {
+        Uint32 k = 0;
+        for (unsigned int y = 0; y < map->col; y++)
+            for (unsigned int x = 0; x < map->row; x++)
+                if (is_shown_num(y, x, map))
+                {
+                    Uint8 value = get_mine_num(y, x, map);
+                    if (k % 2)
+                        *p++ |= value << 4;
+                    else
+                        *p = value;
+                    k++;
+                }
+        if (k % 2)
+            p++;
+    }
+
+    *p_len = p - buf;
+    return buf;
+}
+
+//-------------------------------------------------------------------
+// Decode
+//-------------------------------------------------------------------
+
+/**
+ * @brief Read a varint that fits in 32 bits from [p, end).
+ *
+ * @return Return the end of the varint, or NULL if it is malformed.
+ */
+static const Uint8 *get_snapshot_varint(const Uint8 *p, const Uint8 *end, Uint32 *p_value)
+{
+    Uint64 value;
+    int n = get_varint(p, end - p > VARINT_MAX ? VARINT_MAX : (int)(end - p), &value);
+    if (n == 0 || value > SDL_MAX_UINT32)
+        return NULL;
+    *p_value = value;
+    return p + n;
+}
+
+/**
+ * @brief Read a run-length encoded bitmap of "num" bits from [p, end) into "bits", a byte per bit.
+ *
+ * @return Return the end of the bitmap, or NULL if it is malformed.
+ */
+static const Uint8 *get_bitmap(const Uint8 *p, const Uint8 *end, Uint8 *bits, Uint32 num)
+{
+    Uint8 bit = 0;
+    Uint32 filled = 0;
+    do
+    {
+        Uint32 run;
+        if ((p = get_snapshot_varint(p, end, &run)) == NULL || run > num - filled)
+            return NULL;
+        SDL_memset(bits + filled, bit, run);
+        filled += run;
+        bit = !bit;
+    } while (filled < num);
+    return p;
+}
+
+/**
+ * @brief RC4 only works with a permutation of 0 ~ 255.
+ */
+static SDL_bool is_permutation(const Uint8 *bytes)
+{
+    Uint8 seen[256] = {0};
+    for (int i = 0; i < 256; i++)
+    {
+        if (seen[bytes[i]])
+            return SDL_FALSE;
+        seen[bytes[i]] = 1;
+    }
+    return SDL_TRUE;
+}
+
+/**
+ * @brief Decode a snapshot into the map and "p_info".
+ *
+ * @param buf The snapshot.
+ * @param len The length of the snapshot.
+ * @param map The map of the client, which must have the same size.
+ * @param p_info Points to the info which will be filled in.
+ *
+ * @return Return SDL_FALSE if the snapshot is malformed, nothing is written then.
+ *
+ * @note The whole snapshot is checked before the map and "p_info" are written, and the map hash is recomputed.
+ */
+SDL_bool decode_snapshot(const Uint8 *buf, Uint32 len, Map map, SnapshotInfo *p_info)
+{
+    const Uint8 *p = buf, *end = buf + len;
+    Uint32 width, height, num = map->col * map->row;
+    SnapshotInfo info; ///< Copied to "p_info" once the whole snapshot is checked.
+
+    if (len < 2 || p[0] != SNAPSHOT_FORMAT)
+        return SDL_FALSE;
+    info.flags = p[1];
+    p += 2;
+    if ((p = get_snapshot_varint(p, end, &width)) == NULL || (p = get_snapshot_varint(p, end, &height)) == NULL
+            || (p = get_snapshot_varint(p, end, &info.opened_blocks)) == NULL
+            || (p = get_snapshot_varint(p, end, &info.time_passed)) == NULL)
+        return SDL_FALSE;
+    if (width != map->row || height != map->col || info.opened_blocks > num)
+        return SDL_FALSE;
+
+    SDL_bool has_mines = (info.flags & SNAPSHOT_HAS_MINES) != 0;
+    Uint8 *mines = calloc_fatal(num, 1, "decode_snapshot - mines");
+    Uint8 *opened = malloc_fatal(num, "decode_snapshot - opened");
+    Uint8 *flags = malloc_fatal(num, "decode_snapshot - flags");
+    SDL_bool ok = SDL_FALSE;
+    if (has_mines)
+    {
+        if (end - p < PRNG_RC4_STATE_SIZE || !is_permutation(p))
+            goto out;
+        SDL_memcpy(info.prng_state, p, PRNG_RC4_STATE_SIZE);
+        p += PRNG_RC4_STATE_SIZE;
+        if ((p = get_bitmap(p, end, mines, num)) == NULL)
+            goto out;
+    }
+    if ((p = get_bitmap(p, end, opened, num)) == NULL || (p = get_bitmap(p, end, flags, num)) == NULL)
+        goto out;
+
+    Uint32 n_opened = 0;
+    for (Uint32 i = 0; i < num; i++)
+    {
+        if (opened[i] && (flags[i] || mines[i]))
+            goto out;
+        n_opened += opened[i];
+    }
+    const Uint8 *values = p;
+    if (n_opened != info.opened_blocks || end - p != (has_mines ? 0 : (n_opened + 1) / 2))
+        goto out;
+    for (Uint32 k = 0; k < (has_mines ? 0 : n_opened); k++)
+        if ((k % 2 ? values[k / 2] >> 4 : values[k / 2] & 0x0F) > 8)
+            goto out;
+
+    Uint32 k = 0;
+    for (unsigned int y = 0; y < map->col; y++)
+        for (unsigned int x = 0; x < map->row; x++)
+        {
+            Uint32 block = y * map->row + x;
+            Uint8 value = 0;
+            if (has_mines && mines[block])
+                value = MINE;
+            else if (has_mines)
+                for (int i = 0; i < 8; i++)
+                {
+                    unsigned int next_y = y + directions[i][0], next_x = x + directions[i][1];
+                    if (in_map_range(next_y, next_x, map) && mines[next_y * map->row + next_x])
+                        value++;
+                }
+            else if (opened[block])
+            {
+                value = k % 2 ? values[k / 2] >> 4 : values[k / 2] & 0x0F;
+                k++;
+            }
+            if (opened[block])
+                value += '0';
+            if (flags[block])
+                value |= 1 << FLAG_BIT;
+            set_num(y, x, map, value);
+        }
+    rehash_map(map);
+    *p_info = info;
+    ok = SDL_TRUE;
+
+out:
+    free(mines);
+    free(opened);
+    free(flags);
+    return ok;
+}
+
+//-------------------------------------------------------------------
+// Send and receive
+//-------------------------------------------------------------------
+
+/**
+ * @brief Encode a snapshot and send it in chunks.
+ *
+ * @param map The map of the server.
+ * @param p_info The rest of the game, see "encode_snapshot".
+ */
+void send_snapshot(Map map, const SnapshotInfo *p_info)
+{
+    Uint32 len;
+    Uint8 *buf = encode_snapshot(map, p_info, &len);
+
+    SnapshotPacket snapshot_packet;
+    for (Uint32 offset = 0; offset < len; offset += SNAPSHOT_DATA_MAX)
+    {
+        SDL_zero(snapshot_packet);
+        snapshot_packet.type = TYPE_SNAPSHOT;
+        snapshot_packet.offset = offset;
+        snapshot_packet.data_len = len - offset < SNAPSHOT_DATA_MAX ? len - offset : SNAPSHOT_DATA_MAX;
+        SDL_memcpy(snapshot_packet.data, buf + offset, snapshot_packet.data_len);
+        send_snapshot_packet(&snapshot_packet, SDL_FALSE);
+    }
+    SDL_zero(snapshot_packet);
+    snapshot_packet.type = TYPE_SNAPSHOT;
+    snapshot_packet.offset = len;
+    send_snapshot_packet(&snapshot_packet, SDL_TRUE);
+    free(buf);
+}
+
+static Uint8 *collect_buf; ///< The snapshot being received, freed by "free_snapshot_collector".
+static Uint32 collect_len, collect_cap;
+
+/**
+ * @brief Add a received chunk to the snapshot being received.
+ *
+ * @param p_snapshot_packet The chunk.
+ * @param p_buf Points to the snapshot which will be filled in when it is complete, valid until the next call.
+ * @param p_len Points to its length.
+ *
+ * @return Return 1 if the snapshot is complete, 0 if more chunks are expected, or -1 if the chunk is out of order
+ *         or the snapshot is too long, the chunks received are dropped then.
+ */
+int collect_snapshot_packet(const SnapshotPacket *p_snapshot_packet, const Uint8 **p_buf, Uint32 *p_len)
+{
+    if (p_snapshot_packet->offset != collect_len || p_snapshot_packet->data_len > SNAPSHOT_DATA_MAX
+            || collect_len + p_snapshot_packet->data_len > SNAPSHOT_MAX_LEN)
+    {
+        collect_len = 0;
+        return -1;
+    }
+    if (p_snapshot_packet->data_len == 0)
+    {
+        *p_buf = collect_buf;
+        *p_len = collect_len;
+        collect_len = 0;
+        return 1;
+    }
+    if (collect_len + p_snapshot_packet->data_len > collect_cap)
+    {
+        collect_cap = collect_cap == 0 ? 256 : collect_cap * 2;
+        Uint8 *new_buf = malloc_fatal(collect_cap, "collect_snapshot_packet - new_buf");
+        if (collect_len > 0)
+            SDL_memcpy(new_buf, collect_buf, collect_len);
+        free(collect_buf);
+        collect_buf = new_buf;
+    }
+    SDL_memcpy(collect_buf + collect_len, p_snapshot_packet->data, p_snapshot_packet->data_len);
+    collect_len += p_snapshot_packet->data_len;
+    return 0;
+}
+
+/**
+ * @brief Free the snapshot being received, when the connection is closed.
+ */
+void free_snapshot_collector(void)
+{
+    free(collect_buf);
+    collect_buf = NULL;
+    collect_len = collect_cap = 0;
+}
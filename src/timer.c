@@ -6,6 +6,7 @@
 #include "timer.h"
 #include "SDL.h"
 #include "render.h"
+#include "trace.h"
 #include "fatal.h"
 
 extern Drawer drawer;
@@ -33,12 +34,17 @@ void set_timer(Timer *p_timer)
  * @param p_timer The timer.
  * @param win_width The window width.
  * @param win_height The window height.
+ * @param region_width The width of the time region on the right side of the window.
  */
-void set_timer_pos(Timer *p_timer, unsigned int win_width, unsigned int win_height)
+void set_timer_pos(Timer *p_timer, unsigned int win_width, unsigned int win_height, unsigned int region_width)
 {
     p_timer->timer_block.h = p_timer->timer_block.w = win_height / 15;
     p_timer->timer_block.y = win_height / 2 - (p_timer->timer_block.h * 4 + p_timer->timer_block.h / 4 * 2 + p_timer->timer_block.h / 3) / 2;
-    p_timer->timer_block.x = win_width - TIME_REGION_WIDTH + TIME_REGION_WIDTH / 2 - p_timer->timer_block.w / 2;
+    p_timer->timer_block.x = win_width - region_width + region_width / 2 - p_timer->timer_block.w / 2;
+    p_timer->region.x = win_width - region_width;
+    p_timer->region.y = 0;
+    p_timer->region.w = region_width;
+    p_timer->region.h = win_height;
 }
 
 /**
@@ -67,9 +73,13 @@ void unset_timer(Timer *p_timer)
  */
 Uint32 timer_callback(Uint32 interval, void *param)
 {
+    TRACE_BEGIN(timer_callback);
     unsigned int *p_time_passed = param;
     if (*p_time_passed > 99 * 60 + 60)
+    {
+        TRACE_END(timer_callback);
         return interval;
+    }
 
     SDL_Event event;
     SDL_UserEvent user_event;
@@ -81,6 +91,7 @@ Uint32 timer_callback(Uint32 interval, void *param)
     event.user = user_event;
     SDL_PushEvent(&event);
     
+    TRACE_END(timer_callback);
     return interval;
 }
 
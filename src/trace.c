@@ -0,0 +1,116 @@
+/**
+ * @file trace.c
+ * @author jkilopu
+ * @brief Provides per-thread trace buffers and the Chrome trace JSON writer.
+ */
+#include "trace.h"
+
+#ifdef MYMINES_TRACE
+
+#include "SDL.h"
+#include "fatal.h"
+#include <stdio.h>
+
+static SDL_TLSID trace_tls;
+static TraceBuffer *trace_buffers; ///< Pushed with CAS, never removed, so dumping needs no lock.
+static Uint64 trace_origin;
+static SDL_threadID main_tid;
+
+//-------------------------------------------------------------------
+// Functions
+//-------------------------------------------------------------------
+
+/**
+ * @brief Init tracing, must be called in the main thread before any other thread is traced.
+ */
+void trace_init(void)
+{
+    trace_tls = SDL_TLSCreate();
+    if (trace_tls == 0)
+        SDL_other_fatal_error("Can't create trace TLS!\n%s\n", SDL_GetError());
+    trace_origin = SDL_GetPerformanceCounter();
+    main_tid = SDL_ThreadID();
+}
+
+/**
+ * @brief Get the ring buffer of the calling thread, create it at the first call.
+ */
+static TraceBuffer *get_trace_buffer(void)
+{
+    TraceBuffer *p_buffer = SDL_TLSGet(trace_tls);
+    if (p_buffer != NULL)
+        return p_buffer;
+
+    p_buffer = calloc_fatal(1, sizeof(TraceBuffer), "get_trace_buffer - p_buffer");
+    p_buffer->tid = SDL_ThreadID();
+    SDL_TLSSet(trace_tls, p_buffer, NULL); ///< Not freed with the thread, the events are dumped later.
+    do
+        p_buffer->next = SDL_AtomicGetPtr((void **)&trace_buffers);
+    while (!SDL_AtomicCASPtr((void **)&trace_buffers, p_buffer->next, p_buffer));
+    return p_buffer;
+}
+
+/**
+ * @brief Record a complete event that started at "start" and ends now.
+ *
+ * @param name The event name, must be a string literal.
+ * @param start The performance counter at the beginning of the event.
+ */
+void trace_complete(const char *name, Uint64 start)
+{
+    Uint64 end = SDL_GetPerformanceCounter();
+    TraceBuffer *p_buffer = get_trace_buffer();
+    int written = SDL_AtomicGet(&p_buffer->written);
+    TraceEvent *p_event = &p_buffer->events[(unsigned int)written % TRACE_BUFFER_SIZE];
+
+    p_event->name = name;
+    p_event->start = start;
+    p_event->duration = end - start;
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicSet(&p_buffer->written, written + 1);
+}
+
+/**
+ * @brief Write the events of all threads as Chrome trace JSON.
+ *
+ * @note Threads keep tracing while dumping. The oldest events of a ring may be overwritten meanwhile,
+ * the newest events written after the dump starts are left to the next dump.
+ */
+void trace_dump(void)
+{
+    const char *path = SDL_getenv(TRACE_FILE_ENV);
+    if (path == NULL)
+        path = TRACE_DEFAULT_FILE;
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL)
+    {
+        SDL_Log("Can't open trace file %s!\n", path);
+        return;
+    }
+
+    double us_per_tick = 1e6 / SDL_GetPerformanceFrequency();
+    SDL_bool first = SDL_TRUE;
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (TraceBuffer *p_buffer = SDL_AtomicGetPtr((void **)&trace_buffers); p_buffer != NULL; p_buffer = p_buffer->next)
+    {
+        unsigned int written = (unsigned int)SDL_AtomicGet(&p_buffer->written);
+        SDL_MemoryBarrierAcquire();
+        unsigned int num = written < TRACE_BUFFER_SIZE ? written : TRACE_BUFFER_SIZE;
+        unsigned long tid = (unsigned long)p_buffer->tid;
+
+        fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%lu,\"args\":{\"name\":\"%s\"}}",
+                first ? "" : ",\n", tid, p_buffer->tid == main_tid ? "main" : "worker");
+        first = SDL_FALSE;
+        for (unsigned int i = written - num; i != written; i++)
+        {
+            const TraceEvent *p_event = &p_buffer->events[i % TRACE_BUFFER_SIZE];
+            fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"mymines\",\"ph\":\"X\",\"pid\":1,\"tid\":%lu,\"ts\":%.3f,\"dur\":%.3f}",
+                    p_event->name, tid, (Sint64)(p_event->start - trace_origin) * us_per_tick, p_event->duration * us_per_tick);
+        }
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+    SDL_Log("Trace written to %s\n", path);
+}
+
+#endif